@@ -37,7 +37,7 @@ static QMutex s_instancesMutex;
 static QList<QZeroConfPrivate*> s_instances;
 
 
-QZeroConfPrivate::QZeroConfPrivate(QZeroConf *parent)
+QZeroConfPrivate::QZeroConfPrivate(QZeroConf *parent) : txtUpdater([this](int) { updateTxt(); })
 {
 	qRegisterMetaType<QHostAddress>();
 	qRegisterMetaType<TxtRecordMap>("TxtRecordMap");
@@ -86,21 +86,22 @@ QZeroConfPrivate::~QZeroConfPrivate()
 // To make sure the Java object is not going out of scope and being garbage collected when the QZeroConf object
 // is deleted before the worker thread actually starts, keep a new QAndroidJniObject to nsdManager
 // which will increase the ref counter in the JVM.
-void QZeroConfPrivate::startServicePublish(const char *name, const char *type, quint16 port)
+void QZeroConfPrivate::startServicePublish(const char *name, const char *type, quint16 port, const TxtRecordMap &txt)
 {
 	QAndroidJniObject ref(nsdManager);
 	publishName = name;
 	publishType = type;
+	publishPort = port;
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
 	QtAndroid::runOnAndroidThread([=](){
 #else
 	QNativeInterface::QAndroidApplication::runOnAndroidMainThread([=]() {
 #endif
 		QAndroidJniObject txtMap("java/util/HashMap");
-		foreach (const QByteArray &key, txtRecords.keys()) {
+		foreach (const QByteArray &key, txt.keys()) {
 			txtMap.callObjectMethod("put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;",
 									QAndroidJniObject::fromString(key).object<jstring>(),
-									QAndroidJniObject::fromString(txtRecords.value(key)).object<jstring>());
+									QAndroidJniObject::fromString(txt.value(key)).object<jstring>());
 		}
 
 		ref.callMethod<void>("registerService", "(Ljava/lang/String;Ljava/lang/String;ILjava/util/Map;)V",
@@ -291,14 +292,47 @@ void QZeroConfPrivate::onBrowserStateChanged(bool running, bool error)
 	}
 }
 
+// NsdManager can't change the TXT record of a registered service, so register it again once the
+// old registration is gone (the listener can't be reused before that)
+void QZeroConfPrivate::updateTxt()
+{
+	if (!publisherExists || reregisterPending)
+		return;
+	reregisterPending = true;
+	stopServicePublish();
+}
+
+// Withdraw the registration for good, a TXT update must not bring it back
+void QZeroConfPrivate::unpublish()
+{
+	txtUpdater.cancel(QZeroConfTxtUpdater::servicePublishId);
+	reregisterPending = false;
+	publishId = 0;
+	stopServicePublish();
+}
+
 void QZeroConfPrivate::onPublisherStateChanged(bool running, bool error)
 {
+	if (reregisterPending && !running) {
+		reregisterPending = false;
+		if (!error) {
+			startServicePublish(publishName.toUtf8().constData(), publishType.toUtf8().constData(), publishPort, txtRecords);
+			return;
+		}
+	}
 	publisherExists = running;
 	if (running) {
 		emit pub->servicePublished();
+		if (publishId)
+			emit pub->publishedService(publishId);
 	}
 	if (error) {
 		emit pub->error(QZeroConf::serviceRegistrationFailed);
+		if (publishId) {
+			int id = publishId;
+			publishId = 0;	// the registration is gone, let publishService() start a new one
+			emit pub->publishError(id, QZeroConf::serviceRegistrationFailed);
+		}
 	}
 }
 
@@ -323,12 +357,36 @@ void QZeroConf::startServicePublish(const char *name, const char *type, const ch
 {
 	Q_UNUSED(domain) // Not supported on Android API
 	Q_UNUSED(interface) // Not supported on Android API
-	pri->startServicePublish(name, type, port);
+	// NsdManager handles a single registration, which may already belong to publishService()
+	if (pri->publishId) {
+		qWarning("QZeroConf::startServicePublish() - Android can't mix startServicePublish() and publishService()");
+		emit error(QZeroConf::serviceRegistrationFailed);
+		return;
+	}
+	pri->startServicePublish(name, type, port, pri->txtRecords);
+}
+
+void QZeroConf::startServicePublish(const QList<QZeroConfPublishInfo> &services, quint32 interface)
+{
+	Q_UNUSED(interface) // Not supported on Android API
+	// NsdManager registers one service per registration listener
+	if (services.size() != 1) {
+		qWarning("QZeroConf::startServicePublish() - Android supports publishing one service per instance");
+		emit error(QZeroConf::serviceRegistrationFailed);
+		return;
+	}
+	if (pri->publishId) {
+		qWarning("QZeroConf::startServicePublish() - Android can't mix startServicePublish() and publishService()");
+		emit error(QZeroConf::serviceRegistrationFailed);
+		return;
+	}
+	pri->txtRecords = services.first().txt;
+	pri->startServicePublish(services.first().name.constData(), services.first().type.constData(), services.first().port, pri->txtRecords);
 }
 
 void QZeroConf::stopServicePublish(void)
 {
-	pri->stopServicePublish();
+	pri->unpublish();
 }
 
 bool QZeroConf::publishExists(void)
@@ -336,6 +394,31 @@ bool QZeroConf::publishExists(void)
 	return pri->publisherExists;
 }
 
+int QZeroConf::publishService(const QZeroConfPublishInfo &service, quint32 interface)
+{
+	Q_UNUSED(interface) // Not supported on Android API
+	if (pri->publishId || pri->publisherExists)
+		return -1;
+	pri->publishId = pri->nextPublishId++;
+	pri->startServicePublish(service.name.constData(), service.type.constData(), service.port, service.txt);
+	return pri->publishId;
+}
+
+bool QZeroConf::updateServiceTxt(int id, const QMap<QByteArray, QByteArray> &txt)
+{
+	Q_UNUSED(id)
+	Q_UNUSED(txt)
+	// NsdManager can't change the TXT record of a registered service
+	return false;
+}
+
+void QZeroConf::unpublishService(int id)
+{
+	if (!id || id != pri->publishId)
+		return;
+	pri->unpublish();
+}
+
 void QZeroConf::addServiceTxtRecord(QString nameOnly)
 {
 	pri->txtRecords.insert(nameOnly.toUtf8(), QByteArray());
@@ -351,6 +434,14 @@ void QZeroConf::clearServiceTxtRecords()
 	pri->txtRecords.clear();
 }
 
+void QZeroConf::updateServiceTxtRecords()
+{
+	// The registration of publishService() keeps its own TXT record
+	if (!pri->publisherExists || pri->publishId)
+		return;
+	pri->txtUpdater.request(QZeroConfTxtUpdater::servicePublishId);
+}
+
 void QZeroConf::startBrowser(QString type, QAbstractSocket::NetworkLayerProtocol protocol)
 {
 	pri->startBrowser(type, protocol);
@@ -365,3 +456,8 @@ bool QZeroConf::browserExists(void)
 {
 	return pri->browserExists;
 }
+
+void QZeroConf::setQueryAggregationWindow(int msec)
+{
+	Q_UNUSED(msec) // NsdManager schedules the queries
+}
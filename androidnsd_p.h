@@ -25,6 +25,7 @@
 ---------------------------------------------------------------------------------------------------
 **************************************************************************************************/
 #include "qzeroconf.h"
+#include "qzeroconftxt_p.h"
 #include <QMap>
 
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
@@ -44,8 +45,10 @@ public:
 
 	QZeroConfPrivate(QZeroConf *parent);
 	~QZeroConfPrivate();
-	void startServicePublish(const char *name, const char *type, quint16 port);
+	void startServicePublish(const char *name, const char *type, quint16 port, const TxtRecordMap &txt);
 	void stopServicePublish();
+	void unpublish();
+	void updateTxt();
 	void startBrowser(QString type, QAbstractSocket::NetworkLayerProtocol protocol);
 	void stopBrowser();
 	static void onServiceResolvedJNI(JNIEnv */*env*/, jobject /*thiz*/, jlong id, jstring name, jstring type, jstring hostname, jstring address, jint port, jobject txtRecords);
@@ -62,6 +65,11 @@ public:
 	QMap<QByteArray, QByteArray> txtRecords;
 	QString publishName;
 	QString publishType;
+	quint16 publishPort = 0;
+	bool reregisterPending = false;
+	QZeroConfTxtUpdater txtUpdater;		// only for the service of startServicePublish()
+	int publishId = 0;		// NsdManager handles a single registration, so there is at most one id
+	int nextPublishId = 1;
 
 
 private slots:
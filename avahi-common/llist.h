@@ -55,6 +55,17 @@ AVAHI_C_DECL_BEGIN
                                         *_head = _item; \
                                         } while (0)
 
+/** Insert an item into the list, immediately after another item */
+#define AVAHI_LLIST_INSERT_AFTER(t,name,after,item) do { \
+                                        t *_after = (after), *_item = (item); \
+                                        assert(_after); \
+                                        assert(_item); \
+                                        if ((_item->name##_next = _after->name##_next)) \
+                                           _item->name##_next->name##_prev = _item; \
+                                        _item->name##_prev = _after; \
+                                        _after->name##_next = _item; \
+                                        } while (0)
+
 /** Remove an item from the list */
 #define AVAHI_LLIST_REMOVE(t,name,head,item) do { \
                                     t **_head = &(head), *_item = (item); \
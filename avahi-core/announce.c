@@ -34,12 +34,74 @@
 #define AVAHI_PROBE_JITTER_MSEC 250
 #define AVAHI_PROBE_INTERVAL_MSEC 250
 
+/* An announcer run at most this late still schedules its next step
+ * relative to its tick, so that announcers sharing a tick keep
+ * sharing it */
+#define AVAHI_ANNOUNCE_ALIGN_MSEC 50
+
+static void dequeue_announcement(AvahiAnnouncer *a) {
+    AvahiInterface *i;
+
+    assert(a);
+    i = a->interface;
+
+    if (!a->queued)
+        return;
+
+    AVAHI_LLIST_REMOVE(AvahiAnnouncer, queue, i->announce_queue, a);
+    a->queued = 0;
+
+    if (!i->announce_queue && i->announce_event) {
+        avahi_time_event_free(i->announce_event);
+        i->announce_event = NULL;
+    }
+}
+
+struct AvahiAnnounceTick {
+    AvahiInterface *interface;
+    AvahiTimeEvent *time_event;
+    struct timeval when;
+
+    /* Set while the announcers of this tick are being run */
+    int running;
+
+    AVAHI_LLIST_HEAD(AvahiAnnouncer, announcers);
+    AVAHI_LLIST_FIELDS(AvahiAnnounceTick, ticks);
+};
+
+static void tick_free(AvahiAnnounceTick *t) {
+    assert(t);
+    assert(!t->announcers);
+
+    if (t->time_event)
+        avahi_time_event_free(t->time_event);
+
+    AVAHI_LLIST_REMOVE(AvahiAnnounceTick, ticks, t->interface->announce_ticks, t);
+
+    avahi_free(t);
+}
+
+static void cancel_tick(AvahiAnnouncer *a) {
+    AvahiAnnounceTick *t;
+
+    assert(a);
+
+    if (!(t = a->tick))
+        return;
+
+    AVAHI_LLIST_REMOVE(AvahiAnnouncer, by_tick, t->announcers, a);
+    a->tick = NULL;
+
+    if (!t->announcers && !t->running)
+        tick_free(t);
+}
+
 static void remove_announcer(AvahiServer *s, AvahiAnnouncer *a) {
     assert(s);
     assert(a);
 
-    if (a->time_event)
-        avahi_time_event_free(a->time_event);
+    cancel_tick(a);
+    dequeue_announcement(a);
 
     AVAHI_LLIST_REMOVE(AvahiAnnouncer, by_interface, a->interface->announcers, a);
     AVAHI_LLIST_REMOVE(AvahiAnnouncer, by_entry, a->entry->announcers, a);
@@ -47,23 +109,129 @@ static void remove_announcer(AvahiServer *s, AvahiAnnouncer *a) {
     avahi_free(a);
 }
 
-static void elapse_announce(AvahiTimeEvent *e, void *userdata);
+static void elapse_tick(AvahiTimeEvent *e, void *userdata);
+
+static AvahiAnnounceTick *tick_new(AvahiServer *s, AvahiInterface *i, const struct timeval *when) {
+    AvahiAnnounceTick *t;
+
+    assert(s);
+    assert(i);
+    assert(when);
+
+    if (!(t = avahi_new(AvahiAnnounceTick, 1))) {
+        avahi_log_error(__FILE__": Out of memory.");
+        return NULL;
+    }
+
+    t->interface = i;
+    t->when = *when;
+    t->running = 0;
+    AVAHI_LLIST_HEAD_INIT(AvahiAnnouncer, t->announcers);
+
+    if (!(t->time_event = avahi_time_event_new(s->time_event_queue, &t->when, elapse_tick, t))) {
+        avahi_free(t);
+        return NULL;
+    }
+
+    AVAHI_LLIST_PREPEND(AvahiAnnounceTick, ticks, i->announce_ticks, t);
+
+    return t;
+}
+
+/* Schedule the announcer msec to msec+jitter after base, or after now
+ * if base is NULL or too long ago. If another announcer on this
+ * interface has a tick within that window, join it, so that both run
+ * from the same wakeup and their probes and announcements go out in
+ * the same packets. */
+static void set_tick(AvahiAnnouncer *a, const struct timeval *base, unsigned msec, unsigned jitter) {
+    AvahiInterface *i;
+    AvahiAnnounceTick *t;
+    struct timeval earliest, latest, tv;
 
-static void set_timeout(AvahiAnnouncer *a, const struct timeval *tv) {
     assert(a);
+    i = a->interface;
 
-    if (!tv) {
-        if (a->time_event) {
-            avahi_time_event_free(a->time_event);
-            a->time_event = NULL;
-        }
-    } else {
+    cancel_tick(a);
+
+    if (base && avahi_age(base) <= (AvahiUsec) AVAHI_ANNOUNCE_ALIGN_MSEC*1000)
+        earliest = *base;
+    else
+        gettimeofday(&earliest, NULL);
+
+    avahi_timeval_add(&earliest, (AvahiUsec) msec*1000);
+    latest = earliest;
+    avahi_timeval_add(&latest, (AvahiUsec) (jitter + AVAHI_ANNOUNCE_ALIGN_MSEC)*1000);
+
+    for (t = i->announce_ticks; t; t = t->ticks_next)
+        if (!t->running &&
+            avahi_timeval_compare(&t->when, &earliest) >= 0 &&
+            avahi_timeval_compare(&t->when, &latest) <= 0)
+            break;
+
+    if (!t) {
 
-        if (a->time_event)
-            avahi_time_event_update(a->time_event, tv);
+        /* No suitable tick, start a new one */
+        if (jitter)
+            avahi_elapse_time(&tv, msec, jitter);
         else
-            a->time_event = avahi_time_event_new(a->server->time_event_queue, tv, elapse_announce, a);
+            tv = earliest;
+
+        if (!(t = tick_new(a->server, i, &tv)))
+            return; /* OOM */
+    }
+
+    AVAHI_LLIST_PREPEND(AvahiAnnouncer, by_tick, t->announcers, a);
+    a->tick = t;
+}
+
+static void elapse_announce_queue(AVAHI_GCC_UNUSED AvahiTimeEvent *e, void *userdata) {
+    AvahiInterface *i = userdata;
+    AvahiAnnouncer *a;
+
+    assert(i);
+
+    if (i->announce_event) {
+        avahi_time_event_free(i->announce_event);
+        i->announce_event = NULL;
     }
+
+    while ((a = i->announce_queue)) {
+        AVAHI_LLIST_REMOVE(AvahiAnnouncer, queue, i->announce_queue, a);
+        a->queued = 0;
+
+        if (a->entry->flags & AVAHI_PUBLISH_UNIQUE)
+            /* Send the whole rrset at once */
+            avahi_server_prepare_matching_responses(a->server, a->interface, a->entry->record->key, 0);
+        else
+            avahi_server_prepare_response(a->server, a->interface, a->entry, 0, 0);
+    }
+
+    avahi_server_generate_response(i->monitor->server, i, NULL, NULL, 0, 0, 0);
+}
+
+static void queue_announcement(AvahiAnnouncer *a) {
+    AvahiInterface *i;
+    struct timeval tv;
+
+    assert(a);
+    i = a->interface;
+
+    if (a->queued)
+        return;
+
+    AVAHI_LLIST_PREPEND(AvahiAnnouncer, queue, i->announce_queue, a);
+    a->queued = 1;
+
+    if (i->announce_event)
+        return;
+
+    /* Announcements queued from within a tick are flushed when the
+     * tick is done; this only catches those queued elsewhere */
+    gettimeofday(&tv, NULL);
+
+    if (!(i->announce_event = avahi_time_event_new(a->server->time_event_queue, &tv, elapse_announce_queue, i)))
+        /* OOM, send it right away */
+        elapse_announce_queue(NULL, i);
 }
 
 static void next_state(AvahiAnnouncer *a);
@@ -99,10 +267,8 @@ void avahi_s_entry_group_check_probed(AvahiSEntryGroup *g, int immediately) {
                 a->n_iteration = 1;
                 next_state(a);
             } else {
-                struct timeval tv;
                 a->n_iteration = 0;
-                avahi_elapse_time(&tv, 0, AVAHI_ANNOUNCEMENT_JITTER_MSEC);
-                set_timeout(a, &tv);
+                set_tick(a, NULL, 0, AVAHI_ANNOUNCEMENT_JITTER_MSEC);
             }
         }
     }
@@ -134,51 +300,65 @@ static void next_state(AvahiAnnouncer *a) {
                 a->n_iteration = 1;
             }
 
-            set_timeout(a, NULL);
+            cancel_tick(a);
             next_state(a);
         } else {
-            struct timeval tv;
 
             avahi_interface_post_probe(a->interface, a->entry->record, 0);
 
-            avahi_elapse_time(&tv, AVAHI_PROBE_INTERVAL_MSEC, 0);
-            set_timeout(a, &tv);
+            set_tick(a, &a->last_tick, AVAHI_PROBE_INTERVAL_MSEC, 0);
 
             a->n_iteration++;
         }
 
     } else if (a->state == AVAHI_ANNOUNCING) {
 
-        if (a->entry->flags & AVAHI_PUBLISH_UNIQUE)
-            /* Send the whole rrset at once */
-            avahi_server_prepare_matching_responses(a->server, a->interface, a->entry->record->key, 0);
-        else
-            avahi_server_prepare_response(a->server, a->interface, a->entry, 0, 0);
-
-        avahi_server_generate_response(a->server, a->interface, NULL, NULL, 0, 0, 0);
+        queue_announcement(a);
 
         if (++a->n_iteration >= 4) {
             /* Announcing done */
 
             a->state = AVAHI_ESTABLISHED;
 
-            set_timeout(a, NULL);
+            cancel_tick(a);
         } else {
-            struct timeval tv;
-            avahi_elapse_time(&tv, a->sec_delay*1000, AVAHI_ANNOUNCEMENT_JITTER_MSEC);
+            unsigned msec = a->sec_delay*1000;
 
             if (a->n_iteration < 10)
                 a->sec_delay *= 2;
 
-            set_timeout(a, &tv);
+            set_tick(a, &a->last_tick, msec, AVAHI_ANNOUNCEMENT_JITTER_MSEC);
         }
     }
 }
 
-static void elapse_announce(AvahiTimeEvent *e, void *userdata) {
+static void elapse_tick(AvahiTimeEvent *e, void *userdata) {
+    AvahiAnnounceTick *t = userdata;
+    AvahiInterface *i;
+    AvahiAnnouncer *a;
+
     assert(e);
+    assert(t);
+
+    i = t->interface;
+
+    /* Announcers rescheduled while we run must not join this tick */
+    t->running = 1;
+
+    while ((a = t->announcers)) {
+        AVAHI_LLIST_REMOVE(AvahiAnnouncer, by_tick, t->announcers, a);
+        a->tick = NULL;
+        a->last_tick = t->when;
 
-    next_state(userdata);
+        next_state(a);
+    }
+
+    tick_free(t);
+
+    /* Hand all announcements of this tick to the response scheduler
+     * at once, so that they are packed into as few packets as possible */
+    if (i->announce_queue)
+        elapse_announce_queue(NULL, i);
 }
 
 static AvahiAnnouncer *get_announcer(AvahiServer *s, AvahiEntry *e, AvahiInterface *i) {
@@ -197,7 +377,6 @@ static AvahiAnnouncer *get_announcer(AvahiServer *s, AvahiEntry *e, AvahiInterfa
 
 static void go_to_initial_state(AvahiAnnouncer *a) {
     AvahiEntry *e;
-    struct timeval tv;
 
     assert(a);
     e = a->entry;
@@ -221,11 +400,11 @@ static void go_to_initial_state(AvahiAnnouncer *a) {
         e->group->n_probing++;
 
     if (a->state == AVAHI_PROBING)
-        set_timeout(a, avahi_elapse_time(&tv, 0, AVAHI_PROBE_JITTER_MSEC));
+        set_tick(a, NULL, 0, AVAHI_PROBE_JITTER_MSEC);
     else if (a->state == AVAHI_ANNOUNCING)
-        set_timeout(a, avahi_elapse_time(&tv, 0, AVAHI_ANNOUNCEMENT_JITTER_MSEC));
+        set_tick(a, NULL, 0, AVAHI_ANNOUNCEMENT_JITTER_MSEC);
     else
-        set_timeout(a, NULL);
+        cancel_tick(a);
 }
 
 static void new_announcer(AvahiServer *s, AvahiInterface *i, AvahiEntry *e) {
@@ -251,7 +430,9 @@ static void new_announcer(AvahiServer *s, AvahiInterface *i, AvahiEntry *e) {
     a->server = s;
     a->interface = i;
     a->entry = e;
-    a->time_event = NULL;
+    a->tick = NULL;
+    a->last_tick.tv_sec = a->last_tick.tv_usec = 0;
+    a->queued = 0;
 
     AVAHI_LLIST_PREPEND(AvahiAnnouncer, by_interface, i->announcers, a);
     AVAHI_LLIST_PREPEND(AvahiAnnouncer, by_entry, e->announcers, a);
@@ -416,7 +597,6 @@ static void send_goodbye_callback(AvahiInterfaceMonitor *m, AvahiInterface *i, v
 
 static void reannounce(AvahiAnnouncer *a) {
     AvahiEntry *e;
-    struct timeval tv;
 
     assert(a);
     e = a->entry;
@@ -459,11 +639,11 @@ static void reannounce(AvahiAnnouncer *a) {
     a->sec_delay = 1;
 
     if (a->state == AVAHI_PROBING)
-        set_timeout(a, avahi_elapse_time(&tv, 0, AVAHI_PROBE_JITTER_MSEC));
+        set_tick(a, NULL, 0, AVAHI_PROBE_JITTER_MSEC);
     else if (a->state == AVAHI_ANNOUNCING)
-        set_timeout(a, avahi_elapse_time(&tv, 0, AVAHI_ANNOUNCEMENT_JITTER_MSEC));
+        set_tick(a, NULL, 0, AVAHI_ANNOUNCEMENT_JITTER_MSEC);
     else
-        set_timeout(a, NULL);
+        cancel_tick(a);
 }
 
 
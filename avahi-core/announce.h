@@ -21,6 +21,7 @@
 ***/
 
 typedef struct AvahiAnnouncer AvahiAnnouncer;
+typedef struct AvahiAnnounceTick AvahiAnnounceTick;
 
 #include <avahi-common/llist.h>
 #include "iface.h"
@@ -40,14 +41,23 @@ struct AvahiAnnouncer {
     AvahiInterface *interface;
     AvahiEntry *entry;
 
-    AvahiTimeEvent *time_event;
+    /* The tick this announcer is scheduled for, which is shared with
+     * other announcers on the same interface, and the time of the last
+     * tick it ran in */
+    AvahiAnnounceTick *tick;
+    struct timeval last_tick;
 
     AvahiAnnouncerState state;
     unsigned n_iteration;
     unsigned sec_delay;
 
+    /* Set while this announcer waits in the announce queue of its interface */
+    int queued;
+
     AVAHI_LLIST_FIELDS(AvahiAnnouncer, by_interface);
     AVAHI_LLIST_FIELDS(AvahiAnnouncer, by_entry);
+    AVAHI_LLIST_FIELDS(AvahiAnnouncer, by_tick);
+    AVAHI_LLIST_FIELDS(AvahiAnnouncer, queue);
 };
 
 void avahi_announce_interface(AvahiServer *s, AvahiInterface *i);
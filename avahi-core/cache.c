@@ -40,15 +40,23 @@ static void remove_entry(AvahiCache *c, AvahiCacheEntry *e) {
 
 /*     avahi_log_debug("removing from cache: %p %p", c, e); */
 
-    /* Remove from hash table */
+    /* Remove from hash tables */
+    avahi_hashmap_remove(c->records, e->record);
+
     t = avahi_hashmap_lookup(c->hashmap, e->record->key);
     AVAHI_LLIST_REMOVE(AvahiCacheEntry, by_key, t, e);
-    if (t)
+    if (t) {
+        if (t != avahi_hashmap_lookup(c->hashmap, e->record->key))
+            /* We removed the first entry, pass on its bound */
+            t->oldest = e->oldest;
+
         avahi_hashmap_replace(c->hashmap, t->record->key, t);
-    else
+    } else
         avahi_hashmap_remove(c->hashmap, e->record->key);
 
     /* Remove from linked list */
+    if (c->entries_tail == e)
+        c->entries_tail = e->entry_prev;
     AVAHI_LLIST_REMOVE(AvahiCacheEntry, entry, c->entries, e);
 
     if (e->time_event)
@@ -82,8 +90,17 @@ AvahiCache *avahi_cache_new(AvahiServer *server, AvahiInterface *iface) {
         return NULL; /* OOM */
     }
 
+    if (!(c->records = avahi_hashmap_new((AvahiHashFunc) avahi_record_hash_no_ttl, (AvahiEqualFunc) avahi_record_equal_no_ttl, NULL, NULL))) {
+        avahi_log_error(__FILE__": Out of memory.");
+        avahi_hashmap_free(c->hashmap);
+        avahi_free(c);
+        return NULL; /* OOM */
+    }
+
     AVAHI_LLIST_HEAD_INIT(AvahiCacheEntry, c->entries);
+    c->entries_tail = NULL;
     c->n_entries = 0;
+    c->n_evictions = c->n_rejections = 0;
 
     c->last_rand_timestamp = 0;
 
@@ -98,6 +115,7 @@ void avahi_cache_free(AvahiCache *c) {
     assert(c->n_entries == 0);
 
     avahi_hashmap_free(c->hashmap);
+    avahi_hashmap_free(c->records);
 
     avahi_free(c);
 }
@@ -143,22 +161,28 @@ void* avahi_cache_walk(AvahiCache *c, AvahiKey *pattern, AvahiCacheWalkCallback
     return NULL;
 }
 
-static void* lookup_record_callback(AvahiCache *c, AvahiKey *pattern, AvahiCacheEntry *e, void *userdata) {
+static AvahiCacheEntry *lookup_record(AvahiCache *c, AvahiRecord *r) {
     assert(c);
-    assert(pattern);
-    assert(e);
-
-    if (avahi_record_equal_no_ttl(e->record, userdata))
-        return e;
+    assert(r);
 
-    return NULL;
+    return avahi_hashmap_lookup(c->records, r);
 }
 
-static AvahiCacheEntry *lookup_record(AvahiCache *c, AvahiRecord *r) {
+AvahiRecord* avahi_cache_lookup_view(AvahiCache *c, AvahiDnsPacket *p, const AvahiDnsRecordView *v) {
+    AvahiCacheEntry *e;
+
     assert(c);
-    assert(r);
+    assert(p);
+    assert(v);
+
+    if (avahi_key_is_pattern(&v->key))
+        return NULL;
 
-    return avahi_cache_walk(c, r->key, lookup_record_callback, r);
+    for (e = lookup_key(c, (AvahiKey*) &v->key); e; e = e->by_key_next)
+        if (e->record->ttl == v->ttl && avahi_dns_record_view_equal(p, v, e->record))
+            return avahi_record_ref(e->record);
+
+    return NULL;
 }
 
 static void next_expiry(AvahiCache *c, AvahiCacheEntry *e, unsigned percent);
@@ -273,6 +297,56 @@ static void expire_in_one_second(AvahiCache *c, AvahiCacheEntry *e, AvahiCacheEn
     update_time_event(c, e);
 }
 
+static void prepend_entry(AvahiCache *c, AvahiCacheEntry *e) {
+    assert(c);
+    assert(e);
+
+    AVAHI_LLIST_PREPEND(AvahiCacheEntry, entry, c->entries, e);
+
+    if (!c->entries_tail)
+        c->entries_tail = e;
+}
+
+static void touch_entry(AvahiCache *c, AvahiCacheEntry *e) {
+    assert(c);
+    assert(e);
+
+    if (c->entries == e)
+        return;
+
+    if (c->entries_tail == e)
+        c->entries_tail = e->entry_prev;
+
+    AVAHI_LLIST_REMOVE(AvahiCacheEntry, entry, c->entries, e);
+    prepend_entry(c, e);
+}
+
+/* Evict the least recently updated entry nobody browses for or
+ * resolves right now. Entries in use are kept and moved to the front,
+ * so that they aren't looked at again on the next eviction. Returns 0
+ * if there was no entry to evict. */
+static int evict_entry(AvahiCache *c) {
+    unsigned n;
+
+    assert(c);
+
+    for (n = c->n_entries; n > 0; n--) {
+        AvahiCacheEntry *e = c->entries_tail;
+
+        assert(e);
+
+        if (!avahi_querier_is_used(c->interface, e->record->key)) {
+            remove_entry(c, e);
+            c->n_evictions++;
+            return 1;
+        }
+
+        touch_entry(c, e);
+    }
+
+    return 0;
+}
+
 void avahi_cache_update(AvahiCache *c, AvahiRecord *r, int cache_flush, const AvahiAddress *a) {
 /*     char *txt; */
 
@@ -299,23 +373,31 @@ void avahi_cache_update(AvahiCache *c, AvahiRecord *r, int cache_flush, const Av
 
         if ((first = lookup_key(c, r->key))) {
 
-            if (cache_flush) {
+            if (cache_flush && avahi_timeval_diff(&now, &first->oldest) > 1000000) {
+                struct timeval oldest = now;
 
-                /* For unique entries drop all entries older than one second */
+                /* For unique entries drop all entries older than one
+                 * second. Those already scheduled for that are left
+                 * alone. */
                 for (e = first; e; e = e->by_key_next) {
                     AvahiUsec t;
 
+                    if (e->state == AVAHI_CACHE_REPLACE_FINAL)
+                        continue;
+
                     t = avahi_timeval_diff(&now, &e->timestamp);
 
                     if (t > 1000000)
                         expire_in_one_second(c, e, AVAHI_CACHE_REPLACE_FINAL);
+                    else if (avahi_timeval_compare(&e->timestamp, &oldest) < 0)
+                        oldest = e->timestamp;
                 }
+
+                first->oldest = oldest;
             }
 
             /* Look for exactly the same entry */
-            for (e = first; e; e = e->by_key_next)
-                if (avahi_record_equal_no_ttl(e->record, r))
-                    break;
+            e = lookup_record(c, r);
         }
 
         if (e) {
@@ -327,10 +409,14 @@ void avahi_cache_update(AvahiCache *c, AvahiRecord *r, int cache_flush, const Av
             if (e->by_key_prev == NULL)
                 avahi_hashmap_replace(c->hashmap, r->key, e);
 
+            avahi_hashmap_replace(c->records, r, e);
+
             /* Update the record */
             avahi_record_unref(e->record);
             e->record = avahi_record_ref(r);
 
+            touch_entry(c, e);
+
 /*             avahi_log_debug("cache: updating %s", txt);   */
 
         } else {
@@ -338,8 +424,17 @@ void avahi_cache_update(AvahiCache *c, AvahiRecord *r, int cache_flush, const Av
 
 /*             avahi_log_debug("cache: couldn't find matching cache entry for %s", txt);   */
 
-            if (c->n_entries >= c->server->config.n_cache_entries_max)
-                return;
+            if (c->n_entries >= c->server->config.n_cache_entries_max) {
+
+                /* Make room, unless the cache is full of records in use */
+                if (!evict_entry(c)) {
+                    c->n_rejections++;
+                    return;
+                }
+
+                /* We might have evicted an entry with the same key */
+                first = lookup_key(c, r->key);
+            }
 
             if (!(e = avahi_new(AvahiCacheEntry, 1))) {
                 avahi_log_error(__FILE__": Out of memory");
@@ -350,12 +445,22 @@ void avahi_cache_update(AvahiCache *c, AvahiRecord *r, int cache_flush, const Av
             e->time_event = NULL;
             e->record = avahi_record_ref(r);
 
+            if (avahi_hashmap_insert(c->records, e->record, e) < 0) {
+                avahi_log_error(__FILE__": Out of memory");
+                avahi_record_unref(e->record);
+                avahi_free(e);
+                return;
+            }
+
+            /* The new entry becomes the first one of its chain */
+            e->oldest = first ? first->oldest : now;
+
             /* Append to hash table */
             AVAHI_LLIST_PREPEND(AvahiCacheEntry, by_key, first, e);
             avahi_hashmap_replace(c->hashmap, e->record->key, first);
 
             /* Append to linked list */
-            AVAHI_LLIST_PREPEND(AvahiCacheEntry, entry, c->entries, e);
+            prepend_entry(c, e);
 
             c->n_entries++;
 
@@ -437,6 +542,15 @@ void avahi_cache_flush(AvahiCache *c) {
         remove_entry(c, c->entries);
 }
 
+void avahi_cache_add_stats(AvahiCache *c, AvahiServerCacheStats *ret) {
+    assert(c);
+    assert(ret);
+
+    ret->n_entries += c->n_entries;
+    ret->n_evictions += c->n_evictions;
+    ret->n_rejections += c->n_rejections;
+}
+
 /*** Passive observation of failure ***/
 
 static void* start_poof_callback(AvahiCache *c, AvahiKey *pattern, AvahiCacheEntry *e, void *userdata) {
@@ -27,6 +27,7 @@ typedef struct AvahiCache AvahiCache;
 #include "internal.h"
 #include "timeeventq.h"
 #include "hashmap.h"
+#include "dns.h"
 
 typedef enum {
     AVAHI_CACHE_VALID,
@@ -58,6 +59,11 @@ struct AvahiCacheEntry {
 
     AvahiAddress poof_address;
 
+    /* Only valid for the first entry of a by_key chain: no entry of
+     * the chain that isn't already scheduled for replacement has been
+     * updated before this time */
+    struct timeval oldest;
+
     AVAHI_LLIST_FIELDS(AvahiCacheEntry, by_key);
     AVAHI_LLIST_FIELDS(AvahiCacheEntry, entry);
 };
@@ -69,9 +75,15 @@ struct AvahiCache {
 
     AvahiHashmap *hashmap;
 
+    /* The entries by their record, ignoring the TTL */
+    AvahiHashmap *records;
+
+    /* Most recently updated entries first */
     AVAHI_LLIST_HEAD(AvahiCacheEntry, entries);
+    AvahiCacheEntry *entries_tail;
 
     unsigned n_entries;
+    unsigned n_evictions, n_rejections;
 
     int last_rand;
     time_t last_rand_timestamp;
@@ -82,6 +94,11 @@ void avahi_cache_free(AvahiCache *c);
 
 void avahi_cache_update(AvahiCache *c, AvahiRecord *r, int cache_flush, const AvahiAddress *a);
 
+/** Return a new reference to the cached record that is identical to
+ * the viewed packet record, including its TTL, or NULL if there is
+ * none. */
+AvahiRecord* avahi_cache_lookup_view(AvahiCache *c, AvahiDnsPacket *p, const AvahiDnsRecordView *v);
+
 int avahi_cache_dump(AvahiCache *c, AvahiDumpCallback callback, void* userdata);
 
 typedef void* AvahiCacheWalkCallback(AvahiCache *c, AvahiKey *pattern, AvahiCacheEntry *e, void* userdata);
@@ -98,4 +115,6 @@ void avahi_cache_stop_poof(AvahiCache *c, AvahiRecord *record, const AvahiAddres
 
 void avahi_cache_flush(AvahiCache *c);
 
+void avahi_cache_add_stats(AvahiCache *c, AvahiServerCacheStats *ret);
+
 #endif
@@ -67,10 +67,58 @@ typedef struct AvahiServerConfig {
     int publish_a_on_ipv6;            /**< Publish an IPv4 A RR on IPv6 sockets */
     int publish_aaaa_on_ipv4;         /**< Publish an IPv6 AAAA RR on IPv4 sockets */
     unsigned n_cache_entries_max;     /**< Maximum number of cache entries per interface */
+    unsigned n_wide_area_cache_entries_max; /**< Maximum number of entries in the wide area cache, including cached negative answers */
+    unsigned n_wide_area_parallel_queries; /**< Number of unicast DNS servers a wide area query is sent to at the same time, preferring those that answered quickest */
     AvahiUsec ratelimit_interval;     /**< If non-zero, rate-limiting interval parameter. */
     unsigned ratelimit_burst;         /**< If ratelimit_interval is non-zero, rate-limiting burst parameter. */
+    unsigned query_aggregation_msec;  /**< Delay outgoing queries by at least this many milliseconds, so that queries issued at about the same time share packets. 0 sends the first query of a browser immediately. */
+    unsigned query_ratelimit_source;  /**< Number of query packets per second processed from one source address, 0 for no limit. Queries from local addresses are never limited. */
+    unsigned query_ratelimit_source_burst; /**< Number of query packets from one source address processed in a row before query_ratelimit_source applies */
+    unsigned query_ratelimit_key;     /**< Number of times per second responses are generated for the same record key asked on one interface, 0 for no limit. Probes are never limited. */
+    unsigned query_ratelimit_key_burst; /**< Number of times responses for the same key are generated in a row before query_ratelimit_key applies */
 } AvahiServerConfig;
 
+/** Query statistics as returned by avahi_server_get_query_stats() */
+typedef struct AvahiServerQueryStats {
+    unsigned n_posted;                /**< Number of queries requested by browsers and resolvers */
+    unsigned n_questions;             /**< Number of questions actually sent */
+    unsigned n_packets;               /**< Number of query packets sent, including continuation packets for known answers */
+} AvahiServerQueryStats;
+
+/** Cache statistics as returned by avahi_server_get_cache_stats() */
+typedef struct AvahiServerCacheStats {
+    unsigned n_entries;               /**< Number of records currently cached */
+    unsigned n_evictions;             /**< Number of records evicted to make room for new ones */
+    unsigned n_rejections;            /**< Number of new records not cached because the cache was full of records in use */
+} AvahiServerCacheStats;
+
+/** Statistics of a unicast DNS server as returned by avahi_server_get_wide_area_stats() */
+typedef struct AvahiServerWideAreaStats {
+    AvahiAddress address;             /**< The address of the DNS server */
+    unsigned n_queries;               /**< Number of query packets sent to the server */
+    unsigned n_responses;             /**< Number of responses received from the server */
+    unsigned n_timeouts;              /**< Number of query rounds the server did not answer in time */
+    AvahiUsec srtt;                   /**< Smoothed round trip time in usec, 0 if not measured yet */
+    AvahiUsec rto;                    /**< Current retransmission timeout in usec */
+} AvahiServerWideAreaStats;
+
+/** Statistics of the incoming query rate limits as returned by avahi_server_get_ratelimit_stats() */
+typedef struct AvahiServerRateLimitStats {
+    unsigned n_dropped_source;        /**< Number of query packets ignored since their source exceeded query_ratelimit_source */
+    unsigned n_dropped_key;           /**< Number of questions not answered since their key exceeded query_ratelimit_key */
+} AvahiServerRateLimitStats;
+
+/** Reflector statistics as returned by avahi_server_get_reflector_stats() */
+typedef struct AvahiServerReflectorStats {
+    unsigned n_queries;               /**< Number of incoming questions considered for reflection */
+    unsigned n_responses;             /**< Number of incoming response records considered for reflection */
+    unsigned n_probes;                /**< Number of incoming probe records considered for reflection */
+    unsigned n_forwarded;             /**< Number of questions and records posted to other interfaces */
+    unsigned n_suppressed;            /**< Number of questions and records not reflected, since they had been reflected from the same interface less than a second before */
+    unsigned n_legacy_unicast_slots;  /**< Number of reflected legacy unicast queries currently waiting for responses */
+    unsigned n_legacy_unicast_exhausted; /**< Number of legacy unicast queries dropped since all reflect slots were in use */
+} AvahiServerReflectorStats;
+
 /** Allocate a new mDNS responder object. */
 AvahiServer *avahi_server_new(
     const AvahiPoll *api,          /**< The main loop adapter */
@@ -157,9 +205,34 @@ int avahi_server_set_wide_area_servers(AvahiServer *s, const AvahiAddress *a, un
 /** Set the browsing domains */
 int avahi_server_set_browse_domains(AvahiServer *s, AvahiStringList *domains);
 
+/** Change query_aggregation_msec of a running server. Applies to
+ * queries posted from now on. */
+int avahi_server_set_query_aggregation(AvahiServer *s, unsigned msec);
+
 /** Return the current configuration of the server \since 0.6.17 */
 const AvahiServerConfig* avahi_server_get_config(AvahiServer *s);
 
+/** Return the query statistics summed up over all matching
+ * interfaces. Interfaces that have been removed are not counted. */
+int avahi_server_get_query_stats(AvahiServer *s, AvahiIfIndex interface, AvahiProtocol protocol, AvahiServerQueryStats *ret);
+
+/** Return the cache statistics summed up over all matching
+ * interfaces. Interfaces that have been removed are not counted. */
+int avahi_server_get_cache_stats(AvahiServer *s, AvahiIfIndex interface, AvahiProtocol protocol, AvahiServerCacheStats *ret);
+
+/** Fill in the statistics of up to n wide area DNS servers, in the
+ * order they were configured. Returns the number of configured
+ * servers, which may exceed n, or a negative error code. */
+int avahi_server_get_wide_area_stats(AvahiServer *s, AvahiServerWideAreaStats *ret, unsigned n);
+
+/** Return the reflector statistics. Fails if the reflector is not
+ * enabled. Sample them periodically to obtain throughput rates. */
+int avahi_server_get_reflector_stats(AvahiServer *s, AvahiServerReflectorStats *ret);
+
+/** Return how many incoming queries have been dropped by the query
+ * rate limits */
+int avahi_server_get_ratelimit_stats(AvahiServer *s, AvahiServerRateLimitStats *ret);
+
 AVAHI_C_DECL_END
 
 #endif
@@ -36,8 +36,19 @@
 #include "dns.h"
 #include "log.h"
 
-AvahiDnsPacket* avahi_dns_packet_new(unsigned mtu) {
-    AvahiDnsPacket *p;
+#define AVAHI_DNS_PACKET_POOL_MAX 16
+
+struct AvahiDnsPacketPool {
+    /* Recycled packets, ready to be handed out again */
+    AvahiDnsPacket *packets[AVAHI_DNS_PACKET_POOL_MAX];
+    unsigned n_packets;
+
+    /* Number of packets currently handed out */
+    unsigned n_used;
+    int dead;
+};
+
+static size_t packet_max_size(unsigned mtu) {
     size_t max_size;
 
     if (mtu <= 0)
@@ -50,46 +61,164 @@ AvahiDnsPacket* avahi_dns_packet_new(unsigned mtu) {
     if (max_size < AVAHI_DNS_PACKET_HEADER_SIZE)
         max_size = AVAHI_DNS_PACKET_HEADER_SIZE;
 
-    if (!(p = avahi_malloc(sizeof(AvahiDnsPacket) + max_size)))
-        return p;
+    return max_size;
+}
+
+static void packet_init(AvahiDnsPacket *p, size_t max_size) {
+    assert(p);
+    assert(max_size <= p->capacity);
 
     p->size = p->rindex = AVAHI_DNS_PACKET_HEADER_SIZE;
     p->max_size = max_size;
     p->res_size = 0;
+
+    memset(AVAHI_DNS_PACKET_DATA(p), 0, p->size);
+}
+
+AvahiDnsPacketPool* avahi_dns_packet_pool_new(void) {
+    return avahi_new0(AvahiDnsPacketPool, 1);
+}
+
+static void pool_release(AvahiDnsPacketPool *pool) {
+    assert(pool);
+
+    while (pool->n_packets > 0) {
+        AvahiDnsPacket *p = pool->packets[--pool->n_packets];
+
+        if (p->name_table)
+            avahi_dns_name_table_free(p->name_table);
+
+        avahi_free(p);
+    }
+}
+
+void avahi_dns_packet_pool_free(AvahiDnsPacketPool *pool) {
+    assert(pool);
+    assert(!pool->dead);
+
+    pool_release(pool);
+
+    /* Packets still in use return to a dead pool, the last one frees it */
+    if (pool->n_used > 0)
+        pool->dead = 1;
+    else
+        avahi_free(pool);
+}
+
+static AvahiDnsPacket* pool_get(AvahiDnsPacketPool *pool, size_t max_size) {
+    AvahiDnsPacket *p;
+    unsigned i;
+
+    assert(pool);
+    assert(!pool->dead);
+
+    for (i = 0; i < pool->n_packets; i++)
+        if (pool->packets[i]->capacity >= max_size) {
+            p = pool->packets[i];
+            pool->packets[i] = pool->packets[--pool->n_packets];
+            pool->n_used++;
+            return p;
+        }
+
+    if (!(p = avahi_malloc(sizeof(AvahiDnsPacket) + max_size)))
+        return NULL;
+
+    p->capacity = max_size;
     p->name_table = NULL;
     p->data = NULL;
+    p->pool = pool;
+    pool->n_used++;
 
-    memset(AVAHI_DNS_PACKET_DATA(p), 0, p->size);
     return p;
 }
 
-AvahiDnsPacket* avahi_dns_packet_new_query(unsigned mtu) {
+static void pool_put(AvahiDnsPacketPool *pool, AvahiDnsPacket *p) {
+    assert(pool);
+    assert(p);
+    assert(pool->n_used > 0);
+
+    pool->n_used--;
+
+    if (pool->dead || pool->n_packets >= AVAHI_DNS_PACKET_POOL_MAX) {
+
+        if (p->name_table)
+            avahi_dns_name_table_free(p->name_table);
+
+        avahi_free(p);
+
+        if (pool->dead && pool->n_used == 0)
+            avahi_free(pool);
+
+        return;
+    }
+
+    /* Keep the compression table around, but empty, for the next user */
+    p->size = 0;
+    avahi_dns_packet_cleanup_name_table(p);
+
+    pool->packets[pool->n_packets++] = p;
+}
+
+AvahiDnsPacket* avahi_dns_packet_new_pooled(AvahiDnsPacketPool *pool, unsigned mtu) {
+    AvahiDnsPacket *p;
+    size_t max_size;
+
+    max_size = packet_max_size(mtu);
+
+    if (pool)
+        p = pool_get(pool, max_size);
+    else if ((p = avahi_malloc(sizeof(AvahiDnsPacket) + max_size))) {
+        p->capacity = max_size;
+        p->name_table = NULL;
+        p->data = NULL;
+        p->pool = NULL;
+    }
+
+    if (!p)
+        return NULL;
+
+    packet_init(p, max_size);
+    return p;
+}
+
+AvahiDnsPacket* avahi_dns_packet_new(unsigned mtu) {
+    return avahi_dns_packet_new_pooled(NULL, mtu);
+}
+
+AvahiDnsPacket* avahi_dns_packet_new_query_pooled(AvahiDnsPacketPool *pool, unsigned mtu) {
     AvahiDnsPacket *p;
 
-    if (!(p = avahi_dns_packet_new(mtu)))
+    if (!(p = avahi_dns_packet_new_pooled(pool, mtu)))
         return NULL;
 
     avahi_dns_packet_set_field(p, AVAHI_DNS_FIELD_FLAGS, AVAHI_DNS_FLAGS(0, 0, 0, 0, 0, 0, 0, 0, 0, 0));
     return p;
 }
 
-AvahiDnsPacket* avahi_dns_packet_new_response(unsigned mtu, int aa) {
+AvahiDnsPacket* avahi_dns_packet_new_query(unsigned mtu) {
+    return avahi_dns_packet_new_query_pooled(NULL, mtu);
+}
+
+AvahiDnsPacket* avahi_dns_packet_new_response_pooled(AvahiDnsPacketPool *pool, unsigned mtu, int aa) {
     AvahiDnsPacket *p;
 
-    if (!(p = avahi_dns_packet_new(mtu)))
+    if (!(p = avahi_dns_packet_new_pooled(pool, mtu)))
         return NULL;
 
     avahi_dns_packet_set_field(p, AVAHI_DNS_FIELD_FLAGS, AVAHI_DNS_FLAGS(1, 0, aa, 0, 0, 0, 0, 0, 0, 0));
     return p;
 }
 
-AvahiDnsPacket* avahi_dns_packet_new_reply(AvahiDnsPacket* p, unsigned mtu, int copy_queries, int aa) {
+AvahiDnsPacket* avahi_dns_packet_new_response(unsigned mtu, int aa) {
+    return avahi_dns_packet_new_response_pooled(NULL, mtu, aa);
+}
+
+AvahiDnsPacket* avahi_dns_packet_new_reply_pooled(AvahiDnsPacketPool *pool, AvahiDnsPacket* p, unsigned mtu, int copy_queries, int aa) {
     AvahiDnsPacket *r;
     assert(p);
 
-    if (!(r = avahi_dns_packet_new_response(mtu, aa)))
+    if (!(r = avahi_dns_packet_new_response_pooled(pool, mtu, aa)))
         return NULL;
-
     if (copy_queries) {
         unsigned saved_rindex;
         uint32_t n;
@@ -122,11 +251,20 @@ AvahiDnsPacket* avahi_dns_packet_new_reply(AvahiDnsPacket* p, unsigned mtu, int
 }
 
 
+AvahiDnsPacket* avahi_dns_packet_new_reply(AvahiDnsPacket* p, unsigned mtu, int copy_queries, int aa) {
+    return avahi_dns_packet_new_reply_pooled(NULL, p, mtu, copy_queries, aa);
+}
+
 void avahi_dns_packet_free(AvahiDnsPacket *p) {
     assert(p);
 
+    if (p->pool) {
+        pool_put(p->pool, p);
+        return;
+    }
+
     if (p->name_table)
-        avahi_hashmap_free(p->name_table);
+        avahi_dns_name_table_free(p->name_table);
 
     avahi_free(p);
 }
@@ -153,20 +291,104 @@ void avahi_dns_packet_inc_field(AvahiDnsPacket *p, unsigned idx) {
 }
 
 
-static void name_table_cleanup(void *key, void *value, void *user_data) {
-    AvahiDnsPacket *p = user_data;
+#define NAME_TABLE_ENTRIES_MIN 64
+
+static unsigned name_table_hash(const uint8_t *label, uint32_t parent) {
+    unsigned hash = parent * 2654435761U;
+    unsigned i;
+
+    /* label points to the length byte of an uncompressed label */
+    for (i = 0; i <= label[0]; i++)
+        hash = hash * 31 + label[i];
+
+    return hash % AVAHI_DNS_NAME_TABLE_BUCKETS;
+}
+
+/* Names are identified by the offset of their first label plus one,
+ * so that 0 can stand for the root. Returns the identifier of the name
+ * consisting of the given label followed by the name parent, or 0 if
+ * it has not been written to the packet yet. */
+static uint32_t name_table_lookup(AvahiDnsPacket *p, const uint8_t *label, uint32_t parent) {
+    AvahiDnsNameTable *t = p->name_table;
+    uint32_t idx;
+
+    if (!t)
+        return 0;
+
+    for (idx = t->buckets[name_table_hash(label, parent)]; idx; idx = t->entries[idx-1].next) {
+        AvahiDnsNameTableEntry *e = &t->entries[idx-1];
+
+        if (e->parent == parent &&
+            memcmp(AVAHI_DNS_PACKET_DATA(p) + e->offset, label, (size_t) label[0] + 1) == 0)
+            return e->offset + 1;
+    }
+
+    return 0;
+}
+
+static int name_table_insert(AvahiDnsPacket *p, uint32_t offset, uint32_t parent) {
+    AvahiDnsNameTable *t;
+    AvahiDnsNameTableEntry *e;
+
+    if (!(t = p->name_table)) {
+        if (!(t = p->name_table = avahi_new0(AvahiDnsNameTable, 1)))
+            return -1;
+    }
+
+    if (t->n_entries >= t->n_allocated) {
+        unsigned n = t->n_allocated ? t->n_allocated * 2 : NAME_TABLE_ENTRIES_MIN;
+        AvahiDnsNameTableEntry *entries;
+
+        if (!(entries = avahi_realloc(t->entries, n * sizeof(AvahiDnsNameTableEntry))))
+            return -1;
+
+        t->entries = entries;
+        t->n_allocated = n;
+    }
+
+    /* Entries are appended in the order the labels are written, which
+     * is what avahi_dns_packet_cleanup_name_table() relies on */
+    assert(t->n_entries == 0 || t->entries[t->n_entries-1].offset < offset);
+
+    e = &t->entries[t->n_entries++];
+    e->offset = offset;
+    e->parent = parent;
+    e->bucket = name_table_hash(AVAHI_DNS_PACKET_DATA(p) + offset, parent);
+    e->next = t->buckets[e->bucket];
+    t->buckets[e->bucket] = t->n_entries;
+
+    return 0;
+}
+
+void avahi_dns_name_table_free(AvahiDnsNameTable *t) {
+    assert(t);
 
-    if ((uint8_t*) value >= AVAHI_DNS_PACKET_DATA(p) + p->size)
-        avahi_hashmap_remove(p->name_table, key);
+    avahi_free(t->entries);
+    avahi_free(t);
 }
 
 void avahi_dns_packet_cleanup_name_table(AvahiDnsPacket *p) {
-    if (p->name_table)
-        avahi_hashmap_foreach(p->name_table, name_table_cleanup, p);
+    AvahiDnsNameTable *t;
+
+    if (!(t = p->name_table))
+        return;
+
+    /* Drop all labels that have been truncated away. Since they
+     * are the newest entries they are also the heads of their
+     * buckets. */
+    while (t->n_entries > 0 && t->entries[t->n_entries-1].offset >= p->size) {
+        AvahiDnsNameTableEntry *e = &t->entries[--t->n_entries];
+
+        assert(t->buckets[e->bucket] == t->n_entries + 1);
+        t->buckets[e->bucket] = e->next;
+    }
 }
 
 uint8_t* avahi_dns_packet_append_name(AvahiDnsPacket *p, const char *name) {
-    uint8_t *d, *saved_ptr = NULL;
+    uint8_t labels[AVAHI_DNS_LABELS_MAX][64];
+    uint32_t nodes[AVAHI_DNS_LABELS_MAX+1], offsets[AVAHI_DNS_LABELS_MAX];
+    unsigned n_labels = 0, n_found, n_write, i;
+    uint8_t *saved_ptr;
     size_t saved_size;
 
     assert(p);
@@ -175,54 +397,73 @@ uint8_t* avahi_dns_packet_append_name(AvahiDnsPacket *p, const char *name) {
     saved_size = p->size;
     saved_ptr = avahi_dns_packet_extend(p, 0);
 
+    /* Split the name into wire format labels */
     while (*name) {
-        uint8_t* prev;
-        const char *pname;
-        char label[64], *u;
+        char label[64];
 
-        /* Check whether we can compress this name. */
+        if (n_labels >= AVAHI_DNS_LABELS_MAX)
+            return NULL;
 
-        if (p->name_table && (prev = avahi_hashmap_lookup(p->name_table, name))) {
-            unsigned idx;
+        if (!(avahi_unescape_label(&name, label, sizeof(label))))
+            return NULL;
 
-            assert(prev >= AVAHI_DNS_PACKET_DATA(p));
-            idx = (unsigned) (prev - AVAHI_DNS_PACKET_DATA(p));
+        labels[n_labels][0] = (uint8_t) strlen(label);
+        memcpy(labels[n_labels]+1, label, labels[n_labels][0]);
+        n_labels++;
+    }
 
-            assert(idx < p->size);
+    /* Find the longest suffix of the name that is already in the
+     * packet. This works only for normalized domain names. nodes[i]
+     * identifies the first occurrence of the suffix starting with
+     * label i. */
+    nodes[n_labels] = 0;
 
-            if (idx < 0x4000) {
-                uint8_t *t;
-                if (!(t = (uint8_t*) avahi_dns_packet_extend(p, sizeof(uint16_t))))
-                    return NULL;
+    for (n_found = 0; n_found < n_labels; n_found++) {
+        unsigned k = n_labels - n_found - 1;
 
-		t[0] = (uint8_t) ((0xC000 | idx) >> 8);
-		t[1] = (uint8_t) idx;
-                return saved_ptr;
-            }
-        }
+        if (!(nodes[k] = name_table_lookup(p, labels[k], nodes[k+1])))
+            break;
+    }
 
-        pname = name;
+    /* Compression pointers can only reach the first 16K of the
+     * packet. Suffixes that have been seen only beyond that are
+     * written out again, but not indexed a second time. */
+    for (n_write = n_labels - n_found; n_write < n_labels; n_write++)
+        if (nodes[n_write] - 1 < 0x4000)
+            break;
 
-        if (!(avahi_unescape_label(&name, label, sizeof(label))))
-            goto fail;
+    for (i = 0; i < n_write; i++) {
+        uint8_t *d;
 
-        if (!(d = avahi_dns_packet_append_string(p, label)))
+        if (!(d = avahi_dns_packet_append_bytes(p, labels[i], (size_t) labels[i][0] + 1)))
             goto fail;
 
-        if (!p->name_table)
-            /* This works only for normalized domain names */
-            p->name_table = avahi_hashmap_new(avahi_string_hash, avahi_string_equal, avahi_free, NULL);
-
-        if (!(u = avahi_strdup(pname)))
-            avahi_log_error("avahi_strdup() failed.");
-        else
-            avahi_hashmap_insert(p->name_table, u, d);
+        offsets[i] = (uint32_t) (d - AVAHI_DNS_PACKET_DATA(p));
     }
 
-    if (!(d = avahi_dns_packet_extend(p, 1)))
-        goto fail;
+    for (i = 0; i < n_labels - n_found; i++)
+        if (name_table_insert(p, offsets[i], i+1 < n_labels - n_found ? offsets[i+1] + 1 : nodes[i+1]) < 0)
+            avahi_log_error("name_table_insert() failed.");
+
+    if (n_write < n_labels) {
+        uint8_t *t;
+        unsigned idx = nodes[n_write] - 1;
+
+        assert(idx < p->size);
 
-    *d = 0;
+        if (!(t = avahi_dns_packet_extend(p, sizeof(uint16_t))))
+            goto fail;
+
+        t[0] = (uint8_t) ((0xC000 | idx) >> 8);
+        t[1] = (uint8_t) idx;
+    } else {
+        uint8_t *d;
+
+        if (!(d = avahi_dns_packet_extend(p, 1)))
+            goto fail;
+
+        *d = 0;
+    }
 
     return saved_ptr;
 
@@ -619,43 +860,195 @@ static int parse_rdata(AvahiDnsPacket *p, AvahiRecord *r, uint16_t rdlength) {
     return 0;
 }
 
-AvahiRecord* avahi_dns_packet_consume_record(AvahiDnsPacket *p, int *ret_cache_flush) {
-    char name[AVAHI_DOMAIN_NAME_MAX];
+int avahi_dns_packet_consume_record_view(AvahiDnsPacket *p, AvahiDnsRecordView *v) {
     uint16_t type, class;
-    uint32_t ttl;
-    uint16_t rdlength;
-    AvahiRecord *r = NULL;
 
     assert(p);
+    assert(v);
 
-    if (avahi_dns_packet_consume_name(p, name, sizeof(name)) < 0 ||
+    if (avahi_dns_packet_consume_name(p, v->name, sizeof(v->name)) < 0 ||
         avahi_dns_packet_consume_uint16(p, &type) < 0 ||
         avahi_dns_packet_consume_uint16(p, &class) < 0 ||
-        avahi_dns_packet_consume_uint32(p, &ttl) < 0 ||
-        avahi_dns_packet_consume_uint16(p, &rdlength) < 0 ||
-        p->rindex + rdlength > p->size)
-        goto fail;
+        avahi_dns_packet_consume_uint32(p, &v->ttl) < 0 ||
+        avahi_dns_packet_consume_uint16(p, &v->rdlength) < 0 ||
+        p->rindex + v->rdlength > p->size)
+        return -1;
 
-    if (ret_cache_flush)
-        *ret_cache_flush = !!(class & AVAHI_DNS_CACHE_FLUSH);
-    class &= ~AVAHI_DNS_CACHE_FLUSH;
+    v->cache_flush = !!(class & AVAHI_DNS_CACHE_FLUSH);
 
-    if (!(r = avahi_record_new_full(name, class, type, ttl)))
-        goto fail;
+    v->key.ref = 1;
+    v->key.name = v->name;
+    v->key.clazz = class & ~AVAHI_DNS_CACHE_FLUSH;
+    v->key.type = type;
 
-    if (parse_rdata(p, r, rdlength) < 0)
-        goto fail;
+    v->rdata_offset = p->rindex;
+    p->rindex += v->rdlength;
 
-    if (!avahi_record_is_valid(r))
-        goto fail;
+    return 0;
+}
 
-    return r;
+static int txt_view_equal(AvahiDnsPacket *p, const AvahiDnsRecordView *v, const AvahiStringList *l) {
+    const uint8_t *strings[256];
+    const uint8_t *c;
+    unsigned n = 0;
+    size_t size;
 
-fail:
-    if (r)
+    c = AVAHI_DNS_PACKET_DATA(p) + v->rdata_offset;
+    size = v->rdlength;
+
+    /* avahi_string_list_parse() skips empty strings and builds the
+     * list in reverse order, so do the same here */
+    while (size > 0) {
+        size_t k = *c;
+
+        if (k + 1 > size)
+            return 0;
+
+        if (k > 0) {
+            if (n >= sizeof(strings)/sizeof(strings[0]))
+                /* Let the caller take the slow path */
+                return 0;
+
+            strings[n++] = c;
+        }
+
+        c += k + 1;
+        size -= k + 1;
+    }
+
+    for (; l && n > 0; l = l->next, n--)
+        if (l->size != strings[n-1][0] ||
+            memcmp(l->text, strings[n-1] + 1, l->size) != 0)
+            return 0;
+
+    return !l && n == 0;
+}
+
+int avahi_dns_record_view_equal(AvahiDnsPacket *p, const AvahiDnsRecordView *v, const AvahiRecord *r) {
+    char buf[AVAHI_DOMAIN_NAME_MAX];
+    size_t saved_rindex;
+    int ret = 0;
+
+    assert(p);
+    assert(v);
+    assert(r);
+
+    if (!avahi_key_equal(&v->key, r->key))
+        return 0;
+
+    saved_rindex = p->rindex;
+    p->rindex = v->rdata_offset;
+
+    switch (r->key->type) {
+        case AVAHI_DNS_TYPE_PTR:
+        case AVAHI_DNS_TYPE_CNAME:
+        case AVAHI_DNS_TYPE_NS:
+
+            ret =
+                avahi_dns_packet_consume_name(p, buf, sizeof(buf)) >= 0 &&
+                avahi_domain_equal(buf, r->data.ptr.name);
+            break;
+
+        case AVAHI_DNS_TYPE_SRV: {
+            uint16_t priority, weight, port;
+
+            ret =
+                avahi_dns_packet_consume_uint16(p, &priority) >= 0 &&
+                avahi_dns_packet_consume_uint16(p, &weight) >= 0 &&
+                avahi_dns_packet_consume_uint16(p, &port) >= 0 &&
+                avahi_dns_packet_consume_name(p, buf, sizeof(buf)) >= 0 &&
+                priority == r->data.srv.priority &&
+                weight == r->data.srv.weight &&
+                port == r->data.srv.port &&
+                avahi_domain_equal(buf, r->data.srv.name);
+            break;
+        }
+
+        case AVAHI_DNS_TYPE_HINFO:
+
+            ret =
+                avahi_dns_packet_consume_string(p, buf, sizeof(buf)) >= 0 &&
+                !strcmp(buf, r->data.hinfo.cpu) &&
+                avahi_dns_packet_consume_string(p, buf, sizeof(buf)) >= 0 &&
+                !strcmp(buf, r->data.hinfo.os);
+            break;
+
+        case AVAHI_DNS_TYPE_TXT:
+
+            ret = txt_view_equal(p, v, r->data.txt.string_list);
+            p->rindex += v->rdlength;
+            break;
+
+        case AVAHI_DNS_TYPE_A:
+
+            ret =
+                v->rdlength == sizeof(AvahiIPv4Address) &&
+                memcmp(AVAHI_DNS_PACKET_DATA(p) + v->rdata_offset, &r->data.a.address, sizeof(AvahiIPv4Address)) == 0;
+            p->rindex += v->rdlength;
+            break;
+
+        case AVAHI_DNS_TYPE_AAAA:
+
+            ret =
+                v->rdlength == sizeof(AvahiIPv6Address) &&
+                memcmp(AVAHI_DNS_PACKET_DATA(p) + v->rdata_offset, &r->data.aaaa.address, sizeof(AvahiIPv6Address)) == 0;
+            p->rindex += v->rdlength;
+            break;
+
+        default:
+
+            ret =
+                v->rdlength == r->data.generic.size &&
+                (v->rdlength == 0 || memcmp(AVAHI_DNS_PACKET_DATA(p) + v->rdata_offset, r->data.generic.data, v->rdlength) == 0);
+            p->rindex += v->rdlength;
+            break;
+    }
+
+    /* Same check as in parse_rdata() */
+    if (p->rindex != v->rdata_offset + v->rdlength)
+        ret = 0;
+
+    p->rindex = saved_rindex;
+
+    return ret;
+}
+
+AvahiRecord* avahi_dns_record_view_materialize(AvahiDnsPacket *p, const AvahiDnsRecordView *v) {
+    AvahiRecord *r;
+    size_t saved_rindex;
+
+    assert(p);
+    assert(v);
+
+    if (!(r = avahi_record_new_full(v->name, v->key.clazz, v->key.type, v->ttl)))
+        return NULL;
+
+    saved_rindex = p->rindex;
+    p->rindex = v->rdata_offset;
+
+    if (parse_rdata(p, r, v->rdlength) < 0 ||
+        !avahi_record_is_valid(r)) {
         avahi_record_unref(r);
+        r = NULL;
+    }
 
-    return NULL;
+    p->rindex = saved_rindex;
+
+    return r;
+}
+
+AvahiRecord* avahi_dns_packet_consume_record(AvahiDnsPacket *p, int *ret_cache_flush) {
+    AvahiDnsRecordView v;
+
+    assert(p);
+
+    if (avahi_dns_packet_consume_record_view(p, &v) < 0)
+        return NULL;
+
+    if (ret_cache_flush)
+        *ret_cache_flush = v.cache_flush;
+
+    return avahi_dns_record_view_materialize(p, &v);
 }
 
 AvahiKey* avahi_dns_packet_consume_key(AvahiDnsPacket *p, int *ret_unicast_response) {
@@ -820,6 +1213,132 @@ fail:
     return NULL;
 }
 
+/* The domain name at the end of the rdata, which has to be compressed
+ * against the packet it is written to */
+static const char *rdata_name(AvahiRecord *r) {
+    assert(r);
+
+    switch (r->key->type) {
+        case AVAHI_DNS_TYPE_PTR:
+        case AVAHI_DNS_TYPE_CNAME:
+        case AVAHI_DNS_TYPE_NS:
+            return r->data.ptr.name;
+
+        case AVAHI_DNS_TYPE_SRV:
+            return r->data.srv.name;
+
+        default:
+            return NULL;
+    }
+}
+
+AvahiDnsWireRecord *avahi_dns_wire_record_new(AvahiRecord *r) {
+    AvahiDnsWireRecord *w;
+    AvahiDnsPacket *p;
+    uint8_t *start;
+
+    assert(r);
+
+    /* Serialize into a scratch packet of the largest size */
+    if (!(p = avahi_dns_packet_new(0)))
+        return NULL;
+
+    start = avahi_dns_packet_extend(p, 0);
+
+    if (!avahi_dns_packet_append_uint16(p, r->key->type) ||
+        !avahi_dns_packet_append_uint16(p, r->key->clazz &~ AVAHI_DNS_CACHE_FLUSH) ||
+        !avahi_dns_packet_append_uint32(p, r->ttl) ||
+        !avahi_dns_packet_append_uint16(p, 0))
+        goto fail;
+
+    if (r->key->type == AVAHI_DNS_TYPE_SRV) {
+        if (!avahi_dns_packet_append_uint16(p, r->data.srv.priority) ||
+            !avahi_dns_packet_append_uint16(p, r->data.srv.weight) ||
+            !avahi_dns_packet_append_uint16(p, r->data.srv.port))
+            goto fail;
+    } else if (!rdata_name(r) && append_rdata(p, r) < 0)
+        goto fail;
+
+    if (!(w = avahi_new(AvahiDnsWireRecord, 1)))
+        goto fail;
+
+    w->size = avahi_dns_packet_extend(p, 0) - start;
+
+    /* Without a name the rdata length is known already */
+    if (!rdata_name(r)) {
+        start[8] = (uint8_t) ((w->size - 10) >> 8);
+        start[9] = (uint8_t) (w->size - 10);
+    }
+
+    if (!(w->data = avahi_memdup(start, w->size))) {
+        avahi_free(w);
+        goto fail;
+    }
+
+    avahi_dns_packet_free(p);
+    return w;
+
+fail:
+    avahi_dns_packet_free(p);
+    return NULL;
+}
+
+void avahi_dns_wire_record_free(AvahiDnsWireRecord *w) {
+    assert(w);
+
+    avahi_free(w->data);
+    avahi_free(w);
+}
+
+uint8_t* avahi_dns_packet_append_wire_record(AvahiDnsPacket *p, const AvahiDnsWireRecord *w, AvahiRecord *r, int cache_flush, unsigned max_ttl) {
+    uint8_t *t, *d;
+    const char *name;
+    size_t size;
+
+    assert(p);
+    assert(w);
+    assert(r);
+
+    size = p->size;
+
+    if (!(t = avahi_dns_packet_append_name(p, r->key->name)) ||
+        !(d = avahi_dns_packet_append_bytes(p, w->data, w->size)))
+        goto fail;
+
+    /* Patch what differs between packets: the cache flush bit, the
+     * TTL and the length of rdata with a compressed name */
+    if (cache_flush)
+        d[2] |= AVAHI_DNS_CACHE_FLUSH >> 8;
+
+    if (max_ttl && r->ttl > max_ttl) {
+        d[4] = (uint8_t) (max_ttl >> 24);
+        d[5] = (uint8_t) (max_ttl >> 16);
+        d[6] = (uint8_t) (max_ttl >> 8);
+        d[7] = (uint8_t) max_ttl;
+    }
+
+    if ((name = rdata_name(r))) {
+        size_t l;
+
+        if (!avahi_dns_packet_append_name(p, name))
+            goto fail;
+
+        l = avahi_dns_packet_extend(p, 0) - (d + 10);
+        assert(l <= AVAHI_DNS_RDATA_MAX);
+
+        d[8] = (uint8_t) ((uint16_t) l >> 8);
+        d[9] = (uint8_t) ((uint16_t) l);
+    }
+
+    return t;
+
+fail:
+    p->size = size;
+    avahi_dns_packet_cleanup_name_table(p);
+
+    return NULL;
+}
+
 int avahi_dns_packet_is_empty(AvahiDnsPacket *p) {
     assert(p);
 
@@ -861,9 +1380,10 @@ int avahi_rdata_parse(AvahiRecord *record, const void* rdata, size_t size) {
     assert(rdata);
 
     p.data = (void*) rdata;
-    p.max_size = p.size = size;
+    p.max_size = p.capacity = p.size = size;
     p.rindex = 0;
     p.name_table = NULL;
+    p.pool = NULL;
 
     ret = parse_rdata(&p, record, size);
 
@@ -881,14 +1401,15 @@ size_t avahi_rdata_serialize(AvahiRecord *record, void *rdata, size_t max_size)
     assert(max_size > 0);
 
     p.data = (void*) rdata;
-    p.max_size = max_size;
+    p.max_size = p.capacity = max_size;
     p.size = p.rindex = 0;
     p.name_table = NULL;
+    p.pool = NULL;
 
     ret = append_rdata(&p, record);
 
     if (p.name_table)
-         avahi_hashmap_free(p.name_table);
+         avahi_dns_name_table_free(p.name_table);
 
     if (ret < 0)
         return (size_t) -1;
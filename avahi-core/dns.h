@@ -20,6 +20,8 @@
   USA.
 ***/
 
+#include <avahi-common/domain.h>
+
 #include "rr.h"
 #include "hashmap.h"
 
@@ -29,9 +31,28 @@
 #define AVAHI_DNS_RDATA_MAX 0xFFFF
 #define AVAHI_DNS_PACKET_SIZE_MAX (AVAHI_DNS_PACKET_HEADER_SIZE + 256 + 2 + 2 + 4 + 2 + AVAHI_DNS_RDATA_MAX)
 
+#define AVAHI_DNS_NAME_TABLE_BUCKETS 256
+
+typedef struct AvahiDnsPacketPool AvahiDnsPacketPool;
+
+typedef struct AvahiDnsNameTableEntry {
+    uint32_t offset; /* of the label in the packet */
+    uint32_t parent; /* name following the label, see avahi_dns_packet_append_name() */
+    uint32_t bucket, next;
+} AvahiDnsNameTableEntry;
+
+/* Index of the labels written to a packet, for name compression */
+typedef struct AvahiDnsNameTable {
+    AvahiDnsNameTableEntry *entries;
+    unsigned n_entries, n_allocated;
+    uint32_t buckets[AVAHI_DNS_NAME_TABLE_BUCKETS]; /* index into entries plus one, 0 if empty */
+} AvahiDnsNameTable;
+
 typedef struct AvahiDnsPacket {
     size_t size, rindex, max_size, res_size;
-    AvahiHashmap *name_table; /* for name compression */
+    size_t capacity; /* allocated payload size, max_size never exceeds it */
+    AvahiDnsNameTable *name_table; /* for name compression */
+    AvahiDnsPacketPool *pool; /* if non-NULL avahi_dns_packet_free() recycles the packet */
     uint8_t *data;
 } AvahiDnsPacket;
 
@@ -43,6 +64,19 @@ AvahiDnsPacket* avahi_dns_packet_new_response(unsigned mtu, int aa);
 
 AvahiDnsPacket* avahi_dns_packet_new_reply(AvahiDnsPacket* p, unsigned mtu, int copy_queries, int aa);
 
+/* A free list of packet buffers. Packets taken from a pool are
+ * returned to it by avahi_dns_packet_free(), keeping their payload
+ * and name compression table for reuse. The pool may be freed while
+ * packets are still in use. */
+AvahiDnsPacketPool* avahi_dns_packet_pool_new(void);
+void avahi_dns_packet_pool_free(AvahiDnsPacketPool *pool);
+
+/* Same as above, but take the packet from the pool, if it is non-NULL */
+AvahiDnsPacket* avahi_dns_packet_new_pooled(AvahiDnsPacketPool *pool, unsigned mtu);
+AvahiDnsPacket* avahi_dns_packet_new_query_pooled(AvahiDnsPacketPool *pool, unsigned mtu);
+AvahiDnsPacket* avahi_dns_packet_new_response_pooled(AvahiDnsPacketPool *pool, unsigned mtu, int aa);
+AvahiDnsPacket* avahi_dns_packet_new_reply_pooled(AvahiDnsPacketPool *pool, AvahiDnsPacket* p, unsigned mtu, int copy_queries, int aa);
+
 void avahi_dns_packet_free(AvahiDnsPacket *p);
 void avahi_dns_packet_set_field(AvahiDnsPacket *p, unsigned idx, uint16_t v);
 uint16_t avahi_dns_packet_get_field(AvahiDnsPacket *p, unsigned idx);
@@ -51,6 +85,7 @@ void avahi_dns_packet_inc_field(AvahiDnsPacket *p, unsigned idx);
 uint8_t *avahi_dns_packet_extend(AvahiDnsPacket *p, size_t l);
 
 void avahi_dns_packet_cleanup_name_table(AvahiDnsPacket *p);
+void avahi_dns_name_table_free(AvahiDnsNameTable *t);
 
 uint8_t *avahi_dns_packet_append_uint16(AvahiDnsPacket *p, uint16_t v);
 uint8_t *avahi_dns_packet_append_uint32(AvahiDnsPacket *p, uint32_t v);
@@ -58,6 +93,20 @@ uint8_t *avahi_dns_packet_append_name(AvahiDnsPacket *p, const char *name);
 uint8_t *avahi_dns_packet_append_bytes(AvahiDnsPacket  *p, const void *d, size_t l);
 uint8_t* avahi_dns_packet_append_key(AvahiDnsPacket *p, AvahiKey *k, int unicast_response);
 uint8_t* avahi_dns_packet_append_record(AvahiDnsPacket *p, AvahiRecord *r, int cache_flush, unsigned max_ttl);
+
+/* A record that is sent often, serialized once: type, class, TTL,
+ * rdata length and the rdata up to a trailing domain name. The owner
+ * name and that domain name are compressed against each packet. */
+typedef struct AvahiDnsWireRecord {
+    uint8_t *data;
+    size_t size;
+} AvahiDnsWireRecord;
+
+AvahiDnsWireRecord *avahi_dns_wire_record_new(AvahiRecord *r);
+void avahi_dns_wire_record_free(AvahiDnsWireRecord *w);
+
+/* Like avahi_dns_packet_append_record(), for a record w was made from */
+uint8_t* avahi_dns_packet_append_wire_record(AvahiDnsPacket *p, const AvahiDnsWireRecord *w, AvahiRecord *r, int cache_flush, unsigned max_ttl);
 uint8_t* avahi_dns_packet_append_string(AvahiDnsPacket *p, const char *s);
 
 int avahi_dns_packet_is_query(AvahiDnsPacket *p);
@@ -70,6 +119,28 @@ int avahi_dns_packet_consume_name(AvahiDnsPacket *p, char *ret_name, size_t l);
 int avahi_dns_packet_consume_bytes(AvahiDnsPacket *p, void* ret_data, size_t l);
 AvahiKey* avahi_dns_packet_consume_key(AvahiDnsPacket *p, int *ret_unicast_response);
 AvahiRecord* avahi_dns_packet_consume_record(AvahiDnsPacket *p, int *ret_cache_flush);
+
+/* A resource record of a received packet, with the rdata left in
+ * place. The key points into the view itself, so views must not be
+ * copied. */
+typedef struct AvahiDnsRecordView {
+    AvahiKey key;
+    char name[AVAHI_DOMAIN_NAME_MAX];
+    uint32_t ttl;
+    int cache_flush;
+    size_t rdata_offset;
+    uint16_t rdlength;
+} AvahiDnsRecordView;
+
+/* Like avahi_dns_packet_consume_record(), but does not parse the
+ * rdata or allocate anything */
+int avahi_dns_packet_consume_record_view(AvahiDnsPacket *p, AvahiDnsRecordView *v);
+
+/* Same as avahi_record_equal_no_ttl(), comparing the rdata in the packet */
+int avahi_dns_record_view_equal(AvahiDnsPacket *p, const AvahiDnsRecordView *v, const AvahiRecord *r);
+
+/* Parse the viewed record into a newly allocated AvahiRecord */
+AvahiRecord* avahi_dns_record_view_materialize(AvahiDnsPacket *p, const AvahiDnsRecordView *v);
 int avahi_dns_packet_consume_string(AvahiDnsPacket *p, char *ret_string, size_t l);
 
 const void* avahi_dns_packet_get_rptr(AvahiDnsPacket *p);
@@ -49,6 +49,7 @@
 #include "dns-srv-rr.h"
 #include "rr-util.h"
 #include "domain-util.h"
+#include "dns.h"
 
 static void transport_flags_from_domain(AvahiServer *s, AvahiPublishFlags *flags, const char *domain) {
     assert(flags);
@@ -69,6 +70,78 @@ static void transport_flags_from_domain(AvahiServer *s, AvahiPublishFlags *flags
         *flags |= AVAHI_PUBLISH_USE_WIDE_AREA;
 }
 
+static void link_by_key(AvahiServer *s, AvahiEntry *e) {
+    AvahiEntry *t, *after;
+
+    assert(s);
+    assert(e);
+
+    t = avahi_hashmap_lookup(s->entries_by_key, e->record->key);
+
+    /* Unique entries are kept at the front of the list, so that
+     * check_record_conflict() may stop at the first shared entry when
+     * a shared record is added */
+
+    if ((e->flags & AVAHI_PUBLISH_UNIQUE) || !t || !(t->flags & AVAHI_PUBLISH_UNIQUE)) {
+        AVAHI_LLIST_PREPEND(AvahiEntry, by_key, t, e);
+        avahi_hashmap_replace(s->entries_by_key, e->record->key, t);
+        return;
+    }
+
+    for (after = t; after->by_key_next && (after->by_key_next->flags & AVAHI_PUBLISH_UNIQUE); after = after->by_key_next)
+        ;
+
+    AVAHI_LLIST_INSERT_AFTER(AvahiEntry, by_key, after, e);
+}
+
+static void unlink_by_key(AvahiServer *s, AvahiEntry *e) {
+    AvahiEntry *t;
+
+    assert(s);
+    assert(e);
+
+    t = avahi_hashmap_lookup(s->entries_by_key, e->record->key);
+    AVAHI_LLIST_REMOVE(AvahiEntry, by_key, t, e);
+    if (t)
+        avahi_hashmap_replace(s->entries_by_key, t->record->key, t);
+    else
+        avahi_hashmap_remove(s->entries_by_key, e->record->key);
+}
+
+static void link_by_record(AvahiServer *s, AvahiEntry *e) {
+    AvahiEntry *t;
+
+    assert(s);
+    assert(e);
+
+    /* Failing to serialize is not fatal, the record is then encoded
+     * from scratch whenever it is sent */
+    e->wire = avahi_dns_wire_record_new(e->record);
+
+    t = avahi_hashmap_lookup(s->entries_by_record, e->record);
+    AVAHI_LLIST_PREPEND(AvahiEntry, by_record, t, e);
+    avahi_hashmap_replace(s->entries_by_record, e->record, t);
+}
+
+static void unlink_by_record(AvahiServer *s, AvahiEntry *e) {
+    AvahiEntry *t;
+
+    assert(s);
+    assert(e);
+
+    t = avahi_hashmap_lookup(s->entries_by_record, e->record);
+    AVAHI_LLIST_REMOVE(AvahiEntry, by_record, t, e);
+    if (t)
+        avahi_hashmap_replace(s->entries_by_record, t->record, t);
+    else
+        avahi_hashmap_remove(s->entries_by_record, e->record);
+
+    if (e->wire) {
+        avahi_dns_wire_record_free(e->wire);
+        e->wire = NULL;
+    }
+}
+
 void avahi_entry_free(AvahiServer*s, AvahiEntry *e) {
     AvahiEntry *t;
 
@@ -81,12 +154,18 @@ void avahi_entry_free(AvahiServer*s, AvahiEntry *e) {
     AVAHI_LLIST_REMOVE(AvahiEntry, entries, s->entries, e);
 
     /* Remove from hash table indexed by name */
-    t = avahi_hashmap_lookup(s->entries_by_key, e->record->key);
-    AVAHI_LLIST_REMOVE(AvahiEntry, by_key, t, e);
+    unlink_by_key(s, e);
+
+    /* Remove from hash table indexed by record */
+    unlink_by_record(s, e);
+
+    /* Remove from hash table indexed by name only */
+    t = avahi_hashmap_lookup(s->entries_by_name, e->record->key->name);
+    AVAHI_LLIST_REMOVE(AvahiEntry, by_name, t, e);
     if (t)
-        avahi_hashmap_replace(s->entries_by_key, t->record->key, t);
+        avahi_hashmap_replace(s->entries_by_name, t->record->key->name, t);
     else
-        avahi_hashmap_remove(s->entries_by_key, e->record->key);
+        avahi_hashmap_remove(s->entries_by_name, e->record->key->name);
 
     /* Remove from associated group */
     if (e->group)
@@ -159,7 +238,8 @@ static int check_record_conflict(AvahiServer *s, AvahiIfIndex interface, AvahiPr
             continue;
 
         if (!(flags & AVAHI_PUBLISH_UNIQUE) && !(e->flags & AVAHI_PUBLISH_UNIQUE))
-            continue;
+            /* Only shared entries follow, see link_by_key() */
+            break;
 
         if ((flags & AVAHI_PUBLISH_ALLOW_MULTIPLE) && (e->flags & AVAHI_PUBLISH_ALLOW_MULTIPLE) )
             continue;
@@ -231,28 +311,28 @@ static AvahiEntry * server_add_internal(
 
     if (flags & AVAHI_PUBLISH_UPDATE) {
         AvahiRecord *old_record;
-        int is_first = 1;
 
         /* Update and existing record */
 
         /* Find the first matching entry */
-        for (e = avahi_hashmap_lookup(s->entries_by_key, r->key); e; e = e->by_key_next) {
+        for (e = avahi_hashmap_lookup(s->entries_by_key, r->key); e; e = e->by_key_next)
             if (!e->dead && e->group == g && e->interface == interface && e->protocol == protocol)
                 break;
 
-            is_first = 0;
-        }
-
         /* Hmm, nothing found? */
         if (!e) {
             avahi_server_set_errno(s, AVAHI_ERR_NOT_FOUND);
             return NULL;
         }
 
-        /* Update the entry */
+        /* Update the entry, the flags might move it within the key list */
+        unlink_by_key(s, e);
+        unlink_by_record(s, e);
         old_record = e->record;
         e->record = avahi_record_ref(r);
         e->flags = flags;
+        link_by_key(s, e);
+        link_by_record(s, e);
 
         /* Announce our changes when needed */
         if (!avahi_record_equal_no_ttl(old_record, r) && (!g || g->state != AVAHI_ENTRY_GROUP_UNCOMMITED)) {
@@ -266,8 +346,8 @@ static AvahiEntry * server_add_internal(
         }
 
         /* If we were the first entry in the list, we need to update the key */
-        if (is_first)
-            avahi_hashmap_replace(s->entries_by_key, e->record->key, e);
+        if (!e->by_name_prev)
+            avahi_hashmap_replace(s->entries_by_name, e->record->key->name, e);
 
         avahi_record_unref(old_record);
 
@@ -299,9 +379,15 @@ static AvahiEntry * server_add_internal(
         AVAHI_LLIST_PREPEND(AvahiEntry, entries, s->entries, e);
 
         /* Insert into hash table indexed by name */
-        t = avahi_hashmap_lookup(s->entries_by_key, e->record->key);
-        AVAHI_LLIST_PREPEND(AvahiEntry, by_key, t, e);
-        avahi_hashmap_replace(s->entries_by_key, e->record->key, t);
+        link_by_key(s, e);
+
+        /* Insert into hash table indexed by record */
+        link_by_record(s, e);
+
+        /* Insert into hash table indexed by name only */
+        t = avahi_hashmap_lookup(s->entries_by_name, e->record->key->name);
+        AVAHI_LLIST_PREPEND(AvahiEntry, by_name, t, e);
+        avahi_hashmap_replace(s->entries_by_name, e->record->key->name, t);
 
         /* Insert into group list */
         if (g)
@@ -577,7 +663,9 @@ static int server_add_service_strlst_nocopy(
     const char *domain,
     const char *host,
     uint16_t port,
-    AvahiStringList *strlst) {
+    AvahiStringList *strlst,
+    int enumerate,
+    AvahiEntry **added) {
 
     char ptr_name[AVAHI_DOMAIN_NAME_MAX], svc_name[AVAHI_DOMAIN_NAME_MAX], enum_ptr[AVAHI_DOMAIN_NAME_MAX], *h = NULL;
     AvahiRecord *r = NULL;
@@ -663,11 +751,19 @@ static int server_add_service_strlst_nocopy(
 
     /* Add service type enumeration record */
 
-    if (!(enum_entry = server_add_ptr_internal(s, g, interface, protocol, 0, AVAHI_DEFAULT_TTL, enum_ptr, ptr_name))) {
+    if (enumerate &&
+        !(enum_entry = server_add_ptr_internal(s, g, interface, protocol, 0, AVAHI_DEFAULT_TTL, enum_ptr, ptr_name))) {
         ret = avahi_server_errno(s);
         goto fail;
     }
 
+    /* Let the caller know what we added, for undoing it later on */
+    if (added) {
+        added[0] = ptr_entry;
+        added[1] = srv_entry;
+        added[2] = txt_entry;
+    }
+
 fail:
     if (ret != AVAHI_OK && !(flags & AVAHI_PUBLISH_UPDATE)) {
         if (srv_entry)
@@ -703,7 +799,7 @@ int avahi_server_add_service_strlst(
     assert(type);
     assert(name);
 
-    return server_add_service_strlst_nocopy(s, g, interface, protocol, flags, name, type, domain, host, port, avahi_string_list_copy(strlst));
+    return server_add_service_strlst_nocopy(s, g, interface, protocol, flags, name, type, domain, host, port, avahi_string_list_copy(strlst), 1, NULL);
 }
 
 int avahi_server_add_service(
@@ -723,12 +819,167 @@ int avahi_server_add_service(
     int ret;
 
     va_start(va, port);
-    ret = server_add_service_strlst_nocopy(s, g, interface, protocol, flags, name, type, domain, host, port, avahi_string_list_new_va(va));
+    ret = server_add_service_strlst_nocopy(s, g, interface, protocol, flags, name, type, domain, host, port, avahi_string_list_new_va(va), 1, NULL);
     va_end(va);
 
     return ret;
 }
 
+/* Checks everything about a service of a batch that can be checked
+ * without touching the server, so that a bad batch fails before
+ * anything is added */
+static int validate_batch_service(
+    AvahiServer *s,
+    AvahiPublishFlags flags,
+    const AvahiServicePublishInfo *info,
+    AvahiHashmap *names) {
+
+    char svc_name[AVAHI_DOMAIN_NAME_MAX], enum_ptr[AVAHI_DOMAIN_NAME_MAX], *k;
+    const char *domain;
+    int ret;
+
+    assert(s);
+    assert(info);
+    assert(names);
+
+    AVAHI_CHECK_VALIDITY(s, info->name && avahi_is_valid_service_name(info->name), AVAHI_ERR_INVALID_SERVICE_NAME);
+    AVAHI_CHECK_VALIDITY(s, info->type && avahi_is_valid_service_type_strict(info->type), AVAHI_ERR_INVALID_SERVICE_TYPE);
+    AVAHI_CHECK_VALIDITY(s, !info->domain || avahi_is_valid_domain_name(info->domain), AVAHI_ERR_INVALID_DOMAIN_NAME);
+    AVAHI_CHECK_VALIDITY(s, !info->host || avahi_is_valid_fqdn(info->host), AVAHI_ERR_INVALID_HOST_NAME);
+
+    domain = info->domain ? info->domain : s->domain_name;
+
+    transport_flags_from_domain(s, &flags, domain);
+    AVAHI_CHECK_VALIDITY(s, flags & AVAHI_PUBLISH_USE_MULTICAST, AVAHI_ERR_NOT_SUPPORTED);
+
+    if ((ret = avahi_service_name_join(svc_name, sizeof(svc_name), info->name, info->type, domain)) < 0 ||
+        (ret = avahi_service_name_join(enum_ptr, sizeof(enum_ptr), NULL, "_services._dns-sd._udp", domain)) < 0)
+        return avahi_server_set_errno(s, ret);
+
+    /* Two services of the same name would collide with each other */
+    AVAHI_CHECK_VALIDITY(s, !avahi_hashmap_lookup(names, svc_name), AVAHI_ERR_COLLISION);
+
+    if (!(k = avahi_strdup(svc_name)))
+        return avahi_server_set_errno(s, AVAHI_ERR_NO_MEMORY);
+
+    if (avahi_hashmap_insert(names, k, k) < 0) {
+        avahi_free(k);
+        return avahi_server_set_errno(s, AVAHI_ERR_NO_MEMORY);
+    }
+
+    return AVAHI_OK;
+}
+
+int avahi_server_add_service_batch(
+    AvahiServer *s,
+    AvahiSEntryGroup *g,
+    AvahiIfIndex interface,
+    AvahiProtocol protocol,
+    AvahiPublishFlags flags,
+    const AvahiServicePublishInfo *services,
+    unsigned n_services) {
+
+    AvahiHashmap *names = NULL, *types = NULL;
+    AvahiEntry **added = NULL;
+    unsigned i, n_added = 0;
+    int ret = AVAHI_OK;
+
+    assert(s);
+    assert(services || n_services == 0);
+
+    AVAHI_CHECK_VALIDITY(s, g, AVAHI_ERR_INVALID_OBJECT);
+    AVAHI_CHECK_VALIDITY(s, g->state == AVAHI_ENTRY_GROUP_UNCOMMITED, AVAHI_ERR_BAD_STATE);
+    AVAHI_CHECK_VALIDITY(s, AVAHI_IF_VALID(interface), AVAHI_ERR_INVALID_INTERFACE);
+    AVAHI_CHECK_VALIDITY(s, AVAHI_PROTO_VALID(protocol), AVAHI_ERR_INVALID_PROTOCOL);
+    AVAHI_CHECK_VALIDITY(s, AVAHI_FLAGS_VALID(flags,
+                                              AVAHI_PUBLISH_NO_COOKIE|
+                                              AVAHI_PUBLISH_USE_WIDE_AREA|
+                                              AVAHI_PUBLISH_USE_MULTICAST), AVAHI_ERR_INVALID_FLAGS);
+    AVAHI_CHECK_VALIDITY(s, n_services > 0, AVAHI_ERR_IS_EMPTY);
+
+    /* Validate the whole batch first */
+
+    if (!(names = avahi_hashmap_new((AvahiHashFunc) avahi_domain_hash, (AvahiEqualFunc) avahi_domain_equal, avahi_free, NULL))) {
+        ret = avahi_server_set_errno(s, AVAHI_ERR_NO_MEMORY);
+        goto finish;
+    }
+
+    for (i = 0; i < n_services; i++)
+        if ((ret = validate_batch_service(s, flags, services + i, names)) < 0)
+            goto finish;
+
+    /* Then add it. What may still fail now are collisions with records
+     * published elsewhere and running out of memory, in which case the
+     * entries added so far are removed again. Every service adds three
+     * entries and possibly the enumeration record of its type. */
+
+    if (!(types = avahi_hashmap_new((AvahiHashFunc) avahi_domain_hash, (AvahiEqualFunc) avahi_domain_equal, avahi_free, NULL)) ||
+        !(added = avahi_new(AvahiEntry*, n_services * 4))) {
+        ret = avahi_server_set_errno(s, AVAHI_ERR_NO_MEMORY);
+        goto finish;
+    }
+
+    for (i = 0; i < n_services; i++) {
+        const AvahiServicePublishInfo *info = services + i;
+        char ptr_name[AVAHI_DOMAIN_NAME_MAX], enum_ptr[AVAHI_DOMAIN_NAME_MAX], *k;
+        const char *domain;
+        AvahiEntry *e;
+
+        if ((ret = server_add_service_strlst_nocopy(s, g, interface, protocol, flags, info->name, info->type, info->domain, info->host, info->port, avahi_string_list_copy(info->strlst), 0, added + n_added)) < 0)
+            goto finish;
+
+        n_added += 3;
+
+        /* Add the service type enumeration record only once per type,
+         * the names have been checked above */
+
+        domain = info->domain ? info->domain : s->domain_name;
+
+        avahi_service_name_join(ptr_name, sizeof(ptr_name), NULL, info->type, domain);
+        avahi_service_name_join(enum_ptr, sizeof(enum_ptr), NULL, "_services._dns-sd._udp", domain);
+
+        if (avahi_hashmap_lookup(types, ptr_name))
+            continue;
+
+        if (!(e = server_add_ptr_internal(s, g, interface, protocol, 0, AVAHI_DEFAULT_TTL, enum_ptr, ptr_name))) {
+            ret = avahi_server_errno(s);
+            goto finish;
+        }
+
+        added[n_added++] = e;
+
+        if (!(k = avahi_strdup(ptr_name))) {
+            ret = avahi_server_set_errno(s, AVAHI_ERR_NO_MEMORY);
+            goto finish;
+        }
+
+        if (avahi_hashmap_insert(types, k, k) < 0) {
+            avahi_free(k);
+            ret = avahi_server_set_errno(s, AVAHI_ERR_NO_MEMORY);
+            goto finish;
+        }
+    }
+
+    /* Commit once, so that all services are probed and announced
+     * together by the probe and announce schedulers */
+    ret = avahi_s_entry_group_commit(g);
+
+finish:
+    if (ret != AVAHI_OK)
+        while (n_added > 0)
+            avahi_entry_free(s, added[--n_added]);
+
+    avahi_free(added);
+
+    if (types)
+        avahi_hashmap_free(types);
+
+    if (names)
+        avahi_hashmap_free(names);
+
+    return ret;
+}
+
 static int server_update_service_txt_strlst_nocopy(
     AvahiServer *s,
     AvahiSEntryGroup *g,
@@ -182,7 +182,8 @@ static void netlink_callback(AvahiNetlink *nl, struct nlmsghdr *n, void* userdat
         struct rtattr *a = NULL;
         size_t l;
         AvahiAddress raddr, rlocal, *r;
-        int raddr_valid = 0, rlocal_valid = 0;
+        AvahiInterfaceAddress *addr;
+        int raddr_valid = 0, rlocal_valid = 0, state;
 
         /* We are only interested in IPv4 and IPv6 */
         if (ifaddrmsg->ifa_family != AF_INET && ifaddrmsg->ifa_family != AF_INET6)
@@ -247,21 +248,33 @@ static void netlink_callback(AvahiNetlink *nl, struct nlmsghdr *n, void* userdat
         else
             return;
 
+        state = avahi_interface_get_publish_state(i);
+
         if (n->nlmsg_type == RTM_NEWADDR) {
-            AvahiInterfaceAddress *addr;
+            int global_scope, deprecated;
+
+            global_scope = ifaddrmsg->ifa_scope == RT_SCOPE_UNIVERSE || ifaddrmsg->ifa_scope == RT_SCOPE_SITE;
+            deprecated = !!(ifaddrmsg->ifa_flags & IFA_F_DEPRECATED);
 
             /* This address is new or has been modified, so let's get an object for it */
-            if (!(addr = avahi_interface_monitor_get_address(m, i, r)))
+            if ((addr = avahi_interface_monitor_get_address(m, i, r))) {
+
+                /* The kernel sends this for every lifetime update
+                 * too, which doesn't change anything for us */
+                if (addr->global_scope == global_scope && addr->deprecated == deprecated)
+                    return;
+
+            } else {
 
                 /* Mmm, no object existing yet, so let's create a new one */
                 if (!(addr = avahi_interface_address_new(m, i, r, ifaddrmsg->ifa_prefixlen)))
                     return; /* OOM */
+            }
 
             /* Update the scope field for the address */
-            addr->global_scope = ifaddrmsg->ifa_scope == RT_SCOPE_UNIVERSE || ifaddrmsg->ifa_scope == RT_SCOPE_SITE;
-            addr->deprecated = !!(ifaddrmsg->ifa_flags & IFA_F_DEPRECATED);
+            addr->global_scope = global_scope;
+            addr->deprecated = deprecated;
         } else {
-            AvahiInterfaceAddress *addr;
             assert(n->nlmsg_type == RTM_DELADDR);
 
             /* Try to get a reference to our AvahiInterfaceAddress object for this address */
@@ -270,16 +283,15 @@ static void netlink_callback(AvahiNetlink *nl, struct nlmsghdr *n, void* userdat
 
             /* And free it */
             avahi_interface_address_free(addr);
+            addr = NULL;
         }
 
         /* Avahi only considers interfaces with at least one address
          * attached relevant. Since we migh have added or removed an
-         * address, let's have it check again whether the interface is
-         * now relevant */
-        avahi_interface_check_relevant(i);
-
-        /* Update any associated RRs, like A or AAAA for our new/removed address */
-        avahi_interface_update_rrs(i, 0);
+         * address, have it check again whether the interface is now
+         * relevant, and update any associated RRs, like A or AAAA for
+         * our new/removed address */
+        avahi_interface_address_changed(i, addr, state);
 
     } else if (n->nlmsg_type == NLMSG_DONE) {
 
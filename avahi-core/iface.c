@@ -280,6 +280,8 @@ void avahi_interface_free(AvahiInterface *i, int send_goodbye) {
     avahi_goodbye_interface(i->monitor->server, i, send_goodbye, 1);
     avahi_response_scheduler_force(i->response_scheduler);
     assert(!i->announcers);
+    assert(!i->announce_ticks);
+    assert(!i->announce_event);
 
     if (i->mcast_joined)
         interface_mdns_mcast_join(i, 0);
@@ -302,6 +304,10 @@ void avahi_interface_free(AvahiInterface *i, int send_goodbye) {
     AVAHI_LLIST_REMOVE(AvahiInterface, interface, i->monitor->interfaces, i);
     AVAHI_LLIST_REMOVE(AvahiInterface, by_hardware, i->hardware->interfaces, i);
 
+    if (i->monitor->server->reflector)
+        avahi_reflector_invalidate(i->monitor->server->reflector);
+    avahi_free(i->reflect_targets);
+
     avahi_free(i);
 }
 
@@ -342,6 +348,15 @@ AvahiInterface* avahi_interface_new(AvahiInterfaceMonitor *m, AvahiHwInterface *
     AVAHI_LLIST_HEAD_INIT(AvahiInterfaceAddress, i->addresses);
     AVAHI_LLIST_HEAD_INIT(AvahiAnnouncer, i->announcers);
 
+    AVAHI_LLIST_HEAD_INIT(AvahiAnnounceTick, i->announce_ticks);
+    AVAHI_LLIST_HEAD_INIT(AvahiAnnouncer, i->announce_queue);
+    i->announce_event = NULL;
+
+    i->resolve_latency = i->resolve_latency_var = 0;
+
+    i->reflect_targets = NULL;
+    i->n_reflect_targets = 0;
+
     AVAHI_LLIST_HEAD_INIT(AvahiQuerier, i->queriers);
     i->queriers_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, NULL, NULL);
 
@@ -445,6 +460,8 @@ void avahi_interface_check_relevant(AvahiInterface *i) {
             avahi_log_info("New relevant interface %s.%s for mDNS.", i->hardware->name, avahi_proto_to_string(i->protocol));
 
             i->announcing = 1;
+            if (m->server->reflector)
+                avahi_reflector_invalidate(m->server->reflector);
             avahi_announce_interface(m->server, i);
             avahi_multicast_lookup_engine_new_interface(m->server->multicast_lookup_engine, i);
         }
@@ -463,11 +480,47 @@ void avahi_interface_check_relevant(AvahiInterface *i) {
         avahi_cache_flush(i->cache);
 
         i->announcing = 0;
+        if (m->server->reflector)
+            avahi_reflector_invalidate(m->server->reflector);
 
     } else
         interface_mdns_mcast_rejoin(i);
 }
 
+int avahi_interface_get_publish_state(AvahiInterface *i) {
+    AvahiInterfaceAddress *a;
+    int state = 0;
+
+    assert(i);
+
+    if (avahi_interface_is_relevant(i))
+        state |= 1;
+
+    /* A global, non-deprecated address hides all others, see
+     * avahi_interface_address_is_relevant() */
+    for (a = i->addresses; a; a = a->address_next)
+        if (a->global_scope && !a->deprecated) {
+            state |= 2;
+            break;
+        }
+
+    return state;
+}
+
+void avahi_interface_address_changed(AvahiInterface *i, AvahiInterfaceAddress *a, int publish_state) {
+    assert(i);
+
+    avahi_interface_check_relevant(i);
+
+    /* Unless the change affected the other addresses too, only the
+     * RRs of the changed address need an update. Those of a removed
+     * address have already been withdrawn when it was freed. */
+    if (avahi_interface_get_publish_state(i) != publish_state)
+        avahi_interface_update_rrs(i, 0);
+    else if (a)
+        avahi_interface_address_update_rrs(a, 0);
+}
+
 void avahi_hw_interface_check_relevant(AvahiHwInterface *hw) {
     AvahiInterface *i;
 
@@ -595,10 +648,10 @@ void avahi_interface_send_packet_unicast(AvahiInterface *i, AvahiDnsPacket *p, c
         i->hardware->ratelimit_counter++;
     }
 
-    if (i->protocol == AVAHI_PROTO_INET && i->monitor->server->fd_ipv4 >= 0)
-        avahi_send_dns_packet_ipv4(i->monitor->server->fd_ipv4, i->hardware->index, p, i->mcast_joined ? &i->local_mcast_address.data.ipv4 : NULL, a ? &a->data.ipv4 : NULL, port);
-    else if (i->protocol == AVAHI_PROTO_INET6 && i->monitor->server->fd_ipv6 >= 0)
-        avahi_send_dns_packet_ipv6(i->monitor->server->fd_ipv6, i->hardware->index, p, i->mcast_joined ? &i->local_mcast_address.data.ipv6 : NULL, a ? &a->data.ipv6 : NULL, port);
+    if (i->protocol == AVAHI_PROTO_INET && i->monitor->server->send_queue_ipv4)
+        avahi_send_queue_push_ipv4(i->monitor->server->send_queue_ipv4, i->hardware->index, p, i->mcast_joined ? &i->local_mcast_address.data.ipv4 : NULL, a ? &a->data.ipv4 : NULL, port);
+    else if (i->protocol == AVAHI_PROTO_INET6 && i->monitor->server->send_queue_ipv6)
+        avahi_send_queue_push_ipv6(i->monitor->server->send_queue_ipv6, i->hardware->index, p, i->mcast_joined ? &i->local_mcast_address.data.ipv6 : NULL, a ? &a->data.ipv6 : NULL, port);
 }
 
 void avahi_interface_send_packet(AvahiInterface *i, AvahiDnsPacket *p) {
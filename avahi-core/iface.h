@@ -113,8 +113,23 @@ struct AvahiInterface {
     AVAHI_LLIST_HEAD(AvahiInterfaceAddress, addresses);
     AVAHI_LLIST_HEAD(AvahiAnnouncer, announcers);
 
+    /* The pending announcer ticks on this interface, and the
+     * announcements not yet handed to the response scheduler */
+    AVAHI_LLIST_HEAD(AvahiAnnounceTick, announce_ticks);
+    AVAHI_LLIST_HEAD(AvahiAnnouncer, announce_queue);
+    AvahiTimeEvent *announce_event;
+
+    /* Smoothed time service resolvers took to get an answer on this
+     * interface, and its variation. 0 until we have seen one. */
+    AvahiUsec resolve_latency, resolve_latency_var;
+
     AvahiHashmap *queriers_by_key;
     AVAHI_LLIST_HEAD(AvahiQuerier, queriers);
+
+    /* Where the reflector forwards traffic from this interface to,
+     * maintained by reflector.c */
+    AvahiInterface **reflect_targets;
+    unsigned n_reflect_targets;
 };
 
 struct AvahiInterfaceAddress {
@@ -166,6 +181,12 @@ void avahi_interface_update_rrs(AvahiInterface *i, int remove_rrs);
 void avahi_interface_check_relevant(AvahiInterface *i);
 int avahi_interface_is_relevant(AvahiInterface *i);
 
+/* Take a snapshot of what decides which addresses of the interface
+ * are published, to be passed to avahi_interface_address_changed()
+ * after one address has been added, modified or removed */
+int avahi_interface_get_publish_state(AvahiInterface *i);
+void avahi_interface_address_changed(AvahiInterface *i, AvahiInterfaceAddress *a, int publish_state);
+
 void avahi_interface_send_packet(AvahiInterface *i, AvahiDnsPacket *p);
 void avahi_interface_send_packet_unicast(AvahiInterface *i, AvahiDnsPacket *p, const AvahiAddress *a, uint16_t port);
 
@@ -38,9 +38,20 @@ typedef struct AvahiEntry AvahiEntry;
 #include "hashmap.h"
 #include "wide-area.h"
 #include "multicast-lookup.h"
+#include "reflector.h"
+#include "ratelimit.h"
 #include "dns-srv-rr.h"
+#include "socket.h"
 
-#define AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX 100
+/* Sizes of the legacy unicast reflect slot table, powers of two no
+ * bigger than the 16 bit DNS ID space */
+#define AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MIN 128
+#define AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX 8192
+
+/* Slots expire on a timer wheel ticking this often */
+#define AVAHI_LEGACY_UNICAST_REFLECT_TIMEOUT_MSEC 2000
+#define AVAHI_LEGACY_UNICAST_REFLECT_TICK_MSEC 100
+#define AVAHI_LEGACY_UNICAST_REFLECT_WHEEL_SIZE (AVAHI_LEGACY_UNICAST_REFLECT_TIMEOUT_MSEC/AVAHI_LEGACY_UNICAST_REFLECT_TICK_MSEC + 2)
 
 #define AVAHI_FLAGS_VALID(flags, max) (!((flags) & ~(max)))
 
@@ -57,8 +68,10 @@ struct AvahiLegacyUnicastReflectSlot {
     AvahiAddress address;
     uint16_t port;
     int interface;
-    struct timeval elapse_time;
-    AvahiTimeEvent *time_event;
+
+    /* The timer wheel bucket this slot expires from */
+    unsigned bucket;
+    AVAHI_LLIST_FIELDS(AvahiLegacyUnicastReflectSlot, slots);
 };
 
 struct AvahiEntry {
@@ -74,7 +87,12 @@ struct AvahiEntry {
 
     AVAHI_LLIST_FIELDS(AvahiEntry, entries);
     AVAHI_LLIST_FIELDS(AvahiEntry, by_key);
+    AVAHI_LLIST_FIELDS(AvahiEntry, by_name);
     AVAHI_LLIST_FIELDS(AvahiEntry, by_group);
+    AVAHI_LLIST_FIELDS(AvahiEntry, by_record);
+
+    /* The record serialized once, see avahi_server_append_record() */
+    AvahiDnsWireRecord *wire;
 
     AVAHI_LLIST_HEAD(AvahiAnnouncer, announcers);
 };
@@ -107,6 +125,8 @@ struct AvahiServer {
 
     AVAHI_LLIST_HEAD(AvahiEntry, entries);
     AvahiHashmap *entries_by_key;
+    AvahiHashmap *entries_by_record;
+    AvahiHashmap *entries_by_name; /* For ANY queries */
 
     AVAHI_LLIST_HEAD(AvahiSEntryGroup, groups);
 
@@ -136,6 +156,15 @@ struct AvahiServer {
     AvahiWatch *watch_ipv4, *watch_ipv6,
         *watch_legacy_unicast_ipv4, *watch_legacy_unicast_ipv6;
 
+    /* Preallocated buffers for batch reception on the mDNS sockets */
+    AvahiRecvRing *recv_ring;
+
+    /* Outgoing mDNS packets, flushed once per main loop iteration */
+    AvahiSendQueue *send_queue_ipv4, *send_queue_ipv6;
+
+    /* Recycled buffers for the packets we generate */
+    AvahiDnsPacketPool *packet_pool;
+
     AvahiServerState state;
     AvahiServerCallback callback;
     void* userdata;
@@ -147,9 +176,15 @@ struct AvahiServer {
     /* Used for assembling responses */
     AvahiRecordList *record_list;
 
-    /* Used for reflection of legacy unicast packets */
+    /* Used for reflection of legacy unicast packets. Slots are found
+     * by the low bits of their ID. */
     AvahiLegacyUnicastReflectSlot **legacy_unicast_reflect_slots;
-    uint16_t legacy_unicast_reflect_id;
+    unsigned legacy_unicast_reflect_slots_size, n_legacy_unicast_reflect_slots;
+    AVAHI_LLIST_HEAD(AvahiLegacyUnicastReflectSlot, legacy_unicast_reflect_wheel[AVAHI_LEGACY_UNICAST_REFLECT_WHEEL_SIZE]);
+    unsigned legacy_unicast_reflect_tick;
+    struct timeval legacy_unicast_reflect_next_tick;
+    AvahiTimeEvent *legacy_unicast_reflect_time_event;
+    unsigned n_legacy_unicast_reflect_exhausted;
 
     /* The last error code */
     int error;
@@ -159,6 +194,12 @@ struct AvahiServer {
 
     AvahiMulticastLookupEngine *multicast_lookup_engine;
     AvahiWideAreaLookupEngine *wide_area_lookup_engine;
+
+    /* NULL unless enable_reflector is set */
+    AvahiReflector *reflector;
+
+    /* Limits for incoming queries, NULL if disabled */
+    AvahiRateLimiter *source_rate_limiter, *key_rate_limiter;
 };
 
 void avahi_entry_free(AvahiServer*s, AvahiEntry *e);
@@ -185,6 +226,8 @@ int avahi_server_set_errno(AvahiServer *s, int error);
 int avahi_server_is_service_local(AvahiServer *s, AvahiIfIndex interface, AvahiProtocol protocol, const char *name);
 int avahi_server_is_record_local(AvahiServer *s, AvahiIfIndex interface, AvahiProtocol protocol, AvahiRecord *record);
 
+uint8_t* avahi_server_append_record(AvahiServer *s, AvahiDnsPacket *p, AvahiRecord *r, int cache_flush, unsigned max_ttl);
+
 int avahi_server_add_ptr(
     AvahiServer *s,
     AvahiSEntryGroup *g,
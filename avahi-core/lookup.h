@@ -230,6 +230,19 @@ AvahiSServiceResolver *avahi_s_service_resolver_new(
 /** Free an AvahiSServiceResolver object */
 void avahi_s_service_resolver_free(AvahiSServiceResolver *r);
 
+/** Timing policy of an AvahiSServiceResolver. By default a resolver
+ * waits 5s and then fails without retrying. */
+typedef struct AvahiSServiceResolverTiming {
+    unsigned timeout_msec;        /**< Time to wait for an answer before the first retry. 0 derives it from the response latency observed on the interface so far, between 1s and 5s; without any, the 5s are spread over all attempts */
+    unsigned backoff_factor;      /**< Factor the timeout grows by with every retry */
+    unsigned max_retries;         /**< Number of times to ask again before AVAHI_RESOLVER_FAILURE is reported */
+    unsigned timeout_max_msec;    /**< Upper limit for the timeout, 0 for none */
+} AvahiSServiceResolverTiming;
+
+/** Change the timing policy of an AvahiSServiceResolver. Applies to
+ * the running attempt, if there is one. */
+int avahi_s_service_resolver_set_timing(AvahiSServiceResolver *r, const AvahiSServiceResolverTiming *timing);
+
 AVAHI_C_DECL_END
 
 #endif
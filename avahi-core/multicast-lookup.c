@@ -52,6 +52,7 @@ struct AvahiMulticastLookup {
 
     AVAHI_LLIST_FIELDS(AvahiMulticastLookup, lookups);
     AVAHI_LLIST_FIELDS(AvahiMulticastLookup, by_key);
+    AVAHI_LLIST_FIELDS(AvahiMulticastLookup, by_cname_key);
 };
 
 struct AvahiMulticastLookupEngine {
@@ -60,6 +61,7 @@ struct AvahiMulticastLookupEngine {
     /* Lookups */
     AVAHI_LLIST_HEAD(AvahiMulticastLookup, lookups);
     AvahiHashmap *lookups_by_key;
+    AvahiHashmap *lookups_by_cname_key;
 
     int cleanup_dead;
 };
@@ -109,6 +111,12 @@ AvahiMulticastLookup *avahi_multicast_lookup_new(
     AVAHI_LLIST_PREPEND(AvahiMulticastLookup, by_key, t, l);
     avahi_hashmap_replace(e->lookups_by_key, avahi_key_ref(l->key), t);
 
+    if (l->cname_key) {
+        t = avahi_hashmap_lookup(e->lookups_by_cname_key, l->cname_key);
+        AVAHI_LLIST_PREPEND(AvahiMulticastLookup, by_cname_key, t, l);
+        avahi_hashmap_replace(e->lookups_by_cname_key, avahi_key_ref(l->cname_key), t);
+    }
+
     AVAHI_LLIST_PREPEND(AvahiMulticastLookup, lookups, e->lookups, l);
 
     avahi_querier_add_for_all(e->server, interface, protocol, l->key, &tv);
@@ -152,6 +160,15 @@ static void lookup_destroy(AvahiMulticastLookup *l) {
     else
         avahi_hashmap_remove(l->engine->lookups_by_key, l->key);
 
+    if (l->cname_key) {
+        t = avahi_hashmap_lookup(l->engine->lookups_by_cname_key, l->cname_key);
+        AVAHI_LLIST_REMOVE(AvahiMulticastLookup, by_cname_key, t, l);
+        if (t)
+            avahi_hashmap_replace(l->engine->lookups_by_cname_key, avahi_key_ref(l->cname_key), t);
+        else
+            avahi_hashmap_remove(l->engine->lookups_by_cname_key, l->cname_key);
+    }
+
     AVAHI_LLIST_REMOVE(AvahiMulticastLookup, lookups, l->engine->lookups, l);
 
     if (l->key)
@@ -304,20 +321,13 @@ void avahi_multicast_lookup_engine_notify(AvahiMulticastLookupEngine *e, AvahiIn
 
 
     if (record->key->clazz == AVAHI_DNS_CLASS_IN && record->key->type == AVAHI_DNS_TYPE_CNAME) {
-        /* It's a CNAME record, so we have to scan the all lookups to see if one matches */
-
-        for (l = e->lookups; l; l = l->lookups_next) {
-            AvahiKey *key;
+        /* It's a CNAME record, so let's notify the lookups for its name, too */
 
+        for (l = avahi_hashmap_lookup(e->lookups_by_cname_key, record->key); l; l = l->by_cname_key_next) {
             if (l->dead || !l->callback)
                 continue;
 
-            if ((key = avahi_key_new_cname(l->key))) {
-                if (avahi_key_equal(record->key, key))
-                    l->callback(e, i->hardware->index, i->protocol, event, AVAHI_LOOKUP_RESULT_MULTICAST, record, l->userdata);
-
-                avahi_key_unref(key);
-            }
+            l->callback(e, i->hardware->index, i->protocol, event, AVAHI_LOOKUP_RESULT_MULTICAST, record, l->userdata);
         }
     }
 }
@@ -333,6 +343,7 @@ AvahiMulticastLookupEngine *avahi_multicast_lookup_engine_new(AvahiServer *s) {
 
     /* Initialize lookup list */
     e->lookups_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, (AvahiFreeFunc) avahi_key_unref, NULL);
+    e->lookups_by_cname_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, (AvahiFreeFunc) avahi_key_unref, NULL);
     AVAHI_LLIST_HEAD_INIT(AvahiWideAreaLookup, e->lookups);
 
     return e;
@@ -345,6 +356,7 @@ void avahi_multicast_lookup_engine_free(AvahiMulticastLookupEngine *e) {
         lookup_destroy(e->lookups);
 
     avahi_hashmap_free(e->lookups_by_key);
+    avahi_hashmap_free(e->lookups_by_cname_key);
     avahi_free(e);
 }
 
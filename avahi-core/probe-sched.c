@@ -30,6 +30,8 @@
 #include "probe-sched.h"
 #include "log.h"
 #include "rr-util.h"
+#include "hashmap.h"
+#include "internal.h"
 
 #define AVAHI_PROBE_HISTORY_MSEC 150
 #define AVAHI_PROBE_DEFER_MSEC 50
@@ -47,6 +49,10 @@ struct AvahiProbeJob {
     AvahiRecord *record;
 
     AVAHI_LLIST_FIELDS(AvahiProbeJob, jobs);
+
+    /* All jobs of the same list with the same key, indexed by the
+     * hash table of that list */
+    AVAHI_LLIST_FIELDS(AvahiProbeJob, by_key);
 };
 
 struct AvahiProbeScheduler {
@@ -55,8 +61,43 @@ struct AvahiProbeScheduler {
 
     AVAHI_LLIST_HEAD(AvahiProbeJob, jobs);
     AVAHI_LLIST_HEAD(AvahiProbeJob, history);
+
+    AvahiHashmap *jobs_by_key;
+    AvahiHashmap *history_by_key;
 };
 
+static void job_index_add(AvahiProbeScheduler *s, AvahiProbeJob *pj) {
+    AvahiHashmap *m;
+    AvahiProbeJob *first;
+
+    assert(s);
+    assert(pj);
+
+    m = pj->done ? s->history_by_key : s->jobs_by_key;
+
+    first = avahi_hashmap_lookup(m, pj->record->key);
+    AVAHI_LLIST_PREPEND(AvahiProbeJob, by_key, first, pj);
+    avahi_hashmap_replace(m, first->record->key, first);
+}
+
+static void job_index_remove(AvahiProbeScheduler *s, AvahiProbeJob *pj) {
+    AvahiHashmap *m;
+    AvahiProbeJob *first;
+
+    assert(s);
+    assert(pj);
+
+    m = pj->done ? s->history_by_key : s->jobs_by_key;
+
+    first = avahi_hashmap_lookup(m, pj->record->key);
+    AVAHI_LLIST_REMOVE(AvahiProbeJob, by_key, first, pj);
+
+    if (first)
+        avahi_hashmap_replace(m, first->record->key, first);
+    else
+        avahi_hashmap_remove(m, pj->record->key);
+}
+
 static AvahiProbeJob* job_new(AvahiProbeScheduler *s, AvahiRecord *record, int done) {
     AvahiProbeJob *pj;
 
@@ -78,6 +119,8 @@ static AvahiProbeJob* job_new(AvahiProbeScheduler *s, AvahiRecord *record, int d
     else
         AVAHI_LLIST_PREPEND(AvahiProbeJob, jobs, s->jobs, pj);
 
+    job_index_add(s, pj);
+
     return pj;
 }
 
@@ -87,6 +130,8 @@ static void job_free(AvahiProbeScheduler *s, AvahiProbeJob *pj) {
     if (pj->time_event)
         avahi_time_event_free(pj->time_event);
 
+    job_index_remove(s, pj);
+
     if (pj->done)
         AVAHI_LLIST_REMOVE(AvahiProbeJob, jobs, s->history, pj);
     else
@@ -118,10 +163,12 @@ static void job_mark_done(AvahiProbeScheduler *s, AvahiProbeJob *pj) {
 
     assert(!pj->done);
 
+    job_index_remove(s, pj);
     AVAHI_LLIST_REMOVE(AvahiProbeJob, jobs, s->jobs, pj);
     AVAHI_LLIST_PREPEND(AvahiProbeJob, jobs, s->history, pj);
 
     pj->done = 1;
+    job_index_add(s, pj);
 
     job_set_elapse_time(s, pj, AVAHI_PROBE_HISTORY_MSEC, 0);
     gettimeofday(&pj->delivery, NULL);
@@ -140,6 +187,21 @@ AvahiProbeScheduler *avahi_probe_scheduler_new(AvahiInterface *i) {
     s->interface = i;
     s->time_event_queue = i->monitor->server->time_event_queue;
 
+    s->jobs_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, NULL, NULL);
+    s->history_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, NULL, NULL);
+
+    if (!s->jobs_by_key || !s->history_by_key) {
+        avahi_log_error(__FILE__": Out of memory");
+
+        if (s->jobs_by_key)
+            avahi_hashmap_free(s->jobs_by_key);
+        if (s->history_by_key)
+            avahi_hashmap_free(s->history_by_key);
+
+        avahi_free(s);
+        return NULL;
+    }
+
     AVAHI_LLIST_HEAD_INIT(AvahiProbeJob, s->jobs);
     AVAHI_LLIST_HEAD_INIT(AvahiProbeJob, s->history);
 
@@ -150,6 +212,10 @@ void avahi_probe_scheduler_free(AvahiProbeScheduler *s) {
     assert(s);
 
     avahi_probe_scheduler_clear(s);
+
+    avahi_hashmap_free(s->jobs_by_key);
+    avahi_hashmap_free(s->history_by_key);
+
     avahi_free(s);
 }
 
@@ -235,7 +301,7 @@ static void elapse_callback(AVAHI_GCC_UNUSED AvahiTimeEvent *e, void* data) {
         return;
     }
 
-    if (!(p = avahi_dns_packet_new_query(s->interface->hardware->mtu)))
+    if (!(p = avahi_dns_packet_new_query_pooled(s->interface->monitor->server->packet_pool, s->interface->hardware->mtu)))
         return; /* OOM */
     n = 1;
 
@@ -254,7 +320,7 @@ static void elapse_callback(AVAHI_GCC_UNUSED AvahiTimeEvent *e, void* data) {
             avahi_record_get_estimate_size(pj->record) +
             AVAHI_DNS_PACKET_HEADER_SIZE;
 
-        if (!(p = avahi_dns_packet_new_query(size + AVAHI_DNS_PACKET_EXTRA_SIZE)))
+        if (!(p = avahi_dns_packet_new_query_pooled(s->interface->monitor->server->packet_pool, size + AVAHI_DNS_PACKET_EXTRA_SIZE)))
             return; /* OOM */
 
         if (!(k = avahi_key_new(pj->record->key->name, pj->record->key->clazz, AVAHI_DNS_TYPE_ANY))) {
@@ -262,7 +328,7 @@ static void elapse_callback(AVAHI_GCC_UNUSED AvahiTimeEvent *e, void* data) {
             return;  /* OOM */
         }
 
-        b = avahi_dns_packet_append_key(p, k, 0) && avahi_dns_packet_append_record(p, pj->record, 0, 0);
+        b = avahi_dns_packet_append_key(p, k, 0) && avahi_server_append_record(s->interface->monitor->server, p, pj->record, 0, 0);
         avahi_key_unref(k);
 
         if (b) {
@@ -302,7 +368,7 @@ static void elapse_callback(AVAHI_GCC_UNUSED AvahiTimeEvent *e, void* data) {
         if (!pj->chosen)
             continue;
 
-        if (!avahi_dns_packet_append_record(p, pj->record, 0, 0)) {
+        if (!avahi_server_append_record(s->interface->monitor->server, p, pj->record, 0, 0)) {
 /*             avahi_log_warn("Bad probe size estimate!"); */
 
             /* Unmark all following jobs */
@@ -330,7 +396,7 @@ static AvahiProbeJob* find_scheduled_job(AvahiProbeScheduler *s, AvahiRecord *re
     assert(s);
     assert(record);
 
-    for (pj = s->jobs; pj; pj = pj->jobs_next) {
+    for (pj = avahi_hashmap_lookup(s->jobs_by_key, record->key); pj; pj = pj->by_key_next) {
         assert(!pj->done);
 
         if (avahi_record_equal_no_ttl(pj->record, record))
@@ -346,7 +412,7 @@ static AvahiProbeJob* find_history_job(AvahiProbeScheduler *s, AvahiRecord *reco
     assert(s);
     assert(record);
 
-    for (pj = s->history; pj; pj = pj->jobs_next) {
+    for (pj = avahi_hashmap_lookup(s->history_by_key, record->key); pj; pj = pj->by_key_next) {
         assert(pj->done);
 
         if (avahi_record_equal_no_ttl(pj->record, record)) {
@@ -131,6 +131,34 @@ int avahi_server_add_service_strlst(
     uint16_t port,
     AvahiStringList *strlst);
 
+/** A single service to be added with avahi_server_add_service_batch() */
+typedef struct AvahiServicePublishInfo {
+    const char *name;         /**< Service name */
+    const char *type;         /**< DNS-SD service type, e.g. "_http._tcp" */
+    const char *domain;       /**< Domain to publish in, or NULL for the default domain */
+    const char *host;         /**< Host name the service runs on, or NULL for the local host */
+    uint16_t port;            /**< IP port of the service */
+    AvahiStringList *strlst;  /**< TXT record data, copied by avahi_server_add_service_batch() */
+} AvahiServicePublishInfo;
+
+/** Add many services to an uncommitted entry group and commit it.
+ * This is the same as calling avahi_server_add_service_strlst() for
+ * each service followed by avahi_s_entry_group_commit(), except that
+ * the service type enumeration record is added only once per service
+ * type and that either all services are added or none. The whole
+ * batch is validated before anything is added; if adding fails
+ * afterwards, e.g. because of a collision with a record published
+ * elsewhere, the services added so far are removed again and the
+ * group is left uncommitted. AVAHI_PUBLISH_UPDATE is not supported. */
+int avahi_server_add_service_batch(
+    AvahiServer *s,
+    AvahiSEntryGroup *g,
+    AvahiIfIndex interface,
+    AvahiProtocol protocol,
+    AvahiPublishFlags flags,
+    const AvahiServicePublishInfo *services,
+    unsigned n_services);
+
 /** Add a subtype for an already existing service */
 int avahi_server_add_service_subtype(
     AvahiServer *s,
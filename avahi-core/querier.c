@@ -260,6 +260,15 @@ int avahi_querier_shall_refresh_cache(AvahiInterface *i, AvahiKey *key) {
     }
 }
 
+int avahi_querier_is_used(AvahiInterface *i, AvahiKey *key) {
+    AvahiQuerier *q;
+
+    assert(i);
+    assert(key);
+
+    return (q = avahi_hashmap_lookup(i->queriers_by_key, key)) && q->n_used > 0;
+}
+
 void avahi_querier_free_all(AvahiInterface *i) {
     assert(i);
 
@@ -45,4 +45,9 @@ void avahi_querier_free_all(AvahiInterface *i);
 /** Return 1 if there is a querier for the specified key on the specified interface */
 int avahi_querier_shall_refresh_cache(AvahiInterface *i, AvahiKey *key);
 
+/** Return 1 if some browser or resolver currently uses the querier
+ * for the specified key on the specified interface. Unlike
+ * avahi_querier_shall_refresh_cache() this has no side effects. */
+int avahi_querier_is_used(AvahiInterface *i, AvahiKey *key);
+
 #endif
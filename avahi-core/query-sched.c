@@ -22,18 +22,19 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <avahi-common/timeval.h>
 #include <avahi-common/malloc.h>
 
 #include "query-sched.h"
 #include "log.h"
+#include "hashmap.h"
 
 #define AVAHI_QUERY_HISTORY_MSEC 100
 #define AVAHI_QUERY_DEFER_MSEC 100
 
 typedef struct AvahiQueryJob AvahiQueryJob;
-typedef struct AvahiKnownAnswer AvahiKnownAnswer;
 
 struct AvahiQueryJob {
     unsigned id;
@@ -47,22 +48,13 @@ struct AvahiQueryJob {
 
     AvahiKey *key;
 
-    /* Jobs are stored in a simple linked list. It might turn out in
-     * the future that this list grows too long and we must switch to
-     * some other kind of data structure. This needs further
-     * investigation. I expect the list to be very short (< 20
-     * entries) most of the time, but this might be a wrong
-     * assumption, especially on setups where traffic reflection is
-     * involved. */
+    /* Jobs are stored in a simple linked list, in the order they
+     * will be sent. Additionally all jobs of the same list with the
+     * same key are chained up and indexed by a hash table, so that
+     * lookups don't need to walk the whole list. */
 
     AVAHI_LLIST_FIELDS(AvahiQueryJob, jobs);
-};
-
-struct AvahiKnownAnswer {
-    AvahiQueryScheduler *scheduler;
-    AvahiRecord *record;
-
-    AVAHI_LLIST_FIELDS(AvahiKnownAnswer, known_answer);
+    AVAHI_LLIST_FIELDS(AvahiQueryJob, by_key);
 };
 
 struct AvahiQueryScheduler {
@@ -73,9 +65,45 @@ struct AvahiQueryScheduler {
 
     AVAHI_LLIST_HEAD(AvahiQueryJob, jobs);
     AVAHI_LLIST_HEAD(AvahiQueryJob, history);
-    AVAHI_LLIST_HEAD(AvahiKnownAnswer, known_answers);
+
+    AvahiHashmap *jobs_by_key;
+    AvahiHashmap *history_by_key;
+
+    AvahiServerQueryStats stats;
 };
 
+static void job_index_add(AvahiQueryScheduler *s, AvahiQueryJob *qj) {
+    AvahiHashmap *m;
+    AvahiQueryJob *first;
+
+    assert(s);
+    assert(qj);
+
+    m = qj->done ? s->history_by_key : s->jobs_by_key;
+
+    first = avahi_hashmap_lookup(m, qj->key);
+    AVAHI_LLIST_PREPEND(AvahiQueryJob, by_key, first, qj);
+    avahi_hashmap_replace(m, first->key, first);
+}
+
+static void job_index_remove(AvahiQueryScheduler *s, AvahiQueryJob *qj) {
+    AvahiHashmap *m;
+    AvahiQueryJob *first;
+
+    assert(s);
+    assert(qj);
+
+    m = qj->done ? s->history_by_key : s->jobs_by_key;
+
+    first = avahi_hashmap_lookup(m, qj->key);
+    AVAHI_LLIST_REMOVE(AvahiQueryJob, by_key, first, qj);
+
+    if (first)
+        avahi_hashmap_replace(m, first->key, first);
+    else
+        avahi_hashmap_remove(m, qj->key);
+}
+
 static AvahiQueryJob* job_new(AvahiQueryScheduler *s, AvahiKey *key, int done) {
     AvahiQueryJob *qj;
 
@@ -98,6 +126,8 @@ static AvahiQueryJob* job_new(AvahiQueryScheduler *s, AvahiKey *key, int done) {
     else
         AVAHI_LLIST_PREPEND(AvahiQueryJob, jobs, s->jobs, qj);
 
+    job_index_add(s, qj);
+
     return qj;
 }
 
@@ -108,6 +138,8 @@ static void job_free(AvahiQueryScheduler *s, AvahiQueryJob *qj) {
     if (qj->time_event)
         avahi_time_event_free(qj->time_event);
 
+    job_index_remove(s, qj);
+
     if (qj->done)
         AVAHI_LLIST_REMOVE(AvahiQueryJob, jobs, s->history, qj);
     else
@@ -139,10 +171,12 @@ static void job_mark_done(AvahiQueryScheduler *s, AvahiQueryJob *qj) {
 
     assert(!qj->done);
 
+    job_index_remove(s, qj);
     AVAHI_LLIST_REMOVE(AvahiQueryJob, jobs, s->jobs, qj);
     AVAHI_LLIST_PREPEND(AvahiQueryJob, jobs, s->history, qj);
 
     qj->done = 1;
+    job_index_add(s, qj);
 
     job_set_elapse_time(s, qj, AVAHI_QUERY_HISTORY_MSEC, 0);
     gettimeofday(&qj->delivery, NULL);
@@ -160,10 +194,25 @@ AvahiQueryScheduler *avahi_query_scheduler_new(AvahiInterface *i) {
     s->interface = i;
     s->time_event_queue = i->monitor->server->time_event_queue;
     s->next_id = 0;
+    memset(&s->stats, 0, sizeof(s->stats));
+
+    s->jobs_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, NULL, NULL);
+    s->history_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, NULL, NULL);
+
+    if (!s->jobs_by_key || !s->history_by_key) {
+        avahi_log_error(__FILE__": Out of memory");
+
+        if (s->jobs_by_key)
+            avahi_hashmap_free(s->jobs_by_key);
+        if (s->history_by_key)
+            avahi_hashmap_free(s->history_by_key);
+
+        avahi_free(s);
+        return NULL; /* OOM */
+    }
 
     AVAHI_LLIST_HEAD_INIT(AvahiQueryJob, s->jobs);
     AVAHI_LLIST_HEAD_INIT(AvahiQueryJob, s->history);
-    AVAHI_LLIST_HEAD_INIT(AvahiKnownAnswer, s->known_answers);
 
     return s;
 }
@@ -171,8 +220,11 @@ AvahiQueryScheduler *avahi_query_scheduler_new(AvahiInterface *i) {
 void avahi_query_scheduler_free(AvahiQueryScheduler *s) {
     assert(s);
 
-    assert(!s->known_answers);
     avahi_query_scheduler_clear(s);
+
+    avahi_hashmap_free(s->jobs_by_key);
+    avahi_hashmap_free(s->history_by_key);
+
     avahi_free(s);
 }
 
@@ -185,27 +237,51 @@ void avahi_query_scheduler_clear(AvahiQueryScheduler *s) {
         job_free(s, s->history);
 }
 
+typedef struct KnownAnswerState {
+    AvahiQueryScheduler *scheduler;
+    AvahiDnsPacket *packet;
+    unsigned n;
+} KnownAnswerState;
+
 static void* known_answer_walk_callback(AvahiCache *c, AvahiKey *pattern, AvahiCacheEntry *e, void* userdata) {
-    AvahiQueryScheduler *s = userdata;
-    AvahiKnownAnswer *ka;
+    KnownAnswerState *st = userdata;
+    AvahiQueryScheduler *s;
 
     assert(c);
     assert(pattern);
     assert(e);
-    assert(s);
+    assert(st);
+
+    s = st->scheduler;
 
     if (avahi_cache_entry_half_ttl(c, e))
         return NULL;
 
-    if (!(ka = avahi_new0(AvahiKnownAnswer, 1))) {
-        avahi_log_error(__FILE__": Out of memory");
-        return NULL;
+    while (!avahi_dns_packet_append_record(st->packet, e->record, 0, 0)) {
+
+        if (avahi_dns_packet_is_empty(st->packet)) {
+            /* The record is too large to fit into one packet, so
+               there's no point in sending it. Better is letting
+               the owner of the record send it as a response. This
+               has the advantage of a cache refresh. */
+
+            return NULL;
+        }
+
+        avahi_dns_packet_set_field(st->packet, AVAHI_DNS_FIELD_FLAGS, avahi_dns_packet_get_field(st->packet, AVAHI_DNS_FIELD_FLAGS) | AVAHI_DNS_FLAG_TC);
+        avahi_dns_packet_set_field(st->packet, AVAHI_DNS_FIELD_ANCOUNT, st->n);
+        avahi_interface_send_packet(s->interface, st->packet);
+        avahi_dns_packet_free(st->packet);
+        s->stats.n_packets++;
+
+        st->n = 0;
+
+        if (!(st->packet = avahi_dns_packet_new_query_pooled(s->interface->monitor->server->packet_pool, s->interface->hardware->mtu)))
+            return st; /* OOM */
     }
 
-    ka->scheduler = s;
-    ka->record = avahi_record_ref(e->record);
+    st->n++;
 
-    AVAHI_LLIST_PREPEND(AvahiKnownAnswer, known_answer, s->known_answers, ka);
     return NULL;
 }
 
@@ -217,57 +293,43 @@ static int packet_add_query_job(AvahiQueryScheduler *s, AvahiDnsPacket *p, Avahi
     if (!avahi_dns_packet_append_key(p, qj->key, 0))
         return 0;
 
-    /* Add all matching known answers to the list */
-    avahi_cache_walk(s->interface->cache, qj->key, known_answer_walk_callback, s);
-
     job_mark_done(s, qj);
 
     return 1;
 }
 
-static void append_known_answers_and_send(AvahiQueryScheduler *s, AvahiDnsPacket *p) {
-    AvahiKnownAnswer *ka;
-    unsigned n;
+static void append_known_answers_and_send(AvahiQueryScheduler *s, AvahiDnsPacket *p, unsigned n_queries) {
+    KnownAnswerState st;
+    AvahiQueryJob *qj, *k;
+    unsigned i, j;
+
     assert(s);
     assert(p);
 
-    n = 0;
-
-    while ((ka = s->known_answers)) {
-        int too_large = 0;
+    st.scheduler = s;
+    st.packet = p;
+    st.n = 0;
 
-        while (!avahi_dns_packet_append_record(p, ka->record, 0, 0)) {
+    /* The jobs we just put into the packet are now the first ones in
+     * the history. Write the matching cache entries directly into
+     * the packet, but only once per key. */
+    for (qj = s->history, i = 0; qj && i < n_queries; qj = qj->jobs_next, i++) {
 
-            if (avahi_dns_packet_is_empty(p)) {
-                /* The record is too large to fit into one packet, so
-                   there's no point in sending it. Better is letting
-                   the owner of the record send it as a response. This
-                   has the advantage of a cache refresh. */
-
-                too_large = 1;
+        for (k = s->history, j = 0; j < i; k = k->jobs_next, j++)
+            if (avahi_key_equal(k->key, qj->key))
                 break;
-            }
 
-            avahi_dns_packet_set_field(p, AVAHI_DNS_FIELD_FLAGS, avahi_dns_packet_get_field(p, AVAHI_DNS_FIELD_FLAGS) | AVAHI_DNS_FLAG_TC);
-            avahi_dns_packet_set_field(p, AVAHI_DNS_FIELD_ANCOUNT, n);
-            avahi_interface_send_packet(s->interface, p);
-            avahi_dns_packet_free(p);
+        if (j < i)
+            continue;
 
-            p = avahi_dns_packet_new_query(s->interface->hardware->mtu);
-            n = 0;
-        }
-
-        AVAHI_LLIST_REMOVE(AvahiKnownAnswer, known_answer, s->known_answers, ka);
-        avahi_record_unref(ka->record);
-        avahi_free(ka);
-
-        if (!too_large)
-            n++;
+        if (avahi_cache_walk(s->interface->cache, qj->key, known_answer_walk_callback, &st))
+            return; /* OOM */
     }
 
-    avahi_dns_packet_set_field(p, AVAHI_DNS_FIELD_ANCOUNT, n);
-    avahi_interface_send_packet(s->interface, p);
-    avahi_dns_packet_free(p);
+    avahi_dns_packet_set_field(st.packet, AVAHI_DNS_FIELD_ANCOUNT, st.n);
+    avahi_interface_send_packet(s->interface, st.packet);
+    avahi_dns_packet_free(st.packet);
+    s->stats.n_packets++;
 }
 
 static void elapse_callback(AVAHI_GCC_UNUSED AvahiTimeEvent *e, void* data) {
@@ -286,16 +348,15 @@ static void elapse_callback(AVAHI_GCC_UNUSED AvahiTimeEvent *e, void* data) {
         return;
     }
 
-    assert(!s->known_answers);
-
-    if (!(p = avahi_dns_packet_new_query(s->interface->hardware->mtu)))
+    if (!(p = avahi_dns_packet_new_query_pooled(s->interface->monitor->server->packet_pool, s->interface->hardware->mtu)))
         return; /* OOM */
 
     b = packet_add_query_job(s, p, qj);
     assert(b); /* An query must always fit in */
     n = 1;
 
-    /* Try to fill up packet with more queries, if available */
+    /* Try to fill up packet with more queries, if available. Those
+     * that don't fit in any more stay on their own timers. */
     while (s->jobs) {
 
         if (!packet_add_query_job(s, p, s->jobs))
@@ -305,9 +366,10 @@ static void elapse_callback(AVAHI_GCC_UNUSED AvahiTimeEvent *e, void* data) {
     }
 
     avahi_dns_packet_set_field(p, AVAHI_DNS_FIELD_QDCOUNT, n);
+    s->stats.n_questions += n;
 
     /* Now add known answers */
-    append_known_answers_and_send(s, p);
+    append_known_answers_and_send(s, p, n);
 }
 
 static AvahiQueryJob* find_scheduled_job(AvahiQueryScheduler *s, AvahiKey *key) {
@@ -316,14 +378,10 @@ static AvahiQueryJob* find_scheduled_job(AvahiQueryScheduler *s, AvahiKey *key)
     assert(s);
     assert(key);
 
-    for (qj = s->jobs; qj; qj = qj->jobs_next) {
+    if ((qj = avahi_hashmap_lookup(s->jobs_by_key, key)))
         assert(!qj->done);
 
-        if (avahi_key_equal(qj->key, key))
-            return qj;
-    }
-
-    return NULL;
+    return qj;
 }
 
 static AvahiQueryJob* find_history_job(AvahiQueryScheduler *s, AvahiKey *key) {
@@ -332,36 +390,42 @@ static AvahiQueryJob* find_history_job(AvahiQueryScheduler *s, AvahiKey *key) {
     assert(s);
     assert(key);
 
-    for (qj = s->history; qj; qj = qj->jobs_next) {
+    if ((qj = avahi_hashmap_lookup(s->history_by_key, key))) {
         assert(qj->done);
 
-        if (avahi_key_equal(qj->key, key)) {
-            /* Check whether this entry is outdated */
-
-            if (avahi_age(&qj->delivery) > AVAHI_QUERY_HISTORY_MSEC*1000) {
-                /* it is outdated, so let's remove it */
-                job_free(s, qj);
-                return NULL;
-            }
+        /* Check whether this entry is outdated */
 
-            return qj;
+        if (avahi_age(&qj->delivery) > AVAHI_QUERY_HISTORY_MSEC*1000) {
+            /* it is outdated, so let's remove it */
+            job_free(s, qj);
+            return NULL;
         }
     }
 
-    return NULL;
+    return qj;
 }
 
 int avahi_query_scheduler_post(AvahiQueryScheduler *s, AvahiKey *key, int immediately, unsigned *ret_id) {
     struct timeval tv;
     AvahiQueryJob *qj;
+    unsigned msec;
 
     assert(s);
     assert(key);
 
+    s->stats.n_posted++;
+
     if ((qj = find_history_job(s, key)))
         return 0;
 
-    avahi_elapse_time(&tv, immediately ? 0 : AVAHI_QUERY_DEFER_MSEC, 0);
+    msec = immediately ? 0 : AVAHI_QUERY_DEFER_MSEC;
+
+    /* Hold back queries a little longer if requested, so that queries
+     * posted at about the same time are merged into one packet */
+    if (msec < s->interface->monitor->server->config.query_aggregation_msec)
+        msec = s->interface->monitor->server->config.query_aggregation_msec;
+
+    avahi_elapse_time(&tv, msec, 0);
 
     if ((qj = find_scheduled_job(s, key))) {
         /* Duplicate questions suppression */
@@ -448,3 +512,12 @@ int avahi_query_scheduler_withdraw_by_id(AvahiQueryScheduler *s, unsigned id) {
 
     return 0;
 }
+
+void avahi_query_scheduler_add_stats(AvahiQueryScheduler *s, AvahiServerQueryStats *ret) {
+    assert(s);
+    assert(ret);
+
+    ret->n_posted += s->stats.n_posted;
+    ret->n_questions += s->stats.n_questions;
+    ret->n_packets += s->stats.n_packets;
+}
@@ -33,4 +33,7 @@ int avahi_query_scheduler_post(AvahiQueryScheduler *s, AvahiKey *key, int immedi
 int avahi_query_scheduler_withdraw_by_id(AvahiQueryScheduler *s, unsigned id);
 void avahi_query_scheduler_incoming(AvahiQueryScheduler *s, AvahiKey *key);
 
+/* Add the counters of this scheduler to *ret */
+void avahi_query_scheduler_add_stats(AvahiQueryScheduler *s, AvahiServerQueryStats *ret);
+
 #endif
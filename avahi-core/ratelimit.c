@@ -0,0 +1,247 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <avahi-common/malloc.h>
+#include <avahi-common/timeval.h>
+
+#include "ratelimit.h"
+#include "hashmap.h"
+#include "log.h"
+
+/* Buckets that refilled completely are forgotten, and we never keep
+ * more than this many. A flood from many addresses then only costs
+ * the oldest buckets. */
+#define AVAHI_RATE_LIMITER_ENTRIES_MAX 1024
+
+typedef struct AvahiRateLimitEntry AvahiRateLimitEntry;
+
+struct AvahiRateLimitEntry {
+    /* Either the source address, or the key and where it was asked */
+    AvahiAddress address;
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+    AvahiKey *key;
+
+    /* Fill level of the bucket, in usec worth of refill */
+    AvahiUsec credit;
+    struct timeval last;
+
+    AVAHI_LLIST_FIELDS(AvahiRateLimitEntry, entries);
+};
+
+struct AvahiRateLimiter {
+    AvahiUsec cost, capacity;
+
+    AvahiHashmap *entries_by_id;
+
+    /* Least recently used first */
+    AVAHI_LLIST_HEAD(AvahiRateLimitEntry, entries);
+    AvahiRateLimitEntry *entries_tail;
+    unsigned n_entries;
+
+    unsigned n_dropped;
+};
+
+static unsigned entry_hash(const AvahiRateLimitEntry *e) {
+    const uint8_t *p;
+    unsigned hash = 0;
+    size_t n;
+
+    assert(e);
+
+    if (e->key)
+        return avahi_key_hash(e->key) + 31 * (unsigned) e->interface + (unsigned) e->protocol;
+
+    p = (const uint8_t*) &e->address.data;
+    for (n = e->address.proto == AVAHI_PROTO_INET ? sizeof(AvahiIPv4Address) : sizeof(AvahiIPv6Address); n > 0; n--, p++)
+        hash = 31 * hash + *p;
+
+    return hash;
+}
+
+static int entry_equal(const AvahiRateLimitEntry *a, const AvahiRateLimitEntry *b) {
+    assert(a);
+    assert(b);
+
+    if (a->key || b->key)
+        return a->key && b->key &&
+            a->interface == b->interface &&
+            a->protocol == b->protocol &&
+            avahi_key_equal(a->key, b->key);
+
+    return avahi_address_cmp(&a->address, &b->address) == 0;
+}
+
+static void entry_free(AvahiRateLimiter *l, AvahiRateLimitEntry *e) {
+    assert(l);
+    assert(e);
+
+    avahi_hashmap_remove(l->entries_by_id, e);
+
+    if (l->entries_tail == e)
+        l->entries_tail = e->entries_prev;
+    AVAHI_LLIST_REMOVE(AvahiRateLimitEntry, entries, l->entries, e);
+
+    assert(l->n_entries > 0);
+    l->n_entries--;
+
+    if (e->key)
+        avahi_key_unref(e->key);
+
+    avahi_free(e);
+}
+
+static void entry_append(AvahiRateLimiter *l, AvahiRateLimitEntry *e) {
+    assert(l);
+    assert(e);
+
+    if (l->entries_tail)
+        AVAHI_LLIST_INSERT_AFTER(AvahiRateLimitEntry, entries, l->entries_tail, e);
+    else
+        AVAHI_LLIST_PREPEND(AvahiRateLimitEntry, entries, l->entries, e);
+
+    l->entries_tail = e;
+}
+
+AvahiRateLimiter *avahi_rate_limiter_new(unsigned rate, unsigned burst) {
+    AvahiRateLimiter *l;
+
+    assert(rate > 0);
+
+    if (!(l = avahi_new(AvahiRateLimiter, 1))) {
+        avahi_log_error(__FILE__": Out of memory.");
+        return NULL;
+    }
+
+    l->cost = 1000000 / rate;
+    if (l->cost <= 0)
+        l->cost = 1;
+    l->capacity = l->cost * (burst > 0 ? burst : 1);
+
+    l->entries_by_id = avahi_hashmap_new((AvahiHashFunc) entry_hash, (AvahiEqualFunc) entry_equal, NULL, NULL);
+    AVAHI_LLIST_HEAD_INIT(AvahiRateLimitEntry, l->entries);
+    l->entries_tail = NULL;
+    l->n_entries = 0;
+    l->n_dropped = 0;
+
+    return l;
+}
+
+void avahi_rate_limiter_free(AvahiRateLimiter *l) {
+    assert(l);
+
+    while (l->entries)
+        entry_free(l, l->entries);
+
+    avahi_hashmap_free(l->entries_by_id);
+    avahi_free(l);
+}
+
+static int take(AvahiRateLimiter *l, AvahiRateLimitEntry *probe) {
+    AvahiRateLimitEntry *e;
+    struct timeval now;
+
+    assert(l);
+    assert(probe);
+
+    gettimeofday(&now, NULL);
+
+    /* Forget buckets that are full again, they are no different from
+     * buckets we don't have */
+    while (l->entries && avahi_timeval_diff(&now, &l->entries->last) >= l->capacity)
+        entry_free(l, l->entries);
+
+    if ((e = avahi_hashmap_lookup(l->entries_by_id, probe))) {
+        AvahiUsec credit = e->credit + avahi_timeval_diff(&now, &e->last);
+
+        e->credit = credit > l->capacity ? l->capacity : credit;
+        e->last = now;
+
+        AVAHI_LLIST_REMOVE(AvahiRateLimitEntry, entries, l->entries, e);
+        if (l->entries_tail == e)
+            l->entries_tail = e->entries_prev;
+        entry_append(l, e);
+
+    } else {
+
+        if (l->n_entries >= AVAHI_RATE_LIMITER_ENTRIES_MAX)
+            entry_free(l, l->entries);
+
+        if (!(e = avahi_new(AvahiRateLimitEntry, 1)))
+            return 1; /* OOM, rather answer than not */
+
+        *e = *probe;
+        if (e->key)
+            avahi_key_ref(e->key);
+        e->credit = l->capacity;
+        e->last = now;
+
+        entry_append(l, e);
+        l->n_entries++;
+        avahi_hashmap_insert(l->entries_by_id, e, e);
+    }
+
+    if (e->credit < l->cost) {
+        l->n_dropped++;
+        return 0;
+    }
+
+    e->credit -= l->cost;
+    return 1;
+}
+
+int avahi_rate_limiter_check_address(AvahiRateLimiter *l, const AvahiAddress *a) {
+    AvahiRateLimitEntry probe;
+
+    assert(l);
+    assert(a);
+
+    memset(&probe, 0, sizeof(probe));
+    probe.address = *a;
+
+    return take(l, &probe);
+}
+
+int avahi_rate_limiter_check_key(AvahiRateLimiter *l, AvahiInterface *i, AvahiKey *k) {
+    AvahiRateLimitEntry probe;
+
+    assert(l);
+    assert(i);
+    assert(k);
+
+    memset(&probe, 0, sizeof(probe));
+    probe.interface = i->hardware->index;
+    probe.protocol = i->protocol;
+    probe.key = k;
+
+    return take(l, &probe);
+}
+
+unsigned avahi_rate_limiter_get_dropped(AvahiRateLimiter *l) {
+    assert(l);
+
+    return l->n_dropped;
+}
@@ -0,0 +1,44 @@
+#ifndef fooratelimithfoo
+#define fooratelimithfoo
+
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Token buckets for incoming queries, one per source address or per
+ * record key and interface */
+typedef struct AvahiRateLimiter AvahiRateLimiter;
+
+#include <avahi-common/address.h>
+
+#include "iface.h"
+#include "rr.h"
+
+/* rate is in tokens per second, burst is the bucket size */
+AvahiRateLimiter *avahi_rate_limiter_new(unsigned rate, unsigned burst);
+void avahi_rate_limiter_free(AvahiRateLimiter *l);
+
+/* Take a token from the bucket of the source address or of the key
+ * on the interface. Returns 0 if there is none left, 1 otherwise. */
+int avahi_rate_limiter_check_address(AvahiRateLimiter *l, const AvahiAddress *a);
+int avahi_rate_limiter_check_key(AvahiRateLimiter *l, AvahiInterface *i, AvahiKey *k);
+
+/* Number of checks that failed */
+unsigned avahi_rate_limiter_get_dropped(AvahiRateLimiter *l);
+
+#endif
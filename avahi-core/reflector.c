@@ -0,0 +1,365 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include <avahi-common/malloc.h>
+#include <avahi-common/timeval.h>
+#include <avahi-common/domain.h>
+
+#include "internal.h"
+#include "reflector.h"
+#include "hashmap.h"
+#include "log.h"
+
+/* Questions and records reflected from an interface are not
+ * reflected again from the same interface for this long. RFC 6762
+ * asks responders not to multicast a record more often anyway. */
+#define AVAHI_REFLECTOR_HISTORY_MSEC 1000
+#define AVAHI_REFLECTOR_HISTORY_MAX 1024
+
+typedef struct AvahiReflectorHistoryEntry AvahiReflectorHistoryEntry;
+
+struct AvahiReflectorHistoryEntry {
+    /* Where this came from. We don't keep a pointer to the
+     * interface, since it might go away before the entry does. */
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+
+    AvahiKey *key;              /* for reflected questions */
+    AvahiRecord *record;        /* for reflected records */
+    int flush_cache;
+
+    struct timeval timestamp;
+
+    AVAHI_LLIST_FIELDS(AvahiReflectorHistoryEntry, history);
+};
+
+struct AvahiReflector {
+    AvahiServer *server;
+
+    /* Whether the reflect_targets of all interfaces are up to date */
+    int tables_valid;
+
+    /* Oldest first */
+    AVAHI_LLIST_HEAD(AvahiReflectorHistoryEntry, history);
+    AvahiReflectorHistoryEntry *history_tail;
+    AvahiHashmap *history_by_item;
+    unsigned n_history;
+
+    AvahiServerReflectorStats stats;
+};
+
+static unsigned history_hash(const AvahiReflectorHistoryEntry *e) {
+    unsigned hash;
+
+    assert(e);
+
+    hash = e->record ? avahi_record_hash_no_ttl(e->record) : avahi_key_hash(e->key);
+    return hash + 31 * (unsigned) e->interface + (unsigned) e->protocol;
+}
+
+static int history_equal(const AvahiReflectorHistoryEntry *a, const AvahiReflectorHistoryEntry *b) {
+    assert(a);
+    assert(b);
+
+    if (a->interface != b->interface || a->protocol != b->protocol)
+        return 0;
+
+    if (a->record || b->record)
+        return a->record && b->record &&
+            a->flush_cache == b->flush_cache &&
+            avahi_record_equal_no_ttl(a->record, b->record);
+
+    return avahi_key_equal(a->key, b->key);
+}
+
+static void history_free(AvahiReflector *r, AvahiReflectorHistoryEntry *e) {
+    assert(r);
+    assert(e);
+
+    avahi_hashmap_remove(r->history_by_item, e);
+
+    if (r->history_tail == e)
+        r->history_tail = e->history_prev;
+    AVAHI_LLIST_REMOVE(AvahiReflectorHistoryEntry, history, r->history, e);
+
+    assert(r->n_history > 0);
+    r->n_history--;
+
+    if (e->key)
+        avahi_key_unref(e->key);
+    if (e->record)
+        avahi_record_unref(e->record);
+
+    avahi_free(e);
+}
+
+static AvahiReflectorHistoryEntry *history_find(AvahiReflector *r, AvahiInterface *i, AvahiKey *k, AvahiRecord *record, int flush_cache) {
+    AvahiReflectorHistoryEntry e;
+
+    assert(r);
+    assert(i);
+
+    /* Expire old entries first, they are ordered by age */
+    while (r->history && avahi_age(&r->history->timestamp) >= (AvahiUsec) AVAHI_REFLECTOR_HISTORY_MSEC*1000)
+        history_free(r, r->history);
+
+    e.interface = i->hardware->index;
+    e.protocol = i->protocol;
+    e.key = k;
+    e.record = record;
+    e.flush_cache = flush_cache;
+
+    return avahi_hashmap_lookup(r->history_by_item, &e);
+}
+
+/* Returns non-zero if the same thing has been reflected from the same
+ * interface within the last AVAHI_REFLECTOR_HISTORY_MSEC, and
+ * remembers it otherwise. */
+static int was_reflected(AvahiReflector *r, AvahiInterface *i, AvahiKey *k, AvahiRecord *record, int flush_cache) {
+    AvahiReflectorHistoryEntry *e;
+
+    assert(r);
+    assert(i);
+    assert(k || record);
+
+    if (history_find(r, i, k, record, flush_cache)) {
+        r->stats.n_suppressed++;
+        return 1;
+    }
+
+    if (r->n_history >= AVAHI_REFLECTOR_HISTORY_MAX)
+        history_free(r, r->history);
+
+    if (!(e = avahi_new(AvahiReflectorHistoryEntry, 1)))
+        return 0; /* OOM, reflect without remembering */
+
+    e->interface = i->hardware->index;
+    e->protocol = i->protocol;
+    e->key = k ? avahi_key_ref(k) : NULL;
+    e->record = record ? avahi_record_ref(record) : NULL;
+    e->flush_cache = flush_cache;
+    gettimeofday(&e->timestamp, NULL);
+
+    if (r->history_tail)
+        AVAHI_LLIST_INSERT_AFTER(AvahiReflectorHistoryEntry, history, r->history_tail, e);
+    else
+        AVAHI_LLIST_PREPEND(AvahiReflectorHistoryEntry, history, r->history, e);
+    r->history_tail = e;
+    r->n_history++;
+
+    avahi_hashmap_insert(r->history_by_item, e, e);
+
+    return 0;
+}
+
+static void rebuild_tables(AvahiReflector *r) {
+    AvahiInterface *i, *j;
+
+    assert(r);
+
+    for (i = r->server->monitor->interfaces; i; i = i->interface_next) {
+        unsigned n = 0;
+
+        avahi_free(i->reflect_targets);
+        i->reflect_targets = NULL;
+        i->n_reflect_targets = 0;
+
+        /* Never back to where it came from. Interfaces that are not
+         * announcing would drop everything we post to them. */
+        for (j = r->server->monitor->interfaces; j; j = j->interface_next)
+            if (j != i && j->announcing && (r->server->config.reflect_ipv || j->protocol == i->protocol))
+                n++;
+
+        if (n == 0)
+            continue;
+
+        if (!(i->reflect_targets = avahi_new(AvahiInterface*, n))) {
+            avahi_log_error(__FILE__": Out of memory.");
+            continue;
+        }
+
+        for (j = r->server->monitor->interfaces; j; j = j->interface_next)
+            if (j != i && j->announcing && (r->server->config.reflect_ipv || j->protocol == i->protocol))
+                i->reflect_targets[i->n_reflect_targets++] = j;
+    }
+
+    r->tables_valid = 1;
+}
+
+static void update_tables(AvahiReflector *r) {
+    assert(r);
+
+    if (!r->tables_valid)
+        rebuild_tables(r);
+}
+
+AvahiReflector *avahi_reflector_new(AvahiServer *s) {
+    AvahiReflector *r;
+
+    assert(s);
+
+    if (!(r = avahi_new0(AvahiReflector, 1))) {
+        avahi_log_error(__FILE__": Out of memory.");
+        return NULL;
+    }
+
+    r->server = s;
+    r->tables_valid = 0;
+
+    AVAHI_LLIST_HEAD_INIT(AvahiReflectorHistoryEntry, r->history);
+    r->history_tail = NULL;
+    r->history_by_item = avahi_hashmap_new((AvahiHashFunc) history_hash, (AvahiEqualFunc) history_equal, NULL, NULL);
+    r->n_history = 0;
+
+    return r;
+}
+
+void avahi_reflector_free(AvahiReflector *r) {
+    assert(r);
+
+    while (r->history)
+        history_free(r, r->history);
+
+    avahi_hashmap_free(r->history_by_item);
+    avahi_free(r);
+}
+
+void avahi_reflector_invalidate(AvahiReflector *r) {
+    assert(r);
+
+    r->tables_valid = 0;
+}
+
+static void* cache_walk_callback(AvahiCache *c, AvahiKey *pattern, AvahiCacheEntry *e, void* userdata) {
+    AvahiServer *s = userdata;
+    AvahiRecord* r;
+
+    assert(c);
+    assert(pattern);
+    assert(e);
+    assert(s);
+
+    /* Don't reflect cache entry with ipv6 link-local addresses. */
+    r = e->record;
+    if ((r->key->type == AVAHI_DNS_TYPE_AAAA) &&
+            (r->data.aaaa.address.address[0] == 0xFE) &&
+            (r->data.aaaa.address.address[1] == 0x80))
+      return NULL;
+
+    avahi_record_list_push(s->record_list, e->record, e->cache_flush, 0, 0);
+    return NULL;
+}
+
+void avahi_reflector_query(AvahiReflector *r, AvahiInterface *i, AvahiKey *k) {
+    unsigned n;
+    int suppressed;
+
+    assert(r);
+    assert(i);
+    assert(k);
+
+    update_tables(r);
+    r->stats.n_queries++;
+
+    if (!i->n_reflect_targets)
+        return;
+
+    suppressed = was_reflected(r, i, k, NULL, 0);
+
+    for (n = 0; n < i->n_reflect_targets; n++) {
+        AvahiInterface *j = i->reflect_targets[n];
+
+        /* Post the query to other networks */
+        if (!suppressed && avahi_interface_post_query(j, k, 1, NULL))
+            r->stats.n_forwarded++;
+
+        /* Reply from caches of other network. This is needed to
+         * "work around" known answer suppression. */
+        avahi_cache_walk(j->cache, k, cache_walk_callback, r->server);
+    }
+}
+
+void avahi_reflector_response(AvahiReflector *r, AvahiInterface *i, AvahiRecord *record, int flush_cache) {
+    unsigned n;
+
+    assert(r);
+    assert(i);
+    assert(record);
+
+    update_tables(r);
+    r->stats.n_responses++;
+
+    if (!i->n_reflect_targets)
+        return;
+
+    if (record->ttl == 0) {
+        AvahiReflectorHistoryEntry *e;
+
+        /* Always pass goodbyes on, and let a new announcement
+         * following one through as well */
+        if ((e = history_find(r, i, NULL, record, flush_cache)))
+            history_free(r, e);
+
+    } else if (was_reflected(r, i, NULL, record, flush_cache))
+        return;
+
+    for (n = 0; n < i->n_reflect_targets; n++)
+        if (avahi_interface_post_response(i->reflect_targets[n], record, flush_cache, NULL, 1))
+            r->stats.n_forwarded++;
+}
+
+void avahi_reflector_probe(AvahiReflector *r, AvahiInterface *i, AvahiRecord *record) {
+    AvahiReflectorHistoryEntry *e, *next;
+    unsigned n;
+
+    assert(r);
+    assert(i);
+    assert(record);
+
+    update_tables(r);
+    r->stats.n_probes++;
+
+    /* Answers to a probe defend the name, so they have to get
+     * through even if the same records were reflected just before */
+    for (e = r->history; e; e = next) {
+        next = e->history_next;
+
+        if (e->record && avahi_domain_equal(e->record->key->name, record->key->name))
+            history_free(r, e);
+    }
+
+    /* Probes are never suppressed, each of them matters for conflict
+     * detection on the other side */
+    for (n = 0; n < i->n_reflect_targets; n++)
+        if (avahi_interface_post_probe(i->reflect_targets[n], record, 1))
+            r->stats.n_forwarded++;
+}
+
+void avahi_reflector_get_stats(AvahiReflector *r, AvahiServerReflectorStats *ret) {
+    assert(r);
+    assert(ret);
+
+    *ret = r->stats;
+}
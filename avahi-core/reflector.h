@@ -0,0 +1,42 @@
+#ifndef fooreflectorhfoo
+#define fooreflectorhfoo
+
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+typedef struct AvahiReflector AvahiReflector;
+
+#include "core.h"
+#include "iface.h"
+#include "rr.h"
+
+AvahiReflector *avahi_reflector_new(AvahiServer *s);
+void avahi_reflector_free(AvahiReflector *r);
+
+/* Called whenever interfaces come, go or change their relevance, so
+ * that the forwarding tables are rebuilt before they are used next */
+void avahi_reflector_invalidate(AvahiReflector *r);
+
+void avahi_reflector_query(AvahiReflector *r, AvahiInterface *i, AvahiKey *k);
+void avahi_reflector_response(AvahiReflector *r, AvahiInterface *i, AvahiRecord *record, int flush_cache);
+void avahi_reflector_probe(AvahiReflector *r, AvahiInterface *i, AvahiRecord *record);
+
+void avahi_reflector_get_stats(AvahiReflector *r, AvahiServerReflectorStats *ret);
+
+#endif
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include <avahi-common/domain.h>
 #include <avahi-common/timeval.h>
@@ -31,10 +32,15 @@
 #include <avahi-common/error.h>
 
 #include "browse.h"
+#include "iface.h"
 #include "log.h"
 
 #define TIMEOUT_MSEC 5000
 
+/* Lower bound for a timeout derived from observed latencies. The
+ * upper bound is TIMEOUT_MSEC. */
+#define ADAPTIVE_TIMEOUT_MIN_MSEC 1000
+
 struct AvahiSServiceResolver {
     AvahiServer *server;
     char *service_name;
@@ -59,24 +65,69 @@ struct AvahiSServiceResolver {
 
     AvahiTimeEvent *time_event;
 
+    AvahiSServiceResolverTiming timing;
+    unsigned n_retries;
+    unsigned timeout_msec;    /* of the running attempt */
+    struct timeval started;   /* when the first attempt since the last result began */
+
     AVAHI_LLIST_FIELDS(AvahiSServiceResolver, resolver);
 };
 
+static void update_latency(AvahiSServiceResolver *r, AvahiLookupResultFlags flags) {
+    AvahiInterface *i;
+    AvahiUsec t, delta;
+
+    assert(r);
+
+    /* Only answers that actually crossed the link tell us something
+     * about it */
+    if (flags & (AVAHI_LOOKUP_RESULT_CACHED|AVAHI_LOOKUP_RESULT_WIDE_AREA|AVAHI_LOOKUP_RESULT_LOCAL|AVAHI_LOOKUP_RESULT_STATIC))
+        return;
+
+    if (r->interface <= 0 || r->protocol == AVAHI_PROTO_UNSPEC)
+        return;
+
+    if (!(i = avahi_interface_monitor_get_interface(r->server->monitor, r->interface, r->protocol)))
+        return;
+
+    if ((t = avahi_age(&r->started)) <= 0)
+        t = 1;
+
+    /* Smoothed like TCP's round trip time estimate (RFC 6298) */
+    if (!i->resolve_latency) {
+        i->resolve_latency = t;
+        i->resolve_latency_var = t/2;
+    } else {
+        delta = t > i->resolve_latency ? t - i->resolve_latency : i->resolve_latency - t;
+        i->resolve_latency_var = (3*i->resolve_latency_var + delta)/4;
+        i->resolve_latency = (7*i->resolve_latency + t)/8;
+
+        if (!i->resolve_latency)
+            i->resolve_latency = 1;
+    }
+}
+
 static void finish(AvahiSServiceResolver *r, AvahiResolverEvent event) {
     AvahiLookupResultFlags flags;
+    int waiting;
 
     assert(r);
 
-    if (r->time_event) {
+    if ((waiting = !!r->time_event)) {
         avahi_time_event_free(r->time_event);
         r->time_event = NULL;
     }
 
+    r->n_retries = 0;
+
     flags =
         r->txt_flags |
         r->srv_flags |
         r->address_flags;
 
+    if (event == AVAHI_RESOLVER_FOUND && waiting)
+        update_latency(r, flags);
+
     switch (event) {
         case AVAHI_RESOLVER_FAILURE:
 
@@ -141,12 +192,76 @@ static void finish(AvahiSServiceResolver *r, AvahiResolverEvent event) {
     }
 }
 
+static unsigned initial_timeout(AvahiSServiceResolver *r) {
+    AvahiInterface *i;
+    AvahiUsec t = 0;
+
+    assert(r);
+
+    if (r->timing.timeout_msec > 0)
+        return r->timing.timeout_msec;
+
+    /* Allow for the slowest of the interfaces an answer may come in
+     * on, with the same margin TCP adds to its round trip time */
+    for (i = r->server->monitor->interfaces; i; i = i->interface_next)
+        if (i->resolve_latency > 0 && avahi_interface_match(i, r->interface, r->protocol)) {
+            AvahiUsec u = i->resolve_latency + 4*i->resolve_latency_var;
+
+            if (u > t)
+                t = u;
+        }
+
+    if (t <= 0) {
+        AvahiUsec attempts = 0, f = 1;
+        unsigned n;
+
+        /* Without a sample, spread the time we always used to wait
+         * over all attempts, weighted by their back-off */
+        for (n = 0; n <= r->timing.max_retries && attempts < TIMEOUT_MSEC / ADAPTIVE_TIMEOUT_MIN_MSEC; n++) {
+            attempts += f;
+            f *= r->timing.backoff_factor;
+        }
+
+        t = TIMEOUT_MSEC / attempts;
+    } else
+        t /= 1000;
+
+    if (t < ADAPTIVE_TIMEOUT_MIN_MSEC)
+        return ADAPTIVE_TIMEOUT_MIN_MSEC;
+
+    return t > TIMEOUT_MSEC ? TIMEOUT_MSEC : (unsigned) t;
+}
+
+static void start_timeout(AvahiSServiceResolver *r);
+
 static void time_event_callback(AvahiTimeEvent *e, void *userdata) {
     AvahiSServiceResolver *r = userdata;
 
     assert(e);
     assert(r);
 
+    if (r->n_retries < r->timing.max_retries) {
+        avahi_time_event_free(r->time_event);
+        r->time_event = NULL;
+
+        r->n_retries++;
+
+        /* Ask again for whatever is still missing */
+        if (!r->srv_record && r->record_browser_srv)
+            avahi_s_record_browser_restart(r->record_browser_srv);
+        if (!r->txt_record && r->record_browser_txt)
+            avahi_s_record_browser_restart(r->record_browser_txt);
+        if (!r->address_record) {
+            if (r->record_browser_aaaa)
+                avahi_s_record_browser_restart(r->record_browser_aaaa);
+            if (r->record_browser_a)
+                avahi_s_record_browser_restart(r->record_browser_a);
+        }
+
+        start_timeout(r);
+        return;
+    }
+
     avahi_server_set_errno(r->server, AVAHI_ERR_TIMEOUT);
     finish(r, AVAHI_RESOLVER_FAILURE);
 }
@@ -158,7 +273,16 @@ static void start_timeout(AvahiSServiceResolver *r) {
     if (r->time_event)
         return;
 
-    avahi_elapse_time(&tv, TIMEOUT_MSEC, 0);
+    if (r->n_retries == 0) {
+        gettimeofday(&r->started, NULL);
+        r->timeout_msec = initial_timeout(r);
+    } else if (r->timing.backoff_factor > 1)
+        r->timeout_msec = r->timeout_msec > UINT_MAX / r->timing.backoff_factor ? UINT_MAX : r->timeout_msec * r->timing.backoff_factor;
+
+    if (r->timing.timeout_max_msec > 0 && r->timeout_msec > r->timing.timeout_max_msec)
+        r->timeout_msec = r->timing.timeout_max_msec;
+
+    avahi_elapse_time(&tv, r->timeout_msec, 0);
 
     r->time_event = avahi_time_event_new(r->server->time_event_queue, &tv, time_event_callback, r);
 }
@@ -431,6 +555,12 @@ AvahiSServiceResolver *avahi_s_service_resolver_new(
     r->user_flags = flags;
     r->record_browser_a = r->record_browser_aaaa = r->record_browser_srv = r->record_browser_txt = NULL;
     r->time_event = NULL;
+    r->timing.timeout_msec = TIMEOUT_MSEC;
+    r->timing.backoff_factor = 1;
+    r->timing.max_retries = 0;
+    r->timing.timeout_max_msec = 0;
+    r->n_retries = 0;
+    r->timeout_msec = 0;
     AVAHI_LLIST_PREPEND(AvahiSServiceResolver, resolver, server->service_resolvers, r);
 
     k = avahi_key_new(n, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_SRV);
@@ -487,3 +617,25 @@ void avahi_s_service_resolver_free(AvahiSServiceResolver *r) {
     avahi_free(r->domain_name);
     avahi_free(r);
 }
+
+int avahi_s_service_resolver_set_timing(AvahiSServiceResolver *r, const AvahiSServiceResolverTiming *timing) {
+    assert(r);
+    assert(timing);
+
+    AVAHI_CHECK_VALIDITY(r->server, !timing->timeout_max_msec || timing->timeout_max_msec >= timing->timeout_msec, AVAHI_ERR_INVALID_ARGUMENT);
+
+    r->timing = *timing;
+
+    if (r->timing.backoff_factor < 1)
+        r->timing.backoff_factor = 1;
+
+    /* Restart the running attempt under the new policy */
+    if (r->time_event) {
+        avahi_time_event_free(r->time_event);
+        r->time_event = NULL;
+        r->n_retries = 0;
+        start_timeout(r);
+    }
+
+    return AVAHI_OK;
+}
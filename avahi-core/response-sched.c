@@ -29,6 +29,8 @@
 #include "response-sched.h"
 #include "log.h"
 #include "rr-util.h"
+#include "hashmap.h"
+#include "internal.h"
 
 /* Local packets are supressed this long after sending them */
 #define AVAHI_RESPONSE_HISTORY_MSEC 500
@@ -63,6 +65,10 @@ struct AvahiResponseJob {
     int querier_valid;
 
     AVAHI_LLIST_FIELDS(AvahiResponseJob, jobs);
+
+    /* All jobs of the same state with the same key, indexed by the
+     * hash table of that state */
+    AVAHI_LLIST_FIELDS(AvahiResponseJob, by_key);
 };
 
 struct AvahiResponseScheduler {
@@ -72,8 +78,70 @@ struct AvahiResponseScheduler {
     AVAHI_LLIST_HEAD(AvahiResponseJob, jobs);
     AVAHI_LLIST_HEAD(AvahiResponseJob, history);
     AVAHI_LLIST_HEAD(AvahiResponseJob, suppressed);
+
+    AvahiHashmap *jobs_by_key;
+    AvahiHashmap *history_by_key;
+    AvahiHashmap *suppressed_by_key;
 };
 
+static AvahiHashmap* job_index(AvahiResponseScheduler *s, AvahiResponseJobState state) {
+    assert(s);
+
+    if (state == AVAHI_SCHEDULED)
+        return s->jobs_by_key;
+    else if (state == AVAHI_DONE)
+        return s->history_by_key;
+    else /* state == AVAHI_SUPPRESSED */
+        return s->suppressed_by_key;
+}
+
+static void job_index_add(AvahiResponseScheduler *s, AvahiResponseJob *rj) {
+    AvahiHashmap *m;
+    AvahiResponseJob *first;
+
+    assert(s);
+    assert(rj);
+
+    m = job_index(s, rj->state);
+
+    first = avahi_hashmap_lookup(m, rj->record->key);
+    AVAHI_LLIST_PREPEND(AvahiResponseJob, by_key, first, rj);
+    avahi_hashmap_replace(m, first->record->key, first);
+}
+
+static void job_index_remove(AvahiResponseScheduler *s, AvahiResponseJob *rj) {
+    AvahiHashmap *m;
+    AvahiResponseJob *first;
+
+    assert(s);
+    assert(rj);
+
+    m = job_index(s, rj->state);
+
+    first = avahi_hashmap_lookup(m, rj->record->key);
+    AVAHI_LLIST_REMOVE(AvahiResponseJob, by_key, first, rj);
+
+    if (first)
+        avahi_hashmap_replace(m, first->record->key, first);
+    else
+        avahi_hashmap_remove(m, rj->record->key);
+}
+
+static void job_set_record(AvahiResponseScheduler *s, AvahiResponseJob *rj, AvahiRecord *record) {
+    assert(s);
+    assert(rj);
+    assert(record);
+    assert(avahi_key_equal(rj->record->key, record->key));
+
+    /* The hash table references the key of the first job of each
+     * chain, hence update it if we replace that key */
+    if (!rj->by_key_prev)
+        avahi_hashmap_replace(job_index(s, rj->state), record->key, rj);
+
+    avahi_record_unref(rj->record);
+    rj->record = avahi_record_ref(record);
+}
+
 static AvahiResponseJob* job_new(AvahiResponseScheduler *s, AvahiRecord *record, AvahiResponseJobState state) {
     AvahiResponseJob *rj;
 
@@ -98,6 +166,8 @@ static AvahiResponseJob* job_new(AvahiResponseScheduler *s, AvahiRecord *record,
     else  /* rj->state == AVAHI_SUPPRESSED */
         AVAHI_LLIST_PREPEND(AvahiResponseJob, jobs, s->suppressed, rj);
 
+    job_index_add(s, rj);
+
     return rj;
 }
 
@@ -108,6 +178,8 @@ static void job_free(AvahiResponseScheduler *s, AvahiResponseJob *rj) {
     if (rj->time_event)
         avahi_time_event_free(rj->time_event);
 
+    job_index_remove(s, rj);
+
     if (rj->state == AVAHI_SCHEDULED)
         AVAHI_LLIST_REMOVE(AvahiResponseJob, jobs, s->jobs, rj);
     else if (rj->state == AVAHI_DONE)
@@ -141,10 +213,12 @@ static void job_mark_done(AvahiResponseScheduler *s, AvahiResponseJob *rj) {
 
     assert(rj->state == AVAHI_SCHEDULED);
 
+    job_index_remove(s, rj);
     AVAHI_LLIST_REMOVE(AvahiResponseJob, jobs, s->jobs, rj);
     AVAHI_LLIST_PREPEND(AvahiResponseJob, jobs, s->history, rj);
 
     rj->state = AVAHI_DONE;
+    job_index_add(s, rj);
 
     job_set_elapse_time(s, rj, AVAHI_RESPONSE_HISTORY_MSEC, 0);
 
@@ -163,6 +237,24 @@ AvahiResponseScheduler *avahi_response_scheduler_new(AvahiInterface *i) {
     s->interface = i;
     s->time_event_queue = i->monitor->server->time_event_queue;
 
+    s->jobs_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, NULL, NULL);
+    s->history_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, NULL, NULL);
+    s->suppressed_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, NULL, NULL);
+
+    if (!s->jobs_by_key || !s->history_by_key || !s->suppressed_by_key) {
+        avahi_log_error(__FILE__": Out of memory");
+
+        if (s->jobs_by_key)
+            avahi_hashmap_free(s->jobs_by_key);
+        if (s->history_by_key)
+            avahi_hashmap_free(s->history_by_key);
+        if (s->suppressed_by_key)
+            avahi_hashmap_free(s->suppressed_by_key);
+
+        avahi_free(s);
+        return NULL;
+    }
+
     AVAHI_LLIST_HEAD_INIT(AvahiResponseJob, s->jobs);
     AVAHI_LLIST_HEAD_INIT(AvahiResponseJob, s->history);
     AVAHI_LLIST_HEAD_INIT(AvahiResponseJob, s->suppressed);
@@ -174,6 +266,11 @@ void avahi_response_scheduler_free(AvahiResponseScheduler *s) {
     assert(s);
 
     avahi_response_scheduler_clear(s);
+
+    avahi_hashmap_free(s->jobs_by_key);
+    avahi_hashmap_free(s->history_by_key);
+    avahi_hashmap_free(s->suppressed_by_key);
+
     avahi_free(s);
 }
 
@@ -203,7 +300,7 @@ static int packet_add_response_job(AvahiResponseScheduler *s, AvahiDnsPacket *p,
     assert(rj);
 
     /* Try to add this record to the packet */
-    if (!avahi_dns_packet_append_record(p, rj->record, rj->flush_cache, 0))
+    if (!avahi_server_append_record(s->interface->monitor->server, p, rj->record, rj->flush_cache, 0))
         return 0;
 
     /* Ok, this record will definitely be sent, so schedule the
@@ -221,7 +318,7 @@ static void send_response_packet(AvahiResponseScheduler *s, AvahiResponseJob *rj
     assert(s);
     assert(rj);
 
-    if (!(p = avahi_dns_packet_new_response(s->interface->hardware->mtu, 1)))
+    if (!(p = avahi_dns_packet_new_response_pooled(s->interface->monitor->server->packet_pool, s->interface->hardware->mtu, 1)))
         return; /* OOM */
     n = 1;
 
@@ -245,7 +342,7 @@ static void send_response_packet(AvahiResponseScheduler *s, AvahiResponseJob *rj
         /* OK, the packet was too small, so create one that fits */
         size = avahi_record_get_estimate_size(rj->record) + AVAHI_DNS_PACKET_HEADER_SIZE;
 
-        if (!(p = avahi_dns_packet_new_response(size + AVAHI_DNS_PACKET_EXTRA_SIZE, 1)))
+        if (!(p = avahi_dns_packet_new_response_pooled(s->interface->monitor->server->packet_pool, size + AVAHI_DNS_PACKET_EXTRA_SIZE, 1)))
             return; /* OOM */
 
         if (!packet_add_response_job(s, p, rj)) {
@@ -279,7 +376,7 @@ static AvahiResponseJob* find_scheduled_job(AvahiResponseScheduler *s, AvahiReco
     assert(s);
     assert(record);
 
-    for (rj = s->jobs; rj; rj = rj->jobs_next) {
+    for (rj = avahi_hashmap_lookup(s->jobs_by_key, record->key); rj; rj = rj->by_key_next) {
         assert(rj->state == AVAHI_SCHEDULED);
 
         if (avahi_record_equal_no_ttl(rj->record, record))
@@ -295,7 +392,7 @@ static AvahiResponseJob* find_history_job(AvahiResponseScheduler *s, AvahiRecord
     assert(s);
     assert(record);
 
-    for (rj = s->history; rj; rj = rj->jobs_next) {
+    for (rj = avahi_hashmap_lookup(s->history_by_key, record->key); rj; rj = rj->by_key_next) {
         assert(rj->state == AVAHI_DONE);
 
         if (avahi_record_equal_no_ttl(rj->record, record)) {
@@ -323,7 +420,7 @@ static AvahiResponseJob* find_suppressed_job(AvahiResponseScheduler *s, AvahiRec
     assert(record);
     assert(querier);
 
-    for (rj = s->suppressed; rj; rj = rj->jobs_next) {
+    for (rj = avahi_hashmap_lookup(s->suppressed_by_key, record->key); rj; rj = rj->by_key_next) {
         assert(rj->state == AVAHI_SUPPRESSED);
         assert(rj->querier_valid);
 
@@ -404,8 +501,7 @@ int avahi_response_scheduler_post(AvahiResponseScheduler *s, AvahiRecord *record
             rj->querier_valid = 0;
 
         /* Update record data (just for the TTL) */
-        avahi_record_unref(rj->record);
-        rj->record = avahi_record_ref(record);
+        job_set_record(s, rj, record);
 
         return 1;
     } else {
@@ -450,8 +546,7 @@ void avahi_response_scheduler_incoming(AvahiResponseScheduler *s, AvahiRecord *r
 
     if ((rj = find_history_job(s, record))) {
         /* Found a history job, let's update it */
-        avahi_record_unref(rj->record);
-        rj->record = avahi_record_ref(record);
+        job_set_record(s, rj, record);
     } else
         /* Found no existing history job, so let's create a new one */
         if (!(rj = job_new(s, record, AVAHI_DONE)))
@@ -486,8 +581,7 @@ void avahi_response_scheduler_suppress(AvahiResponseScheduler *s, AvahiRecord *r
     if ((rj = find_suppressed_job(s, record, querier))) {
 
         /* Let's update the old entry */
-        avahi_record_unref(rj->record);
-        rj->record = avahi_record_ref(record);
+        job_set_record(s, rj, record);
 
     } else {
 
@@ -414,6 +414,55 @@ int avahi_record_equal_no_ttl(const AvahiRecord *a, const AvahiRecord *b) {
         rdata_equal(a, b);
 }
 
+static unsigned data_hash(unsigned hash, const void *data, size_t size) {
+    const uint8_t *p;
+
+    for (p = data; size > 0; p++, size--)
+        hash = 31 * hash + *p;
+
+    return hash;
+}
+
+unsigned avahi_record_hash_no_ttl(const AvahiRecord *r) {
+    unsigned hash;
+    AvahiStringList *l;
+
+    assert(r);
+
+    hash = avahi_key_hash(r->key);
+
+    switch (r->key->type) {
+        case AVAHI_DNS_TYPE_SRV:
+            return hash +
+                r->data.srv.priority +
+                r->data.srv.weight +
+                r->data.srv.port +
+                avahi_domain_hash(r->data.srv.name);
+
+        case AVAHI_DNS_TYPE_PTR:
+        case AVAHI_DNS_TYPE_CNAME:
+        case AVAHI_DNS_TYPE_NS:
+            return hash + avahi_domain_hash(r->data.ptr.name);
+
+        case AVAHI_DNS_TYPE_HINFO:
+            hash = data_hash(hash, r->data.hinfo.cpu, strlen(r->data.hinfo.cpu));
+            return data_hash(hash, r->data.hinfo.os, strlen(r->data.hinfo.os));
+
+        case AVAHI_DNS_TYPE_TXT:
+            for (l = r->data.txt.string_list; l; l = l->next)
+                hash = data_hash(hash, l->text, l->size);
+            return hash;
+
+        case AVAHI_DNS_TYPE_A:
+            return data_hash(hash, &r->data.a.address, sizeof(AvahiIPv4Address));
+
+        case AVAHI_DNS_TYPE_AAAA:
+            return data_hash(hash, &r->data.aaaa.address, sizeof(AvahiIPv6Address));
+
+        default:
+            return data_hash(hash, r->data.generic.data, r->data.generic.size);
+    }
+}
 
 AvahiRecord *avahi_record_copy(AvahiRecord *r) {
     AvahiRecord *copy;
@@ -155,6 +155,10 @@ char *avahi_record_to_string(const AvahiRecord *r);
 /** Check whether two records are equal (regardless of the TTL */
 int avahi_record_equal_no_ttl(const AvahiRecord *a, const AvahiRecord *b);
 
+/** Return a numeric hash value for a record, ignoring the TTL, for
+ * usage in hash tables together with avahi_record_equal_no_ttl() */
+unsigned avahi_record_hash_no_ttl(const AvahiRecord *r);
+
 /** Check whether the specified key is valid */
 int avahi_key_is_valid(AvahiKey *k);
 
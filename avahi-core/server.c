@@ -50,6 +50,16 @@
 #include "rr-util.h"
 
 #define AVAHI_DEFAULT_CACHE_ENTRIES_MAX 4096
+#define AVAHI_DEFAULT_WIDE_AREA_CACHE_ENTRIES_MAX 500
+
+/* Well above what a single host or a busy key needs: hosts space out
+ * their queries, and responses to the same key are aggregated anyway.
+ * The key limit is shared by all hosts on a link, so it is kept above
+ * the source limit: a single host can't starve a key for everybody. */
+#define AVAHI_DEFAULT_QUERY_RATELIMIT_SOURCE 100
+#define AVAHI_DEFAULT_QUERY_RATELIMIT_SOURCE_BURST 200
+#define AVAHI_DEFAULT_QUERY_RATELIMIT_KEY 200
+#define AVAHI_DEFAULT_QUERY_RATELIMIT_KEY_BURST 400
 
 static void enum_aux_records(AvahiServer *s, AvahiInterface *i, const char *name, uint16_t type, void (*callback)(AvahiServer *s, AvahiRecord *r, int flush_cache, void* userdata), void* userdata) {
     assert(s);
@@ -60,25 +70,25 @@ static void enum_aux_records(AvahiServer *s, AvahiInterface *i, const char *name
     if (type == AVAHI_DNS_TYPE_ANY) {
         AvahiEntry *e;
 
-        for (e = s->entries; e; e = e->entries_next)
+        for (e = avahi_hashmap_lookup(s->entries_by_name, name); e; e = e->by_name_next)
             if (!e->dead &&
                 avahi_entry_is_registered(s, e, i) &&
-                e->record->key->clazz == AVAHI_DNS_CLASS_IN &&
-                avahi_domain_equal(name, e->record->key->name))
+                e->record->key->clazz == AVAHI_DNS_CLASS_IN)
                 callback(s, e->record, e->flags & AVAHI_PUBLISH_UNIQUE, userdata);
 
     } else {
         AvahiEntry *e;
-        AvahiKey *k;
+        AvahiKey k;
 
-        if (!(k = avahi_key_new(name, AVAHI_DNS_CLASS_IN, type)))
-            return; /** OOM */
+        /* The key is only used for the lookup, so avoid allocating it */
+        k.ref = 1;
+        k.name = (char*) name;
+        k.clazz = AVAHI_DNS_CLASS_IN;
+        k.type = type;
 
-        for (e = avahi_hashmap_lookup(s->entries_by_key, k); e; e = e->by_key_next)
+        for (e = avahi_hashmap_lookup(s->entries_by_key, &k); e; e = e->by_key_next)
             if (!e->dead && avahi_entry_is_registered(s, e, i))
                 callback(s, e->record, e->flags & AVAHI_PUBLISH_UNIQUE, userdata);
-
-        avahi_key_unref(k);
     }
 }
 
@@ -122,7 +132,7 @@ void avahi_server_prepare_matching_responses(AvahiServer *s, AvahiInterface *i,
 
         /* Handle ANY query */
 
-        for (e = s->entries; e; e = e->entries_next)
+        for (e = avahi_hashmap_lookup(s->entries_by_name, k->name); e; e = e->by_name_next)
             if (!e->dead && avahi_key_pattern_match(k, e->record->key) && avahi_entry_is_registered(s, e, i))
                 avahi_server_prepare_response(s, i, e, unicast_response, 0);
 
@@ -141,13 +151,15 @@ void avahi_server_prepare_matching_responses(AvahiServer *s, AvahiInterface *i,
     if ((k->clazz == AVAHI_DNS_CLASS_IN || k->clazz == AVAHI_DNS_CLASS_ANY)
         && k->type != AVAHI_DNS_TYPE_CNAME && k->type != AVAHI_DNS_TYPE_ANY) {
 
-        AvahiKey *cname_key;
+        AvahiKey cname_key;
 
-        if (!(cname_key = avahi_key_new(k->name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_CNAME)))
-            return;
+        /* The key is only used for the lookup, so avoid allocating it */
+        cname_key.ref = 1;
+        cname_key.name = k->name;
+        cname_key.clazz = AVAHI_DNS_CLASS_IN;
+        cname_key.type = AVAHI_DNS_TYPE_CNAME;
 
-        avahi_server_prepare_matching_responses(s, i, cname_key, unicast_response);
-        avahi_key_unref(cname_key);
+        avahi_server_prepare_matching_responses(s, i, &cname_key, unicast_response);
     }
 }
 
@@ -370,14 +382,14 @@ void avahi_server_generate_response(AvahiServer *s, AvahiInterface *i, AvahiDnsP
         AvahiDnsPacket *reply;
         AvahiRecord *r;
 
-        if (!(reply = avahi_dns_packet_new_reply(p, 512 + AVAHI_DNS_PACKET_EXTRA_SIZE /* unicast DNS maximum packet size is 512 */ , 1, 1)))
+        if (!(reply = avahi_dns_packet_new_reply_pooled(s->packet_pool, p, 512 + AVAHI_DNS_PACKET_EXTRA_SIZE /* unicast DNS maximum packet size is 512 */ , 1, 1)))
             return; /* OOM */
 
         while ((r = avahi_record_list_next(s->record_list, NULL, NULL, NULL))) {
 
             append_aux_records_to_list(s, i, r, 0);
 
-            if (avahi_dns_packet_append_record(reply, r, 0, 10))
+            if (avahi_server_append_record(s, reply, r, 0, 10))
                 avahi_dns_packet_inc_field(reply, AVAHI_DNS_FIELD_ANCOUNT);
             else {
                 char *t = avahi_record_to_string(r);
@@ -428,11 +440,11 @@ void avahi_server_generate_response(AvahiServer *s, AvahiInterface *i, AvahiDnsP
                     if (!reply) {
                         assert(p);
 
-                        if (!(reply = avahi_dns_packet_new_reply(p, i->hardware->mtu, 0, 0)))
+                        if (!(reply = avahi_dns_packet_new_reply_pooled(s->packet_pool, p, i->hardware->mtu, 0, 0)))
                             break; /* OOM */
                     }
 
-                    if (avahi_dns_packet_append_record(reply, r, flush_cache, 0)) {
+                    if (avahi_server_append_record(s, reply, r, flush_cache, 0)) {
 
                         /* Appending this record succeeded, so incremeant
                          * the specific header field, and return to the caller */
@@ -449,10 +461,10 @@ void avahi_server_generate_response(AvahiServer *s, AvahiInterface *i, AvahiDnsP
                         avahi_dns_packet_free(reply);
                         size = avahi_record_get_estimate_size(r) + AVAHI_DNS_PACKET_HEADER_SIZE;
 
-                        if (!(reply = avahi_dns_packet_new_reply(p, size + AVAHI_DNS_PACKET_EXTRA_SIZE, 0, 1)))
+                        if (!(reply = avahi_dns_packet_new_reply_pooled(s->packet_pool, p, size + AVAHI_DNS_PACKET_EXTRA_SIZE, 0, 1)))
                             break; /* OOM */
 
-                        if (avahi_dns_packet_append_record(reply, r, flush_cache, 0)) {
+                        if (avahi_server_append_record(s, reply, r, flush_cache, 0)) {
 
                             /* Appending this record succeeded, so incremeant
                              * the specific header field, and return to the caller */
@@ -496,79 +508,7 @@ void avahi_server_generate_response(AvahiServer *s, AvahiInterface *i, AvahiDnsP
     avahi_record_list_flush(s->record_list);
 }
 
-static void reflect_response(AvahiServer *s, AvahiInterface *i, AvahiRecord *r, int flush_cache) {
-    AvahiInterface *j;
-
-    assert(s);
-    assert(i);
-    assert(r);
-
-    if (!s->config.enable_reflector)
-        return;
-
-    for (j = s->monitor->interfaces; j; j = j->interface_next)
-        if (j != i && (s->config.reflect_ipv || j->protocol == i->protocol))
-            avahi_interface_post_response(j, r, flush_cache, NULL, 1);
-}
-
-static void* reflect_cache_walk_callback(AvahiCache *c, AvahiKey *pattern, AvahiCacheEntry *e, void* userdata) {
-    AvahiServer *s = userdata;
-    AvahiRecord* r;
-
-    assert(c);
-    assert(pattern);
-    assert(e);
-    assert(s);
-
-    /* Don't reflect cache entry with ipv6 link-local addresses. */
-    r = e->record;
-    if ((r->key->type == AVAHI_DNS_TYPE_AAAA) &&
-            (r->data.aaaa.address.address[0] == 0xFE) &&
-            (r->data.aaaa.address.address[1] == 0x80))
-      return NULL;
-
-    avahi_record_list_push(s->record_list, e->record, e->cache_flush, 0, 0);
-    return NULL;
-}
-
-static void reflect_query(AvahiServer *s, AvahiInterface *i, AvahiKey *k) {
-    AvahiInterface *j;
-
-    assert(s);
-    assert(i);
-    assert(k);
-
-    if (!s->config.enable_reflector)
-        return;
-
-    for (j = s->monitor->interfaces; j; j = j->interface_next)
-        if (j != i && (s->config.reflect_ipv || j->protocol == i->protocol)) {
-            /* Post the query to other networks */
-            avahi_interface_post_query(j, k, 1, NULL);
-
-            /* Reply from caches of other network. This is needed to
-             * "work around" known answer suppression. */
-
-            avahi_cache_walk(j->cache, k, reflect_cache_walk_callback, s);
-        }
-}
-
-static void reflect_probe(AvahiServer *s, AvahiInterface *i, AvahiRecord *r) {
-    AvahiInterface *j;
-
-    assert(s);
-    assert(i);
-    assert(r);
-
-    if (!s->config.enable_reflector)
-        return;
-
-    for (j = s->monitor->interfaces; j; j = j->interface_next)
-        if (j != i && (s->config.reflect_ipv || j->protocol == i->protocol))
-            avahi_interface_post_probe(j, r, 1);
-}
-
-static void handle_query_packet(AvahiServer *s, AvahiDnsPacket *p, AvahiInterface *i, const AvahiAddress *a, uint16_t port, int legacy_unicast, int from_local_iface) {
+static void handle_query_packet(AvahiServer *s, AvahiDnsPacket *p, AvahiInterface *i, const AvahiAddress *a, uint16_t port, int legacy_unicast, int from_local_iface, int rate_limited) {
     size_t n;
     int is_probe;
 
@@ -592,7 +532,8 @@ static void handle_query_packet(AvahiServer *s, AvahiDnsPacket *p, AvahiInterfac
         }
 
         if (!legacy_unicast && !from_local_iface) {
-            reflect_query(s, i, key);
+            if (s->reflector)
+                avahi_reflector_query(s->reflector, i, key);
             if (!unicast_response)
               avahi_cache_start_poof(i->cache, key, a);
         }
@@ -603,6 +544,14 @@ static void handle_query_packet(AvahiServer *s, AvahiDnsPacket *p, AvahiInterfac
              * queries only when they do not include known answers */
             avahi_query_scheduler_incoming(i->query_scheduler, key);
 
+        /* Don't let a single question that is asked over and over
+         * again keep us busy assembling responses. Probes are never
+         * limited, we have to defend our names against them. */
+        if (rate_limited && !is_probe && s->key_rate_limiter && !avahi_rate_limiter_check_key(s->key_rate_limiter, i, key)) {
+            avahi_key_unref(key);
+            continue;
+        }
+
         avahi_server_prepare_matching_responses(s, i, key, unicast_response);
         avahi_key_unref(key);
     }
@@ -637,8 +586,8 @@ static void handle_query_packet(AvahiServer *s, AvahiDnsPacket *p, AvahiInterfac
             }
 
             if (!avahi_key_is_pattern(record->key)) {
-                if (!from_local_iface)
-                    reflect_probe(s, i, record);
+                if (!from_local_iface && s->reflector)
+                    avahi_reflector_probe(s->reflector, i, record);
                 incoming_probe(s, record, i);
             }
 
@@ -666,9 +615,20 @@ static void handle_response_packet(AvahiServer *s, AvahiDnsPacket *p, AvahiInter
     for (n = avahi_dns_packet_get_field(p, AVAHI_DNS_FIELD_ANCOUNT) +
              avahi_dns_packet_get_field(p, AVAHI_DNS_FIELD_ARCOUNT); n > 0; n--) {
         AvahiRecord *record;
-        int cache_flush = 0;
+        AvahiDnsRecordView view;
+        int cache_flush;
+
+        if (avahi_dns_packet_consume_record_view(p, &view) < 0) {
+            avahi_log_debug(__FILE__": Packet too short or invalid while reading response record. (Maybe a UTF-8 problem?)");
+            break;
+        }
+
+        cache_flush = view.cache_flush;
 
-        if (!(record = avahi_dns_packet_consume_record(p, &cache_flush))) {
+        /* Most responses just refresh records we already have cached,
+         * hence reuse the cached copy instead of parsing a new one */
+        if (!(record = avahi_cache_lookup_view(i->cache, p, &view)) &&
+            !(record = avahi_dns_record_view_materialize(p, &view))) {
             avahi_log_debug(__FILE__": Packet too short or invalid while reading response record. (Maybe a UTF-8 problem?)");
             break;
         }
@@ -676,8 +636,8 @@ static void handle_response_packet(AvahiServer *s, AvahiDnsPacket *p, AvahiInter
         if (!avahi_key_is_pattern(record->key)) {
 
             if (handle_conflict(s, i, record, cache_flush)) {
-                if (!from_local_iface && !avahi_record_is_link_local_address(record))
-                    reflect_response(s, i, record, cache_flush);
+                if (!from_local_iface && s->reflector && !avahi_record_is_link_local_address(record))
+                    avahi_reflector_response(s->reflector, i, record, cache_flush);
                 avahi_cache_update(i->cache, record, cache_flush, a);
                 avahi_response_scheduler_incoming(i->response_scheduler, record, cache_flush);
             }
@@ -693,90 +653,151 @@ static void handle_response_packet(AvahiServer *s, AvahiDnsPacket *p, AvahiInter
         avahi_server_generate_response(s, i, NULL, NULL, 0, 0, 1);
 }
 
-static AvahiLegacyUnicastReflectSlot* allocate_slot(AvahiServer *s) {
-    unsigned n, idx = (unsigned) -1;
-    AvahiLegacyUnicastReflectSlot *slot;
+static void deallocate_slot(AvahiServer *s, AvahiLegacyUnicastReflectSlot *slot) {
+    unsigned idx;
 
     assert(s);
+    assert(slot);
 
-    if (!s->legacy_unicast_reflect_slots)
-        s->legacy_unicast_reflect_slots = avahi_new0(AvahiLegacyUnicastReflectSlot*, AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX);
+    idx = slot->id & (s->legacy_unicast_reflect_slots_size - 1);
+
+    assert(s->legacy_unicast_reflect_slots[idx] == slot);
+    s->legacy_unicast_reflect_slots[idx] = NULL;
 
-    for (n = 0; n < AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX; n++, s->legacy_unicast_reflect_id++) {
-        idx = s->legacy_unicast_reflect_id % AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX;
+    AVAHI_LLIST_REMOVE(AvahiLegacyUnicastReflectSlot, slots, s->legacy_unicast_reflect_wheel[slot->bucket], slot);
 
-        if (!s->legacy_unicast_reflect_slots[idx])
-            break;
+    assert(s->n_legacy_unicast_reflect_slots > 0);
+    s->n_legacy_unicast_reflect_slots--;
+
+    avahi_free(slot);
+}
+
+static void legacy_unicast_reflect_tick(AvahiTimeEvent *e, void *userdata) {
+    AvahiServer *s = userdata;
+    unsigned tick;
+
+    assert(e);
+    assert(s);
+    assert(s->legacy_unicast_reflect_time_event == e);
+
+    tick = s->legacy_unicast_reflect_tick = (s->legacy_unicast_reflect_tick + 1) % AVAHI_LEGACY_UNICAST_REFLECT_WHEEL_SIZE;
+
+    while (s->legacy_unicast_reflect_wheel[tick])
+        deallocate_slot(s, s->legacy_unicast_reflect_wheel[tick]);
+
+    if (s->n_legacy_unicast_reflect_slots > 0) {
+        avahi_timeval_add(&s->legacy_unicast_reflect_next_tick, AVAHI_LEGACY_UNICAST_REFLECT_TICK_MSEC*1000);
+        avahi_time_event_update(e, &s->legacy_unicast_reflect_next_tick);
+    } else {
+        /* Nothing left to expire, stay quiet until the next slot */
+        avahi_time_event_free(e);
+        s->legacy_unicast_reflect_time_event = NULL;
     }
+}
 
-    if (idx == (unsigned) -1 || s->legacy_unicast_reflect_slots[idx])
-        return NULL;
+static int grow_slots(AvahiServer *s) {
+    AvahiLegacyUnicastReflectSlot **slots;
+    unsigned size, idx;
 
-    if (!(slot = avahi_new(AvahiLegacyUnicastReflectSlot, 1)))
-        return NULL; /* OOM */
+    assert(s);
 
-    s->legacy_unicast_reflect_slots[idx] = slot;
-    slot->id = s->legacy_unicast_reflect_id++;
-    slot->server = s;
+    size = s->legacy_unicast_reflect_slots_size ? s->legacy_unicast_reflect_slots_size * 2 : AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MIN;
 
-    return slot;
+    if (size > AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX)
+        return -1;
+
+    if (!(slots = avahi_new0(AvahiLegacyUnicastReflectSlot*, size)))
+        return -1; /* OOM */
+
+    /* IDs with distinct low bits still differ when we look at one
+     * bit more, so this can't collide */
+    for (idx = 0; idx < s->legacy_unicast_reflect_slots_size; idx++)
+        if (s->legacy_unicast_reflect_slots[idx])
+            slots[s->legacy_unicast_reflect_slots[idx]->id & (size - 1)] = s->legacy_unicast_reflect_slots[idx];
+
+    avahi_free(s->legacy_unicast_reflect_slots);
+    s->legacy_unicast_reflect_slots = slots;
+    s->legacy_unicast_reflect_slots_size = size;
+
+    return 0;
 }
 
-static void deallocate_slot(AvahiServer *s, AvahiLegacyUnicastReflectSlot *slot) {
-    unsigned idx;
+static AvahiLegacyUnicastReflectSlot* allocate_slot(AvahiServer *s) {
+    unsigned mask, idx;
+    uint16_t id;
+    AvahiLegacyUnicastReflectSlot *slot;
 
     assert(s);
-    assert(slot);
 
-    idx = slot->id % AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX;
+    /* Keep the table at most half full, so that a free index is found
+     * right away. Once it can't grow any more we fill it up. */
+    if (s->n_legacy_unicast_reflect_slots * 2 >= s->legacy_unicast_reflect_slots_size)
+        grow_slots(s);
 
-    assert(s->legacy_unicast_reflect_slots[idx] == slot);
+    if (s->n_legacy_unicast_reflect_slots >= s->legacy_unicast_reflect_slots_size) {
+        s->n_legacy_unicast_reflect_exhausted++;
+        return NULL;
+    }
 
-    avahi_time_event_free(slot->time_event);
+    /* Pick a random ID to make responses harder to spoof, and move on
+     * to the next free index if its index is taken */
+    mask = s->legacy_unicast_reflect_slots_size - 1;
+    id = (uint16_t) rand();
 
-    avahi_free(slot);
-    s->legacy_unicast_reflect_slots[idx] = NULL;
+    for (idx = id & mask; s->legacy_unicast_reflect_slots[idx]; idx = (idx + 1) & mask)
+        ;
+
+    if (!(slot = avahi_new(AvahiLegacyUnicastReflectSlot, 1)))
+        return NULL; /* OOM */
+
+    slot->id = (uint16_t) ((id & ~mask) | idx);
+    slot->server = s;
+
+    s->legacy_unicast_reflect_slots[idx] = slot;
+    s->n_legacy_unicast_reflect_slots++;
+
+    /* Expire after at least AVAHI_LEGACY_UNICAST_REFLECT_TIMEOUT_MSEC */
+    slot->bucket = (s->legacy_unicast_reflect_tick + AVAHI_LEGACY_UNICAST_REFLECT_TIMEOUT_MSEC/AVAHI_LEGACY_UNICAST_REFLECT_TICK_MSEC + 1) % AVAHI_LEGACY_UNICAST_REFLECT_WHEEL_SIZE;
+    AVAHI_LLIST_PREPEND(AvahiLegacyUnicastReflectSlot, slots, s->legacy_unicast_reflect_wheel[slot->bucket], slot);
+
+    if (!s->legacy_unicast_reflect_time_event) {
+        avahi_elapse_time(&s->legacy_unicast_reflect_next_tick, AVAHI_LEGACY_UNICAST_REFLECT_TICK_MSEC, 0);
+        s->legacy_unicast_reflect_time_event = avahi_time_event_new(s->time_event_queue, &s->legacy_unicast_reflect_next_tick, legacy_unicast_reflect_tick, s);
+    }
+
+    return slot;
 }
 
 static void free_slots(AvahiServer *s) {
     unsigned idx;
     assert(s);
 
-    if (!s->legacy_unicast_reflect_slots)
-        return;
-
-    for (idx = 0; idx < AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX; idx ++)
+    for (idx = 0; idx < s->legacy_unicast_reflect_slots_size; idx ++)
         if (s->legacy_unicast_reflect_slots[idx])
             deallocate_slot(s, s->legacy_unicast_reflect_slots[idx]);
 
     avahi_free(s->legacy_unicast_reflect_slots);
     s->legacy_unicast_reflect_slots = NULL;
+    s->legacy_unicast_reflect_slots_size = 0;
+
+    if (s->legacy_unicast_reflect_time_event) {
+        avahi_time_event_free(s->legacy_unicast_reflect_time_event);
+        s->legacy_unicast_reflect_time_event = NULL;
+    }
 }
 
 static AvahiLegacyUnicastReflectSlot* find_slot(AvahiServer *s, uint16_t id) {
-    unsigned idx;
+    AvahiLegacyUnicastReflectSlot *slot;
 
     assert(s);
 
     if (!s->legacy_unicast_reflect_slots)
         return NULL;
 
-    idx = id % AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX;
-
-    if (!s->legacy_unicast_reflect_slots[idx] || s->legacy_unicast_reflect_slots[idx]->id != id)
+    if (!(slot = s->legacy_unicast_reflect_slots[id & (s->legacy_unicast_reflect_slots_size - 1)]) || slot->id != id)
         return NULL;
 
-    return s->legacy_unicast_reflect_slots[idx];
-}
-
-static void legacy_unicast_reflect_slot_timeout(AvahiTimeEvent *e, void *userdata) {
-    AvahiLegacyUnicastReflectSlot *slot = userdata;
-
-    assert(e);
-    assert(slot);
-    assert(slot->time_event == e);
-
-    deallocate_slot(slot->server, slot);
+    return slot;
 }
 
 static void reflect_legacy_unicast_query_packet(AvahiServer *s, AvahiDnsPacket *p, AvahiInterface *i, const AvahiAddress *a, uint16_t port) {
@@ -812,9 +833,6 @@ static void reflect_legacy_unicast_query_packet(AvahiServer *s, AvahiDnsPacket *
     slot->port = port;
     slot->interface = i->hardware->index;
 
-    avahi_elapse_time(&slot->elapse_time, 2000, 0);
-    slot->time_event = avahi_time_event_new(s->time_event_queue, &slot->elapse_time, legacy_unicast_reflect_slot_timeout, slot);
-
     /* Patch the packet with our new locally generatet id */
     avahi_dns_packet_set_field(p, AVAHI_DNS_FIELD_ID, slot->id);
 
@@ -929,7 +947,7 @@ static void dispatch_packet(AvahiServer *s, AvahiDnsPacket *p, const AvahiAddres
     }
 
     if (avahi_dns_packet_is_query(p)) {
-        int legacy_unicast = 0;
+        int legacy_unicast = 0, rate_limited;
 
         /* For queries EDNS0 might allow ARCOUNT != 0. We ignore the
          * AR section completely here, so far. Until the day we add
@@ -947,10 +965,20 @@ static void dispatch_packet(AvahiServer *s, AvahiDnsPacket *p, const AvahiAddres
             legacy_unicast = 1;
         }
 
+        /* Our own queries are never limited */
+        rate_limited =
+            (s->source_rate_limiter || s->key_rate_limiter) &&
+            !(from_local_iface || originates_from_local_iface(s, iface, src_address, port));
+
+        /* Under a flood don't even parse the packet, the drops are
+         * counted by the rate limiter */
+        if (rate_limited && s->source_rate_limiter && !avahi_rate_limiter_check_address(s->source_rate_limiter, src_address))
+            return;
+
         if (legacy_unicast)
             reflect_legacy_unicast_query_packet(s, p, i, src_address, port);
 
-        handle_query_packet(s, p, i, src_address, port, legacy_unicast, from_local_iface);
+        handle_query_packet(s, p, i, src_address, port, legacy_unicast, from_local_iface, rate_limited);
 
     } else {
         char t[AVAHI_ADDRESS_STR_MAX];
@@ -1017,26 +1045,34 @@ static void dispatch_legacy_unicast_packet(AvahiServer *s, AvahiDnsPacket *p) {
 
 static void mcast_socket_event(AvahiWatch *w, int fd, AvahiWatchEvent events, void *userdata) {
     AvahiServer *s = userdata;
-    AvahiAddress dest, src;
-    AvahiDnsPacket *p = NULL;
-    AvahiIfIndex iface;
-    uint16_t port;
-    uint8_t ttl;
+    unsigned i;
+    int n;
 
     assert(w);
     assert(fd >= 0);
     assert(events & AVAHI_WATCH_IN);
+    assert(s->recv_ring);
 
-    if (fd == s->fd_ipv4) {
-        dest.proto = src.proto = AVAHI_PROTO_INET;
-        p = avahi_recv_dns_packet_ipv4(s->fd_ipv4, &src.data.ipv4, &port, &dest.data.ipv4, &iface, &ttl);
-    } else {
+    if (fd == s->fd_ipv4)
+        n = avahi_recv_dns_packets_ipv4(s->fd_ipv4, s->recv_ring);
+    else {
         assert(fd == s->fd_ipv6);
-        dest.proto = src.proto = AVAHI_PROTO_INET6;
-        p = avahi_recv_dns_packet_ipv6(s->fd_ipv6, &src.data.ipv6, &port, &dest.data.ipv6, &iface, &ttl);
+        n = avahi_recv_dns_packets_ipv6(s->fd_ipv6, s->recv_ring);
     }
 
-    if (p) {
+    if (n <= 0)
+        return;
+
+    for (i = 0; i < (unsigned) n; i++) {
+        AvahiAddress dest, src;
+        AvahiDnsPacket *p;
+        AvahiIfIndex iface;
+        uint16_t port;
+        uint8_t ttl;
+
+        if (!(p = avahi_recv_ring_get(s->recv_ring, i, &src, &port, &dest, &iface, &ttl)))
+            continue;
+
         if (iface == AVAHI_IF_UNSPEC)
             iface = avahi_find_interface_for_address(s->monitor, &dest);
 
@@ -1044,11 +1080,9 @@ static void mcast_socket_event(AvahiWatch *w, int fd, AvahiWatchEvent events, vo
             dispatch_packet(s, p, &src, port, &dest, iface, ttl);
         else
             avahi_log_error("Incoming packet received on address that isn't local.");
-
-        avahi_dns_packet_free(p);
-
-        avahi_cleanup_dead_entries(s);
     }
+
+    avahi_cleanup_dead_entries(s);
 }
 
 static void legacy_unicast_socket_event(AvahiWatch *w, int fd, AvahiWatchEvent events, void *userdata) {
@@ -1339,6 +1373,29 @@ static int setup_sockets(AvahiServer *s) {
     s->fd_legacy_unicast_ipv4 = s->fd_ipv4 >= 0 && s->config.enable_reflector ? avahi_open_unicast_socket_ipv4() : -1;
     s->fd_legacy_unicast_ipv6 = s->fd_ipv6 >= 0 && s->config.enable_reflector ? avahi_open_unicast_socket_ipv6() : -1;
 
+    s->send_queue_ipv4 = s->send_queue_ipv6 = NULL;
+
+    if (!(s->recv_ring = avahi_recv_ring_new()) ||
+        (s->fd_ipv4 >= 0 && !(s->send_queue_ipv4 = avahi_send_queue_new(s->poll_api, s->fd_ipv4))) ||
+        (s->fd_ipv6 >= 0 && !(s->send_queue_ipv6 = avahi_send_queue_new(s->poll_api, s->fd_ipv6)))) {
+
+        if (s->send_queue_ipv4)
+            avahi_send_queue_free(s->send_queue_ipv4);
+        if (s->recv_ring)
+            avahi_recv_ring_free(s->recv_ring);
+
+        if (s->fd_ipv4 >= 0)
+            close(s->fd_ipv4);
+        if (s->fd_ipv6 >= 0)
+            close(s->fd_ipv6);
+        if (s->fd_legacy_unicast_ipv4 >= 0)
+            close(s->fd_legacy_unicast_ipv4);
+        if (s->fd_legacy_unicast_ipv6 >= 0)
+            close(s->fd_legacy_unicast_ipv6);
+
+        return AVAHI_ERR_NO_MEMORY;
+    }
+
     s->watch_ipv4 =
         s->watch_ipv6 =
         s->watch_legacy_unicast_ipv4 =
@@ -1357,9 +1414,18 @@ static int setup_sockets(AvahiServer *s) {
     return 0;
 }
 
+static unsigned record_pointer_hash(const void *data) {
+    return (unsigned) ((uintptr_t) data / sizeof(void*));
+}
+
+static int record_pointer_equal(const void *a, const void *b) {
+    return a == b;
+}
+
 AvahiServer *avahi_server_new(const AvahiPoll *poll_api, const AvahiServerConfig *sc, AvahiServerCallback callback, void* userdata, int *error) {
     AvahiServer *s;
     int e;
+    unsigned n;
 
     if (sc && (e = valid_server_config(sc)) < 0) {
         if (error)
@@ -1381,10 +1447,21 @@ AvahiServer *avahi_server_new(const AvahiPoll *poll_api, const AvahiServerConfig
     else
         avahi_server_config_init(&s->config);
 
+    if (!(s->packet_pool = avahi_dns_packet_pool_new())) {
+        if (error)
+            *error = AVAHI_ERR_NO_MEMORY;
+
+        avahi_server_config_free(&s->config);
+        avahi_free(s);
+
+        return NULL;
+    }
+
     if ((e = setup_sockets(s)) < 0) {
         if (error)
             *error = e;
 
+        avahi_dns_packet_pool_free(s->packet_pool);
         avahi_server_config_free(&s->config);
         avahi_free(s);
 
@@ -1407,6 +1484,8 @@ AvahiServer *avahi_server_new(const AvahiPoll *poll_api, const AvahiServerConfig
     s->time_event_queue = avahi_time_event_queue_new(poll_api);
 
     s->entries_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, NULL, NULL);
+    s->entries_by_name = avahi_hashmap_new((AvahiHashFunc) avahi_domain_hash, (AvahiEqualFunc) avahi_domain_equal, NULL, NULL);
+    s->entries_by_record = avahi_hashmap_new(record_pointer_hash, record_pointer_equal, NULL, NULL);
     AVAHI_LLIST_HEAD_INIT(AvahiEntry, s->entries);
     AVAHI_LLIST_HEAD_INIT(AvahiGroup, s->groups);
 
@@ -1421,7 +1500,12 @@ AvahiServer *avahi_server_new(const AvahiPoll *poll_api, const AvahiServerConfig
     AVAHI_LLIST_HEAD_INIT(AvahiSDNSServerBrowser, s->dns_server_browsers);
 
     s->legacy_unicast_reflect_slots = NULL;
-    s->legacy_unicast_reflect_id = 0;
+    s->legacy_unicast_reflect_slots_size = s->n_legacy_unicast_reflect_slots = 0;
+    for (n = 0; n < AVAHI_LEGACY_UNICAST_REFLECT_WHEEL_SIZE; n++)
+        AVAHI_LLIST_HEAD_INIT(AvahiLegacyUnicastReflectSlot, s->legacy_unicast_reflect_wheel[n]);
+    s->legacy_unicast_reflect_tick = 0;
+    s->legacy_unicast_reflect_time_event = NULL;
+    s->n_legacy_unicast_reflect_exhausted = 0;
 
     s->record_list = avahi_record_list_new();
 
@@ -1444,6 +1528,11 @@ AvahiServer *avahi_server_new(const AvahiPoll *poll_api, const AvahiServerConfig
 
     s->multicast_lookup_engine = avahi_multicast_lookup_engine_new(s);
 
+    s->reflector = s->config.enable_reflector ? avahi_reflector_new(s) : NULL;
+
+    s->source_rate_limiter = s->config.query_ratelimit_source > 0 ? avahi_rate_limiter_new(s->config.query_ratelimit_source, s->config.query_ratelimit_source_burst) : NULL;
+    s->key_rate_limiter = s->config.query_ratelimit_key > 0 ? avahi_rate_limiter_new(s->config.query_ratelimit_key, s->config.query_ratelimit_key_burst) : NULL;
+
     s->monitor = avahi_interface_monitor_new(s);
     avahi_interface_monitor_sync(s->monitor);
 
@@ -1488,6 +1577,8 @@ void avahi_server_free(AvahiServer* s) {
     free_slots(s);
 
     avahi_hashmap_free(s->entries_by_key);
+    avahi_hashmap_free(s->entries_by_name);
+    avahi_hashmap_free(s->entries_by_record);
     avahi_record_list_free(s->record_list);
     avahi_hashmap_free(s->record_browser_hashmap);
 
@@ -1495,6 +1586,14 @@ void avahi_server_free(AvahiServer* s) {
         avahi_wide_area_engine_free(s->wide_area_lookup_engine);
     avahi_multicast_lookup_engine_free(s->multicast_lookup_engine);
 
+    if (s->reflector)
+        avahi_reflector_free(s->reflector);
+
+    if (s->source_rate_limiter)
+        avahi_rate_limiter_free(s->source_rate_limiter);
+    if (s->key_rate_limiter)
+        avahi_rate_limiter_free(s->key_rate_limiter);
+
     if (s->cleanup_time_event)
         avahi_time_event_free(s->cleanup_time_event);
 
@@ -1512,6 +1611,13 @@ void avahi_server_free(AvahiServer* s) {
     if (s->watch_legacy_unicast_ipv6)
         s->poll_api->watch_free(s->watch_legacy_unicast_ipv6);
 
+    /* Send whatever is still queued before the sockets go away */
+
+    if (s->send_queue_ipv4)
+        avahi_send_queue_free(s->send_queue_ipv4);
+    if (s->send_queue_ipv6)
+        avahi_send_queue_free(s->send_queue_ipv6);
+
     /* Free sockets */
 
     if (s->fd_ipv4 >= 0)
@@ -1524,8 +1630,12 @@ void avahi_server_free(AvahiServer* s) {
     if (s->fd_legacy_unicast_ipv6 >= 0)
         close(s->fd_legacy_unicast_ipv6);
 
+    avahi_recv_ring_free(s->recv_ring);
+
     /* Free other stuff */
 
+    avahi_dns_packet_pool_free(s->packet_pool);
+
     avahi_free(s->host_name);
     avahi_free(s->domain_name);
     avahi_free(s->host_name_fqdn);
@@ -1599,8 +1709,15 @@ AvahiServerConfig* avahi_server_config_init(AvahiServerConfig *c) {
     c->publish_aaaa_on_ipv4 = 1;
     c->publish_a_on_ipv6 = 0;
     c->n_cache_entries_max = AVAHI_DEFAULT_CACHE_ENTRIES_MAX;
+    c->n_wide_area_cache_entries_max = AVAHI_DEFAULT_WIDE_AREA_CACHE_ENTRIES_MAX;
+    c->n_wide_area_parallel_queries = 2;
     c->ratelimit_interval = 0;
     c->ratelimit_burst = 0;
+    c->query_aggregation_msec = 0;
+    c->query_ratelimit_source = AVAHI_DEFAULT_QUERY_RATELIMIT_SOURCE;
+    c->query_ratelimit_source_burst = AVAHI_DEFAULT_QUERY_RATELIMIT_SOURCE_BURST;
+    c->query_ratelimit_key = AVAHI_DEFAULT_QUERY_RATELIMIT_KEY;
+    c->query_ratelimit_key_burst = AVAHI_DEFAULT_QUERY_RATELIMIT_KEY_BURST;
 
     return c;
 }
@@ -1771,6 +1888,21 @@ int avahi_server_is_record_local(AvahiServer *s, AvahiIfIndex interface, AvahiPr
     return 0;
 }
 
+uint8_t* avahi_server_append_record(AvahiServer *s, AvahiDnsPacket *p, AvahiRecord *r, int cache_flush, unsigned max_ttl) {
+    AvahiEntry *e;
+
+    assert(s);
+    assert(p);
+    assert(r);
+
+    /* Records we publish ourselves have been serialized when they
+     * were added, everything else is encoded from scratch */
+    if ((e = avahi_hashmap_lookup(s->entries_by_record, r)) && e->wire)
+        return avahi_dns_packet_append_wire_record(p, e->wire, r, cache_flush, max_ttl);
+
+    return avahi_dns_packet_append_record(p, r, cache_flush, max_ttl);
+}
+
 /** Set the wide area DNS servers */
 int avahi_server_set_wide_area_servers(AvahiServer *s, const AvahiAddress *a, unsigned n) {
     assert(s);
@@ -1782,6 +1914,46 @@ int avahi_server_set_wide_area_servers(AvahiServer *s, const AvahiAddress *a, un
     return AVAHI_OK;
 }
 
+int avahi_server_set_query_aggregation(AvahiServer *s, unsigned msec) {
+    assert(s);
+
+    s->config.query_aggregation_msec = msec;
+    return AVAHI_OK;
+}
+
+int avahi_server_get_wide_area_stats(AvahiServer *s, AvahiServerWideAreaStats *ret, unsigned n) {
+    assert(s);
+    assert(ret || n == 0);
+
+    if (!s->wide_area_lookup_engine)
+        return avahi_server_set_errno(s, AVAHI_ERR_INVALID_CONFIG);
+
+    return (int) avahi_wide_area_get_stats(s->wide_area_lookup_engine, ret, n);
+}
+
+int avahi_server_get_reflector_stats(AvahiServer *s, AvahiServerReflectorStats *ret) {
+    assert(s);
+    assert(ret);
+
+    if (!s->reflector)
+        return avahi_server_set_errno(s, AVAHI_ERR_INVALID_CONFIG);
+
+    avahi_reflector_get_stats(s->reflector, ret);
+    ret->n_legacy_unicast_slots = s->n_legacy_unicast_reflect_slots;
+    ret->n_legacy_unicast_exhausted = s->n_legacy_unicast_reflect_exhausted;
+    return AVAHI_OK;
+}
+
+int avahi_server_get_ratelimit_stats(AvahiServer *s, AvahiServerRateLimitStats *ret) {
+    assert(s);
+    assert(ret);
+
+    ret->n_dropped_source = s->source_rate_limiter ? avahi_rate_limiter_get_dropped(s->source_rate_limiter) : 0;
+    ret->n_dropped_key = s->key_rate_limiter ? avahi_rate_limiter_get_dropped(s->key_rate_limiter) : 0;
+
+    return AVAHI_OK;
+}
+
 const AvahiServerConfig* avahi_server_get_config(AvahiServer *s) {
     assert(s);
 
@@ -1803,3 +1975,39 @@ int avahi_server_set_browse_domains(AvahiServer *s, AvahiStringList *domains) {
 
     return AVAHI_OK;
 }
+
+int avahi_server_get_query_stats(AvahiServer *s, AvahiIfIndex interface, AvahiProtocol protocol, AvahiServerQueryStats *ret) {
+    AvahiInterface *i;
+
+    assert(s);
+    assert(ret);
+
+    AVAHI_CHECK_VALIDITY(s, AVAHI_IF_VALID(interface), AVAHI_ERR_INVALID_INTERFACE);
+    AVAHI_CHECK_VALIDITY(s, AVAHI_PROTO_VALID(protocol), AVAHI_ERR_INVALID_PROTOCOL);
+
+    memset(ret, 0, sizeof(AvahiServerQueryStats));
+
+    for (i = s->monitor->interfaces; i; i = i->interface_next)
+        if (avahi_interface_match(i, interface, protocol) && i->query_scheduler)
+            avahi_query_scheduler_add_stats(i->query_scheduler, ret);
+
+    return AVAHI_OK;
+}
+
+int avahi_server_get_cache_stats(AvahiServer *s, AvahiIfIndex interface, AvahiProtocol protocol, AvahiServerCacheStats *ret) {
+    AvahiInterface *i;
+
+    assert(s);
+    assert(ret);
+
+    AVAHI_CHECK_VALIDITY(s, AVAHI_IF_VALID(interface), AVAHI_ERR_INVALID_INTERFACE);
+    AVAHI_CHECK_VALIDITY(s, AVAHI_PROTO_VALID(protocol), AVAHI_ERR_INVALID_PROTOCOL);
+
+    memset(ret, 0, sizeof(AvahiServerCacheStats));
+
+    for (i = s->monitor->interfaces; i; i = i->interface_next)
+        if (avahi_interface_match(i, interface, protocol) && i->cache)
+            avahi_cache_add_stats(i->cache, ret);
+
+    return AVAHI_OK;
+}
@@ -45,6 +45,9 @@
 #include <net/if_dl.h>
 #endif
 
+#include <avahi-common/malloc.h>
+#include <avahi-common/watch.h>
+
 #include "dns.h"
 #include "fdutil.h"
 #include "socket.h"
@@ -468,6 +471,58 @@ static int sendmsg_loop(int fd, struct msghdr *msg, int flags) {
     return 0;
 }
 
+#ifdef IP_PKTINFO
+static void set_pktinfo_ipv4(struct msghdr *msg, size_t *cmsg_data, size_t cmsg_size, AvahiIfIndex interface, const AvahiIPv4Address *src_address) {
+    struct cmsghdr *cmsg;
+    struct in_pktinfo *pkti;
+
+    assert(msg);
+    assert(cmsg_size >= CMSG_SPACE(sizeof(struct in_pktinfo)));
+
+    memset(cmsg_data, 0, cmsg_size);
+    msg->msg_control = cmsg_data;
+    msg->msg_controllen = CMSG_LEN(sizeof(struct in_pktinfo));
+
+    cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_len = msg->msg_controllen;
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+
+    pkti = (struct in_pktinfo*) CMSG_DATA(cmsg);
+
+    if (interface > 0)
+        pkti->ipi_ifindex = interface;
+
+    if (src_address)
+        pkti->ipi_spec_dst.s_addr = src_address->address;
+}
+#endif
+
+static void set_pktinfo_ipv6(struct msghdr *msg, size_t *cmsg_data, size_t cmsg_size, AvahiIfIndex interface, const AvahiIPv6Address *src_address) {
+    struct cmsghdr *cmsg;
+    struct in6_pktinfo *pkti;
+
+    assert(msg);
+    assert(cmsg_size >= CMSG_SPACE(sizeof(struct in6_pktinfo)));
+
+    memset(cmsg_data, 0, cmsg_size);
+    msg->msg_control = cmsg_data;
+    msg->msg_controllen = CMSG_LEN(sizeof(struct in6_pktinfo));
+
+    cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_len = msg->msg_controllen;
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type = IPV6_PKTINFO;
+
+    pkti = (struct in6_pktinfo*) CMSG_DATA(cmsg);
+
+    if (interface > 0)
+        pkti->ipi6_ifindex = interface;
+
+    if (src_address)
+        memcpy(&pkti->ipi6_addr, src_address->address, sizeof(src_address->address));
+}
+
 int avahi_send_dns_packet_ipv4(
         int fd,
         AvahiIfIndex interface,
@@ -480,7 +535,6 @@ int avahi_send_dns_packet_ipv4(
     struct msghdr msg;
     struct iovec io;
 #ifdef IP_PKTINFO
-    struct cmsghdr *cmsg;
     size_t cmsg_data[( CMSG_SPACE(sizeof(struct in_pktinfo)) / sizeof(size_t)) + 1];
 #elif !defined(IP_MULTICAST_IF) && defined(IP_SENDSRCADDR)
     struct cmsghdr *cmsg;
@@ -511,26 +565,8 @@ int avahi_send_dns_packet_ipv4(
     msg.msg_controllen = 0;
 
 #ifdef IP_PKTINFO
-    if (interface > 0 || src_address) {
-        struct in_pktinfo *pkti;
-
-        memset(cmsg_data, 0, sizeof(cmsg_data));
-        msg.msg_control = cmsg_data;
-        msg.msg_controllen = CMSG_LEN(sizeof(struct in_pktinfo));
-
-        cmsg = CMSG_FIRSTHDR(&msg);
-        cmsg->cmsg_len = msg.msg_controllen;
-        cmsg->cmsg_level = IPPROTO_IP;
-        cmsg->cmsg_type = IP_PKTINFO;
-
-        pkti = (struct in_pktinfo*) CMSG_DATA(cmsg);
-
-        if (interface > 0)
-            pkti->ipi_ifindex = interface;
-
-        if (src_address)
-            pkti->ipi_spec_dst.s_addr = src_address->address;
-    }
+    if (interface > 0 || src_address)
+        set_pktinfo_ipv4(&msg, cmsg_data, sizeof(cmsg_data), interface, src_address);
 #elif defined(IP_MULTICAST_IF)
     if (src_address) {
         struct in_addr any = { INADDR_ANY };
@@ -573,7 +609,6 @@ int avahi_send_dns_packet_ipv6(
     struct sockaddr_in6 sa;
     struct msghdr msg;
     struct iovec io;
-    struct cmsghdr *cmsg;
     size_t cmsg_data[(CMSG_SPACE(sizeof(struct in6_pktinfo))/sizeof(size_t)) + 1];
 
     assert(fd >= 0);
@@ -597,119 +632,310 @@ int avahi_send_dns_packet_ipv6(
     msg.msg_iovlen = 1;
     msg.msg_flags = 0;
 
-    if (interface > 0 || src_address) {
-        struct in6_pktinfo *pkti;
+    if (interface > 0 || src_address)
+        set_pktinfo_ipv6(&msg, cmsg_data, sizeof(cmsg_data), interface, src_address);
+    else {
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+    }
 
-        memset(cmsg_data, 0, sizeof(cmsg_data));
-        msg.msg_control = cmsg_data;
-        msg.msg_controllen = CMSG_LEN(sizeof(struct in6_pktinfo));
+    return sendmsg_loop(fd, &msg, 0);
+}
 
-        cmsg = CMSG_FIRSTHDR(&msg);
-        cmsg->cmsg_len = msg.msg_controllen;
-        cmsg->cmsg_level = IPPROTO_IPV6;
-        cmsg->cmsg_type = IPV6_PKTINFO;
+/* Outgoing packets are only batched if the kernel lets us pass the
+ * outgoing interface as per-message control data, since the
+ * IP_MULTICAST_IF fallback changes socket state for each send. */
+#if defined(HAVE_SENDMMSG) && defined(IP_PKTINFO)
+#define SEND_QUEUE_BATCHING 1
+#endif
 
-        pkti = (struct in6_pktinfo*) CMSG_DATA(cmsg);
+struct AvahiSendQueue {
+    const AvahiPoll *poll_api;
+    int fd;
+
+#ifdef SEND_QUEUE_BATCHING
+    AvahiTimeout *flush_timeout;
+    int flush_scheduled;
+
+    unsigned n_entries;
+
+    struct {
+        union {
+            struct sockaddr_in in;
+            struct sockaddr_in6 in6;
+        } sa;
+        socklen_t sa_len;
+        size_t offset, length;
+        size_t cmsg_data[(CMSG_SPACE(sizeof(struct in6_pktinfo)) / sizeof(size_t)) + 1];
+        int has_cmsg;
+        struct iovec io;
+    } entries[AVAHI_SEND_BATCH_MAX];
+
+    struct mmsghdr msgs[AVAHI_SEND_BATCH_MAX];
+
+    /* Packet payloads of all queued entries, back to back */
+    uint8_t *buffer;
+    size_t buffer_size, buffer_alloc;
+#endif
+};
 
-        if (interface > 0)
-            pkti->ipi6_ifindex = interface;
+#ifdef SEND_QUEUE_BATCHING
 
-        if (src_address)
-            memcpy(&pkti->ipi6_addr, src_address->address, sizeof(src_address->address));
-    } else {
-        msg.msg_control = NULL;
-        msg.msg_controllen = 0;
+static void send_queue_flush_callback(AvahiTimeout *t, void *userdata) {
+    AvahiSendQueue *q = userdata;
+
+    assert(t);
+    assert(q);
+
+    avahi_send_queue_flush(q);
+}
+
+static void send_queue_schedule_flush(AvahiSendQueue *q) {
+    struct timeval now;
+
+    assert(q);
+
+    if (q->flush_scheduled)
+        return;
+
+    /* Expires right away, i.e. in the next main loop iteration */
+    gettimeofday(&now, NULL);
+    q->poll_api->timeout_update(q->flush_timeout, &now);
+    q->flush_scheduled = 1;
+}
+
+static int send_queue_append(AvahiSendQueue *q, AvahiDnsPacket *p, const struct sockaddr *sa, socklen_t sa_len, unsigned *ret_idx) {
+    unsigned idx;
+
+    assert(q);
+    assert(p);
+    assert(sa);
+    assert(sa_len <= sizeof(q->entries[0].sa));
+
+    if (q->n_entries >= AVAHI_SEND_BATCH_MAX)
+        avahi_send_queue_flush(q);
+
+    if (q->buffer_size + p->size > q->buffer_alloc) {
+        size_t n = q->buffer_alloc ? q->buffer_alloc : 4096;
+        uint8_t *b;
+
+        while (n < q->buffer_size + p->size)
+            n *= 2;
+
+        if (!(b = avahi_realloc(q->buffer, n)))
+            return -1;
+
+        q->buffer = b;
+        q->buffer_alloc = n;
     }
 
-    return sendmsg_loop(fd, &msg, 0);
+    idx = q->n_entries++;
+
+    memcpy(q->buffer + q->buffer_size, AVAHI_DNS_PACKET_DATA(p), p->size);
+    q->entries[idx].offset = q->buffer_size;
+    q->entries[idx].length = p->size;
+    q->buffer_size += p->size;
+
+    memcpy(&q->entries[idx].sa, sa, sa_len);
+    q->entries[idx].sa_len = sa_len;
+    q->entries[idx].has_cmsg = 0;
+
+    send_queue_schedule_flush(q);
+
+    *ret_idx = idx;
+    return 0;
 }
 
-AvahiDnsPacket *avahi_recv_dns_packet_ipv4(
-        int fd,
-        AvahiIPv4Address *ret_src_address,
-        uint16_t *ret_src_port,
-        AvahiIPv4Address *ret_dst_address,
-        AvahiIfIndex *ret_iface,
-        uint8_t *ret_ttl) {
+#endif
 
-    AvahiDnsPacket *p= NULL;
-    struct msghdr msg;
-    struct iovec io;
-    size_t aux[1024 / sizeof(size_t)]; /* for alignment on ia64 ! */
-    ssize_t l;
-    struct cmsghdr *cmsg;
-    int found_addr = 0;
-    int ms;
-    struct sockaddr_in sa;
+AvahiSendQueue* avahi_send_queue_new(const AvahiPoll *poll_api, int fd) {
+    AvahiSendQueue *q;
 
+    assert(poll_api);
     assert(fd >= 0);
 
-    if (ioctl(fd, FIONREAD, &ms) < 0) {
-        avahi_log_warn("ioctl(): %s", strerror(errno));
-        goto fail;
+    if (!(q = avahi_new0(AvahiSendQueue, 1)))
+        return NULL;
+
+    q->poll_api = poll_api;
+    q->fd = fd;
+
+#ifdef SEND_QUEUE_BATCHING
+    if (!(q->flush_timeout = poll_api->timeout_new(poll_api, NULL, send_queue_flush_callback, q))) {
+        avahi_free(q);
+        return NULL;
     }
+#endif
 
-    if (ms < 0) {
-        avahi_log_warn("FIONREAD returned negative value.");
-        goto fail;
+    return q;
+}
+
+void avahi_send_queue_free(AvahiSendQueue *q) {
+    assert(q);
+
+    /* Make sure that goodbye packets queued during shutdown still go out */
+    avahi_send_queue_flush(q);
+
+#ifdef SEND_QUEUE_BATCHING
+    q->poll_api->timeout_free(q->flush_timeout);
+    avahi_free(q->buffer);
+#endif
+
+    avahi_free(q);
+}
+
+int avahi_send_queue_push_ipv4(AvahiSendQueue *q, AvahiIfIndex interface, AvahiDnsPacket *p, const AvahiIPv4Address *src_address, const AvahiIPv4Address *dst_address, uint16_t dst_port) {
+#ifdef SEND_QUEUE_BATCHING
+    struct sockaddr_in sa;
+    struct msghdr msg;
+    unsigned idx;
+
+    assert(q);
+    assert(p);
+    assert(avahi_dns_packet_check_valid(p) >= 0);
+    assert(!dst_address || dst_port > 0);
+
+    if (!dst_address)
+        mdns_mcast_group_ipv4(&sa);
+    else
+        ipv4_address_to_sockaddr(&sa, dst_address, dst_port);
+
+    if (send_queue_append(q, p, (struct sockaddr*) &sa, sizeof(sa), &idx) < 0)
+        return avahi_send_dns_packet_ipv4(q->fd, interface, p, src_address, dst_address, dst_port);
+
+    if (interface > 0 || src_address) {
+        memset(&msg, 0, sizeof(msg));
+        set_pktinfo_ipv4(&msg, q->entries[idx].cmsg_data, sizeof(q->entries[idx].cmsg_data), interface, src_address);
+        q->entries[idx].has_cmsg = 1;
     }
 
-    p = avahi_dns_packet_new(ms + AVAHI_DNS_PACKET_EXTRA_SIZE);
+    return 0;
+#else
+    assert(q);
 
-    io.iov_base = AVAHI_DNS_PACKET_DATA(p);
-    io.iov_len = p->max_size;
+    return avahi_send_dns_packet_ipv4(q->fd, interface, p, src_address, dst_address, dst_port);
+#endif
+}
 
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &sa;
-    msg.msg_namelen = sizeof(sa);
-    msg.msg_iov = &io;
-    msg.msg_iovlen = 1;
-    msg.msg_control = aux;
-    msg.msg_controllen = sizeof(aux);
-    msg.msg_flags = 0;
+int avahi_send_queue_push_ipv6(AvahiSendQueue *q, AvahiIfIndex interface, AvahiDnsPacket *p, const AvahiIPv6Address *src_address, const AvahiIPv6Address *dst_address, uint16_t dst_port) {
+#ifdef SEND_QUEUE_BATCHING
+    struct sockaddr_in6 sa;
+    struct msghdr msg;
+    unsigned idx;
 
-    if ((l = recvmsg(fd, &msg, 0)) < 0) {
-        /* Linux returns EAGAIN when an invalid IP packet has been
-        received. We suppress warnings in this case because this might
-        create quite a bit of log traffic on machines with unstable
-        links. (See #60) */
+    assert(q);
+    assert(p);
+    assert(avahi_dns_packet_check_valid(p) >= 0);
+    assert(!dst_address || dst_port > 0);
 
-        if (errno != EAGAIN)
-            avahi_log_warn("recvmsg(): %s", strerror(errno));
+    if (!dst_address)
+        mdns_mcast_group_ipv6(&sa);
+    else
+        ipv6_address_to_sockaddr(&sa, dst_address, dst_port);
 
-        goto fail;
+    if (send_queue_append(q, p, (struct sockaddr*) &sa, sizeof(sa), &idx) < 0)
+        return avahi_send_dns_packet_ipv6(q->fd, interface, p, src_address, dst_address, dst_port);
+
+    if (interface > 0 || src_address) {
+        memset(&msg, 0, sizeof(msg));
+        set_pktinfo_ipv6(&msg, q->entries[idx].cmsg_data, sizeof(q->entries[idx].cmsg_data), interface, src_address);
+        q->entries[idx].has_cmsg = 1;
     }
 
-    /* For corrupt packets FIONREAD returns zero size (See rhbz #607297). So
-     * fail after having read them. */
-    if (!ms)
-        goto fail;
+    return 0;
+#else
+    assert(q);
 
-    if (sa.sin_addr.s_addr == INADDR_ANY)
-        /* Linux 2.4 behaves very strangely sometimes! */
-        goto fail;
+    return avahi_send_dns_packet_ipv6(q->fd, interface, p, src_address, dst_address, dst_port);
+#endif
+}
 
-    assert(!(msg.msg_flags & MSG_CTRUNC));
-    assert(!(msg.msg_flags & MSG_TRUNC));
+void avahi_send_queue_flush(AvahiSendQueue *q) {
+#ifdef SEND_QUEUE_BATCHING
+    unsigned i, n;
 
-    p->size = (size_t) l;
+    assert(q);
 
-    if (ret_src_port)
-        *ret_src_port = avahi_port_from_sockaddr((struct sockaddr*) &sa);
+    if (q->flush_scheduled) {
+        q->poll_api->timeout_update(q->flush_timeout, NULL);
+        q->flush_scheduled = 0;
+    }
 
-    if (ret_src_address) {
-        AvahiAddress a;
-        avahi_address_from_sockaddr((struct sockaddr*) &sa, &a);
-        *ret_src_address = a.data.ipv4;
+    if (!(n = q->n_entries))
+        return;
+
+    /* The iovecs are set up only now, because the buffer might have
+     * been moved by avahi_realloc() while entries were queued */
+    for (i = 0; i < n; i++) {
+        struct msghdr *msg = &q->msgs[i].msg_hdr;
+
+        q->entries[i].io.iov_base = q->buffer + q->entries[i].offset;
+        q->entries[i].io.iov_len = q->entries[i].length;
+
+        memset(msg, 0, sizeof(struct msghdr));
+        msg->msg_name = &q->entries[i].sa;
+        msg->msg_namelen = q->entries[i].sa_len;
+        msg->msg_iov = &q->entries[i].io;
+        msg->msg_iovlen = 1;
+
+        if (q->entries[i].has_cmsg) {
+            struct cmsghdr *cmsg = (struct cmsghdr*) q->entries[i].cmsg_data;
+
+            msg->msg_control = q->entries[i].cmsg_data;
+            msg->msg_controllen = cmsg->cmsg_len;
+        }
+    }
+
+    for (i = 0; i < n;) {
+        int r;
+
+        if ((r = sendmmsg(q->fd, q->msgs + i, n - i, 0)) > 0) {
+            i += (unsigned) r;
+            continue;
+        }
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r < 0 && errno == EAGAIN) {
+            if (avahi_wait_for_write(q->fd) < 0)
+                break;
+
+            continue;
+        }
+
+        if (r < 0) {
+            char where[64];
+            struct sockaddr_in *sin = q->msgs[i].msg_hdr.msg_name;
+
+            inet_ntop(sin->sin_family, sin->sin_family == AF_INET6 ? (void*) &((struct sockaddr_in6*) sin)->sin6_addr : (void*) &sin->sin_addr, where, sizeof(where));
+            avahi_log_debug("sendmmsg() to %s failed: %s", where, strerror(errno));
+        }
+
+        /* Skip the packet that failed and go on with the rest */
+        i++;
     }
 
+    q->n_entries = 0;
+    q->buffer_size = 0;
+#else
+    assert(q);
+#endif
+}
+
+static int parse_cmsg_ipv4(struct msghdr *msg, AvahiIPv4Address *ret_dst_address, AvahiIfIndex *ret_iface, uint8_t *ret_ttl) {
+    struct cmsghdr *cmsg;
+    int found_addr = 0;
+
+    assert(msg);
+
     if (ret_ttl)
         *ret_ttl = 255;
 
     if (ret_iface)
         *ret_iface = AVAHI_IF_UNSPEC;
 
-    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
 
         if (cmsg->cmsg_level == IPPROTO_IP) {
 
@@ -774,57 +1000,92 @@ AvahiDnsPacket *avahi_recv_dns_packet_ipv4(
         }
     }
 
-    assert(found_addr);
-
-    return p;
-
-fail:
-    if (p)
-        avahi_dns_packet_free(p);
-
-    return NULL;
+    return found_addr;
 }
 
-AvahiDnsPacket *avahi_recv_dns_packet_ipv6(
-        int fd,
-        AvahiIPv6Address *ret_src_address,
-        uint16_t *ret_src_port,
-        AvahiIPv6Address *ret_dst_address,
-        AvahiIfIndex *ret_iface,
-        uint8_t *ret_ttl) {
-
-    AvahiDnsPacket *p = NULL;
-    struct msghdr msg;
-    struct iovec io;
-    size_t aux[1024 / sizeof(size_t)];
-    ssize_t l;
-    int ms;
+static void parse_cmsg_ipv6(struct msghdr *msg, AvahiIPv6Address *ret_dst_address, AvahiIfIndex *ret_iface, uint8_t *ret_ttl, int *ret_found_iface, int *ret_found_ttl) {
     struct cmsghdr *cmsg;
     int found_ttl = 0, found_iface = 0;
-    struct sockaddr_in6 sa;
 
-    assert(fd >= 0);
+    assert(msg);
 
-    if (ioctl(fd, FIONREAD, &ms) < 0) {
-        avahi_log_warn("ioctl(): %s", strerror(errno));
-        goto fail;
-    }
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
 
-    if (ms < 0) {
-        avahi_log_warn("FIONREAD returned negative value.");
-        goto fail;
-    }
+        if (cmsg->cmsg_level == IPPROTO_IPV6) {
 
-    p = avahi_dns_packet_new(ms + AVAHI_DNS_PACKET_EXTRA_SIZE);
+            switch (cmsg->cmsg_type) {
 
-    io.iov_base = AVAHI_DNS_PACKET_DATA(p);
-    io.iov_len = p->max_size;
+                case IPV6_HOPLIMIT:
 
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = (struct sockaddr*) &sa;
-    msg.msg_namelen = sizeof(sa);
+                    if (ret_ttl)
+                        *ret_ttl = (uint8_t) (*(int *) CMSG_DATA(cmsg));
 
-    msg.msg_iov = &io;
+                    found_ttl = 1;
+
+                    break;
+
+                case IPV6_PKTINFO: {
+                    struct in6_pktinfo *i = (struct in6_pktinfo*) CMSG_DATA(cmsg);
+
+                    if (ret_iface && i->ipi6_ifindex > 0)
+                        *ret_iface = i->ipi6_ifindex;
+
+                    if (ret_dst_address)
+                        memcpy(ret_dst_address->address, i->ipi6_addr.s6_addr, 16);
+
+                    found_iface = 1;
+                    break;
+                }
+
+                default:
+                    avahi_log_warn("Unhandled cmsg_type: %d", cmsg->cmsg_type);
+                    break;
+            }
+        }
+    }
+
+    *ret_found_iface = found_iface;
+    *ret_found_ttl = found_ttl;
+}
+
+AvahiDnsPacket *avahi_recv_dns_packet_ipv4(
+        int fd,
+        AvahiIPv4Address *ret_src_address,
+        uint16_t *ret_src_port,
+        AvahiIPv4Address *ret_dst_address,
+        AvahiIfIndex *ret_iface,
+        uint8_t *ret_ttl) {
+
+    AvahiDnsPacket *p= NULL;
+    struct msghdr msg;
+    struct iovec io;
+    size_t aux[1024 / sizeof(size_t)]; /* for alignment on ia64 ! */
+    ssize_t l;
+    int found_addr;
+    int ms;
+    struct sockaddr_in sa;
+
+    assert(fd >= 0);
+
+    if (ioctl(fd, FIONREAD, &ms) < 0) {
+        avahi_log_warn("ioctl(): %s", strerror(errno));
+        goto fail;
+    }
+
+    if (ms < 0) {
+        avahi_log_warn("FIONREAD returned negative value.");
+        goto fail;
+    }
+
+    p = avahi_dns_packet_new(ms + AVAHI_DNS_PACKET_EXTRA_SIZE);
+
+    io.iov_base = AVAHI_DNS_PACKET_DATA(p);
+    io.iov_len = p->max_size;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sa;
+    msg.msg_namelen = sizeof(sa);
+    msg.msg_iov = &io;
     msg.msg_iovlen = 1;
     msg.msg_control = aux;
     msg.msg_controllen = sizeof(aux);
@@ -847,6 +1108,10 @@ AvahiDnsPacket *avahi_recv_dns_packet_ipv6(
     if (!ms)
         goto fail;
 
+    if (sa.sin_addr.s_addr == INADDR_ANY)
+        /* Linux 2.4 behaves very strangely sometimes! */
+        goto fail;
+
     assert(!(msg.msg_flags & MSG_CTRUNC));
     assert(!(msg.msg_flags & MSG_TRUNC));
 
@@ -858,44 +1123,99 @@ AvahiDnsPacket *avahi_recv_dns_packet_ipv6(
     if (ret_src_address) {
         AvahiAddress a;
         avahi_address_from_sockaddr((struct sockaddr*) &sa, &a);
-        *ret_src_address = a.data.ipv6;
+        *ret_src_address = a.data.ipv4;
     }
 
-    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    found_addr = parse_cmsg_ipv4(&msg, ret_dst_address, ret_iface, ret_ttl);
 
-        if (cmsg->cmsg_level == IPPROTO_IPV6) {
+    assert(found_addr);
 
-            switch (cmsg->cmsg_type) {
+    return p;
 
-                case IPV6_HOPLIMIT:
+fail:
+    if (p)
+        avahi_dns_packet_free(p);
 
-                    if (ret_ttl)
-                        *ret_ttl = (uint8_t) (*(int *) CMSG_DATA(cmsg));
+    return NULL;
+}
 
-                    found_ttl = 1;
+AvahiDnsPacket *avahi_recv_dns_packet_ipv6(
+        int fd,
+        AvahiIPv6Address *ret_src_address,
+        uint16_t *ret_src_port,
+        AvahiIPv6Address *ret_dst_address,
+        AvahiIfIndex *ret_iface,
+        uint8_t *ret_ttl) {
 
-                    break;
+    AvahiDnsPacket *p = NULL;
+    struct msghdr msg;
+    struct iovec io;
+    size_t aux[1024 / sizeof(size_t)];
+    ssize_t l;
+    int ms;
+    int found_ttl, found_iface;
+    struct sockaddr_in6 sa;
 
-                case IPV6_PKTINFO: {
-                    struct in6_pktinfo *i = (struct in6_pktinfo*) CMSG_DATA(cmsg);
+    assert(fd >= 0);
 
-                    if (ret_iface && i->ipi6_ifindex > 0)
-                        *ret_iface = i->ipi6_ifindex;
+    if (ioctl(fd, FIONREAD, &ms) < 0) {
+        avahi_log_warn("ioctl(): %s", strerror(errno));
+        goto fail;
+    }
 
-                    if (ret_dst_address)
-                        memcpy(ret_dst_address->address, i->ipi6_addr.s6_addr, 16);
+    if (ms < 0) {
+        avahi_log_warn("FIONREAD returned negative value.");
+        goto fail;
+    }
 
-                    found_iface = 1;
-                    break;
-                }
+    p = avahi_dns_packet_new(ms + AVAHI_DNS_PACKET_EXTRA_SIZE);
 
-                default:
-                    avahi_log_warn("Unhandled cmsg_type: %d", cmsg->cmsg_type);
-                    break;
-            }
-        }
+    io.iov_base = AVAHI_DNS_PACKET_DATA(p);
+    io.iov_len = p->max_size;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (struct sockaddr*) &sa;
+    msg.msg_namelen = sizeof(sa);
+
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+    msg.msg_control = aux;
+    msg.msg_controllen = sizeof(aux);
+    msg.msg_flags = 0;
+
+    if ((l = recvmsg(fd, &msg, 0)) < 0) {
+        /* Linux returns EAGAIN when an invalid IP packet has been
+        received. We suppress warnings in this case because this might
+        create quite a bit of log traffic on machines with unstable
+        links. (See #60) */
+
+        if (errno != EAGAIN)
+            avahi_log_warn("recvmsg(): %s", strerror(errno));
+
+        goto fail;
     }
 
+    /* For corrupt packets FIONREAD returns zero size (See rhbz #607297). So
+     * fail after having read them. */
+    if (!ms)
+        goto fail;
+
+    assert(!(msg.msg_flags & MSG_CTRUNC));
+    assert(!(msg.msg_flags & MSG_TRUNC));
+
+    p->size = (size_t) l;
+
+    if (ret_src_port)
+        *ret_src_port = avahi_port_from_sockaddr((struct sockaddr*) &sa);
+
+    if (ret_src_address) {
+        AvahiAddress a;
+        avahi_address_from_sockaddr((struct sockaddr*) &sa, &a);
+        *ret_src_address = a.data.ipv6;
+    }
+
+    parse_cmsg_ipv6(&msg, ret_dst_address, ret_iface, ret_ttl, &found_iface, &found_ttl);
+
     assert(found_iface);
     assert(found_ttl);
 
@@ -908,6 +1228,303 @@ fail:
     return NULL;
 }
 
+struct AvahiRecvRing {
+    unsigned n_packets;
+
+    struct {
+        AvahiDnsPacket packet;
+        int valid;
+
+        AvahiAddress src_address, dst_address;
+        uint16_t src_port;
+        AvahiIfIndex iface;
+        uint8_t ttl;
+
+        union {
+            struct sockaddr_in in;
+            struct sockaddr_in6 in6;
+        } sa;
+        struct iovec io;
+        size_t aux[1024 / sizeof(size_t)]; /* for alignment on ia64 ! */
+    } slots[AVAHI_RECV_BATCH_MAX];
+
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[AVAHI_RECV_BATCH_MAX];
+#else
+    struct msghdr msg;
+#endif
+
+    uint8_t *buffer;
+};
+
+AvahiRecvRing* avahi_recv_ring_new(void) {
+    AvahiRecvRing *r;
+    unsigned i;
+
+    if (!(r = avahi_new0(AvahiRecvRing, 1)))
+        return NULL;
+
+    if (!(r->buffer = avahi_new(uint8_t, AVAHI_RECV_BATCH_MAX * AVAHI_RECV_PACKET_SIZE_MAX))) {
+        avahi_free(r);
+        return NULL;
+    }
+
+    /* The packets point into the shared buffer, so
+     * avahi_dns_packet_free() must never be called on them */
+    for (i = 0; i < AVAHI_RECV_BATCH_MAX; i++) {
+        AvahiDnsPacket *p = &r->slots[i].packet;
+
+        p->data = r->buffer + i * AVAHI_RECV_PACKET_SIZE_MAX;
+        p->max_size = p->capacity = AVAHI_RECV_PACKET_SIZE_MAX;
+    }
+
+    return r;
+}
+
+static void recv_ring_reset(AvahiRecvRing *r) {
+    unsigned i;
+
+    assert(r);
+
+    for (i = 0; i < r->n_packets; i++) {
+        AvahiDnsPacket *p = &r->slots[i].packet;
+
+        if (p->name_table) {
+            avahi_dns_name_table_free(p->name_table);
+            p->name_table = NULL;
+        }
+
+        r->slots[i].valid = 0;
+    }
+
+    r->n_packets = 0;
+}
+
+void avahi_recv_ring_free(AvahiRecvRing *r) {
+    assert(r);
+
+    recv_ring_reset(r);
+
+    avahi_free(r->buffer);
+    avahi_free(r);
+}
+
+static void recv_ring_prepare_msg(AvahiRecvRing *r, unsigned i, struct msghdr *msg, socklen_t sa_len) {
+    assert(r);
+    assert(i < AVAHI_RECV_BATCH_MAX);
+    assert(msg);
+
+    r->slots[i].io.iov_base = r->slots[i].packet.data;
+    r->slots[i].io.iov_len = r->slots[i].packet.max_size;
+
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_name = &r->slots[i].sa;
+    msg->msg_namelen = sa_len;
+    msg->msg_iov = &r->slots[i].io;
+    msg->msg_iovlen = 1;
+    msg->msg_control = r->slots[i].aux;
+    msg->msg_controllen = sizeof(r->slots[i].aux);
+    msg->msg_flags = 0;
+}
+
+/* Fills the ring with as many pending datagrams as the socket has
+ * queued (but at most AVAHI_RECV_BATCH_MAX), using a single
+ * recvmmsg() call. Returns the number of datagrams fetched, which
+ * might include invalid ones, or -1 on failure. */
+static int recv_ring_fill(int fd, AvahiRecvRing *r, socklen_t sa_len, struct msghdr **ret_msgs, size_t *ret_lengths) {
+    unsigned i;
+    int n;
+
+    assert(fd >= 0);
+    assert(r);
+
+    recv_ring_reset(r);
+
+#ifdef HAVE_RECVMMSG
+    for (i = 0; i < AVAHI_RECV_BATCH_MAX; i++)
+        recv_ring_prepare_msg(r, i, &r->msgs[i].msg_hdr, sa_len);
+
+    for (;;) {
+        if ((n = recvmmsg(fd, r->msgs, AVAHI_RECV_BATCH_MAX, MSG_DONTWAIT, NULL)) >= 0)
+            break;
+
+        if (errno == EINTR)
+            continue;
+
+        /* Linux returns EAGAIN when an invalid IP packet has been
+        received. We suppress warnings in this case because this might
+        create quite a bit of log traffic on machines with unstable
+        links. (See #60) */
+
+        if (errno != EAGAIN)
+            avahi_log_warn("recvmmsg(): %s", strerror(errno));
+
+        return -1;
+    }
+
+    for (i = 0; i < (unsigned) n; i++) {
+        ret_msgs[i] = &r->msgs[i].msg_hdr;
+        ret_lengths[i] = r->msgs[i].msg_len;
+    }
+#else
+    {
+        ssize_t l;
+
+        /* Without recvmmsg() we fall back to one datagram per wakeup,
+         * but still receive into the preallocated ring */
+        recv_ring_prepare_msg(r, 0, &r->msg, sa_len);
+
+        if ((l = recvmsg(fd, &r->msg, 0)) < 0) {
+            if (errno != EAGAIN)
+                avahi_log_warn("recvmsg(): %s", strerror(errno));
+
+            return -1;
+        }
+
+        ret_msgs[0] = &r->msg;
+        ret_lengths[0] = (size_t) l;
+        n = 1;
+    }
+#endif
+
+    r->n_packets = (unsigned) n;
+
+    for (i = 0; i < r->n_packets; i++) {
+        AvahiDnsPacket *p = &r->slots[i].packet;
+
+        p->size = p->rindex = AVAHI_DNS_PACKET_HEADER_SIZE;
+        p->res_size = 0;
+        p->name_table = NULL;
+    }
+
+    return n;
+}
+
+static int recv_ring_check_msg(struct msghdr *msg, size_t l) {
+    assert(msg);
+
+    /* Corrupt packets are reported with zero size (See rhbz #607297) */
+    if (!l)
+        return -1;
+
+    if (msg->msg_flags & MSG_TRUNC) {
+        avahi_log_debug("Dropping oversized packet.");
+        return -1;
+    }
+
+    /* Without all of its ancillary data we can't tell where the
+     * packet came in, so drop just this one */
+    if (msg->msg_flags & MSG_CTRUNC) {
+        avahi_log_warn("Dropping packet with truncated ancillary data.");
+        return -1;
+    }
+
+    return 0;
+}
+
+int avahi_recv_dns_packets_ipv4(int fd, AvahiRecvRing *r) {
+    struct msghdr *msgs[AVAHI_RECV_BATCH_MAX];
+    size_t lengths[AVAHI_RECV_BATCH_MAX];
+    unsigned i;
+    int n;
+
+    assert(fd >= 0);
+    assert(r);
+
+    if ((n = recv_ring_fill(fd, r, sizeof(struct sockaddr_in), msgs, lengths)) <= 0)
+        return n;
+
+    for (i = 0; i < (unsigned) n; i++) {
+        struct sockaddr_in *sa = &r->slots[i].sa.in;
+        int found_addr;
+
+        if (recv_ring_check_msg(msgs[i], lengths[i]) < 0)
+            continue;
+
+        if (sa->sin_addr.s_addr == INADDR_ANY)
+            /* Linux 2.4 behaves very strangely sometimes! */
+            continue;
+
+        r->slots[i].packet.size = lengths[i];
+
+        r->slots[i].src_address.proto = r->slots[i].dst_address.proto = AVAHI_PROTO_INET;
+        r->slots[i].src_port = avahi_port_from_sockaddr((struct sockaddr*) sa);
+        avahi_address_from_sockaddr((struct sockaddr*) sa, &r->slots[i].src_address);
+
+        found_addr = parse_cmsg_ipv4(msgs[i], &r->slots[i].dst_address.data.ipv4, &r->slots[i].iface, &r->slots[i].ttl);
+        assert(found_addr);
+
+        r->slots[i].valid = 1;
+    }
+
+    return n;
+}
+
+int avahi_recv_dns_packets_ipv6(int fd, AvahiRecvRing *r) {
+    struct msghdr *msgs[AVAHI_RECV_BATCH_MAX];
+    size_t lengths[AVAHI_RECV_BATCH_MAX];
+    unsigned i;
+    int n;
+
+    assert(fd >= 0);
+    assert(r);
+
+    if ((n = recv_ring_fill(fd, r, sizeof(struct sockaddr_in6), msgs, lengths)) <= 0)
+        return n;
+
+    for (i = 0; i < (unsigned) n; i++) {
+        struct sockaddr_in6 *sa = &r->slots[i].sa.in6;
+        int found_ttl, found_iface;
+
+        if (recv_ring_check_msg(msgs[i], lengths[i]) < 0)
+            continue;
+
+        r->slots[i].packet.size = lengths[i];
+
+        r->slots[i].src_address.proto = r->slots[i].dst_address.proto = AVAHI_PROTO_INET6;
+        r->slots[i].src_port = avahi_port_from_sockaddr((struct sockaddr*) sa);
+        avahi_address_from_sockaddr((struct sockaddr*) sa, &r->slots[i].src_address);
+
+        r->slots[i].iface = AVAHI_IF_UNSPEC;
+        parse_cmsg_ipv6(msgs[i], &r->slots[i].dst_address.data.ipv6, &r->slots[i].iface, &r->slots[i].ttl, &found_iface, &found_ttl);
+        assert(found_iface);
+        assert(found_ttl);
+
+        r->slots[i].valid = 1;
+    }
+
+    return n;
+}
+
+AvahiDnsPacket* avahi_recv_ring_get(
+        AvahiRecvRing *r,
+        unsigned idx,
+        AvahiAddress *ret_src_address,
+        uint16_t *ret_src_port,
+        AvahiAddress *ret_dst_address,
+        AvahiIfIndex *ret_iface,
+        uint8_t *ret_ttl) {
+
+    assert(r);
+    assert(idx < r->n_packets);
+
+    if (!r->slots[idx].valid)
+        return NULL;
+
+    if (ret_src_address)
+        *ret_src_address = r->slots[idx].src_address;
+    if (ret_src_port)
+        *ret_src_port = r->slots[idx].src_port;
+    if (ret_dst_address)
+        *ret_dst_address = r->slots[idx].dst_address;
+    if (ret_iface)
+        *ret_iface = r->slots[idx].iface;
+    if (ret_ttl)
+        *ret_ttl = r->slots[idx].ttl;
+
+    return &r->slots[idx].packet;
+}
+
 int avahi_open_unicast_socket_ipv4(void) {
     struct sockaddr_in local;
     int fd = -1;
@@ -948,6 +1565,68 @@ fail:
     return -1;
 }
 
+static int connect_tcp(int family, const struct sockaddr *sa, socklen_t sa_len) {
+    int fd;
+
+    if ((fd = socket(family, SOCK_STREAM, 0)) < 0) {
+        avahi_log_warn("socket() failed: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (avahi_set_cloexec(fd) < 0) {
+        avahi_log_warn("FD_CLOEXEC failed: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (avahi_set_nonblock(fd) < 0) {
+        avahi_log_warn("O_NONBLOCK failed: %s", strerror(errno));
+        goto fail;
+    }
+
+#ifdef SO_NOSIGPIPE
+    {
+        int yes = 1;
+
+        /* For systems without MSG_NOSIGNAL */
+        if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes)) < 0) {
+            avahi_log_warn("SO_NOSIGPIPE failed: %s", strerror(errno));
+            goto fail;
+        }
+    }
+#endif
+
+    if (connect(fd, sa, sa_len) < 0 && errno != EINPROGRESS) {
+        avahi_log_warn("connect() failed: %s", strerror(errno));
+        goto fail;
+    }
+
+    return fd;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+
+    return -1;
+}
+
+int avahi_open_tcp_socket_ipv4(const AvahiIPv4Address *dst_address, uint16_t dst_port) {
+    struct sockaddr_in sa;
+
+    assert(dst_address);
+
+    ipv4_address_to_sockaddr(&sa, dst_address, dst_port);
+    return connect_tcp(AF_INET, (struct sockaddr*) &sa, sizeof(sa));
+}
+
+int avahi_open_tcp_socket_ipv6(const AvahiIPv6Address *dst_address, uint16_t dst_port) {
+    struct sockaddr_in6 sa;
+
+    assert(dst_address);
+
+    ipv6_address_to_sockaddr(&sa, dst_address, dst_port);
+    return connect_tcp(AF_INET6, (struct sockaddr*) &sa, sizeof(sa));
+}
+
 int avahi_open_unicast_socket_ipv6(void) {
     struct sockaddr_in6 local;
     int fd = -1, yes;
@@ -22,6 +22,8 @@
 
 #include <inttypes.h>
 
+#include <avahi-common/watch.h>
+
 #include "dns.h"
 
 #define AVAHI_MDNS_PORT 5353
@@ -35,12 +37,56 @@ int avahi_open_socket_ipv6(int no_reuse);
 int avahi_open_unicast_socket_ipv4(void);
 int avahi_open_unicast_socket_ipv6(void);
 
+/* Start a non-blocking TCP connection to the specified DNS server. The
+ * socket becomes writable once the connection is established or has
+ * failed, check SO_ERROR then. */
+int avahi_open_tcp_socket_ipv4(const AvahiIPv4Address *dst_address, uint16_t dst_port);
+int avahi_open_tcp_socket_ipv6(const AvahiIPv6Address *dst_address, uint16_t dst_port);
+
 int avahi_send_dns_packet_ipv4(int fd, AvahiIfIndex iface, AvahiDnsPacket *p, const AvahiIPv4Address *src_address, const AvahiIPv4Address *dst_address, uint16_t dst_port);
 int avahi_send_dns_packet_ipv6(int fd, AvahiIfIndex iface, AvahiDnsPacket *p, const AvahiIPv6Address *src_address, const AvahiIPv6Address *dst_address, uint16_t dst_port);
 
 AvahiDnsPacket *avahi_recv_dns_packet_ipv4(int fd, AvahiIPv4Address *ret_src_address, uint16_t *ret_src_port, AvahiIPv4Address *ret_dst_address, AvahiIfIndex *ret_iface, uint8_t *ret_ttl);
 AvahiDnsPacket *avahi_recv_dns_packet_ipv6(int fd, AvahiIPv6Address *ret_src_address, uint16_t *ret_src_port, AvahiIPv6Address *ret_dst_address, AvahiIfIndex *ret_iface, uint8_t *ret_ttl);
 
+/** Maximum number of datagrams handed to a single sendmmsg() call */
+#define AVAHI_SEND_BATCH_MAX 32
+
+typedef struct AvahiSendQueue AvahiSendQueue;
+
+/* An outgoing packet queue bound to one socket. Pushed packets are
+ * copied and sent in one go with sendmmsg() in the next main loop
+ * iteration, or as soon as the queue is full. Where sendmmsg() or
+ * IP_PKTINFO is not available packets are sent immediately. */
+AvahiSendQueue* avahi_send_queue_new(const AvahiPoll *poll_api, int fd);
+void avahi_send_queue_free(AvahiSendQueue *q);
+
+int avahi_send_queue_push_ipv4(AvahiSendQueue *q, AvahiIfIndex iface, AvahiDnsPacket *p, const AvahiIPv4Address *src_address, const AvahiIPv4Address *dst_address, uint16_t dst_port);
+int avahi_send_queue_push_ipv6(AvahiSendQueue *q, AvahiIfIndex iface, AvahiDnsPacket *p, const AvahiIPv6Address *src_address, const AvahiIPv6Address *dst_address, uint16_t dst_port);
+
+void avahi_send_queue_flush(AvahiSendQueue *q);
+
+/** Maximum number of datagrams fetched per avahi_recv_dns_packets_ipv4/6() call */
+#define AVAHI_RECV_BATCH_MAX 16
+
+/** Size of each preallocated receive buffer. RFC 6762 limits mDNS
+ * packets to 9000 bytes including IP and UDP headers. */
+#define AVAHI_RECV_PACKET_SIZE_MAX 9000
+
+typedef struct AvahiRecvRing AvahiRecvRing;
+
+AvahiRecvRing* avahi_recv_ring_new(void);
+void avahi_recv_ring_free(AvahiRecvRing *r);
+
+/* Receive up to AVAHI_RECV_BATCH_MAX datagrams into the ring. Returns
+ * the number of ring slots filled, or -1 on failure. The packets stay
+ * valid until the next call on the same ring. */
+int avahi_recv_dns_packets_ipv4(int fd, AvahiRecvRing *r);
+int avahi_recv_dns_packets_ipv6(int fd, AvahiRecvRing *r);
+
+/* Returns NULL if the datagram in slot idx was invalid and has to be skipped */
+AvahiDnsPacket* avahi_recv_ring_get(AvahiRecvRing *r, unsigned idx, AvahiAddress *ret_src_address, uint16_t *ret_src_port, AvahiAddress *ret_dst_address, AvahiIfIndex *ret_iface, uint8_t *ret_ttl);
+
 int avahi_mdns_mcast_join_ipv4(int fd, const AvahiIPv4Address *local_address, int iface, int join);
 int avahi_mdns_mcast_join_ipv6(int fd, const AvahiIPv6Address *local_address, int iface, int join);
 
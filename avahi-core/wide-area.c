@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
 
 #include <avahi-common/malloc.h>
 #include <avahi-common/error.h>
@@ -40,14 +41,62 @@
 #include "addr-util.h"
 #include "rr-util.h"
 
-#define CACHE_ENTRIES_MAX 500
+/* Upper limit for the TTL of cached negative answers, as suggested by
+ * RFC 2308, section 5 */
+#define NEGATIVE_TTL_MAX (3*60*60)
+
+/* Retransmission timeout bounds for a DNS server, see RFC 6298. The
+ * initial value matches the first retransmit we always used to do.
+ * The minimum keeps a lookup with three rounds alive for at least as
+ * long as the 2.5s it used to take before failing. */
+#define RTO_INITIAL (500*1000)
+#define RTO_MIN (1000*1000)
+#define RTO_MAX (4*1000*1000)
+
+/* The UDP payload size we advertise with EDNS0. Answers bigger than
+ * this are truncated by the server and fetched again over TCP. */
+#define EDNS0_UDP_PAYLOAD 1232
+
+#define TCP_TIMEOUT_MSEC 5000
+#define TCP_IDLE_MSEC 10000
+
+/* Answers taken off a connection in one go before they are handled */
+#define TCP_READ_PACKETS_MAX 16
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 /* SO_NOSIGPIPE is set on the socket instead */
+#endif
+
+typedef struct AvahiWideAreaTcpConnection AvahiWideAreaTcpConnection;
+
+typedef struct AvahiWideAreaDnsServer {
+    AvahiAddress address;
+
+    /* Set once the server rejected a query with an OPT record */
+    int no_edns0;
+
+    /* Open connection for queries whose answers did not fit in a
+     * datagram, if any */
+    AvahiWideAreaTcpConnection *tcp;
+
+    /* Smoothed round trip time, its variation and the resulting
+     * retransmission timeout. srtt is 0 until the first sample. */
+    AvahiUsec srtt, rttvar, rto;
+
+    unsigned n_queries, n_responses, n_timeouts;
+} AvahiWideAreaDnsServer;
 
 typedef struct AvahiWideAreaCacheEntry AvahiWideAreaCacheEntry;
 
 struct AvahiWideAreaCacheEntry {
     AvahiWideAreaLookupEngine *engine;
 
+    /* For negative entries record is NULL and error is the error the
+     * server answered with for key */
+    AvahiKey *key;
     AvahiRecord *record;
+    int error;
+
     struct timeval timestamp;
     struct timeval expiry;
 
@@ -67,15 +116,56 @@ struct AvahiWideAreaLookup {
     AvahiKey *key, *cname_key;
 
     int n_send;
-    AvahiDnsPacket *packet;
+
+    /* The query with an EDNS0 OPT record, and the same without for
+     * servers that don't do EDNS0, created when first needed */
+    AvahiDnsPacket *packet, *packet_no_edns0;
+    size_t packet_no_edns0_size;
+
+    /* Index of the server plus one while we wait for an answer over
+     * TCP, 0 otherwise */
+    unsigned tcp;
 
     AvahiWideAreaLookupCallback callback;
     void *userdata;
 
-    AvahiAddress dns_server_used;
+    /* Per DNS server: how often we sent the query there, when we did
+     * so last and whether it was part of the latest round */
+    unsigned n_sent_to[AVAHI_WIDE_AREA_SERVERS_MAX];
+    struct timeval sent[AVAHI_WIDE_AREA_SERVERS_MAX];
+    unsigned round;
+
+    /* Set while we wait for the answer to a query for the same key
+     * another lookup has sent */
+    int waiting;
+
+    /* The error to report for a cached negative answer */
+    int error;
 
     AVAHI_LLIST_FIELDS(AvahiWideAreaLookup, lookups);
     AVAHI_LLIST_FIELDS(AvahiWideAreaLookup, by_key);
+    AVAHI_LLIST_FIELDS(AvahiWideAreaLookup, by_cname_key);
+};
+
+struct AvahiWideAreaTcpConnection {
+    AvahiWideAreaLookupEngine *engine;
+    unsigned server;
+
+    int fd;
+    AvahiWatch *watch;
+    int connected;
+
+    /* Queries not written yet, each prefixed by its length. Queries
+     * are pipelined, answers are matched by their ID. */
+    uint8_t *obuf;
+    size_t o_len, o_allocated;
+
+    /* The answer we are reading */
+    uint8_t ilen[2];
+    size_t i_len, i_got;
+    AvahiDnsPacket *ipacket;
+
+    AvahiTimeEvent *idle_event;
 };
 
 struct AvahiWideAreaLookupEngine {
@@ -86,21 +176,23 @@ struct AvahiWideAreaLookupEngine {
 
     uint16_t next_id;
 
-    /* Cache */
+    /* Cache, most recently used entries first */
     AVAHI_LLIST_HEAD(AvahiWideAreaCacheEntry, cache);
+    AvahiWideAreaCacheEntry *cache_tail;
     AvahiHashmap *cache_by_key;
+    AvahiHashmap *negative_by_key;
     unsigned cache_n_entries;
 
     /* Lookups */
     AVAHI_LLIST_HEAD(AvahiWideAreaLookup, lookups);
     AvahiHashmap *lookups_by_id;
     AvahiHashmap *lookups_by_key;
+    AvahiHashmap *lookups_by_cname_key;
 
     int cleanup_dead;
 
-    AvahiAddress dns_servers[AVAHI_WIDE_AREA_SERVERS_MAX];
+    AvahiWideAreaDnsServer dns_servers[AVAHI_WIDE_AREA_SERVERS_MAX];
     unsigned n_dns_servers;
-    unsigned current_dns_server;
 };
 
 static AvahiWideAreaLookup* find_lookup(AvahiWideAreaLookupEngine *e, uint16_t id) {
@@ -120,19 +212,14 @@ static AvahiWideAreaLookup* find_lookup(AvahiWideAreaLookupEngine *e, uint16_t i
     return l;
 }
 
-static int send_to_dns_server(AvahiWideAreaLookup *l, AvahiDnsPacket *p) {
+static int send_to_dns_server(AvahiWideAreaLookup *l, AvahiDnsPacket *p, unsigned idx) {
     AvahiAddress *a;
 
     assert(l);
     assert(p);
+    assert(idx < l->engine->n_dns_servers);
 
-    if (l->engine->n_dns_servers <= 0)
-        return -1;
-
-    assert(l->engine->current_dns_server < l->engine->n_dns_servers);
-
-    a = &l->engine->dns_servers[l->engine->current_dns_server];
-    l->dns_server_used = *a;
+    a = &l->engine->dns_servers[idx].address;
 
     if (a->proto == AVAHI_PROTO_INET) {
 
@@ -151,13 +238,95 @@ static int send_to_dns_server(AvahiWideAreaLookup *l, AvahiDnsPacket *p) {
     }
 }
 
-static void next_dns_server(AvahiWideAreaLookupEngine *e) {
-    assert(e);
+static AvahiDnsPacket *packet_for_server(AvahiWideAreaLookup *l, unsigned idx) {
+    assert(l);
+    assert(idx < l->engine->n_dns_servers);
+
+    if (!l->engine->dns_servers[idx].no_edns0)
+        return l->packet;
 
-    e->current_dns_server++;
+    if (!l->packet_no_edns0) {
 
-    if (e->current_dns_server >= e->n_dns_servers)
-        e->current_dns_server = 0;
+        /* Same query, just cut off before the OPT record */
+        if (!(l->packet_no_edns0 = avahi_dns_packet_new(0)))
+            return NULL;
+
+        l->packet_no_edns0->size = 0;
+        avahi_dns_packet_append_bytes(l->packet_no_edns0, AVAHI_DNS_PACKET_DATA(l->packet), l->packet_no_edns0_size);
+        avahi_dns_packet_set_field(l->packet_no_edns0, AVAHI_DNS_FIELD_ARCOUNT, 0);
+    }
+
+    return l->packet_no_edns0;
+}
+
+/* Send the query to the servers with the lowest retransmission timeout,
+ * as many as we are configured to race. Returns the timeout to wait for
+ * an answer before trying again, or 0 if nothing could be sent. */
+static AvahiUsec send_query(AvahiWideAreaLookup *l) {
+    AvahiWideAreaLookupEngine *e;
+    unsigned n_parallel, n = 0, tried = 0;
+    AvahiUsec timeout = 0;
+    AvahiDnsPacket *p;
+
+    assert(l);
+    e = l->engine;
+
+    if ((n_parallel = e->server->config.n_wide_area_parallel_queries) < 1)
+        n_parallel = 1;
+
+    l->round = 0;
+
+    while (n < n_parallel) {
+        unsigned i, best = e->n_dns_servers;
+
+        for (i = 0; i < e->n_dns_servers; i++)
+            if (!(tried & (1U << i)) && (best >= e->n_dns_servers || e->dns_servers[i].rto < e->dns_servers[best].rto))
+                best = i;
+
+        if (best >= e->n_dns_servers)
+            break;
+
+        tried |= 1U << best;
+        n++;
+
+        if (!(p = packet_for_server(l, best)) || send_to_dns_server(l, p, best) < 0)
+            continue;
+
+        l->round |= 1U << best;
+        e->dns_servers[best].n_queries++;
+        l->n_sent_to[best]++;
+        gettimeofday(&l->sent[best], NULL);
+
+        if (!timeout || e->dns_servers[best].rto < timeout)
+            timeout = e->dns_servers[best].rto;
+    }
+
+    return timeout;
+}
+
+static void update_rtt(AvahiWideAreaDnsServer *d, AvahiUsec rtt) {
+    AvahiUsec delta;
+
+    assert(d);
+
+    if (!d->srtt) {
+        d->srtt = rtt > 0 ? rtt : 1;
+        d->rttvar = rtt / 2;
+    } else {
+        delta = d->srtt > rtt ? d->srtt - rtt : rtt - d->srtt;
+        d->rttvar = (3 * d->rttvar + delta) / 4;
+        d->srtt = (7 * d->srtt + rtt) / 8;
+
+        if (!d->srtt)
+            d->srtt = 1;
+    }
+
+    d->rto = d->srtt + 4 * d->rttvar;
+
+    if (d->rto < RTO_MIN)
+        d->rto = RTO_MIN;
+    else if (d->rto > RTO_MAX)
+        d->rto = RTO_MAX;
 }
 
 static void lookup_stop(AvahiWideAreaLookup *l) {
@@ -171,34 +340,122 @@ static void lookup_stop(AvahiWideAreaLookup *l) {
     }
 }
 
+/* Report the final event of a query to the lookup that sent it and to
+ * all lookups waiting for its answer */
+static void finish_lookup(AvahiWideAreaLookup *l, AvahiBrowserEvent event, AvahiLookupResultFlags flags) {
+    AvahiWideAreaLookup *w;
+
+    assert(l);
+
+    if (l->callback)
+        l->callback(l->engine, event, flags, NULL, l->userdata);
+
+    lookup_stop(l);
+
+    for (w = avahi_hashmap_lookup(l->engine->lookups_by_key, l->key); w; w = w->by_key_next) {
+        if (!w->waiting || w->dead)
+            continue;
+
+        w->waiting = 0;
+
+        if (w->callback)
+            w->callback(w->engine, event, flags, NULL, w->userdata);
+
+        lookup_stop(w);
+    }
+}
+
 static void sender_timeout_callback(AvahiTimeEvent *e, void *userdata) {
     AvahiWideAreaLookup *l = userdata;
+    AvahiWideAreaLookupEngine *engine;
+    AvahiUsec timeout;
     struct timeval tv;
+    unsigned i;
 
     assert(l);
+    engine = l->engine;
 
-    /* Try another DNS server after three retries */
-    if (l->n_send >= 3 && avahi_address_cmp(&l->engine->dns_servers[l->engine->current_dns_server], &l->dns_server_used) == 0) {
-        next_dns_server(l->engine);
+    /* If we were waiting for a TCP answer we go back to datagrams for
+     * the next round */
+    l->tcp = 0;
 
-        if (avahi_address_cmp(&l->engine->dns_servers[l->engine->current_dns_server], &l->dns_server_used) == 0)
-            /* There is no other DNS server, fail */
-            l->n_send = 1000;
-    }
+    /* None of the servers we asked in the last round answered in
+     * time, so back off on them */
+    for (i = 0; i < engine->n_dns_servers; i++)
+        if (l->round & (1U << i)) {
+            AvahiWideAreaDnsServer *d = &engine->dns_servers[i];
 
-    if (l->n_send >= 6) {
+            d->n_timeouts++;
+            d->rto = d->rto >= RTO_MAX/2 ? RTO_MAX : d->rto * 2;
+        }
+
+    /* Give up after three rounds, or after six if there are servers
+     * left we have not raced yet */
+    if (l->n_send >= (engine->n_dns_servers > engine->server->config.n_wide_area_parallel_queries ? 6 : 3) ||
+        !(timeout = send_query(l))) {
         avahi_log_warn(__FILE__": Query timed out.");
-        avahi_server_set_errno(l->engine->server, AVAHI_ERR_TIMEOUT);
-        l->callback(l->engine, AVAHI_BROWSER_FAILURE, AVAHI_LOOKUP_RESULT_WIDE_AREA, NULL, l->userdata);
-        lookup_stop(l);
+        avahi_server_set_errno(engine->server, AVAHI_ERR_TIMEOUT);
+        finish_lookup(l, AVAHI_BROWSER_FAILURE, AVAHI_LOOKUP_RESULT_WIDE_AREA);
         return;
     }
 
-    assert(l->packet);
-    send_to_dns_server(l, l->packet);
     l->n_send++;
 
-    avahi_time_event_update(e, avahi_elapse_time(&tv, 1000, 0));
+    avahi_time_event_update(e, avahi_elapse_time(&tv, (unsigned) (timeout / 1000), 0));
+}
+
+static void negative_callback(AvahiTimeEvent *e, void *userdata) {
+    AvahiWideAreaLookup *l = userdata;
+
+    assert(e);
+    assert(l);
+
+    avahi_server_set_errno(l->engine->server, l->error);
+    l->callback(l->engine, AVAHI_BROWSER_FAILURE, AVAHI_LOOKUP_RESULT_WIDE_AREA|AVAHI_LOOKUP_RESULT_CACHED, NULL, l->userdata);
+    lookup_stop(l);
+}
+
+/* Whether the lookup has a query out, or is about to send one. Those
+ * that answer from the negative cache just wait for the main loop. */
+static int is_querying(AvahiWideAreaLookup *l) {
+    assert(l);
+
+    return !l->dead && l->time_event && l->error == AVAHI_OK;
+}
+
+static AvahiWideAreaLookup* find_query(AvahiWideAreaLookupEngine *e, AvahiKey *key) {
+    AvahiWideAreaLookup *l;
+
+    assert(e);
+    assert(key);
+
+    for (l = avahi_hashmap_lookup(e->lookups_by_key, key); l; l = l->by_key_next)
+        if (is_querying(l))
+            return l;
+
+    return NULL;
+}
+
+/* Append an OPT pseudo record to tell the server about the answer
+ * size we can take, see RFC 6891 */
+static uint8_t *append_opt_record(AvahiDnsPacket *p) {
+    uint8_t *d;
+
+    assert(p);
+
+    /* The record is owned by the root domain */
+    if (!(d = avahi_dns_packet_extend(p, 1)))
+        return NULL;
+
+    *d = 0;
+
+    if (!avahi_dns_packet_append_uint16(p, AVAHI_DNS_TYPE_OPT) ||
+        !avahi_dns_packet_append_uint16(p, EDNS0_UDP_PAYLOAD) ||
+        !avahi_dns_packet_append_uint32(p, 0) ||
+        !avahi_dns_packet_append_uint16(p, 0))
+        return NULL;
+
+    return d;
 }
 
 AvahiWideAreaLookup *avahi_wide_area_lookup_new(
@@ -209,6 +466,7 @@ AvahiWideAreaLookup *avahi_wide_area_lookup_new(
 
     struct timeval tv;
     AvahiWideAreaLookup *l, *t;
+    AvahiWideAreaCacheEntry *c;
     uint8_t *p;
 
     assert(e);
@@ -223,6 +481,13 @@ AvahiWideAreaLookup *avahi_wide_area_lookup_new(
     l->cname_key = avahi_key_new_cname(l->key);
     l->callback = callback;
     l->userdata = userdata;
+    l->time_event = NULL;
+    l->n_send = 0;
+    l->waiting = 0;
+    l->error = AVAHI_OK;
+    l->round = 0;
+    l->tcp = 0;
+    memset(l->n_sent_to, 0, sizeof(l->n_sent_to));
 
     /* If more than 65K wide area quries are issued simultaneously,
      * this will break. This should be limited by some higher level */
@@ -244,19 +509,44 @@ AvahiWideAreaLookup *avahi_wide_area_lookup_new(
 
     avahi_dns_packet_set_field(l->packet, AVAHI_DNS_FIELD_QDCOUNT, 1);
 
-    if (send_to_dns_server(l, l->packet) < 0) {
-        avahi_log_error(__FILE__": Failed to send packet.");
-        avahi_dns_packet_free(l->packet);
-        avahi_key_unref(l->key);
-        if (l->cname_key)
-            avahi_key_unref(l->cname_key);
-        avahi_free(l);
-        return NULL;
-    }
+    l->packet_no_edns0 = NULL;
+    l->packet_no_edns0_size = l->packet->size;
+
+    p = append_opt_record(l->packet);
+    assert(p);
+
+    avahi_dns_packet_set_field(l->packet, AVAHI_DNS_FIELD_ARCOUNT, 1);
+
+    if ((c = avahi_hashmap_lookup(e->negative_by_key, key))) {
+
+        /* We know already that there is nothing, report that from the
+         * main loop */
+        l->error = c->error;
+        l->time_event = avahi_time_event_new(e->server->time_event_queue, avahi_elapse_time(&tv, 0, 0), negative_callback, l);
+
+    } else if (find_query(e, key))
+
+        /* Another lookup asked the same question already, let's wait
+         * for its answer instead of asking again */
+        l->waiting = 1;
 
-    l->n_send = 1;
+    else {
+        AvahiUsec timeout;
+
+        if (!(timeout = send_query(l))) {
+            avahi_log_error(__FILE__": Failed to send packet.");
+            avahi_dns_packet_free(l->packet);
+            avahi_key_unref(l->key);
+            if (l->cname_key)
+                avahi_key_unref(l->cname_key);
+            avahi_free(l);
+            return NULL;
+        }
+
+        l->n_send = 1;
 
-    l->time_event = avahi_time_event_new(e->server->time_event_queue, avahi_elapse_time(&tv, 500, 0), sender_timeout_callback, l);
+        l->time_event = avahi_time_event_new(e->server->time_event_queue, avahi_elapse_time(&tv, (unsigned) (timeout / 1000), 0), sender_timeout_callback, l);
+    }
 
     avahi_hashmap_insert(e->lookups_by_id, &l->id, l);
 
@@ -264,6 +554,12 @@ AvahiWideAreaLookup *avahi_wide_area_lookup_new(
     AVAHI_LLIST_PREPEND(AvahiWideAreaLookup, by_key, t, l);
     avahi_hashmap_replace(e->lookups_by_key, avahi_key_ref(l->key), t);
 
+    if (l->cname_key) {
+        t = avahi_hashmap_lookup(e->lookups_by_cname_key, l->cname_key);
+        AVAHI_LLIST_PREPEND(AvahiWideAreaLookup, by_cname_key, t, l);
+        avahi_hashmap_replace(e->lookups_by_cname_key, avahi_key_ref(l->cname_key), t);
+    }
+
     AVAHI_LLIST_PREPEND(AvahiWideAreaLookup, lookups, e->lookups, l);
 
     return l;
@@ -282,11 +578,23 @@ static void lookup_destroy(AvahiWideAreaLookup *l) {
     else
         avahi_hashmap_remove(l->engine->lookups_by_key, l->key);
 
+    if (l->cname_key) {
+        t = avahi_hashmap_lookup(l->engine->lookups_by_cname_key, l->cname_key);
+        AVAHI_LLIST_REMOVE(AvahiWideAreaLookup, by_cname_key, t, l);
+        if (t)
+            avahi_hashmap_replace(l->engine->lookups_by_cname_key, avahi_key_ref(l->cname_key), t);
+        else
+            avahi_hashmap_remove(l->engine->lookups_by_cname_key, l->cname_key);
+    }
+
     AVAHI_LLIST_REMOVE(AvahiWideAreaLookup, lookups, l->engine->lookups, l);
 
     avahi_hashmap_remove(l->engine->lookups_by_id, &l->id);
     avahi_dns_packet_free(l->packet);
 
+    if (l->packet_no_edns0)
+        avahi_dns_packet_free(l->packet_no_edns0);
+
     if (l->key)
         avahi_key_unref(l->key);
 
@@ -296,15 +604,78 @@ static void lookup_destroy(AvahiWideAreaLookup *l) {
     avahi_free(l);
 }
 
+/* Make w responsible for the query l has sent. The two swap their IDs,
+ * so that the response to the query in flight is accepted by w */
+static void take_over_query(AvahiWideAreaLookup *w, AvahiWideAreaLookup *l) {
+    AvahiWideAreaLookupEngine *e;
+    AvahiUsec timeout = RTO_INITIAL;
+    struct timeval tv;
+    uint32_t id;
+    unsigned i;
+
+    assert(w);
+    assert(l);
+    assert(w->waiting);
+
+    e = l->engine;
+
+    avahi_hashmap_remove(e->lookups_by_id, &l->id);
+    avahi_hashmap_remove(e->lookups_by_id, &w->id);
+
+    id = l->id;
+    l->id = w->id;
+    w->id = id;
+
+    avahi_dns_packet_set_field(l->packet, AVAHI_DNS_FIELD_ID, (uint16_t) l->id);
+    avahi_dns_packet_set_field(w->packet, AVAHI_DNS_FIELD_ID, (uint16_t) w->id);
+
+    if (l->packet_no_edns0)
+        avahi_dns_packet_set_field(l->packet_no_edns0, AVAHI_DNS_FIELD_ID, (uint16_t) l->id);
+
+    if (w->packet_no_edns0)
+        avahi_dns_packet_set_field(w->packet_no_edns0, AVAHI_DNS_FIELD_ID, (uint16_t) w->id);
+
+    avahi_hashmap_insert(e->lookups_by_id, &l->id, l);
+    avahi_hashmap_insert(e->lookups_by_id, &w->id, w);
+
+    w->waiting = 0;
+    w->n_send = l->n_send;
+    w->round = l->round;
+    w->tcp = l->tcp;
+    memcpy(w->n_sent_to, l->n_sent_to, sizeof(w->n_sent_to));
+    memcpy(w->sent, l->sent, sizeof(w->sent));
+
+    for (i = 0; i < e->n_dns_servers; i++)
+        if ((w->round & (1U << i)) && e->dns_servers[i].rto < timeout)
+            timeout = e->dns_servers[i].rto;
+
+    w->time_event = avahi_time_event_new(e->server->time_event_queue, avahi_elapse_time(&tv, (unsigned) (timeout / 1000), 0), sender_timeout_callback, w);
+}
+
 void avahi_wide_area_lookup_free(AvahiWideAreaLookup *l) {
+    int querying;
+
     assert(l);
 
     if (l->dead)
         return;
 
+    querying = is_querying(l);
+
     l->dead = 1;
     l->engine->cleanup_dead = 1;
     lookup_stop(l);
+
+    if (querying) {
+        AvahiWideAreaLookup *w;
+
+        /* Hand the query over to a lookup waiting for its answer */
+        for (w = avahi_hashmap_lookup(l->engine->lookups_by_key, l->key); w; w = w->by_key_next)
+            if (w->waiting && !w->dead) {
+                take_over_query(w, l);
+                break;
+            }
+    }
 }
 
 void avahi_wide_area_cleanup(AvahiWideAreaLookupEngine *e) {
@@ -330,21 +701,77 @@ static void cache_entry_free(AvahiWideAreaCacheEntry *c) {
     if (c->time_event)
         avahi_time_event_free(c->time_event);
 
+    if (c->engine->cache_tail == c)
+        c->engine->cache_tail = c->cache_prev;
     AVAHI_LLIST_REMOVE(AvahiWideAreaCacheEntry, cache, c->engine->cache, c);
 
-    t = avahi_hashmap_lookup(c->engine->cache_by_key, c->record->key);
-    AVAHI_LLIST_REMOVE(AvahiWideAreaCacheEntry, by_key, t, c);
-    if (t)
-        avahi_hashmap_replace(c->engine->cache_by_key, avahi_key_ref(c->record->key), t);
-    else
-        avahi_hashmap_remove(c->engine->cache_by_key, c->record->key);
+    if (c->record) {
+        t = avahi_hashmap_lookup(c->engine->cache_by_key, c->key);
+        AVAHI_LLIST_REMOVE(AvahiWideAreaCacheEntry, by_key, t, c);
+        if (t)
+            avahi_hashmap_replace(c->engine->cache_by_key, avahi_key_ref(c->key), t);
+        else
+            avahi_hashmap_remove(c->engine->cache_by_key, c->key);
+
+        avahi_record_unref(c->record);
+    } else
+        avahi_hashmap_remove(c->engine->negative_by_key, c->key);
 
     c->engine->cache_n_entries --;
 
-    avahi_record_unref(c->record);
+    avahi_key_unref(c->key);
     avahi_free(c);
 }
 
+static void cache_entry_touch(AvahiWideAreaCacheEntry *c) {
+    AvahiWideAreaLookupEngine *e;
+
+    assert(c);
+    e = c->engine;
+
+    if (e->cache == c)
+        return;
+
+    if (e->cache_tail == c)
+        e->cache_tail = c->cache_prev;
+
+    AVAHI_LLIST_REMOVE(AvahiWideAreaCacheEntry, cache, e->cache, c);
+    AVAHI_LLIST_PREPEND(AvahiWideAreaCacheEntry, cache, e->cache, c);
+}
+
+static AvahiWideAreaCacheEntry *cache_entry_new(AvahiWideAreaLookupEngine *e, AvahiKey *key) {
+    AvahiWideAreaCacheEntry *c;
+
+    assert(e);
+    assert(key);
+
+    /* Enforce cache size by evicting the least recently used entry */
+    if (e->cache_n_entries >= e->server->config.n_wide_area_cache_entries_max) {
+        if (!e->cache_tail)
+            return NULL;
+
+        cache_entry_free(e->cache_tail);
+    }
+
+    if (!(c = avahi_new(AvahiWideAreaCacheEntry, 1)))
+        return NULL;
+
+    c->engine = e;
+    c->key = avahi_key_ref(key);
+    c->record = NULL;
+    c->error = AVAHI_OK;
+    c->time_event = NULL;
+
+    AVAHI_LLIST_PREPEND(AvahiWideAreaCacheEntry, cache, e->cache, c);
+
+    if (!e->cache_tail)
+        e->cache_tail = c;
+
+    e->cache_n_entries ++;
+
+    return c;
+}
+
 static void expiry_event(AvahiTimeEvent *te, void *userdata) {
     AvahiWideAreaCacheEntry *e = userdata;
 
@@ -381,24 +808,30 @@ static void run_callbacks(AvahiWideAreaLookupEngine *e, AvahiRecord *r) {
     }
 
     if (r->key->clazz == AVAHI_DNS_CLASS_IN && r->key->type == AVAHI_DNS_TYPE_CNAME) {
-        /* It's a CNAME record, so we have to scan the all lookups to see if one matches */
-
-        for (l = e->lookups; l; l = l->lookups_next) {
-            AvahiKey *key;
+        /* It's a CNAME record, so let's notify the lookups for its name, too */
 
+        for (l = avahi_hashmap_lookup(e->lookups_by_cname_key, r->key); l; l = l->by_cname_key_next) {
             if (l->dead || !l->callback)
                 continue;
 
-            if ((key = avahi_key_new_cname(l->key))) {
-                if (avahi_key_equal(r->key, key))
-                    l->callback(e, AVAHI_BROWSER_NEW, AVAHI_LOOKUP_RESULT_WIDE_AREA, r, l->userdata);
-
-                avahi_key_unref(key);
-            }
+            l->callback(e, AVAHI_BROWSER_NEW, AVAHI_LOOKUP_RESULT_WIDE_AREA, r, l->userdata);
         }
     }
 }
 
+static void cache_entry_set_ttl(AvahiWideAreaCacheEntry *c, uint32_t ttl) {
+    assert(c);
+
+    gettimeofday(&c->timestamp, NULL);
+    c->expiry = c->timestamp;
+    avahi_timeval_add(&c->expiry, (AvahiUsec) ttl * 1000000);
+
+    if (c->time_event)
+        avahi_time_event_update(c->time_event, &c->expiry);
+    else
+        c->time_event = avahi_time_event_new(c->engine->server->time_event_queue, &c->expiry, expiry_event, c);
+}
+
 static void add_to_cache(AvahiWideAreaLookupEngine *e, AvahiRecord *r) {
     AvahiWideAreaCacheEntry *c;
     int is_new;
@@ -406,45 +839,32 @@ static void add_to_cache(AvahiWideAreaLookupEngine *e, AvahiRecord *r) {
     assert(e);
     assert(r);
 
+    /* A cached negative answer for this key is obviously outdated */
+    if ((c = avahi_hashmap_lookup(e->negative_by_key, r->key)))
+        cache_entry_free(c);
+
     if ((c = find_record_in_cache(e, r))) {
         is_new = 0;
 
         /* Update the existing entry */
         avahi_record_unref(c->record);
+        cache_entry_touch(c);
     } else {
         AvahiWideAreaCacheEntry *t;
 
         is_new = 1;
 
-        /* Enforce cache size */
-        if (e->cache_n_entries >= CACHE_ENTRIES_MAX)
-            /* Eventually we should improve the caching algorithm here */
+        if (!(c = cache_entry_new(e, r->key)))
             goto finish;
 
-        c = avahi_new(AvahiWideAreaCacheEntry, 1);
-        c->engine = e;
-        c->time_event = NULL;
-
-        AVAHI_LLIST_PREPEND(AvahiWideAreaCacheEntry, cache, e->cache, c);
-
         /* Add the new entry to the cache entry hash table */
         t = avahi_hashmap_lookup(e->cache_by_key, r->key);
         AVAHI_LLIST_PREPEND(AvahiWideAreaCacheEntry, by_key, t, c);
         avahi_hashmap_replace(e->cache_by_key, avahi_key_ref(r->key), t);
-
-        e->cache_n_entries ++;
     }
 
     c->record = avahi_record_ref(r);
-
-    gettimeofday(&c->timestamp, NULL);
-    c->expiry = c->timestamp;
-    avahi_timeval_add(&c->expiry, r->ttl * 1000000);
-
-    if (c->time_event)
-        avahi_time_event_update(c->time_event, &c->expiry);
-    else
-        c->time_event = avahi_time_event_new(e->server->time_event_queue, &c->expiry, expiry_event, c);
+    cache_entry_set_ttl(c, r->ttl);
 
 finish:
 
@@ -452,6 +872,47 @@ finish:
         run_callbacks(e, r);
 }
 
+static void add_negative_to_cache(AvahiWideAreaLookupEngine *e, AvahiKey *key, int error, uint32_t ttl) {
+    AvahiWideAreaCacheEntry *c;
+
+    assert(e);
+    assert(key);
+
+    if ((c = avahi_hashmap_lookup(e->negative_by_key, key)))
+        cache_entry_touch(c);
+    else {
+        if (!(c = cache_entry_new(e, key)))
+            return;
+
+        avahi_hashmap_insert(e->negative_by_key, c->key, c);
+    }
+
+    c->error = error;
+    cache_entry_set_ttl(c, ttl);
+}
+
+/* Return the TTL for caching a negative answer with the specified SOA
+ * record from its authority section, see RFC 2308, section 5 */
+static uint32_t negative_ttl(AvahiRecord *soa) {
+    const uint8_t *minimum;
+    uint32_t ttl;
+
+    assert(soa);
+    assert(soa->key->type == AVAHI_DNS_TYPE_SOA);
+
+    /* The MINIMUM field concludes the SOA rdata */
+    if (soa->data.generic.size < 20)
+        return 0;
+
+    minimum = (const uint8_t*) soa->data.generic.data + soa->data.generic.size - 4;
+    ttl = ((uint32_t) minimum[0] << 24) | ((uint32_t) minimum[1] << 16) | ((uint32_t) minimum[2] << 8) | minimum[3];
+
+    if (soa->ttl < ttl)
+        ttl = soa->ttl;
+
+    return ttl < NEGATIVE_TTL_MAX ? ttl : NEGATIVE_TTL_MAX;
+}
+
 static int map_dns_error(uint16_t error) {
     static const int table[16] = {
         AVAHI_OK,
@@ -477,9 +938,290 @@ static int map_dns_error(uint16_t error) {
     return table[error];
 }
 
-static void handle_packet(AvahiWideAreaLookupEngine *e, AvahiDnsPacket *p) {
+static void handle_packet(AvahiWideAreaLookupEngine *e, AvahiDnsPacket *p, const AvahiAddress *src);
+
+static void tcp_free(AvahiWideAreaTcpConnection *c) {
+    AvahiWideAreaLookupEngine *e;
+    AvahiWideAreaLookup *l;
+    struct timeval tv;
+
+    assert(c);
+    e = c->engine;
+
+    assert(e->dns_servers[c->server].tcp == c);
+    e->dns_servers[c->server].tcp = NULL;
+
+    /* Lookups still waiting for an answer on this connection retry
+     * right away, without blaming the server for a timeout */
+    for (l = e->lookups; l; l = l->lookups_next)
+        if (l->tcp == c->server + 1 && is_querying(l)) {
+            l->tcp = 0;
+            l->round &= ~(1U << c->server);
+            avahi_time_event_update(l->time_event, avahi_elapse_time(&tv, 0, 0));
+        }
+
+    if (c->idle_event)
+        avahi_time_event_free(c->idle_event);
+
+    if (c->watch)
+        e->server->poll_api->watch_free(c->watch);
+
+    close(c->fd);
+
+    if (c->ipacket)
+        avahi_dns_packet_free(c->ipacket);
+
+    avahi_free(c->obuf);
+    avahi_free(c);
+}
+
+static void tcp_idle_callback(AvahiTimeEvent *e, void *userdata) {
+    AvahiWideAreaTcpConnection *c = userdata;
+
+    assert(e);
+    assert(c);
+
+    tcp_free(c);
+}
+
+static void tcp_touch(AvahiWideAreaTcpConnection *c) {
+    struct timeval tv;
+
+    assert(c);
+
+    /* Lookups give up on TCP long before the connection is idle for
+     * this long, so no one is waiting for it anymore by then */
+    avahi_elapse_time(&tv, TCP_IDLE_MSEC, 0);
+
+    if (c->idle_event)
+        avahi_time_event_update(c->idle_event, &tv);
+    else
+        c->idle_event = avahi_time_event_new(c->engine->server->time_event_queue, &tv, tcp_idle_callback, c);
+}
+
+static void tcp_update_watch(AvahiWideAreaTcpConnection *c) {
+    assert(c);
+
+    c->engine->server->poll_api->watch_update(c->watch, AVAHI_WATCH_IN | (!c->connected || c->o_len > 0 ? AVAHI_WATCH_OUT : 0));
+}
+
+/* Read what is available, returns -1 if the connection is gone.
+ * Complete answers are only collected in packets[] and must be handled
+ * by the caller: that may run callbacks which free the connection. */
+static int tcp_read(AvahiWideAreaTcpConnection *c, AvahiDnsPacket **packets, unsigned *n_packets) {
+    assert(c);
+    assert(packets);
+    assert(n_packets);
+
+    /* Leave the rest for the next time the socket is readable */
+    while (*n_packets < TCP_READ_PACKETS_MAX) {
+        uint8_t *d;
+        size_t n;
+        ssize_t r;
+
+        if (!c->ipacket) {
+            d = c->ilen + c->i_got;
+            n = sizeof(c->ilen) - c->i_got;
+        } else {
+            d = AVAHI_DNS_PACKET_DATA(c->ipacket) + c->i_got;
+            n = c->i_len - c->i_got;
+        }
+
+        if ((r = read(c->fd, d, n)) <= 0) {
+
+            if (r < 0 && errno == EAGAIN)
+                return 0;
+
+            if (r < 0)
+                avahi_log_warn(__FILE__": read() failed: %s", strerror(errno));
+
+            tcp_free(c);
+            return -1;
+        }
+
+        c->i_got += (size_t) r;
+        tcp_touch(c);
+
+        if (!c->ipacket) {
+
+            if (c->i_got < sizeof(c->ilen))
+                continue;
+
+            c->i_len = ((size_t) c->ilen[0] << 8) | c->ilen[1];
+
+            if (c->i_len < AVAHI_DNS_PACKET_HEADER_SIZE) {
+                avahi_log_warn(__FILE__": Ignoring invalid response for wide area stream.");
+                tcp_free(c);
+                return -1;
+            }
+
+            if (!(c->ipacket = avahi_dns_packet_new(c->i_len + AVAHI_DNS_PACKET_EXTRA_SIZE))) {
+                tcp_free(c);
+                return -1;
+            }
+
+            c->i_got = 0;
+
+        } else if (c->i_got >= c->i_len) {
+            c->ipacket->size = c->i_len;
+            packets[(*n_packets)++] = c->ipacket;
+            c->ipacket = NULL;
+            c->i_got = 0;
+        }
+    }
+
+    return 0;
+}
+
+static void tcp_event(AvahiWatch *w, int fd, AvahiWatchEvent events, void *userdata) {
+    AvahiWideAreaTcpConnection *c = userdata;
+    AvahiWideAreaLookupEngine *e;
+    AvahiDnsPacket *packets[TCP_READ_PACKETS_MAX];
+    AvahiAddress src;
+    unsigned n_packets = 0, i;
+
+    assert(w);
+    assert(c);
+    assert(fd == c->fd);
+
+    e = c->engine;
+    src = e->dns_servers[c->server].address;
+
+    if (!c->connected) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+            avahi_log_warn(__FILE__": Failed to connect to DNS server: %s", strerror(error ? error : errno));
+            tcp_free(c);
+            return;
+        }
+
+        c->connected = 1;
+    }
+
+    if (c->o_len > 0) {
+        ssize_t r;
+
+        /* A server closing the connection must not kill us with SIGPIPE */
+        if ((r = send(fd, c->obuf, c->o_len, MSG_NOSIGNAL)) < 0) {
+            if (errno != EAGAIN) {
+                if (errno == EPIPE)
+                    avahi_log_debug(__FILE__": DNS server closed the connection.");
+                else
+                    avahi_log_warn(__FILE__": send() failed: %s", strerror(errno));
+                tcp_free(c);
+                return;
+            }
+        } else {
+            c->o_len -= (size_t) r;
+            memmove(c->obuf, c->obuf + r, c->o_len);
+        }
+    }
+
+    if (!(events & (AVAHI_WATCH_IN|AVAHI_WATCH_HUP|AVAHI_WATCH_ERR)) || tcp_read(c, packets, &n_packets) == 0)
+        tcp_update_watch(c);
+
+    /* c may be gone from here on */
+    for (i = 0; i < n_packets; i++) {
+        handle_packet(e, packets[i], &src);
+        avahi_dns_packet_free(packets[i]);
+    }
+}
+
+static AvahiWideAreaTcpConnection *tcp_new(AvahiWideAreaLookupEngine *e, unsigned idx) {
+    AvahiWideAreaTcpConnection *c;
+    AvahiAddress *a;
+    int fd;
+
+    assert(e);
+    assert(idx < e->n_dns_servers);
+    assert(!e->dns_servers[idx].tcp);
+
+    a = &e->dns_servers[idx].address;
+
+    if (a->proto == AVAHI_PROTO_INET)
+        fd = avahi_open_tcp_socket_ipv4(&a->data.ipv4, AVAHI_DNS_PORT);
+    else {
+        assert(a->proto == AVAHI_PROTO_INET6);
+        fd = avahi_open_tcp_socket_ipv6(&a->data.ipv6, AVAHI_DNS_PORT);
+    }
+
+    if (fd < 0)
+        return NULL;
+
+    if (!(c = avahi_new0(AvahiWideAreaTcpConnection, 1))) {
+        close(fd);
+        return NULL;
+    }
+
+    c->engine = e;
+    c->server = idx;
+    c->fd = fd;
+
+    if (!(c->watch = e->server->poll_api->watch_new(e->server->poll_api, fd, AVAHI_WATCH_OUT, tcp_event, c))) {
+        close(fd);
+        avahi_free(c);
+        return NULL;
+    }
+
+    e->dns_servers[idx].tcp = c;
+    tcp_touch(c);
+
+    return c;
+}
+
+/* Ask the server again over TCP, since its answer was truncated */
+static int tcp_query(AvahiWideAreaLookup *l, unsigned idx) {
+    AvahiWideAreaLookupEngine *e;
+    AvahiWideAreaTcpConnection *c;
+    AvahiDnsPacket *p;
+    struct timeval tv;
+
+    assert(l);
+    e = l->engine;
+    assert(idx < e->n_dns_servers);
+
+    if (!(p = packet_for_server(l, idx)))
+        return -1;
+
+    if (!(c = e->dns_servers[idx].tcp) && !(c = tcp_new(e, idx)))
+        return -1;
+
+    if (c->o_len + 2 + p->size > c->o_allocated) {
+        size_t n = (c->o_len + 2 + p->size) * 2;
+        uint8_t *b;
+
+        if (!(b = avahi_realloc(c->obuf, n)))
+            return -1;
+
+        c->obuf = b;
+        c->o_allocated = n;
+    }
+
+    c->obuf[c->o_len++] = (uint8_t) (p->size >> 8);
+    c->obuf[c->o_len++] = (uint8_t) p->size;
+    memcpy(c->obuf + c->o_len, AVAHI_DNS_PACKET_DATA(p), p->size);
+    c->o_len += p->size;
+
+    tcp_update_watch(c);
+    tcp_touch(c);
+
+    e->dns_servers[idx].n_queries++;
+    l->n_sent_to[idx]++;
+    l->tcp = idx + 1;
+
+    avahi_time_event_update(l->time_event, avahi_elapse_time(&tv, TCP_TIMEOUT_MSEC, 0));
+
+    return 0;
+}
+
+static void handle_packet(AvahiWideAreaLookupEngine *e, AvahiDnsPacket *p, const AvahiAddress *src) {
     AvahiWideAreaLookup *l = NULL;
-    int i, r;
+    int i, r, error = AVAHI_OK;
+    uint32_t ttl = 0;
+    uint16_t flags;
+    unsigned j;
 
     AvahiBrowserEvent final_event = AVAHI_BROWSER_ALL_FOR_NOW;
 
@@ -496,11 +1238,55 @@ static void handle_packet(AvahiWideAreaLookupEngine *e, AvahiDnsPacket *p) {
     if (!(l = find_lookup(e, avahi_dns_packet_get_field(p, AVAHI_DNS_FIELD_ID))) || l->dead)
         goto finish;
 
+    for (j = 0; j < e->n_dns_servers; j++)
+        if (avahi_address_cmp(&e->dns_servers[j].address, src) == 0) {
+            e->dns_servers[j].n_responses++;
+
+            /* If we asked this server more than once we cannot tell
+             * which query this answers, so take no sample (Karn) */
+            if (l->n_sent_to[j] == 1) {
+                AvahiUsec rtt = avahi_age(&l->sent[j]);
+                update_rtt(&e->dns_servers[j], rtt > 0 ? rtt : 0);
+            }
+
+            break;
+        }
+
+    /* Ignore answers from servers that lost the race */
+    if (!is_querying(l))
+        return;
+
+    flags = avahi_dns_packet_get_field(p, AVAHI_DNS_FIELD_FLAGS);
+
+    if (j < e->n_dns_servers) {
+        AvahiWideAreaDnsServer *d = &e->dns_servers[j];
+
+        /* Servers that don't know EDNS0 may refuse queries with an OPT
+         * record, so ask them again without one */
+        if (!d->no_edns0 && ((flags & AVAHI_DNS_FLAG_RCODE) == 1 || (flags & AVAHI_DNS_FLAG_RCODE) == 4)) {
+            AvahiDnsPacket *q;
+
+            d->no_edns0 = 1;
+
+            if ((q = packet_for_server(l, j)) && send_to_dns_server(l, q, j) >= 0) {
+                d->n_queries++;
+                l->n_sent_to[j]++;
+                return;
+            }
+        }
+
+        /* The answer did not fit, fetch it over TCP. If that is not
+         * possible we go on with what we got. */
+        if ((flags & AVAHI_DNS_FLAG_TC) && !l->tcp && tcp_query(l, j) >= 0)
+            return;
+    }
+
     /* Check whether this a packet indicating a failure */
-    if ((r = avahi_dns_packet_get_field(p, AVAHI_DNS_FIELD_FLAGS) & 15) != 0 ||
+    if ((r = flags & AVAHI_DNS_FLAG_RCODE) != 0 ||
         avahi_dns_packet_get_field(p, AVAHI_DNS_FIELD_ANCOUNT) == 0) {
 
-        avahi_server_set_errno(e->server, r == 0 ? AVAHI_ERR_NOT_FOUND : map_dns_error(r));
+        error = r == 0 ? AVAHI_ERR_NOT_FOUND : map_dns_error(r);
+        avahi_server_set_errno(e->server, error);
         /* Tell the user about the failure */
         final_event = AVAHI_BROWSER_FAILURE;
 
@@ -527,42 +1313,55 @@ static void handle_packet(AvahiWideAreaLookupEngine *e, AvahiDnsPacket *p) {
              (int) avahi_dns_packet_get_field(p, AVAHI_DNS_FIELD_NSCOUNT) +
              (int) avahi_dns_packet_get_field(p, AVAHI_DNS_FIELD_ARCOUNT); i > 0; i--) {
 
-        AvahiRecord *rr;
+        AvahiDnsRecordView v;
+        AvahiRecord *rr = NULL;
 
-        if (!(rr = avahi_dns_packet_consume_record(p, NULL))) {
+        if (avahi_dns_packet_consume_record_view(p, &v) < 0 ||
+            (v.key.type != AVAHI_DNS_TYPE_OPT && !(rr = avahi_dns_record_view_materialize(p, &v)))) {
             avahi_log_warn(__FILE__": Wide area response packet too short or invalid while reading response record. (Maybe a UTF-8 problem?)");
             avahi_server_set_errno(e->server, AVAHI_ERR_INVALID_PACKET);
             final_event = AVAHI_BROWSER_FAILURE;
             goto finish;
         }
 
+        /* The EDNS0 OPT pseudo record carries no data for us */
+        if (!rr)
+            continue;
+
+        if (rr->key->type == AVAHI_DNS_TYPE_SOA && rr->key->clazz == AVAHI_DNS_CLASS_IN)
+            ttl = negative_ttl(rr);
+
         add_to_cache(e, rr);
         avahi_record_unref(rr);
     }
 
-finish:
+    /* Remember NXDOMAIN and NODATA answers, but only those that come
+     * with an SOA record to take the TTL from */
+    if ((error == AVAHI_ERR_DNS_NXDOMAIN || error == AVAHI_ERR_NOT_FOUND) && ttl > 0)
+        add_negative_to_cache(e, l->key, error, ttl);
 
-    if (l && !l->dead) {
-        if (l->callback)
-            l->callback(e, final_event, AVAHI_LOOKUP_RESULT_WIDE_AREA, NULL, l->userdata);
+finish:
 
-        lookup_stop(l);
-    }
+    if (l && !l->dead)
+        finish_lookup(l, final_event, AVAHI_LOOKUP_RESULT_WIDE_AREA);
 }
 
 static void socket_event(AVAHI_GCC_UNUSED AvahiWatch *w, int fd, AVAHI_GCC_UNUSED AvahiWatchEvent events, void *userdata) {
     AvahiWideAreaLookupEngine *e = userdata;
     AvahiDnsPacket *p = NULL;
+    AvahiAddress src;
 
-    if (fd == e->fd_ipv4)
-        p = avahi_recv_dns_packet_ipv4(e->fd_ipv4, NULL, NULL, NULL, NULL, NULL);
-    else {
+    if (fd == e->fd_ipv4) {
+        src.proto = AVAHI_PROTO_INET;
+        p = avahi_recv_dns_packet_ipv4(e->fd_ipv4, &src.data.ipv4, NULL, NULL, NULL, NULL);
+    } else {
         assert(fd == e->fd_ipv6);
-        p = avahi_recv_dns_packet_ipv6(e->fd_ipv6, NULL, NULL, NULL, NULL, NULL);
+        src.proto = AVAHI_PROTO_INET6;
+        p = avahi_recv_dns_packet_ipv6(e->fd_ipv6, &src.data.ipv6, NULL, NULL, NULL, NULL);
     }
 
     if (p) {
-        handle_packet(e, p);
+        handle_packet(e, p, &src);
         avahi_dns_packet_free(p);
     }
 }
@@ -602,23 +1401,28 @@ AvahiWideAreaLookupEngine *avahi_wide_area_engine_new(AvahiServer *s) {
     if (e->fd_ipv6 >= 0)
         e->watch_ipv6 = s->poll_api->watch_new(e->server->poll_api, e->fd_ipv6, AVAHI_WATCH_IN, socket_event, e);
 
-    e->n_dns_servers = e->current_dns_server = 0;
+    e->n_dns_servers = 0;
     e->next_id = (uint16_t) rand();
 
     /* Initialize cache */
     AVAHI_LLIST_HEAD_INIT(AvahiWideAreaCacheEntry, e->cache);
+    e->cache_tail = NULL;
     e->cache_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, (AvahiFreeFunc) avahi_key_unref, NULL);
+    e->negative_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, NULL, NULL);
     e->cache_n_entries = 0;
 
     /* Initialize lookup list */
     e->lookups_by_id = avahi_hashmap_new((AvahiHashFunc) avahi_int_hash, (AvahiEqualFunc) avahi_int_equal, NULL, NULL);
     e->lookups_by_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, (AvahiFreeFunc) avahi_key_unref, NULL);
+    e->lookups_by_cname_key = avahi_hashmap_new((AvahiHashFunc) avahi_key_hash, (AvahiEqualFunc) avahi_key_equal, (AvahiFreeFunc) avahi_key_unref, NULL);
     AVAHI_LLIST_HEAD_INIT(AvahiWideAreaLookup, e->lookups);
 
     return e;
 }
 
 void avahi_wide_area_engine_free(AvahiWideAreaLookupEngine *e) {
+    unsigned i;
+
     assert(e);
 
     avahi_wide_area_clear_cache(e);
@@ -626,9 +1430,15 @@ void avahi_wide_area_engine_free(AvahiWideAreaLookupEngine *e) {
     while (e->lookups)
         lookup_destroy(e->lookups);
 
+    for (i = 0; i < e->n_dns_servers; i++)
+        if (e->dns_servers[i].tcp)
+            tcp_free(e->dns_servers[i].tcp);
+
     avahi_hashmap_free(e->cache_by_key);
+    avahi_hashmap_free(e->negative_by_key);
     avahi_hashmap_free(e->lookups_by_id);
     avahi_hashmap_free(e->lookups_by_key);
+    avahi_hashmap_free(e->lookups_by_cname_key);
 
     if (e->watch_ipv4)
         e->server->poll_api->watch_free(e->watch_ipv4);
@@ -655,22 +1465,71 @@ void avahi_wide_area_clear_cache(AvahiWideAreaLookupEngine *e) {
 }
 
 void avahi_wide_area_set_servers(AvahiWideAreaLookupEngine *e, const AvahiAddress *a, unsigned n) {
+    AvahiWideAreaDnsServer old[AVAHI_WIDE_AREA_SERVERS_MAX];
+    AvahiWideAreaLookup *l;
+    unsigned n_old, i;
+
     assert(e);
 
+    for (i = 0; i < e->n_dns_servers; i++)
+        if (e->dns_servers[i].tcp)
+            tcp_free(e->dns_servers[i].tcp);
+
+    memcpy(old, e->dns_servers, sizeof(old));
+    n_old = e->n_dns_servers;
+
     if (a) {
         for (e->n_dns_servers = 0; n > 0 && e->n_dns_servers < AVAHI_WIDE_AREA_SERVERS_MAX; a++, n--)
-            if ((a->proto == AVAHI_PROTO_INET && e->fd_ipv4 >= 0) || (a->proto == AVAHI_PROTO_INET6 && e->fd_ipv6 >= 0))
-                e->dns_servers[e->n_dns_servers++] = *a;
+            if ((a->proto == AVAHI_PROTO_INET && e->fd_ipv4 >= 0) || (a->proto == AVAHI_PROTO_INET6 && e->fd_ipv6 >= 0)) {
+                AvahiWideAreaDnsServer *d = &e->dns_servers[e->n_dns_servers++];
+
+                /* Keep what we learnt about servers we already knew */
+                for (i = 0; i < n_old; i++)
+                    if (avahi_address_cmp(&old[i].address, a) == 0)
+                        break;
+
+                if (i < n_old)
+                    *d = old[i];
+                else {
+                    memset(d, 0, sizeof(*d));
+                    d->address = *a;
+                    d->rto = RTO_INITIAL;
+                }
+            }
     } else {
         assert(n == 0);
         e->n_dns_servers = 0;
     }
 
-    e->current_dns_server = 0;
+    /* The servers have been renumbered, forget which ones the running
+     * lookups asked */
+    for (l = e->lookups; l; l = l->lookups_next) {
+        l->round = 0;
+        l->tcp = 0;
+        memset(l->n_sent_to, 0, sizeof(l->n_sent_to));
+    }
 
     avahi_wide_area_clear_cache(e);
 }
 
+unsigned avahi_wide_area_get_stats(AvahiWideAreaLookupEngine *e, AvahiServerWideAreaStats *ret, unsigned n) {
+    unsigned i;
+
+    assert(e);
+    assert(ret || n == 0);
+
+    for (i = 0; i < e->n_dns_servers && i < n; i++) {
+        ret[i].address = e->dns_servers[i].address;
+        ret[i].n_queries = e->dns_servers[i].n_queries;
+        ret[i].n_responses = e->dns_servers[i].n_responses;
+        ret[i].n_timeouts = e->dns_servers[i].n_timeouts;
+        ret[i].srtt = e->dns_servers[i].srtt;
+        ret[i].rto = e->dns_servers[i].rto;
+    }
+
+    return e->n_dns_servers;
+}
+
 void avahi_wide_area_cache_dump(AvahiWideAreaLookupEngine *e, AvahiDumpCallback callback, void* userdata) {
     AvahiWideAreaCacheEntry *c;
 
@@ -680,7 +1539,12 @@ void avahi_wide_area_cache_dump(AvahiWideAreaLookupEngine *e, AvahiDumpCallback
     callback(";; WIDE AREA CACHE ;;; ", userdata);
 
     for (c = e->cache; c; c = c->cache_next) {
-        char *t = avahi_record_to_string(c->record);
+        char *t;
+
+        if (!c->record)
+            continue;
+
+        t = avahi_record_to_string(c->record);
         callback(t, userdata);
         avahi_free(t);
     }
@@ -696,6 +1560,7 @@ unsigned avahi_wide_area_scan_cache(AvahiWideAreaLookupEngine *e, AvahiKey *key,
     assert(callback);
 
     for (c = avahi_hashmap_lookup(e->cache_by_key, key); c; c = c->by_key_next) {
+        cache_entry_touch(c);
         callback(e, AVAHI_BROWSER_NEW, AVAHI_LOOKUP_RESULT_WIDE_AREA|AVAHI_LOOKUP_RESULT_CACHED, c->record, userdata);
         n++;
     }
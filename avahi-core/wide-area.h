@@ -42,6 +42,7 @@ void avahi_wide_area_set_servers(AvahiWideAreaLookupEngine *e, const AvahiAddres
 void avahi_wide_area_clear_cache(AvahiWideAreaLookupEngine *e);
 void avahi_wide_area_cleanup(AvahiWideAreaLookupEngine *e);
 int avahi_wide_area_has_servers(AvahiWideAreaLookupEngine *e);
+unsigned avahi_wide_area_get_stats(AvahiWideAreaLookupEngine *e, AvahiServerWideAreaStats *ret, unsigned n);
 
 AvahiWideAreaLookup *avahi_wide_area_lookup_new(AvahiWideAreaLookupEngine *e, AvahiKey *key, AvahiWideAreaLookupCallback callback, void *userdata);
 void avahi_wide_area_lookup_free(AvahiWideAreaLookup *q);
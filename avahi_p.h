@@ -0,0 +1,84 @@
+/**************************************************************************************************
+---------------------------------------------------------------------------------------------------
+	Copyright (C) 2015  Jonathan Bagg
+	This file is part of QtZeroConf.
+
+	QtZeroConf is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	QtZeroConf is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with QtZeroConf.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------------------------------
+   Project name : QtZeroConf
+   File name    : avahi_p.h
+   Created      : 19 October 2026
+---------------------------------------------------------------------------------------------------
+   Helpers shared by the avahi-client and avahi-core wrappers
+---------------------------------------------------------------------------------------------------
+**************************************************************************************************/
+#ifndef QZEROCONFAVAHI_P_H_
+#define QZEROCONFAVAHI_P_H_
+
+#include <avahi-common/address.h>
+#include <avahi-common/defs.h>
+#include <avahi-common/strlst.h>
+#include <QMap>
+#include "qzeroconf.h"
+
+// a service of publishService(), Group is the entry group type of the avahi flavour
+template <typename Private, typename Group>
+struct AvahiPublisher
+{
+	Private *ref;
+	int id;
+	Group *group;
+	QZeroConfPublishInfo info;
+	AvahiIfIndex interface;
+};
+
+static inline AvahiStringList *txtStringList(const QMap<QByteArray, QByteArray> &txt)
+{
+	AvahiStringList *list = NULL;
+
+	QMap<QByteArray, QByteArray>::const_iterator i;
+	for (i = txt.constBegin(); i != txt.constEnd(); i++) {
+		if (i.value().isEmpty())
+			list = avahi_string_list_add(list, i.key().constData());
+		else
+			list = avahi_string_list_add_pair(list, i.key().constData(), i.value().constData());
+	}
+	return list;
+}
+
+// the entry group of a publisher changed state, the publisher is removed when it failed
+template <typename Publisher>
+void publisherStateChanged(Publisher *publisher, AvahiEntryGroupState state)
+{
+	auto *ref = publisher->ref;
+	int id = publisher->id;
+
+	switch (state) {
+		case AVAHI_ENTRY_GROUP_ESTABLISHED:
+			emit ref->pub->publishedService(id);
+			break;
+		case AVAHI_ENTRY_GROUP_COLLISION:
+			ref->removePublisher(id);
+			emit ref->pub->publishError(id, QZeroConf::serviceNameCollision);
+			break;
+		case AVAHI_ENTRY_GROUP_FAILURE:
+			ref->removePublisher(id);
+			emit ref->pub->publishError(id, QZeroConf::serviceRegistrationFailed);
+			break;
+		case AVAHI_ENTRY_GROUP_UNCOMMITED: break;
+		case AVAHI_ENTRY_GROUP_REGISTERING: break;
+	}
+}
+
+#endif	// QZEROCONFAVAHI_P_H_
@@ -31,11 +31,17 @@
 #include <avahi-common/error.h>
 #include <avahi-client/lookup.h>
 #include "qzeroconf.h"
+#include "qzeroconftxt_p.h"
+#include "avahi_p.h"
+
+class QZeroConfPrivate;
+
+typedef AvahiPublisher<QZeroConfPrivate, AvahiEntryGroup> Publisher;
 
 class QZeroConfPrivate
 {
 public:
-	QZeroConfPrivate(QZeroConf *parent)
+	QZeroConfPrivate(QZeroConf *parent) : txtUpdater([this](int id) { updateTxt(id); })
 	{
 		qint32 error;
 
@@ -43,6 +49,7 @@ public:
 		pub = parent;
 		group = NULL;
 		browser = NULL;
+		nextPublisherId = 1;
 		poll = avahi_qt_poll_get();
 		if (!poll) {
 			return;
@@ -75,6 +82,11 @@ public:
 		}
 	}
 
+	static void publisherCallback(AvahiEntryGroup *, AvahiEntryGroupState state, void *userdata)
+	{
+		publisherStateChanged(static_cast<Publisher *>(userdata), state);
+	}
+
 	static void browseCallback(AvahiServiceBrowser *,
 			AvahiIfIndex interface,
 			AvahiProtocol protocol,
@@ -200,6 +212,43 @@ public:
 		resolvers.clear();
 	}
 
+	// push the current txt records into the published service without re-registering it, called by txtUpdater
+	void updateTxt(int id)
+	{
+		int ret;
+
+		if (id == QZeroConfTxtUpdater::servicePublishId) {
+			if (!group || publishName.isEmpty())
+				return;
+			ret = avahi_entry_group_update_service_txt_strlst(group, publishInterface, AVAHI_PROTO_UNSPEC, static_cast<AvahiPublishFlags>(0),
+					publishName.constData(), publishType.constData(), publishDomain.isEmpty() ? NULL : publishDomain.constData(), txt);
+			if (ret < 0)
+				emit pub->error(QZeroConf::serviceRegistrationFailed);
+			return;
+		}
+
+		Publisher *publisher = publishers.value(id);
+		if (!publisher)
+			return;
+		const QZeroConfPublishInfo &info = publisher->info;
+		AvahiStringList *list = txtStringList(info.txt);
+		ret = avahi_entry_group_update_service_txt_strlst(publisher->group, publisher->interface, AVAHI_PROTO_UNSPEC, static_cast<AvahiPublishFlags>(0),
+				info.name.constData(), info.type.constData(), info.domain.isEmpty() ? NULL : info.domain.constData(), list);
+		avahi_string_list_free(list);
+		if (ret < 0)
+			emit pub->publishError(id, QZeroConf::serviceRegistrationFailed);
+	}
+
+	void removePublisher(int id)
+	{
+		Publisher *publisher = publishers.take(id);
+		if (!publisher)
+			return;
+		txtUpdater.cancel(id);
+		avahi_entry_group_free(publisher->group);
+		delete publisher;
+	}
+
 	QZeroConf *pub;
 	const AvahiPoll *poll;
 	AvahiClient *client;
@@ -208,6 +257,11 @@ public:
 	AvahiProtocol aProtocol;
 	QMap <QString, AvahiServiceResolver *> resolvers;
 	AvahiStringList *txt;
+	QMap<int, Publisher *> publishers;
+	int nextPublisherId;
+	QByteArray publishName, publishType, publishDomain;
+	AvahiIfIndex publishInterface;
+	QZeroConfTxtUpdater txtUpdater;
 };
 
 
@@ -221,6 +275,8 @@ QZeroConf::~QZeroConf()
 {
 	avahi_string_list_free(pri->txt);
 	pri->broswerCleanUp();
+	for (int id : pri->publishers.keys())
+		pri->removePublisher(id);
 	if (pri->client)
 		avahi_client_free(pri->client);
 	delete pri;
@@ -237,6 +293,10 @@ void QZeroConf::startServicePublish(const char *name, const char *type, const ch
 	}
 
 	pri->group = avahi_entry_group_new(pri->client, QZeroConfPrivate::groupCallback, pri);
+	pri->publishName = name;
+	pri->publishType = type;
+	pri->publishDomain = domain;
+	pri->publishInterface = interface;
 
 	int ret = avahi_entry_group_add_service_strlst(pri->group, interface, AVAHI_PROTO_UNSPEC, AVAHI_PUBLISH_UPDATE, name, type, domain, NULL, port, pri->txt);
 	if (ret < 0) {
@@ -257,8 +317,45 @@ void QZeroConf::startServicePublish(const char *name, const char *type, const ch
 		emit error(QZeroConf::serviceRegistrationFailed);
 }
 
+// all services go into one entry group, so the daemon probes and announces them together
+void QZeroConf::startServicePublish(const QList<QZeroConfPublishInfo> &services, quint32 interface)
+{
+	if (!pri->client || pri->group || services.isEmpty()) {
+		emit error(QZeroConf::serviceRegistrationFailed);
+		return;
+	}
+	if (interface <= 0) {
+		interface = AVAHI_IF_UNSPEC;
+	}
+
+	pri->group = avahi_entry_group_new(pri->client, QZeroConfPrivate::groupCallback, pri);
+	pri->publishName.clear();
+	if (!pri->group) {
+		emit error(QZeroConf::serviceRegistrationFailed);
+		return;
+	}
+
+	int ret = 0;
+	for (int i = 0; i < services.size() && ret >= 0; i++) {
+		const QZeroConfPublishInfo &service = services.at(i);
+		AvahiStringList *txt = txtStringList(service.txt);
+		ret = avahi_entry_group_add_service_strlst(pri->group, interface, AVAHI_PROTO_UNSPEC, static_cast<AvahiPublishFlags>(0),
+				service.name.constData(), service.type.constData(), service.domain.isEmpty() ? NULL : service.domain.constData(), NULL, service.port, txt);
+		avahi_string_list_free(txt);
+	}
+
+	if (ret >= 0)
+		ret = avahi_entry_group_commit(pri->group);
+	if (ret < 0) {
+		avahi_entry_group_free(pri->group);
+		pri->group = NULL;
+		emit error(QZeroConf::serviceRegistrationFailed);
+	}
+}
+
 void QZeroConf::stopServicePublish(void)
 {
+	pri->txtUpdater.cancel(QZeroConfTxtUpdater::servicePublishId);
 	if (pri->group) {
 		avahi_entry_group_free(pri->group);
 		pri->group = NULL;
@@ -273,6 +370,55 @@ bool QZeroConf::publishExists(void)
 		return false;
 }
 
+// every published service gets its own entry group on the shared daemon connection
+int QZeroConf::publishService(const QZeroConfPublishInfo &service, quint32 interface)
+{
+	if (!pri->client)
+		return -1;
+
+	Publisher *publisher = new Publisher;
+	publisher->ref = pri;
+	publisher->id = pri->nextPublisherId++;
+	publisher->info = service;
+	publisher->interface = interface > 0 ? static_cast<AvahiIfIndex>(interface) : AVAHI_IF_UNSPEC;
+	publisher->group = avahi_entry_group_new(pri->client, QZeroConfPrivate::publisherCallback, publisher);
+	if (!publisher->group) {
+		delete publisher;
+		return -1;
+	}
+
+	AvahiStringList *list = txtStringList(service.txt);
+	int ret = avahi_entry_group_add_service_strlst(publisher->group, publisher->interface, AVAHI_PROTO_UNSPEC, static_cast<AvahiPublishFlags>(0),
+			service.name.constData(), service.type.constData(), service.domain.isEmpty() ? NULL : service.domain.constData(), NULL, service.port, list);
+	avahi_string_list_free(list);
+	if (ret >= 0)
+		ret = avahi_entry_group_commit(publisher->group);
+	if (ret < 0) {
+		avahi_entry_group_free(publisher->group);
+		delete publisher;
+		return -1;
+	}
+
+	pri->publishers.insert(publisher->id, publisher);
+	return publisher->id;
+}
+
+bool QZeroConf::updateServiceTxt(int id, const QMap<QByteArray, QByteArray> &txt)
+{
+	Publisher *publisher = pri->publishers.value(id);
+	if (!publisher)
+		return false;
+
+	publisher->info.txt = txt;
+	pri->txtUpdater.request(id);
+	return true;
+}
+
+void QZeroConf::unpublishService(int id)
+{
+	pri->removePublisher(id);
+}
+
 // http://www.zeroconf.org/rendezvous/txtrecords.html
 
 void QZeroConf::addServiceTxtRecord(QString nameOnly)
@@ -293,6 +439,13 @@ void QZeroConf::clearServiceTxtRecords()
 	pri->txt = NULL;
 }
 
+void QZeroConf::updateServiceTxtRecords()
+{
+	if (!pri->group)
+		return;
+	pri->txtUpdater.request(QZeroConfTxtUpdater::servicePublishId);
+}
+
 void QZeroConf::startBrowser(QString type, QAbstractSocket::NetworkLayerProtocol protocol)
 {
 	if (!pri->client || pri->browser) {  // check client is ok (avahi daemon is running) and browser is not already started
@@ -326,3 +479,8 @@ bool QZeroConf::browserExists(void)
 	else
 		return false;
 }
+
+void QZeroConf::setQueryAggregationWindow(int msec)
+{
+	Q_UNUSED(msec) // the daemon schedules the queries
+}
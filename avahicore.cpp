@@ -31,12 +31,19 @@
 #include <avahi-core/lookup.h>
 #include <avahi-common/simple-watch.h>
 #include <QCoreApplication>
+#include <QVector>
 #include "qzeroconf.h"
+#include "qzeroconftxt_p.h"
+#include "avahi_p.h"
+
+class QZeroConfPrivate;
+
+typedef AvahiPublisher<QZeroConfPrivate, AvahiSEntryGroup> Publisher;	// group is NULL until the server is running
 
 class QZeroConfPrivate
 {
 public:
-	QZeroConfPrivate(QZeroConf *parent)
+	QZeroConfPrivate(QZeroConf *parent) : txtUpdater([this](int id) { updateTxt(id); })
 	{
 		qint32 error;
 
@@ -44,8 +51,9 @@ public:
 		group = NULL;
 		browser = NULL;
 		txt = NULL;
-		ready = 0;
+		nextPublisherId = 1;
 		registerWaiting = 0;
+		instances.append(this);
 
 		poll = avahi_qt_poll_get();
 		if (!poll) {
@@ -54,9 +62,11 @@ public:
 
 		avahi_server_config_init(&config);
 		config.publish_workstation = 0;
+		config.query_aggregation_msec = queryAggregationWindow;
 
+		// the server is shared by all instances, its state is passed on to each of them
 		if (!referenceCount) {
-			server = avahi_server_new(poll, &config, serverCallback, this, &error);
+			server = avahi_server_new(poll, &config, serverCallback, NULL, &error);
 		}
 		referenceCount++;
 		if (!server) {
@@ -64,16 +74,13 @@ public:
 		}
 	}
 
-	static void serverCallback(AvahiServer *, AvahiServerState state, AVAHI_GCC_UNUSED void * userdata)
+	static void serverCallback(AvahiServer *, AvahiServerState state, void *)
 	{
-		QZeroConfPrivate *ref = static_cast<QZeroConfPrivate *>(userdata);
 		switch (state) {
 			case AVAHI_SERVER_RUNNING:
-				ref->ready = 1;
-                if (ref->registerWaiting) {
-                    ref->registerWaiting = 0;
-                    ref->registerService(ref->name.toUtf8(), ref->type.toUtf8(), ref->domain.toUtf8(), ref->port, 0);
-				}
+				ready = 1;
+				for (QZeroConfPrivate *ref : QList<QZeroConfPrivate *>(instances))
+					ref->serverRunning();
 				break;
 			case AVAHI_SERVER_COLLISION:
 				break;
@@ -84,7 +91,27 @@ public:
 		}
 	}
 
-	static void groupCallback(AvahiServer *, AvahiSEntryGroup *g, AvahiEntryGroupState state, AVAHI_GCC_UNUSED void *userdata)
+	void serverRunning()
+	{
+		if (registerWaiting) {
+			registerWaiting = 0;
+			if (!batch.isEmpty()) {
+				registerServices(batch, batchInterface);
+				batch.clear();
+			}
+			else
+				registerService(name.toUtf8(), type.toUtf8(), domain.toUtf8(), port, 0);
+		}
+		for (int id : publishers.keys()) {
+			Publisher *publisher = publishers.value(id);
+			if (!publisher || publisher->group || registerPublisher(publisher))
+				continue;
+			removePublisher(id);
+			emit pub->publishError(id, QZeroConf::serviceRegistrationFailed);
+		}
+	}
+
+	static void groupCallback(AvahiServer *, AvahiSEntryGroup *g, AvahiEntryGroupState state, void *userdata)
 	{
 		QZeroConfPrivate *ref = static_cast<QZeroConfPrivate *>(userdata);
 		switch (state) {
@@ -106,6 +133,11 @@ public:
 		}
 	}
 
+	static void publisherCallback(AvahiServer *, AvahiSEntryGroup *, AvahiEntryGroupState state, void *userdata)
+	{
+		publisherStateChanged(static_cast<Publisher *>(userdata), state);
+	}
+
 	static void browseCallback(
 			AvahiSServiceBrowser *,
 			AvahiIfIndex interface,
@@ -127,8 +159,12 @@ public:
 				emit ref->pub->error(QZeroConf::browserFailed);
 				break;
 			case AVAHI_BROWSER_NEW:
-				if (!ref->resolvers.contains(key))
-					ref->resolvers.insert(key, avahi_s_service_resolver_new(ref->server, interface, protocol, name, type, domain, ref->aProtocol, AVAHI_LOOKUP_USE_MULTICAST, resolveCallback, ref));
+				if (!ref->resolvers.contains(key)) {
+					AvahiSServiceResolver *resolver = avahi_s_service_resolver_new(ref->server, interface, protocol, name, type, domain, ref->aProtocol, AVAHI_LOOKUP_USE_MULTICAST, resolveCallback, ref);
+					if (resolver)
+						ref->setResolverTiming(resolver);
+					ref->resolvers.insert(key, resolver);
+				}
 				break;
 			case AVAHI_BROWSER_REMOVE:
 				if (!ref->resolvers.contains(key))
@@ -211,6 +247,20 @@ public:
 		}
 	}
 
+	void setResolverTiming(AvahiSServiceResolver *resolver)
+	{
+		const QZeroConfResolverTiming &policy = pub->resolverTimingPolicy;
+		AvahiSServiceResolverTiming timing;
+
+		timing.timeout_msec = qMax(policy.timeout, 0);
+		timing.backoff_factor = qMax(policy.backoffFactor, 1);
+		timing.max_retries = qMax(policy.maxRetries, 0);
+		timing.timeout_max_msec = qMax(policy.maxTimeout, 0);
+		if (timing.timeout_max_msec && timing.timeout_max_msec < timing.timeout_msec)
+			timing.timeout_max_msec = timing.timeout_msec;
+		avahi_s_service_resolver_set_timing(resolver, &timing);
+	}
+
 	void broswerCleanUp(void)
 	{
 		if (!browser)
@@ -243,6 +293,12 @@ public:
 			interface = AVAHI_IF_UNSPEC;
 		}
 
+		// remembered for updateTxt()
+		this->name = name;
+		this->type = type;
+		this->domain = domain;
+		publishInterface = interface;
+
 		ret = avahi_server_add_service_strlst(server, group, interface, AVAHI_PROTO_UNSPEC, AVAHI_PUBLISH_UPDATE, name, type, domain, NULL, port, txt);
 		if (ret < 0) {
 			avahi_s_entry_group_free(group);
@@ -259,23 +315,136 @@ public:
 		}
 	}
 
+	// all services go into one entry group, so they are probed and announced together
+	void registerServices(const QList<QZeroConfPublishInfo> &services, quint32 interface)
+	{
+		QVector<AvahiServicePublishInfo> info(services.size());
+		qint32 ret;
+
+		group = avahi_s_entry_group_new(server, QZeroConfPrivate::groupCallback, this);
+		if (!group) {
+			pub->emit error(QZeroConf::serviceRegistrationFailed);
+			return;
+		}
+
+		if (interface <= 0) {
+			interface = AVAHI_IF_UNSPEC;
+		}
+
+		name.clear();		// there's no single service for updateTxt()
+
+		for (int i = 0; i < services.size(); i++) {
+			const QZeroConfPublishInfo &service = services.at(i);
+			info[i].name = service.name.constData();
+			info[i].type = service.type.constData();
+			info[i].domain = service.domain.isEmpty() ? NULL : service.domain.constData();
+			info[i].host = NULL;
+			info[i].port = service.port;
+			info[i].strlst = txtStringList(service.txt);
+		}
+
+		ret = avahi_server_add_service_batch(server, group, interface, AVAHI_PROTO_UNSPEC, static_cast<AvahiPublishFlags>(0), info.data(), info.size());
+		for (int i = 0; i < info.size(); i++)
+			avahi_string_list_free(info[i].strlst);
+		if (ret < 0) {
+			avahi_s_entry_group_free(group);
+			group = NULL;
+			pub->emit error(QZeroConf::serviceRegistrationFailed);
+		}
+	}
+
+	// every published service gets its own entry group on the shared server
+	bool registerPublisher(Publisher *publisher)
+	{
+		const QZeroConfPublishInfo &info = publisher->info;
+		AvahiStringList *list;
+		qint32 ret;
+
+		publisher->group = avahi_s_entry_group_new(server, QZeroConfPrivate::publisherCallback, publisher);
+		if (!publisher->group)
+			return false;
+
+		list = txtStringList(info.txt);
+		ret = avahi_server_add_service_strlst(server, publisher->group, publisher->interface, AVAHI_PROTO_UNSPEC, static_cast<AvahiPublishFlags>(0),
+				info.name.constData(), info.type.constData(), info.domain.isEmpty() ? NULL : info.domain.constData(), NULL, info.port, list);
+		avahi_string_list_free(list);
+		if (ret >= 0)
+			ret = avahi_s_entry_group_commit(publisher->group);
+		if (ret < 0) {
+			avahi_s_entry_group_free(publisher->group);
+			publisher->group = NULL;
+			return false;
+		}
+		return true;
+	}
+
+	// push the current txt records into the published service without re-registering it, called by txtUpdater
+	void updateTxt(int id)
+	{
+		qint32 ret;
+
+		if (id == QZeroConfTxtUpdater::servicePublishId) {
+			if (!group || name.isEmpty())
+				return;
+			ret = avahi_server_update_service_txt_strlst(server, group, publishInterface, AVAHI_PROTO_UNSPEC, static_cast<AvahiPublishFlags>(0),
+					name.toUtf8().constData(), type.toUtf8().constData(), domain.isEmpty() ? NULL : domain.toUtf8().constData(), txt);
+			if (ret < 0)
+				pub->emit error(QZeroConf::serviceRegistrationFailed);
+			return;
+		}
+
+		Publisher *publisher = publishers.value(id);
+		if (!publisher || !publisher->group)	// registered with the latest txt records once the server runs
+			return;
+		const QZeroConfPublishInfo &info = publisher->info;
+		AvahiStringList *list = txtStringList(info.txt);
+		ret = avahi_server_update_service_txt_strlst(server, publisher->group, publisher->interface, AVAHI_PROTO_UNSPEC, static_cast<AvahiPublishFlags>(0),
+				info.name.constData(), info.type.constData(), info.domain.isEmpty() ? NULL : info.domain.constData(), list);
+		avahi_string_list_free(list);
+		if (ret < 0)
+			pub->emit publishError(id, QZeroConf::serviceRegistrationFailed);
+	}
+
+	void removePublisher(int id)
+	{
+		Publisher *publisher = publishers.take(id);
+		if (!publisher)
+			return;
+		txtUpdater.cancel(id);
+		if (publisher->group)
+			avahi_s_entry_group_free(publisher->group);
+		delete publisher;
+	}
+
 	QZeroConf *pub;
 	const AvahiPoll *poll;
 	static AvahiServer *server;
 	static quint32 referenceCount;
+	static QList<QZeroConfPrivate *> instances;
+	static bool ready;
+	static unsigned queryAggregationWindow;
 	AvahiServerConfig config;
 	AvahiSEntryGroup *group;
 	AvahiSServiceBrowser *browser;
 	AvahiProtocol aProtocol;
 	QMap <QString, AvahiSServiceResolver *> resolvers;
 	AvahiStringList *txt;
-	bool ready, registerWaiting;
+	bool registerWaiting;
 	QString name, type, domain;
 	qint32 port;
+	QList<QZeroConfPublishInfo> batch;
+	quint32 batchInterface;
+	QMap<int, Publisher *> publishers;
+	int nextPublisherId;
+	AvahiIfIndex publishInterface;
+	QZeroConfTxtUpdater txtUpdater;
 };
 
 AvahiServer* QZeroConfPrivate::server = nullptr;
 quint32 QZeroConfPrivate::referenceCount = 0;
+QList<QZeroConfPrivate *> QZeroConfPrivate::instances;
+bool QZeroConfPrivate::ready = false;
+unsigned QZeroConfPrivate::queryAggregationWindow = 0;
 
 QZeroConf::QZeroConf(QObject *parent) : QObject (parent)
 {
@@ -287,10 +456,16 @@ QZeroConf::~QZeroConf()
 {
 	avahi_string_list_free(pri->txt);
 	pri->broswerCleanUp();
+	for (int id : pri->publishers.keys())
+		pri->removePublisher(id);
 	avahi_server_config_free(&pri->config);
+	pri->instances.removeOne(pri);
 	pri->referenceCount--;
-	if (!pri->referenceCount)
+	if (!pri->referenceCount) {
 		avahi_server_free(pri->server);
+		pri->server = nullptr;
+		pri->ready = false;
+	}
 	delete pri;
 }
 
@@ -308,11 +483,28 @@ void QZeroConf::startServicePublish(const char *name, const char *type, const ch
 		pri->type = type;
 		pri->domain = domain;
 		pri->port = port;
+		pri->batch.clear();
+	}
+}
+
+void QZeroConf::startServicePublish(const QList<QZeroConfPublishInfo> &services, quint32 interface)
+{
+	if (pri->group || services.isEmpty()) {
+		emit error(QZeroConf::serviceRegistrationFailed);
+		return;
+	}
+	if (pri->ready)
+		pri->registerServices(services, interface);
+	else {
+		pri->registerWaiting = 1;
+		pri->batch = services;
+		pri->batchInterface = interface;
 	}
 }
 
 void QZeroConf::stopServicePublish(void)
 {
+	pri->txtUpdater.cancel(QZeroConfTxtUpdater::servicePublishId);
 	if (pri->group) {
 		avahi_s_entry_group_free(pri->group);
 		pri->group = NULL;
@@ -327,6 +519,43 @@ bool QZeroConf::publishExists(void)
 		return false;
 }
 
+int QZeroConf::publishService(const QZeroConfPublishInfo &service, quint32 interface)
+{
+	if (!pri->server)
+		return -1;
+
+	Publisher *publisher = new Publisher;
+	publisher->ref = pri;
+	publisher->id = pri->nextPublisherId++;
+	publisher->group = NULL;
+	publisher->info = service;
+	publisher->interface = interface > 0 ? static_cast<AvahiIfIndex>(interface) : AVAHI_IF_UNSPEC;
+
+	// before the server is running, the service is registered from serverCallback()
+	if (pri->ready && !pri->registerPublisher(publisher)) {
+		delete publisher;
+		return -1;
+	}
+	pri->publishers.insert(publisher->id, publisher);
+	return publisher->id;
+}
+
+bool QZeroConf::updateServiceTxt(int id, const QMap<QByteArray, QByteArray> &txt)
+{
+	Publisher *publisher = pri->publishers.value(id);
+	if (!publisher)
+		return false;
+
+	publisher->info.txt = txt;
+	pri->txtUpdater.request(id);
+	return true;
+}
+
+void QZeroConf::unpublishService(int id)
+{
+	pri->removePublisher(id);
+}
+
 // http://www.zeroconf.org/rendezvous/txtrecords.html
 
 void QZeroConf::addServiceTxtRecord(QString nameOnly)
@@ -347,6 +576,13 @@ void QZeroConf::clearServiceTxtRecords()
 	pri->txt = NULL;
 }
 
+void QZeroConf::updateServiceTxtRecords()
+{
+	if (!pri->group)
+		return;
+	pri->txtUpdater.request(QZeroConfTxtUpdater::servicePublishId);
+}
+
 void QZeroConf::startBrowser(QString type, QAbstractSocket::NetworkLayerProtocol protocol)
 {
 	if (pri->browser)
@@ -378,3 +614,10 @@ bool QZeroConf::browserExists(void)
 	else
 		return false;
 }
+
+void QZeroConf::setQueryAggregationWindow(int msec)
+{
+	QZeroConfPrivate::queryAggregationWindow = static_cast<unsigned>(qMax(msec, 0));
+	if (QZeroConfPrivate::server)
+		avahi_server_set_query_aggregation(QZeroConfPrivate::server, QZeroConfPrivate::queryAggregationWindow);
+}
@@ -24,6 +24,7 @@
    Wrapper for Apple's Bonjour library for use on Windows, MACs and iOS
 ---------------------------------------------------------------------------------------------------
 **************************************************************************************************/
+#include <climits>
 #include "qzeroconf.h"
 #include "bonjour_p.h"
 
@@ -43,6 +44,79 @@ void Resolver::addressReady()
 		cleanUp();
 }
 
+// starts an attempt, deleting the resolver on failure
+bool Resolver::start()
+{
+	const QZeroConfResolverTiming &policy = ref->pub->resolverTimingPolicy;
+
+	age.start();
+	if (!retries)
+		timeout = ref->initialResolveTimeout(zcs->interfaceIndex());
+	else
+		timeout = static_cast<int>(qMin<qint64>(static_cast<qint64>(timeout) * qMax(policy.backoffFactor, 1), INT_MAX));
+	if (policy.maxTimeout > 0)
+		timeout = qMin(timeout, policy.maxTimeout);
+
+	DNSServiceErrorType err = DNSServiceResolve(&DNSresolverRef, 0, zcs->interfaceIndex(), zcs->name().toUtf8(), zcs->type().toUtf8(), zcs->domain().toUtf8(), static_cast<DNSServiceResolveReply>(QZeroConfPrivate::resolverCallback), this);
+	if (err != kDNSServiceErr_NoError) {
+		cleanUp();
+		return false;
+	}
+	int sockfd = DNSServiceRefSockFD(DNSresolverRef);
+	if (sockfd == -1) {
+		cleanUp();
+		return false;
+	}
+	resolverNotifier = QSharedPointer<QSocketNotifier>::create(sockfd, QSocketNotifier::Read);
+	connect(resolverNotifier.data(), &QSocketNotifier::activated, this, &Resolver::resolverReady);
+	timeoutTimer.start(timeout);
+	return true;
+}
+
+void Resolver::resolved()
+{
+	if (!timeoutTimer.isActive())
+		return;
+	timeoutTimer.stop();
+	ref->updateResolveLatency(zcs->interfaceIndex(), age.elapsed());
+}
+
+// the queries run without kDNSServiceFlagsTimeout, so close them once the address is known.  Called from
+// the address callback, which still uses the resolver, so it goes away with the next event loop iteration
+void Resolver::finish()
+{
+	timeoutTimer.stop();
+	resolverNotifier->setEnabled(false);
+	addressNotifier->setEnabled(false);
+	DNSServiceRefDeallocate(DNSresolverRef);
+	DNSresolverRef = nullptr;
+	DNSServiceRefDeallocate(DNSaddressRef);
+	DNSaddressRef = nullptr;
+	QString key = zcs->name() + QString::number(zcs->interfaceIndex());
+	ref->resolvers.remove(key);
+	deleteLater();
+}
+
+void Resolver::resolveTimeout()
+{
+	if (retries >= ref->pub->resolverTimingPolicy.maxRetries) {
+		cleanUp();
+		return;
+	}
+	retries++;
+
+	// ask again from scratch, dropping the notifiers before their sockets go away
+	resolverNotifier.clear();
+	addressNotifier.clear();
+	DNSServiceRefDeallocate(DNSresolverRef);
+	DNSresolverRef = nullptr;
+	if (DNSaddressRef) {
+		DNSServiceRefDeallocate(DNSaddressRef);
+		DNSaddressRef = nullptr;
+	}
+	start();
+}
+
 void Resolver::cleanUp()
 {
 	DNSServiceRefDeallocate(DNSresolverRef);
@@ -53,7 +127,7 @@ void Resolver::cleanUp()
 	delete this;
 }
 
-QZeroConfPrivate::QZeroConfPrivate(QZeroConf *parent)
+QZeroConfPrivate::QZeroConfPrivate(QZeroConf *parent) : txtUpdater([this](int id) { updateTxt(id); })
 {
 	pub = parent;
 }
@@ -67,6 +141,49 @@ void QZeroConfPrivate::bsRead()
 	}
 }
 
+// a NULL RecordRef updates the primary TXT record of the registration, no re-registration needed.  Called by txtUpdater
+void QZeroConfPrivate::updateTxt(int id)
+{
+	DNSServiceErrorType err;
+
+	if (id == QZeroConfTxtUpdater::servicePublishId) {
+		if (!dnssRef || !publishRefs.isEmpty())		// dnssRef is a shared connection after a bulk publish
+			return;
+		err = DNSServiceUpdateRecord(dnssRef, nullptr, 0, static_cast<uint16_t>(txt.size()), txt.data(), 0);
+		if (err != kDNSServiceErr_NoError)
+			emit pub->error(QZeroConf::serviceRegistrationFailed);
+		return;
+	}
+
+	Publisher *publisher = publishers.value(id);
+	if (!publisher)
+		return;
+	err = DNSServiceUpdateRecord(publisher->sdRef, nullptr, 0, static_cast<uint16_t>(publisher->txt.size()), publisher->txt.constData(), 0);
+	if (err != kDNSServiceErr_NoError)
+		emit pub->publishError(id, QZeroConf::serviceRegistrationFailed);
+}
+
+void QZeroConfPrivate::publishRead()
+{
+	DNSServiceErrorType err = DNSServiceProcessResult(publishConnection);
+	if (err != kDNSServiceErr_NoError) {
+		QList<int> ids = publishers.keys();
+		cleanUp(publishConnection);
+		for (int id : ids)
+			emit pub->publishError(id, QZeroConf::serviceRegistrationFailed);
+	}
+}
+
+void QZeroConfPrivate::removePublisher(int id)
+{
+	Publisher *publisher = publishers.take(id);
+	if (!publisher)
+		return;
+	txtUpdater.cancel(id);
+	DNSServiceRefDeallocate(publisher->sdRef);
+	delete publisher;
+}
+
 void QZeroConfPrivate::browserRead()
 {
 	DNSServiceErrorType err = DNSServiceProcessResult(browser);
@@ -78,27 +195,67 @@ void QZeroConfPrivate::browserRead()
 
 void QZeroConfPrivate::resolve(QZeroConfService zcs)
 {
-	DNSServiceErrorType err;
 	Resolver *resolver = new Resolver;
 	QString key = zcs->name() + QString::number(zcs->interfaceIndex());
 	resolvers.insert(key, resolver);
 	resolver->ref = this;
 	resolver->zcs = zcs;
+	resolver->timeoutTimer.setSingleShot(true);
+	connect(&resolver->timeoutTimer, &QTimer::timeout, resolver, &Resolver::resolveTimeout);
+	resolver->start();
+}
 
-	err = DNSServiceResolve(&resolver->DNSresolverRef, kDNSServiceFlagsTimeout, zcs->interfaceIndex(), zcs->name().toUtf8(), zcs->type().toUtf8(), zcs->domain().toUtf8(), static_cast<DNSServiceResolveReply>(resolverCallback), resolver);
-	if (err == kDNSServiceErr_NoError) {
-		int sockfd = DNSServiceRefSockFD(resolver->DNSresolverRef);
-		if (sockfd == -1) {
-			resolver->cleanUp();
-		}
-		else {
-			resolver->resolverNotifier = QSharedPointer<QSocketNotifier>::create(sockfd, QSocketNotifier::Read);
-			connect(resolver->resolverNotifier.data(), &QSocketNotifier::activated, resolver, &Resolver::resolverReady);
+int QZeroConfPrivate::initialResolveTimeout(quint32 interfaceIndex)
+{
+	if (pub->resolverTimingPolicy.timeout > 0)
+		return pub->resolverTimingPolicy.timeout;
+
+	// like TCP's retransmission timeout: smoothed latency plus four times its variation, on the slowest interface that may answer
+	qint64 timeout = 0;
+	for (auto i = resolveLatency.constBegin(); i != resolveLatency.constEnd(); i++)
+		if (!interfaceIndex || i.key() == interfaceIndex)
+			timeout = qMax(timeout, i->smoothed + 4 * i->variation);
+	if (!timeout) {
+		// no sample yet: spread the default over all attempts, weighted by their back-off
+		const QZeroConfResolverTiming &policy = pub->resolverTimingPolicy;
+		qint64 attempts = 0, f = 1;
+		for (int n = 0; n <= policy.maxRetries && attempts < defaultResolveTimeout / minResolveTimeout; n++) {
+			attempts += f;
+			f *= qMax(policy.backoffFactor, 1);
 		}
+		timeout = defaultResolveTimeout / attempts;
 	}
-	else {
-		resolver->cleanUp();
+	return static_cast<int>(qBound<qint64>(minResolveTimeout, timeout, defaultResolveTimeout));
+}
+
+void QZeroConfPrivate::updateResolveLatency(quint32 interfaceIndex, qint64 elapsed)
+{
+	if (!interfaceIndex)
+		return;
+	elapsed = qMax<qint64>(elapsed, 1);
+	if (!resolveLatency.contains(interfaceIndex)) {
+		resolveLatency[interfaceIndex].smoothed = elapsed;
+		resolveLatency[interfaceIndex].variation = elapsed / 2;
+		return;
 	}
+	ResolveLatency &l = resolveLatency[interfaceIndex];
+	l.variation = (3 * l.variation + qAbs(l.smoothed - elapsed)) / 4;
+	l.smoothed = qMax<qint64>((7 * l.smoothed + elapsed) / 8, 1);
+}
+
+QByteArray QZeroConfPrivate::txtRecord(const QMap<QByteArray, QByteArray> &txt)
+{
+	QByteArray record;
+
+	QMap<QByteArray, QByteArray>::const_iterator i;
+	for (i = txt.constBegin(); i != txt.constEnd(); i++) {
+		QByteArray entry = i.key();
+		if (!i.value().isEmpty())
+			entry += '=' + i.value();
+		record.append(static_cast<char>(entry.size()));
+		record.append(entry);
+	}
+	return record;
 }
 
 void DNSSD_API QZeroConfPrivate::registerCallback(DNSServiceRef, DNSServiceFlags, DNSServiceErrorType errorCode, const char *, const char *, const char *, void *userdata)
@@ -106,6 +263,9 @@ void DNSSD_API QZeroConfPrivate::registerCallback(DNSServiceRef, DNSServiceFlags
 	QZeroConfPrivate *ref = static_cast<QZeroConfPrivate *>(userdata);
 
 	if (errorCode == kDNSServiceErr_NoError) {
+		// a bulk publish is reported once all of its services are registered
+		if (ref->publishPending && --ref->publishPending)
+			return;
 		emit ref->pub->servicePublished();
 	}
 	else {
@@ -114,6 +274,21 @@ void DNSSD_API QZeroConfPrivate::registerCallback(DNSServiceRef, DNSServiceFlags
 	}
 }
 
+void DNSSD_API QZeroConfPrivate::publisherCallback(DNSServiceRef, DNSServiceFlags, DNSServiceErrorType errorCode, const char *, const char *, const char *, void *userdata)
+{
+	Publisher *publisher = static_cast<Publisher *>(userdata);
+	QZeroConfPrivate *ref = publisher->ref;
+	int id = publisher->id;
+
+	if (errorCode == kDNSServiceErr_NoError) {
+		emit ref->pub->publishedService(id);
+	}
+	else {
+		ref->removePublisher(id);
+		emit ref->pub->publishError(id, QZeroConf::serviceRegistrationFailed);
+	}
+}
+
 void DNSSD_API QZeroConfPrivate::browseCallback(DNSServiceRef, DNSServiceFlags flags,
 		quint32 interfaceIndex, DNSServiceErrorType err, const char *name,
 		const char *type, const char *domain, void *userdata)
@@ -217,6 +392,7 @@ void DNSSD_API QZeroConfPrivate::addressReply(DNSServiceRef sdRef,
 		if ((flags & kDNSServiceFlagsAdd) != 0) {
 			QHostAddress hAddress(address);
 			resolver->zcs->setIp(hAddress);
+			resolver->resolved();
 
 			QString key = resolver->zcs->name() + QString::number(interfaceIndex);
 			if (!resolver->ref->pub->services.contains(key)) {
@@ -226,6 +402,8 @@ void DNSSD_API QZeroConfPrivate::addressReply(DNSServiceRef sdRef,
 			else
 				emit resolver->ref->pub->serviceUpdated(resolver->zcs);
 
+			if (!(flags & kDNSServiceFlagsMoreComing))
+				resolver->finish();
 		}
 	}
 	else
@@ -249,6 +427,21 @@ void QZeroConfPrivate::cleanUp(DNSServiceRef toClean)
 	else if (toClean == dnssRef) {
 		dnssRef = nullptr;
 		serviceNotifier.clear();
+		txtUpdater.cancel(QZeroConfTxtUpdater::servicePublishId);
+		for (auto publishRef : publishRefs)
+			DNSServiceRefDeallocate(publishRef);
+		publishRefs.clear();
+		publishPending = 0;
+	}
+	else if (toClean == publishConnection) {
+		publishConnection = nullptr;
+		publishNotifier.clear();
+		for (auto publisher : publishers) {
+			txtUpdater.cancel(publisher->id);
+			DNSServiceRefDeallocate(publisher->sdRef);
+			delete publisher;
+		}
+		publishers.clear();
 	}
 
 	DNSServiceRefDeallocate(toClean);
@@ -263,6 +456,7 @@ QZeroConf::QZeroConf(QObject *parent) : QObject (parent)
 QZeroConf::~QZeroConf()
 {
 	pri->cleanUp(pri->dnssRef);
+	pri->cleanUp(pri->publishConnection);
 	pri->cleanUp(pri->browser);
 	delete pri;
 }
@@ -302,6 +496,55 @@ void QZeroConf::startServicePublish(const char *name, const char *type, const ch
 	}
 }
 
+void QZeroConf::startServicePublish(const QList<QZeroConfPublishInfo> &services, quint32 interface)
+{
+	DNSServiceErrorType err;
+
+	if (pri->dnssRef || services.isEmpty()) {
+		emit error(QZeroConf::serviceRegistrationFailed);
+		return;
+	}
+
+	// all services share one connection to the daemon
+	err = DNSServiceCreateConnection(&pri->dnssRef);
+	if (err != kDNSServiceErr_NoError) {
+		pri->dnssRef = nullptr;
+		emit error(QZeroConf::serviceRegistrationFailed);
+		return;
+	}
+
+	for (const QZeroConfPublishInfo &service : services) {
+		DNSServiceRef publishRef = pri->dnssRef;
+		QByteArray txt = QZeroConfPrivate::txtRecord(service.txt);
+
+		err = DNSServiceRegister(&publishRef, kDNSServiceFlagsShareConnection, interface,
+				service.name.constData(),
+				service.type.constData(),
+				service.domain.isEmpty() ? nullptr : service.domain.constData(),
+				nullptr,
+				qFromBigEndian<quint16>(service.port),
+				static_cast<uint16_t>(txt.size()), txt.constData(),
+				static_cast<DNSServiceRegisterReply>(QZeroConfPrivate::registerCallback), pri);
+		if (err != kDNSServiceErr_NoError) {
+			pri->cleanUp(pri->dnssRef);
+			emit error(QZeroConf::serviceRegistrationFailed);
+			return;
+		}
+		pri->publishRefs.append(publishRef);
+	}
+	pri->publishPending = services.size();
+
+	int sockfd = DNSServiceRefSockFD(pri->dnssRef);
+	if (sockfd == -1) {
+		pri->cleanUp(pri->dnssRef);
+		emit error(QZeroConf::serviceRegistrationFailed);
+	}
+	else {
+		pri->serviceNotifier = QSharedPointer<QSocketNotifier>::create(sockfd, QSocketNotifier::Read, this);
+		connect(pri->serviceNotifier.data(), &QSocketNotifier::activated, pri, &QZeroConfPrivate::bsRead);
+	}
+}
+
 void QZeroConf::stopServicePublish(void)
 {
 	pri->cleanUp(pri->dnssRef);
@@ -315,6 +558,65 @@ bool QZeroConf::publishExists(void)
 		return false;
 }
 
+// all services published by id share one connection to the daemon
+int QZeroConf::publishService(const QZeroConfPublishInfo &service, quint32 interface)
+{
+	DNSServiceErrorType err;
+
+	if (!pri->publishConnection) {
+		err = DNSServiceCreateConnection(&pri->publishConnection);
+		if (err != kDNSServiceErr_NoError) {
+			pri->publishConnection = nullptr;
+			return -1;
+		}
+		int sockfd = DNSServiceRefSockFD(pri->publishConnection);
+		if (sockfd == -1) {
+			pri->cleanUp(pri->publishConnection);
+			return -1;
+		}
+		pri->publishNotifier = QSharedPointer<QSocketNotifier>::create(sockfd, QSocketNotifier::Read, this);
+		connect(pri->publishNotifier.data(), &QSocketNotifier::activated, pri, &QZeroConfPrivate::publishRead);
+	}
+
+	Publisher *publisher = new Publisher;
+	publisher->ref = pri;
+	publisher->id = pri->nextPublisherId++;
+	publisher->sdRef = pri->publishConnection;
+	QByteArray txt = QZeroConfPrivate::txtRecord(service.txt);
+
+	err = DNSServiceRegister(&publisher->sdRef, kDNSServiceFlagsShareConnection, interface,
+			service.name.constData(),
+			service.type.constData(),
+			service.domain.isEmpty() ? nullptr : service.domain.constData(),
+			nullptr,
+			qFromBigEndian<quint16>(service.port),
+			static_cast<uint16_t>(txt.size()), txt.constData(),
+			static_cast<DNSServiceRegisterReply>(QZeroConfPrivate::publisherCallback), publisher);
+	if (err != kDNSServiceErr_NoError) {
+		delete publisher;
+		return -1;
+	}
+
+	pri->publishers.insert(publisher->id, publisher);
+	return publisher->id;
+}
+
+bool QZeroConf::updateServiceTxt(int id, const QMap<QByteArray, QByteArray> &txt)
+{
+	Publisher *publisher = pri->publishers.value(id);
+	if (!publisher)
+		return false;
+
+	publisher->txt = QZeroConfPrivate::txtRecord(txt);
+	pri->txtUpdater.request(id);
+	return true;
+}
+
+void QZeroConf::unpublishService(int id)
+{
+	pri->removePublisher(id);
+}
+
 void QZeroConf::addServiceTxtRecord(QString nameOnly)
 {
 	pri->txt.append(static_cast<char>(nameOnly.size()));
@@ -333,6 +635,13 @@ void QZeroConf::clearServiceTxtRecords()
 	pri->txt.clear();
 }
 
+void QZeroConf::updateServiceTxtRecords()
+{
+	if (!pri->dnssRef)
+		return;
+	pri->txtUpdater.request(QZeroConfTxtUpdater::servicePublishId);
+}
+
 void QZeroConf::startBrowser(QString type, QAbstractSocket::NetworkLayerProtocol protocol)
 {
 	DNSServiceErrorType err;
@@ -381,3 +690,8 @@ bool QZeroConf::browserExists(void)
 	else
 		return false;
 }
+
+void QZeroConf::setQueryAggregationWindow(int msec)
+{
+	Q_UNUSED(msec) // the daemon schedules the queries
+}
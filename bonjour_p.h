@@ -29,19 +29,21 @@
 
 #include <dns_sd.h>
 #include <QSocketNotifier>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <QtEndian>
 #include <QHostAddress>
 #include "qzeroconf.h"
+#include "qzeroconftxt_p.h"
 #include <QDebug>
 
-#ifndef kDNSServiceFlagsTimeout		// earlier versions of dns_sd.h don't define this constant
-	#define	kDNSServiceFlagsTimeout	0x10000
-#endif
-
 class Resolver : public QObject
 {
 	Q_OBJECT
 public:
+	bool start();
+	void resolved();
+	void finish();
 	void cleanUp();
 	QZeroConfService zcs;
 	QZeroConfPrivate *ref = nullptr;
@@ -49,10 +51,30 @@ public:
 	DNSServiceRef DNSaddressRef = nullptr;
 	QSharedPointer <QSocketNotifier> resolverNotifier;
 	QSharedPointer <QSocketNotifier> addressNotifier;
+	QTimer timeoutTimer;
+	QElapsedTimer age;			// since the running attempt started
+	int timeout = 0;			// of the running attempt, ms
+	int retries = 0;
 
 public slots:
 	void resolverReady();
 	void addressReady();
+	void resolveTimeout();
+};
+
+struct ResolveLatency
+{
+	qint64 smoothed = 0;		// ms
+	qint64 variation = 0;
+};
+
+class Publisher
+{
+public:
+	QZeroConfPrivate *ref = nullptr;
+	int id = 0;
+	DNSServiceRef sdRef = nullptr;		// shares the publishConnection
+	QByteArray txt;						// latest txt record, sent by txtUpdater
 };
 
 class QZeroConfPrivate : public QObject
@@ -63,10 +85,18 @@ public:
 	QZeroConfPrivate(QZeroConf *parent);
 	void cleanUp(DNSServiceRef ref);
 	void resolve(QZeroConfService);
+	static QByteArray txtRecord(const QMap<QByteArray, QByteArray> &txt);
+	void removePublisher(int id);
+	void updateTxt(int id);
+	int initialResolveTimeout(quint32 interfaceIndex);
+	void updateResolveLatency(quint32 interfaceIndex, qint64 elapsed);
 
 	static void DNSSD_API registerCallback(DNSServiceRef, DNSServiceFlags, DNSServiceErrorType errorCode, const char *,
 			const char *, const char *, void *userdata);
 
+	static void DNSSD_API publisherCallback(DNSServiceRef, DNSServiceFlags, DNSServiceErrorType errorCode, const char *,
+			const char *, const char *, void *userdata);
+
 	static void DNSSD_API browseCallback(DNSServiceRef, DNSServiceFlags flags,quint32, DNSServiceErrorType err, const char *name,
 			const char *type, const char *domain, void *userdata);
 
@@ -83,10 +113,21 @@ public:
 	QSharedPointer<QSocketNotifier> serviceNotifier;
 	QSharedPointer<QSocketNotifier> browserNotifier;
 	QByteArray txt;
+	QList<DNSServiceRef> publishRefs;	// services sharing the dnssRef connection
+	int publishPending = 0;
+	DNSServiceRef publishConnection = nullptr;
+	QSharedPointer<QSocketNotifier> publishNotifier;
+	QMap<int, Publisher *> publishers;
+	int nextPublisherId = 1;
+	QZeroConfTxtUpdater txtUpdater;
 	QHash<QString, Resolver*> resolvers;
+	QHash<quint32, ResolveLatency> resolveLatency;
+	static const int defaultResolveTimeout = 5000;
+	static const int minResolveTimeout = 1000;		// bounds of timeouts derived from resolveLatency are min and default
 
 public slots:
 	void bsRead();
+	void publishRead();
 	void browserRead();
 };
 
@@ -1,7 +1,7 @@
 
 # for Qt4 on Linux
 lessThan(QT_MAJOR_VERSION, 5) {
-	HEADERS+= $$PWD/qzeroconf.h $$PWD/avahi-qt/qt-watch.h  $$PWD/avahi-qt/qt-watch_p.h
+	HEADERS+= $$PWD/qzeroconf.h $$PWD/avahi-qt/qt-watch.h  $$PWD/avahi-qt/qt-watch_p.h $$PWD/avahi_p.h
 	SOURCES+= $$PWD/avahiclient.cpp $$PWD/avahi-qt/qt-watch.cpp
 	LIBS+= -lavahi-client -lavahi-common
 	QMAKE_CXXFLAGS+= -I$$PWD
@@ -9,14 +9,14 @@ lessThan(QT_MAJOR_VERSION, 5) {
 
 # below for >= Qt5
 linux:!android:!ubports {
-	HEADERS+= $$PWD/qzeroconf.h $$PWD/avahi-qt/qt-watch.h  $$PWD/avahi-qt/qt-watch_p.h
+	HEADERS+= $$PWD/qzeroconf.h $$PWD/avahi-qt/qt-watch.h  $$PWD/avahi-qt/qt-watch_p.h $$PWD/avahi_p.h
 	SOURCES+= $$PWD/avahiclient.cpp $$PWD/avahi-qt/qt-watch.cpp
 	LIBS+= -lavahi-client -lavahi-common
 	QMAKE_CXXFLAGS+= -I$$PWD
 }
 
 freebsd {
-	HEADERS+= $$PWD/qzeroconf.h $$PWD/avahi-qt/qt-watch.h  $$PWD/avahi-qt/qt-watch_p.h
+	HEADERS+= $$PWD/qzeroconf.h $$PWD/avahi-qt/qt-watch.h  $$PWD/avahi-qt/qt-watch_p.h $$PWD/avahi_p.h
 	SOURCES+= $$PWD/avahiclient.cpp $$PWD/avahi-qt/qt-watch.cpp
 	LIBS+= -lavahi-client -lavahi-common
 	QMAKE_CXXFLAGS+= -I$$PWD
@@ -62,7 +62,7 @@ ubports: {
 	QMAKE_CFLAGS+= -I$$PWD
 	ACM = $$PWD/avahi-common
 	ACR = $$PWD/avahi-core
-	HEADERS+= $$PWD/qzeroconf.h $$PWD/avahi-qt/qt-watch.h  $$PWD/avahi-qt/qt-watch_p.h
+	HEADERS+= $$PWD/qzeroconf.h $$PWD/avahi-qt/qt-watch.h  $$PWD/avahi-qt/qt-watch_p.h $$PWD/avahi_p.h
 	SOURCES+= $$PWD/avahicore.cpp $$PWD/avahi-qt/qt-watch.cpp
 	# avahi-common
 	android: {
@@ -84,7 +84,7 @@ ubports: {
 	SOURCES+= $$ACM/timeval.c
 	SOURCES+= $$ACM/utf8.c
 	# avahi-core
-	DEFINES+= HAVE_NETLINK
+	DEFINES+= HAVE_NETLINK HAVE_RECVMMSG HAVE_SENDMMSG
 	SOURCES+= $$ACR/addr-util.c
 	SOURCES+= $$ACR/announce.c
 	SOURCES+= $$ACR/browse.c
@@ -107,6 +107,8 @@ ubports: {
 	SOURCES+= $$ACR/probe-sched.c
 	SOURCES+= $$ACR/querier.c
 	SOURCES+= $$ACR/query-sched.c
+	SOURCES+= $$ACR/ratelimit.c
+	SOURCES+= $$ACR/reflector.c
 	SOURCES+= $$ACR/resolve-address.c
 	SOURCES+= $$ACR/resolve-host-name.c
 	SOURCES+= $$ACR/resolve-service.c
@@ -132,6 +134,6 @@ android: {
 	DISTFILES += $$PWD/QZeroConfNsdManager.java
 }
 
-HEADERS+= $$PWD/qzeroconfservice.h $$PWD/qzeroconfglobal.h
+HEADERS+= $$PWD/qzeroconfservice.h $$PWD/qzeroconfglobal.h $$PWD/qzeroconftxt_p.h
 
 SOURCES+= $$PWD/qzeroconfservice.cpp
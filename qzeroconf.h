@@ -35,6 +35,24 @@
 
 class QZeroConfPrivate;
 
+struct QZeroConfPublishInfo
+{
+	QByteArray name;
+	QByteArray type;
+	QByteArray domain;
+	quint16 port = 0;
+	QMap<QByteArray, QByteArray> txt;
+};
+
+// How long resolving a browsed service may take before it is given up on. Times are in ms.
+struct QZeroConfResolverTiming
+{
+	int timeout = 0;			// first attempt, 0 = derive from the latency seen on the interface (1 to 5 s)
+	int backoffFactor = 2;		// each retry waits this many times longer than the previous attempt
+	int maxRetries = 0;
+	int maxTimeout = 30000;		// 0 = no limit
+};
+
 class Q_ZEROCONF_EXPORT QZeroConf : public QObject
 {
 	Q_OBJECT
@@ -51,8 +69,12 @@ public:
     QZeroConf(QObject *parent = Q_NULLPTR);
 	~QZeroConf();
 	void startServicePublish(const char *name, const char *type, const char *domain, quint16 port, quint32 interface = 0);
+	void startServicePublish(const QList<QZeroConfPublishInfo> &services, quint32 interface = 0);
 	void stopServicePublish(void);
 	bool publishExists(void);
+	int publishService(const QZeroConfPublishInfo &service, quint32 interface = 0);
+	bool updateServiceTxt(int id, const QMap<QByteArray, QByteArray> &txt);
+	void unpublishService(int id);
 	inline void startBrowser(QString type)
 	{
 		startBrowser(type, QAbstractSocket::IPv4Protocol);
@@ -63,9 +85,23 @@ public:
 	void addServiceTxtRecord(QString nameOnly);
 	void addServiceTxtRecord(QString name, QString value);
 	void clearServiceTxtRecords();
+	void updateServiceTxtRecords();
+	// applies to services found by browsers started afterwards
+	inline void setResolverTiming(const QZeroConfResolverTiming &timing)
+	{
+		resolverTimingPolicy = timing;
+	}
+	inline QZeroConfResolverTiming resolverTiming(void) const
+	{
+		return resolverTimingPolicy;
+	}
+	// queries of all instances are held back at least this long (ms), so that they share packets
+	static void setQueryAggregationWindow(int msec);
 
 Q_SIGNALS:
 	void servicePublished(void);
+	void publishedService(int id);
+	void publishError(int id, QZeroConf::error_t);
 	void serviceNameChanged(const QString &newName);
 	void error(QZeroConf::error_t);
 	void serviceAdded(QZeroConfService);
@@ -75,6 +111,7 @@ Q_SIGNALS:
 private:
 	QZeroConfPrivate	*pri;
 	QMap<QString, QZeroConfService> services;
+	QZeroConfResolverTiming resolverTimingPolicy;
 
 
 
@@ -0,0 +1,104 @@
+/**************************************************************************************************
+---------------------------------------------------------------------------------------------------
+	Copyright (C) 2015  Jonathan Bagg
+	This file is part of QtZeroConf.
+
+	QtZeroConf is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	QtZeroConf is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with QtZeroConf.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------------------------------
+   Project name : QtZeroConf
+   File name    : qzeroconftxt_p.h
+   Created      : 19 October 2026
+---------------------------------------------------------------------------------------------------
+   Rate limiting of txt record updates, shared by all backends
+---------------------------------------------------------------------------------------------------
+**************************************************************************************************/
+#ifndef QZEROCONFTXT_P_H_
+#define QZEROCONFTXT_P_H_
+
+#include <functional>
+#include <QHash>
+#include <QTimer>
+#include <QElapsedTimer>
+
+// Sends at most one txt update per service and interval, carrying the latest txt records: an update
+// goes out right away if the previous one of the service is old enough, otherwise once the interval
+// has passed.  Updates requested meanwhile are folded into that one.
+class QZeroConfTxtUpdater
+{
+public:
+	// RFC 6762 section 8.4 allows multicasting a record at most once per second
+	static const int interval = 1000;		// ms
+	static const int servicePublishId = 0;	// the service of startServicePublish(), publishService() ids start at 1
+
+	explicit QZeroConfTxtUpdater(std::function<void(int)> send) : send(send) {}
+	~QZeroConfTxtUpdater()
+	{
+		for (Service *service : services) {
+			delete service->timer;
+			delete service;
+		}
+	}
+
+	void request(int id)
+	{
+		Service *service = services.value(id);
+		if (!service) {
+			service = new Service;
+			service->timer = new QTimer;
+			service->timer->setSingleShot(true);
+			QObject::connect(service->timer, &QTimer::timeout, [this, id]() { fire(id); });
+			services.insert(id, service);
+		}
+		if (service->timer->isActive())
+			return;
+
+		qint64 wait = service->age.isValid() ? interval - service->age.elapsed() : 0;
+		if (wait > 0)
+			service->timer->start(static_cast<int>(wait));
+		else
+			fire(id);
+	}
+
+	// the service is gone, drop its pending update.  Safe to call from send()
+	void cancel(int id)
+	{
+		Service *service = services.take(id);
+		if (!service)
+			return;
+		service->timer->stop();
+		service->timer->deleteLater();
+		delete service;
+	}
+
+private:
+	struct Service
+	{
+		QTimer *timer;
+		QElapsedTimer age;		// since the last update was sent
+	};
+
+	void fire(int id)
+	{
+		Service *service = services.value(id);
+		if (!service)
+			return;
+		service->age.start();
+		send(id);
+	}
+
+	std::function<void(int)> send;
+	QHash<int, Service *> services;
+};
+
+#endif	// QZEROCONFTXT_P_H_
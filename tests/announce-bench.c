@@ -0,0 +1,137 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Commits N entry groups (argv[1], default 1000) with one service each
+ * at once, and counts the packets, send calls and main loop iterations
+ * it takes until all of them are established and announced. Linked
+ * with -Wl,--wrap=sendmsg,--wrap=sendmmsg to count the packets. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/socket.h>
+
+#include <avahi-common/error.h>
+#include <avahi-common/malloc.h>
+#include <avahi-common/timeval.h>
+#include <avahi-common/gccmacro.h>
+#include <avahi-core/core.h>
+#include <avahi-core/publish.h>
+
+#include "test-server.h"
+
+/* Probing takes 750ms, the three announcements another 3s */
+#define ANNOUNCE_MSEC 4000
+
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+int __real_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned vlen, int flags);
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags);
+int __wrap_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned vlen, int flags);
+
+static unsigned n_packets = 0, n_calls = 0;
+static unsigned n_established = 0, n_groups = 0;
+static int all_established = 0;
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags) {
+    ssize_t r = __real_sendmsg(fd, msg, flags);
+
+    n_calls++;
+    if (r >= 0)
+        n_packets++;
+
+    return r;
+}
+
+int __wrap_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned vlen, int flags) {
+    int r = __real_sendmmsg(fd, msgvec, vlen, flags);
+
+    n_calls++;
+    if (r > 0)
+        n_packets += (unsigned) r;
+
+    return r;
+}
+
+static void group_callback(AVAHI_GCC_UNUSED AvahiServer *s, AVAHI_GCC_UNUSED AvahiSEntryGroup *g, AvahiEntryGroupState state, AVAHI_GCC_UNUSED void *userdata) {
+    assert(state != AVAHI_ENTRY_GROUP_COLLISION && state != AVAHI_ENTRY_GROUP_FAILURE);
+
+    if (state == AVAHI_ENTRY_GROUP_ESTABLISHED && ++n_established == n_groups)
+        all_established = 1;
+}
+
+int main(int argc, char *argv[]) {
+    AvahiServerConfig config;
+    AvahiServer *s;
+    AvahiSEntryGroup **groups;
+    unsigned i, packets, calls, iterations;
+    struct timeval start;
+    AvahiUsec usec;
+
+    n_groups = argc > 1 ? (unsigned) atoi(argv[1]) : 1000;
+    assert(n_groups > 0);
+
+    avahi_server_config_init(&config);
+    config.publish_workstation = 0;
+    config.use_ipv6 = 0;
+    config.host_name = avahi_strdup("announce-bench");
+
+    if (!(s = test_server_new(&config)))
+        return 1;
+
+    /* Let the host name announcements pass */
+    test_run(ANNOUNCE_MSEC);
+
+    groups = avahi_new(AvahiSEntryGroup*, n_groups);
+    for (i = 0; i < n_groups; i++) {
+        char name[32];
+        int r;
+
+        snprintf(name, sizeof(name), "Device %u", i);
+        groups[i] = avahi_s_entry_group_new(s, group_callback, NULL);
+        r = avahi_server_add_service(s, groups[i], AVAHI_IF_UNSPEC, AVAHI_PROTO_INET, 0, name, "_announce._tcp", NULL, NULL, (uint16_t) (1000 + i), "a=b", NULL);
+        assert(r == AVAHI_OK);
+    }
+
+    packets = n_packets;
+    calls = n_calls;
+    iterations = test_iterations();
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < n_groups; i++)
+        avahi_s_entry_group_commit(groups[i]);
+
+    if (!test_run_until(&all_established, ANNOUNCE_MSEC)) {
+        fprintf(stderr, "Only %u of %u groups established\n", n_established, n_groups);
+        return 1;
+    }
+    usec = avahi_age(&start);
+
+    /* The announcements that follow */
+    test_run(ANNOUNCE_MSEC);
+
+    printf("%u groups established after %lld ms\n", n_groups, (long long) usec / 1000);
+    printf("packets=%u send calls=%u iterations=%u\n", n_packets - packets, n_calls - calls, test_iterations() - iterations);
+
+    avahi_free(groups);
+
+    test_server_free(s);
+    avahi_server_config_free(&config);
+
+    return 0;
+}
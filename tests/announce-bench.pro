@@ -0,0 +1,4 @@
+TARGET = announce-bench
+include($$PWD/tests.pri)
+SOURCES+= $$PWD/announce-bench.c
+QMAKE_LFLAGS+= -Wl,--wrap=sendmsg -Wl,--wrap=sendmmsg
@@ -0,0 +1,161 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Adds N services (argv[1], default 3000) with one call to
+ * avahi_server_add_service_batch() and, for comparison, with one call
+ * to avahi_server_add_service_strlst() each. Then checks that a batch
+ * is added completely or not at all. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <avahi-common/malloc.h>
+#include <avahi-common/error.h>
+#include <avahi-common/timeval.h>
+#include <avahi-core/core.h>
+#include <avahi-core/publish.h>
+
+#include "test-server.h"
+
+static AvahiServicePublishInfo *services_new(unsigned n, AvahiStringList *strlst) {
+    AvahiServicePublishInfo *services;
+    unsigned i;
+
+    services = avahi_new0(AvahiServicePublishInfo, n);
+
+    for (i = 0; i < n; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "Device %u", i);
+        services[i].name = avahi_strdup(name);
+        services[i].type = (i & 1) ? "_bee._tcp" : "_cee._tcp";
+        services[i].port = (uint16_t) (1000 + i);
+        services[i].strlst = strlst;
+    }
+
+    return services;
+}
+
+static void services_free(AvahiServicePublishInfo *services, unsigned n) {
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+        avahi_free((char*) services[i].name);
+
+    avahi_free(services);
+}
+
+static void check_batch(AvahiServer *s, const AvahiServicePublishInfo *services, unsigned n, int expected) {
+    AvahiSEntryGroup *g;
+    int r;
+
+    g = avahi_s_entry_group_new(s, NULL, NULL);
+    r = avahi_server_add_service_batch(s, g, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0, services, n);
+    printf("batch of %u -> %s\n", n, avahi_strerror(r));
+
+    assert(r == expected);
+
+    /* Nothing stays behind, and the group can still be used */
+    assert(avahi_s_entry_group_is_empty(g));
+    assert(avahi_s_entry_group_get_state(g) == AVAHI_ENTRY_GROUP_UNCOMMITED);
+
+    avahi_s_entry_group_free(g);
+}
+
+int main(int argc, char *argv[]) {
+    AvahiServerConfig config;
+    AvahiServer *s;
+    AvahiSEntryGroup *batch, *single;
+    AvahiServicePublishInfo *services;
+    AvahiStringList *strlst;
+    struct timeval start;
+    AvahiUsec batch_usec, single_usec;
+    unsigned n, i;
+    int r;
+
+    n = argc > 1 ? (unsigned) atoi(argv[1]) : 3000;
+    assert(n >= 2);
+
+    avahi_server_config_init(&config);
+    config.publish_workstation = 0;
+    config.use_ipv6 = 0;
+    config.host_name = avahi_strdup("batch-bench");
+
+    if (!(s = test_server_new(&config)))
+        return 1;
+
+    strlst = avahi_string_list_new("a=b", NULL);
+    services = services_new(n, strlst);
+
+    batch = avahi_s_entry_group_new(s, NULL, NULL);
+    gettimeofday(&start, NULL);
+    r = avahi_server_add_service_batch(s, batch, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0, services, n);
+    batch_usec = avahi_age(&start);
+    assert(r == AVAHI_OK);
+    assert(avahi_s_entry_group_get_state(batch) != AVAHI_ENTRY_GROUP_UNCOMMITED);
+
+    /* The same services under another type, one at a time */
+    single = avahi_s_entry_group_new(s, NULL, NULL);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < n; i++) {
+        r = avahi_server_add_service_strlst(s, single, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0, services[i].name, (i & 1) ? "_dee._tcp" : "_eee._tcp", NULL, NULL, services[i].port, strlst);
+        assert(r == AVAHI_OK);
+    }
+    r = avahi_s_entry_group_commit(single);
+    single_usec = avahi_age(&start);
+    assert(r == AVAHI_OK);
+
+    printf("%u services: batch %lld us, one by one %lld us\n", n, (long long) batch_usec, (long long) single_usec);
+
+    /* A committed group can't take a batch */
+    r = avahi_server_add_service_batch(s, batch, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0, services, 1);
+    assert(r == AVAHI_ERR_BAD_STATE);
+
+    {
+        AvahiServicePublishInfo invalid[2] = {
+            { "Fine", "_fff._tcp", NULL, NULL, 1, NULL },
+            { "Broken", "fff", NULL, NULL, 2, NULL }
+        };
+        AvahiServicePublishInfo duplicate[2] = {
+            { "Twin", "_fff._tcp", NULL, NULL, 1, NULL },
+            { "Twin", "_fff._tcp", NULL, NULL, 2, NULL }
+        };
+        AvahiServicePublishInfo collision[3] = {
+            { "New 1", "_bee._tcp", NULL, NULL, 1, NULL },
+            { "New 2", "_fff._tcp", NULL, NULL, 2, NULL },
+            { "Device 1", "_bee._tcp", NULL, NULL, 3, NULL }
+        };
+
+        /* Rejected before anything is added */
+        check_batch(s, invalid, 2, AVAHI_ERR_INVALID_SERVICE_TYPE);
+        check_batch(s, duplicate, 2, AVAHI_ERR_COLLISION);
+
+        /* Rolled back after the first two were added */
+        check_batch(s, collision, 3, AVAHI_ERR_COLLISION);
+    }
+
+    services_free(services, n);
+    avahi_string_list_free(strlst);
+
+    test_server_free(s);
+    avahi_server_config_free(&config);
+
+    return 0;
+}
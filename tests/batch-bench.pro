@@ -0,0 +1,3 @@
+TARGET = batch-bench
+include($$PWD/tests.pri)
+SOURCES+= $$PWD/batch-bench.c
@@ -0,0 +1,166 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Floods a small interface cache with records and checks what gets
+ * evicted: the least recently updated records, but never those of a
+ * key some querier uses. Once all cached records are in use, new ones
+ * are rejected. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include <avahi-common/malloc.h>
+#include <avahi-common/gccmacro.h>
+#include <avahi-core/core.h>
+
+#include "avahi-core/internal.h"
+#include "avahi-core/cache.h"
+#include "avahi-core/querier.h"
+
+#include "test-server.h"
+
+#define CACHE_ENTRIES_MAX 100
+#define FLOOD 10000
+
+static AvahiInterface *interface = NULL;
+static AvahiAddress source;
+
+static AvahiRecord *record_new(const char *prefix, unsigned k) {
+    AvahiRecord *r;
+    char name[64];
+
+    snprintf(name, sizeof(name), "%s-%u.local", prefix, k);
+    r = avahi_record_new_full(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_A, 120);
+    r->data.a.address.address = htonl(0x0a000000 | k);
+
+    return r;
+}
+
+static void update(AvahiRecord *r) {
+    avahi_cache_update(interface->cache, r, 0, &source);
+}
+
+static void flood(const char *prefix, unsigned n, AvahiRecord *refresh) {
+    unsigned k;
+
+    for (k = 0; k < n; k++) {
+        AvahiRecord *r = record_new(prefix, k);
+
+        update(r);
+        avahi_record_unref(r);
+
+        /* Keep one record recently updated */
+        if (refresh && k % (CACHE_ENTRIES_MAX / 2) == 0)
+            update(refresh);
+    }
+}
+
+static int cached(AvahiRecord *r) {
+    AvahiCacheEntry *e;
+
+    for (e = interface->cache->entries; e; e = e->entry_next)
+        if (avahi_record_equal_no_ttl(e->record, r))
+            return 1;
+
+    return 0;
+}
+
+static void check_stats(AvahiServer *s, const char *what, AvahiServerCacheStats *st) {
+    avahi_server_get_cache_stats(s, TEST_IFINDEX, AVAHI_PROTO_INET, st);
+    printf("%s: entries=%u evictions=%u rejections=%u\n", what, st->n_entries, st->n_evictions, st->n_rejections);
+
+    assert(st->n_entries == interface->cache->n_entries);
+    assert(st->n_entries <= CACHE_ENTRIES_MAX);
+}
+
+int main(AVAHI_GCC_UNUSED int argc, AVAHI_GCC_UNUSED char *argv[]) {
+    AvahiServerConfig config;
+    AvahiServer *s;
+    AvahiServerCacheStats st;
+    AvahiRecord *wanted, *fresh, *late;
+    unsigned k;
+
+    avahi_server_config_init(&config);
+    config.publish_workstation = 0;
+    config.publish_addresses = 0;
+    config.use_ipv6 = 0;
+    config.n_cache_entries_max = CACHE_ENTRIES_MAX;
+    config.host_name = avahi_strdup("cache-test");
+
+    if (!(s = test_server_new(&config)))
+        return 1;
+
+    interface = test_interface(s, AVAHI_PROTO_INET);
+    assert(interface);
+    avahi_address_parse("192.0.2.99", AVAHI_PROTO_INET, &source);
+
+    /* A noisy network fills the cache, the oldest records make room */
+    flood("noise", FLOOD, NULL);
+    check_stats(s, "flood", &st);
+    assert(st.n_entries == CACHE_ENTRIES_MAX);
+    assert(st.n_evictions == FLOOD - CACHE_ENTRIES_MAX);
+    assert(st.n_rejections == 0);
+
+    /* A browsed record survives the flood, and so does one that keeps
+     * being refreshed */
+    wanted = record_new("wanted", 1);
+    fresh = record_new("fresh", 1);
+    avahi_querier_add(interface, wanted->key, NULL);
+    update(wanted);
+    update(fresh);
+
+    flood("noise2", FLOOD, fresh);
+    check_stats(s, "flood with a browsed record", &st);
+    assert(cached(wanted));
+    assert(cached(fresh));
+
+    /* Without refreshes it goes eventually */
+    flood("noise3", CACHE_ENTRIES_MAX, NULL);
+    assert(!cached(fresh));
+    assert(cached(wanted));
+
+    /* Every cached record in use: new ones are rejected */
+    for (k = 0; k < CACHE_ENTRIES_MAX; k++) {
+        AvahiRecord *r = record_new("pinned", k);
+
+        avahi_querier_add(interface, r->key, NULL);
+        update(r);
+        avahi_record_unref(r);
+    }
+    check_stats(s, "pinned", &st);
+    assert(st.n_rejections == 1);
+
+    late = record_new("late", 1);
+    update(late);
+    check_stats(s, "late", &st);
+    assert(!cached(late));
+    assert(st.n_rejections == 2);
+    assert(cached(wanted));
+
+    avahi_record_unref(wanted);
+    avahi_record_unref(fresh);
+    avahi_record_unref(late);
+
+    test_server_free(s);
+    avahi_server_config_free(&config);
+
+    return 0;
+}
@@ -0,0 +1,3 @@
+TARGET = cache-test
+include($$PWD/tests.pri)
+SOURCES+= $$PWD/cache-test.c
@@ -0,0 +1,239 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Checks that record browsers follow CNAME chains arriving in any
+ * order, survive CNAME cycles, and that a CNAME notification reaches
+ * exactly the lookups for its name. argv[1] is the number of lookups
+ * for the last part, which is also timed (default 10000). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include <avahi-common/malloc.h>
+#include <avahi-common/timeval.h>
+#include <avahi-common/gccmacro.h>
+#include <avahi-core/core.h>
+#include <avahi-core/lookup.h>
+
+#include "avahi-core/internal.h"
+#include "avahi-core/cache.h"
+#include "avahi-core/multicast-lookup.h"
+
+#include "test-server.h"
+
+/* Record browsers start from a deferred time event */
+#define START_MSEC 100
+
+static AvahiInterface *interface = NULL;
+static AvahiAddress source;
+
+typedef struct Browse {
+    unsigned n_new;
+    char *last;
+} Browse;
+
+static void browser_callback(
+    AVAHI_GCC_UNUSED AvahiSRecordBrowser *b,
+    AVAHI_GCC_UNUSED AvahiIfIndex idx,
+    AVAHI_GCC_UNUSED AvahiProtocol protocol,
+    AvahiBrowserEvent event,
+    AvahiRecord *r,
+    AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+    void *userdata) {
+
+    Browse *browse = userdata;
+
+    if (event != AVAHI_BROWSER_NEW)
+        return;
+
+    /* Only the records at the end of the chain are reported */
+    assert(r->key->type == AVAHI_DNS_TYPE_A);
+
+    browse->n_new++;
+    avahi_free(browse->last);
+    browse->last = avahi_key_to_string(r->key);
+}
+
+static void add_cname(const char *name, const char *target) {
+    AvahiRecord *r;
+
+    r = avahi_record_new_full(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_CNAME, 120);
+    r->data.cname.name = avahi_strdup(target);
+    avahi_cache_update(interface->cache, r, 0, &source);
+    avahi_record_unref(r);
+}
+
+static void add_a(const char *name, uint32_t address) {
+    AvahiRecord *r;
+
+    r = avahi_record_new_full(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_A, 120);
+    r->data.a.address.address = htonl(address);
+    avahi_cache_update(interface->cache, r, 0, &source);
+    avahi_record_unref(r);
+}
+
+static AvahiSRecordBrowser *browse_a(AvahiServer *s, const char *name, Browse *browse) {
+    AvahiSRecordBrowser *b;
+    AvahiKey *k;
+
+    memset(browse, 0, sizeof(*browse));
+
+    k = avahi_key_new(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_A);
+    b = avahi_s_record_browser_new(s, TEST_IFINDEX, AVAHI_PROTO_INET, k, 0, browser_callback, browse);
+    avahi_key_unref(k);
+    assert(b);
+
+    test_run(START_MSEC);
+
+    return b;
+}
+
+static void lookup_callback(
+    AVAHI_GCC_UNUSED AvahiMulticastLookupEngine *e,
+    AVAHI_GCC_UNUSED AvahiIfIndex idx,
+    AVAHI_GCC_UNUSED AvahiProtocol protocol,
+    AVAHI_GCC_UNUSED AvahiBrowserEvent event,
+    AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+    AvahiRecord *r,
+    void *userdata) {
+
+    unsigned *hits = userdata;
+
+    assert(r->key->type == AVAHI_DNS_TYPE_CNAME);
+    (*hits)++;
+}
+
+static void notify_cnames(AvahiServer *s, unsigned n) {
+    AvahiMulticastLookup **lookups;
+    unsigned *hits, k;
+    struct timeval start;
+    AvahiUsec usec;
+    char name[64];
+
+    lookups = avahi_new(AvahiMulticastLookup*, n);
+    hits = avahi_new0(unsigned, n);
+
+    for (k = 0; k < n; k++) {
+        AvahiKey *key;
+
+        snprintf(name, sizeof(name), "host-%u.local", k);
+        key = avahi_key_new(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_A);
+        lookups[k] = avahi_multicast_lookup_new(s->multicast_lookup_engine, TEST_IFINDEX, AVAHI_PROTO_INET, key, lookup_callback, &hits[k]);
+        avahi_key_unref(key);
+    }
+
+    gettimeofday(&start, NULL);
+    for (k = 0; k < 2 * n; k++) {
+        AvahiRecord *r;
+
+        /* Every other name has no lookup */
+        snprintf(name, sizeof(name), (k & 1) ? "other-%u.local" : "host-%u.local", k / 2);
+        r = avahi_record_new_full(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_CNAME, 120);
+        r->data.cname.name = avahi_strdup("target.local");
+        avahi_multicast_lookup_engine_notify(s->multicast_lookup_engine, interface, r, AVAHI_BROWSER_NEW);
+        avahi_record_unref(r);
+    }
+    usec = avahi_age(&start);
+
+    printf("%u CNAME notifications with %u lookups took %lld us\n", 2 * n, n, (long long) usec);
+
+    for (k = 0; k < n; k++) {
+        assert(hits[k] == 1);
+        avahi_multicast_lookup_free(lookups[k]);
+    }
+
+    avahi_multicast_lookup_engine_cleanup(s->multicast_lookup_engine);
+
+    avahi_free(lookups);
+    avahi_free(hits);
+}
+
+int main(int argc, char *argv[]) {
+    AvahiServerConfig config;
+    AvahiServer *s;
+    AvahiSRecordBrowser *b;
+    Browse browse;
+    unsigned n;
+
+    n = argc > 1 ? (unsigned) atoi(argv[1]) : 10000;
+
+    avahi_server_config_init(&config);
+    config.publish_workstation = 0;
+    config.publish_addresses = 0;
+    config.use_ipv6 = 0;
+    config.host_name = avahi_strdup("cname-test");
+
+    if (!(s = test_server_new(&config)))
+        return 1;
+
+    interface = test_interface(s, AVAHI_PROTO_INET);
+    assert(interface);
+    avahi_address_parse("192.0.2.99", AVAHI_PROTO_INET, &source);
+
+    /* The chain arrives front to back, the browser follows each link */
+    b = browse_a(s, "alias1.local", &browse);
+    add_cname("alias1.local", "alias2.local");
+    add_cname("alias2.local", "alias3.local");
+    assert(browse.n_new == 0);
+    add_a("alias3.local", 0xc000024d);
+    assert(browse.n_new == 1);
+    assert(strstr(browse.last, "alias3.local"));
+    avahi_s_record_browser_free(b);
+    avahi_free(browse.last);
+
+    /* The chain is cached back to front, a new browser finds it all */
+    add_a("back3.local", 0xc000024e);
+    add_cname("back2.local", "back3.local");
+    add_cname("back1.local", "back2.local");
+    b = browse_a(s, "back1.local", &browse);
+    assert(browse.n_new == 1);
+    assert(strstr(browse.last, "back3.local"));
+    avahi_s_record_browser_free(b);
+    avahi_free(browse.last);
+
+    /* The middle link arrives last */
+    b = browse_a(s, "gap1.local", &browse);
+    add_cname("gap1.local", "gap2.local");
+    add_a("gap3.local", 0xc000024f);
+    assert(browse.n_new == 0);
+    add_cname("gap2.local", "gap3.local");
+    assert(browse.n_new == 1);
+    assert(strstr(browse.last, "gap3.local"));
+    avahi_s_record_browser_free(b);
+    avahi_free(browse.last);
+
+    /* A cycle is followed only up to the lookup limit */
+    b = browse_a(s, "loop1.local", &browse);
+    add_cname("loop1.local", "loop2.local");
+    add_cname("loop2.local", "loop1.local");
+    test_run(START_MSEC);
+    assert(browse.n_new == 0);
+    avahi_s_record_browser_free(b);
+
+    test_run(START_MSEC);
+    notify_cnames(s, n);
+
+    test_server_free(s);
+    avahi_server_config_free(&config);
+
+    return 0;
+}
@@ -0,0 +1,3 @@
+TARGET = cname-test
+include($$PWD/tests.pri)
+SOURCES+= $$PWD/cname-test.c
@@ -0,0 +1,324 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <avahi-common/llist.h>
+#include <avahi-common/malloc.h>
+#include <avahi-common/gccmacro.h>
+
+#include "avahi-core/socket.h"
+
+#include "dns-stub.h"
+
+/* Plain DNS over UDP, no EDNS0 */
+#define UDP_SIZE_MAX 512
+
+/* Two length bytes and a message of at most 64k */
+#define TCP_BUFFER_SIZE (2 + 0xFFFF)
+
+typedef struct DnsStubConnection DnsStubConnection;
+
+struct DnsStubConnection {
+    DnsStub *stub;
+    int fd;
+    AvahiWatch *watch;
+
+    uint8_t buffer[TCP_BUFFER_SIZE];
+    size_t size;
+
+    AVAHI_LLIST_FIELDS(DnsStubConnection, connections);
+};
+
+struct DnsStub {
+    const AvahiPoll *poll_api;
+    int udp_fd, tcp_fd;
+    AvahiWatch *udp_watch, *tcp_watch;
+
+    DnsStubCallback callback;
+    void *userdata;
+
+    unsigned n_queries, n_tcp_queries, n_connections;
+
+    AVAHI_LLIST_HEAD(DnsStubConnection, connections);
+};
+
+/* Returns the answer to the query in data, or NULL */
+static AvahiDnsPacket *handle_query(DnsStub *stub, const uint8_t *data, size_t size, int tcp) {
+    AvahiDnsPacket *p, *reply = NULL;
+    AvahiKey *key = NULL;
+
+    p = avahi_dns_packet_new(size + AVAHI_DNS_PACKET_EXTRA_SIZE);
+    assert(p);
+    memcpy(AVAHI_DNS_PACKET_DATA(p), data, size);
+    p->size = size;
+
+    if (avahi_dns_packet_check_valid(p) < 0 ||
+        !avahi_dns_packet_is_query(p) ||
+        avahi_dns_packet_get_field(p, AVAHI_DNS_FIELD_QDCOUNT) != 1 ||
+        !(key = avahi_dns_packet_consume_key(p, NULL)))
+        goto finish;
+
+    stub->n_queries++;
+    if (tcp)
+        stub->n_tcp_queries++;
+
+    reply = avahi_dns_packet_new_reply(p, tcp ? 0 : UDP_SIZE_MAX + AVAHI_DNS_PACKET_EXTRA_SIZE, 1, 1);
+    assert(reply);
+    avahi_dns_packet_set_field(reply, AVAHI_DNS_FIELD_FLAGS, AVAHI_DNS_FLAGS(1, 0, 1, 0, 1, 1, 0, 0, 0, 0));
+
+    if (!stub->callback(stub, p, key, reply, tcp, stub->userdata)) {
+        avahi_dns_packet_free(reply);
+        reply = NULL;
+    }
+
+finish:
+    if (key)
+        avahi_key_unref(key);
+
+    avahi_dns_packet_free(p);
+    return reply;
+}
+
+static void udp_event(AVAHI_GCC_UNUSED AvahiWatch *w, int fd, AVAHI_GCC_UNUSED AvahiWatchEvent events, void *userdata) {
+    DnsStub *stub = userdata;
+    uint8_t data[UDP_SIZE_MAX];
+    struct sockaddr_in sa;
+    socklen_t sa_len = sizeof(sa);
+    AvahiDnsPacket *reply;
+    ssize_t r;
+
+    if ((r = recvfrom(fd, data, sizeof(data), 0, (struct sockaddr*) &sa, &sa_len)) < 0)
+        return;
+
+    if (!(reply = handle_query(stub, data, (size_t) r, 0)))
+        return;
+
+    if (sendto(fd, AVAHI_DNS_PACKET_DATA(reply), reply->size, 0, (struct sockaddr*) &sa, sa_len) < 0)
+        perror("sendto");
+
+    avahi_dns_packet_free(reply);
+}
+
+static void connection_free(DnsStubConnection *c) {
+    assert(c);
+
+    AVAHI_LLIST_REMOVE(DnsStubConnection, connections, c->stub->connections, c);
+
+    c->stub->poll_api->watch_free(c->watch);
+    close(c->fd);
+    avahi_free(c);
+}
+
+static void connection_event(AVAHI_GCC_UNUSED AvahiWatch *w, int fd, AVAHI_GCC_UNUSED AvahiWatchEvent events, void *userdata) {
+    DnsStubConnection *c = userdata;
+    size_t offsets[64], n = 0, offset = 0, l;
+    uint8_t *out = NULL;
+    size_t out_size = 0;
+    int drop = 0;
+    ssize_t r;
+
+    if ((r = read(fd, c->buffer + c->size, sizeof(c->buffer) - c->size)) <= 0) {
+        connection_free(c);
+        return;
+    }
+
+    c->size += (size_t) r;
+
+    /* Collect the complete queries */
+    while (n < sizeof(offsets)/sizeof(offsets[0]) && c->size - offset >= 2) {
+        l = ((size_t) c->buffer[offset] << 8) | c->buffer[offset + 1];
+
+        if (c->size - offset < 2 + l)
+            break;
+
+        offsets[n++] = offset;
+        offset += 2 + l;
+    }
+
+    /* Pipelined queries are answered last first, so that the client
+     * has to match the answers by their IDs */
+    while (n > 0) {
+        AvahiDnsPacket *reply;
+
+        n--;
+        l = ((size_t) c->buffer[offsets[n]] << 8) | c->buffer[offsets[n] + 1];
+
+        if (!(reply = handle_query(c->stub, c->buffer + offsets[n] + 2, l, 1))) {
+            drop = 1;
+            continue;
+        }
+
+        out = avahi_realloc(out, out_size + 2 + reply->size);
+        assert(out);
+        out[out_size] = (uint8_t) (reply->size >> 8);
+        out[out_size + 1] = (uint8_t) reply->size;
+        memcpy(out + out_size + 2, AVAHI_DNS_PACKET_DATA(reply), reply->size);
+        out_size += 2 + reply->size;
+
+        avahi_dns_packet_free(reply);
+    }
+
+    memmove(c->buffer, c->buffer + offset, c->size - offset);
+    c->size -= offset;
+
+    /* The answers are small enough for the socket buffer */
+    if (out_size > 0 && write(fd, out, out_size) != (ssize_t) out_size)
+        perror("write");
+
+    avahi_free(out);
+
+    if (drop)
+        connection_free(c);
+}
+
+static void tcp_event(AVAHI_GCC_UNUSED AvahiWatch *w, int fd, AVAHI_GCC_UNUSED AvahiWatchEvent events, void *userdata) {
+    DnsStub *stub = userdata;
+    DnsStubConnection *c;
+    int cfd;
+
+    if ((cfd = accept(fd, NULL, NULL)) < 0) {
+        perror("accept");
+        return;
+    }
+
+    stub->n_connections++;
+
+    c = avahi_new0(DnsStubConnection, 1);
+    c->stub = stub;
+    c->fd = cfd;
+    c->watch = stub->poll_api->watch_new(stub->poll_api, cfd, AVAHI_WATCH_IN, connection_event, c);
+    assert(c->watch);
+
+    AVAHI_LLIST_PREPEND(DnsStubConnection, connections, stub->connections, c);
+}
+
+static int open_socket(int type) {
+    struct sockaddr_in sa;
+    int fd, yes = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(AVAHI_DNS_PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((fd = socket(AF_INET, type, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (type == SOCK_STREAM && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+        perror("SO_REUSEADDR");
+        goto fail;
+    }
+
+    if (bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0) {
+        perror("bind");
+        goto fail;
+    }
+
+    if (type == SOCK_STREAM && listen(fd, 5) < 0) {
+        perror("listen");
+        goto fail;
+    }
+
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+DnsStub *dns_stub_new(const AvahiPoll *poll_api, DnsStubCallback callback, void *userdata) {
+    DnsStub *stub;
+    int udp_fd, tcp_fd;
+
+    assert(poll_api);
+    assert(callback);
+
+    if ((udp_fd = open_socket(SOCK_DGRAM)) < 0)
+        return NULL;
+
+    if ((tcp_fd = open_socket(SOCK_STREAM)) < 0) {
+        close(udp_fd);
+        return NULL;
+    }
+
+    stub = avahi_new0(DnsStub, 1);
+    stub->poll_api = poll_api;
+    stub->udp_fd = udp_fd;
+    stub->tcp_fd = tcp_fd;
+    stub->callback = callback;
+    stub->userdata = userdata;
+    AVAHI_LLIST_HEAD_INIT(DnsStubConnection, stub->connections);
+
+    stub->udp_watch = poll_api->watch_new(poll_api, udp_fd, AVAHI_WATCH_IN, udp_event, stub);
+    stub->tcp_watch = poll_api->watch_new(poll_api, tcp_fd, AVAHI_WATCH_IN, tcp_event, stub);
+    assert(stub->udp_watch && stub->tcp_watch);
+
+    return stub;
+}
+
+void dns_stub_free(DnsStub *stub) {
+    assert(stub);
+
+    while (stub->connections)
+        connection_free(stub->connections);
+
+    stub->poll_api->watch_free(stub->udp_watch);
+    stub->poll_api->watch_free(stub->tcp_watch);
+    close(stub->udp_fd);
+    close(stub->tcp_fd);
+    avahi_free(stub);
+}
+
+unsigned dns_stub_queries(DnsStub *stub) {
+    assert(stub);
+
+    return stub->n_queries;
+}
+
+unsigned dns_stub_tcp_queries(DnsStub *stub) {
+    assert(stub);
+
+    return stub->n_tcp_queries;
+}
+
+unsigned dns_stub_connections(DnsStub *stub) {
+    assert(stub);
+
+    return stub->n_connections;
+}
+
+void dns_stub_append(AvahiDnsPacket *reply, unsigned field, AvahiRecord *r) {
+    assert(reply);
+    assert(field == AVAHI_DNS_FIELD_ANCOUNT || field == AVAHI_DNS_FIELD_NSCOUNT || field == AVAHI_DNS_FIELD_ARCOUNT);
+    assert(r);
+
+    if (!avahi_dns_packet_append_record(reply, r, 0, 0))
+        assert(0);
+
+    avahi_dns_packet_inc_field(reply, field);
+}
@@ -0,0 +1,55 @@
+#ifndef foodnsstubhfoo
+#define foodnsstubhfoo
+
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* A unicast DNS server on 127.0.0.1:53 for the wide area tests,
+ * listening on UDP and TCP. A callback fills in the answer to each
+ * query. Queries pipelined on a TCP connection are answered in reverse
+ * order. */
+
+#include <avahi-common/watch.h>
+
+#include "avahi-core/dns.h"
+
+typedef struct DnsStub DnsStub;
+
+/* Called for each query with a single question, key. reply already
+ * holds the ID, the question and the flags of a successful answer, tcp
+ * is set if the query came over TCP. Returns 0 to leave the query
+ * unanswered, which over TCP closes the connection. */
+typedef int (*DnsStubCallback)(DnsStub *stub, AvahiDnsPacket *query, AvahiKey *key, AvahiDnsPacket *reply, int tcp, void *userdata);
+
+/* Returns NULL if the ports can't be bound, usually for lack of
+ * privileges; the caller should skip the test then */
+DnsStub *dns_stub_new(const AvahiPoll *poll_api, DnsStubCallback callback, void *userdata);
+void dns_stub_free(DnsStub *stub);
+
+/* Number of queries received so far, of those over TCP, and number of
+ * TCP connections accepted */
+unsigned dns_stub_queries(DnsStub *stub);
+unsigned dns_stub_tcp_queries(DnsStub *stub);
+unsigned dns_stub_connections(DnsStub *stub);
+
+/* Appends r to the given section of reply, AVAHI_DNS_FIELD_ANCOUNT,
+ * _NSCOUNT or _ARCOUNT */
+void dns_stub_append(AvahiDnsPacket *reply, unsigned field, AvahiRecord *r);
+
+#endif
@@ -0,0 +1,223 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Replays RTM_NEWADDR/RTM_DELADDR sequences into iface-linux.c and
+ * checks which address records end up published: lifetime refreshes,
+ * extra addresses coming and going, deprecation, the link-local
+ * fallback, and the interface losing and regaining all its addresses.
+ * argv[1] is the number of lifetime refreshes (default 20000). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <avahi-common/error.h>
+#include <avahi-common/timeval.h>
+#include <avahi-common/malloc.h>
+#include <avahi-core/core.h>
+#include <avahi-core/publish.h>
+
+#include "avahi-core/internal.h"
+#include "avahi-core/announce.h"
+
+#include "test-server.h"
+
+/* Long enough for probing and the first announcements */
+#define SETTLE_MSEC 1500
+
+static AvahiServer *server = NULL;
+
+static AvahiInterfaceAddress *find_address(const char *address) {
+    AvahiAddress a;
+    AvahiInterface *i;
+    AvahiInterfaceAddress *ia;
+
+    if (!avahi_address_parse(address, AVAHI_PROTO_UNSPEC, &a))
+        assert(0);
+
+    if (!(i = test_interface(server, a.proto)))
+        return NULL;
+
+    for (ia = i->addresses; ia; ia = ia->address_next)
+        if (avahi_address_cmp(&ia->address, &a) == 0)
+            return ia;
+
+    return NULL;
+}
+
+/* 1 if the address record of the address is published, 0 if not, -1
+ * if the address is unknown */
+static int published(const char *address) {
+    AvahiInterfaceAddress *ia;
+
+    if (!(ia = find_address(address)))
+        return -1;
+
+    return ia->entry_group && !avahi_s_entry_group_is_empty(ia->entry_group);
+}
+
+static void new_address(const char *address, unsigned char scope, unsigned char flags) {
+    test_netlink_address(RTM_NEWADDR, address, strchr(address, ':') ? 64 : 24, scope, flags);
+}
+
+static void del_address(const char *address) {
+    test_netlink_address(RTM_DELADDR, address, strchr(address, ':') ? 64 : 24, RT_SCOPE_UNIVERSE, 0);
+}
+
+/* Number of entries of the group with an announcer on the interface,
+ * and of those that are registered there */
+static unsigned announced(AvahiSEntryGroup *g, AvahiInterface *i, unsigned *n_registered) {
+    AvahiEntry *e;
+    unsigned n = 0;
+
+    *n_registered = 0;
+
+    for (e = g->entries; e; e = e->by_group_next) {
+        AvahiAnnouncer *a;
+
+        if (e->dead)
+            continue;
+
+        for (a = e->announcers; a; a = a->by_entry_next)
+            if (a->interface == i)
+                break;
+
+        if (a) {
+            n++;
+
+            if (avahi_entry_is_registered(server, e, i))
+                (*n_registered)++;
+        }
+    }
+
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    AvahiServerConfig config;
+    AvahiSEntryGroup *g, *ipv4_group, *ipv6_group;
+    AvahiInterface *ipv6;
+    AvahiEntry *e;
+    unsigned n_refresh, k, n_entries, n_announced, n_registered;
+    struct timeval start;
+    int r;
+
+    n_refresh = argc > 1 ? (unsigned) atoi(argv[1]) : 20000;
+
+    avahi_server_config_init(&config);
+    config.publish_workstation = 0;
+    config.host_name = avahi_strdup("netlink-test");
+
+    if (!(server = test_server_new(&config)))
+        return 1;
+
+    g = avahi_s_entry_group_new(server, NULL, NULL);
+    r = avahi_server_add_service(server, g, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0, "Netlink Test", "_netlink._tcp", NULL, NULL, 1234, NULL);
+    assert(r == AVAHI_OK);
+    avahi_s_entry_group_commit(g);
+    test_run(SETTLE_MSEC);
+
+    /* The global address hides the link-local one */
+    assert(published(TEST_ADDRESS_IPV4) == 1);
+    assert(published(TEST_ADDRESS_IPV6) == 1);
+    assert(published(TEST_ADDRESS_LINK_LOCAL) == 0);
+
+    ipv6 = test_interface(server, AVAHI_PROTO_INET6);
+    n_entries = announced(g, ipv6, &n_registered);
+    assert(n_entries > 0 && n_registered == n_entries);
+
+    /* Lifetime refreshes change nothing, not even the entry groups */
+    ipv4_group = find_address(TEST_ADDRESS_IPV4)->entry_group;
+    ipv6_group = find_address(TEST_ADDRESS_IPV6)->entry_group;
+
+    gettimeofday(&start, NULL);
+    for (k = 0; k < n_refresh; k++) {
+        new_address(TEST_ADDRESS_IPV4, RT_SCOPE_UNIVERSE, 0);
+        new_address(TEST_ADDRESS_IPV6, RT_SCOPE_UNIVERSE, 0);
+        new_address(TEST_ADDRESS_LINK_LOCAL, RT_SCOPE_LINK, 0);
+    }
+    printf("%u lifetime refreshes took %lld us\n", 3 * n_refresh, (long long) avahi_age(&start));
+
+    assert(find_address(TEST_ADDRESS_IPV4)->entry_group == ipv4_group);
+    assert(find_address(TEST_ADDRESS_IPV6)->entry_group == ipv6_group);
+    assert(published(TEST_ADDRESS_LINK_LOCAL) == 0);
+
+    for (e = g->entries; e; e = e->by_group_next)
+        assert(avahi_entry_is_registered(server, e, ipv6));
+
+    /* Extra addresses come and go */
+    new_address("fd00::10", RT_SCOPE_UNIVERSE, 0);
+    new_address("fe80::1", RT_SCOPE_LINK, 0);
+    new_address("192.0.2.3", RT_SCOPE_UNIVERSE, 0);
+    test_run(SETTLE_MSEC);
+    assert(published("fd00::10") == 1);
+    assert(published("fe80::1") == 0);
+    assert(published("192.0.2.3") == 1);
+    assert(published(TEST_ADDRESS_IPV6) == 1);
+
+    del_address("192.0.2.3");
+    assert(published("192.0.2.3") == -1);
+    assert(published(TEST_ADDRESS_IPV4) == 1);
+
+    /* Without a global, non-deprecated address, all are published */
+    new_address(TEST_ADDRESS_IPV6, RT_SCOPE_UNIVERSE, IFA_F_DEPRECATED);
+    assert(published("fe80::1") == 0);
+    new_address("fd00::10", RT_SCOPE_UNIVERSE, IFA_F_DEPRECATED);
+    test_run(SETTLE_MSEC);
+    assert(published(TEST_ADDRESS_IPV6) == 1);
+    assert(published("fd00::10") == 1);
+    assert(published("fe80::1") == 1);
+    assert(published(TEST_ADDRESS_LINK_LOCAL) == 1);
+
+    del_address("fd00::10");
+    del_address("fe80::1");
+    assert(published("fd00::10") == -1);
+    assert(published(TEST_ADDRESS_LINK_LOCAL) == 1);
+
+    /* A usable global address hides the others again */
+    new_address(TEST_ADDRESS_IPV6, RT_SCOPE_UNIVERSE, 0);
+    test_run(SETTLE_MSEC);
+    assert(published(TEST_ADDRESS_IPV6) == 1);
+    assert(published(TEST_ADDRESS_LINK_LOCAL) == 0);
+
+    /* The interface loses all its addresses, then regains one: the
+     * service is announced there again */
+    del_address(TEST_ADDRESS_IPV6);
+    del_address(TEST_ADDRESS_LINK_LOCAL);
+    assert(!avahi_interface_is_relevant(ipv6));
+    assert(announced(g, ipv6, &n_registered) == 0);
+
+    new_address(TEST_ADDRESS_IPV6, RT_SCOPE_UNIVERSE, 0);
+    assert(avahi_interface_is_relevant(ipv6));
+    assert(announced(g, ipv6, &n_registered) == n_entries);
+    test_run(SETTLE_MSEC);
+    n_announced = announced(g, ipv6, &n_registered);
+    assert(n_announced == n_entries && n_registered == n_entries);
+    assert(published(TEST_ADDRESS_IPV6) == 1);
+
+    /* The IPv4 side never noticed */
+    assert(find_address(TEST_ADDRESS_IPV4)->entry_group == ipv4_group);
+    assert(published(TEST_ADDRESS_IPV4) == 1);
+
+    test_server_free(server);
+    avahi_server_config_free(&config);
+
+    return 0;
+}
@@ -0,0 +1,3 @@
+TARGET = netlink-test
+include($$PWD/tests.pri)
+SOURCES+= $$PWD/netlink-test.c
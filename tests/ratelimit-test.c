@@ -0,0 +1,241 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Checks the token buckets of the query rate limiter: bursts, refill,
+ * independent buckets per address and key, and the bound on the
+ * number of buckets, timing argv[1] (default 100000) checks from
+ * distinct addresses. Then floods the server with queries over the
+ * loopback device and checks what its limits drop. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <avahi-common/malloc.h>
+#include <avahi-common/timeval.h>
+#include <avahi-core/core.h>
+
+#include "avahi-core/internal.h"
+#include "avahi-core/ratelimit.h"
+#include "avahi-core/socket.h"
+
+#include "test-server.h"
+
+/* AVAHI_RATE_LIMITER_ENTRIES_MAX in ratelimit.c */
+#define ENTRIES_MAX 1024
+
+#define FLOOD 100
+#define SOURCE_BURST 20
+#define KEY_BURST 5
+
+static void address_new(uint32_t n, AvahiAddress *a) {
+    a->proto = AVAHI_PROTO_INET;
+    a->data.ipv4.address = htonl(0x0a000000 | n);
+}
+
+static void check_buckets(AvahiInterface *i) {
+    AvahiRateLimiter *l;
+    AvahiAddress a, b;
+    AvahiKey *k1, *k2;
+    unsigned n;
+
+    /* Ten per second, five in a row */
+    l = avahi_rate_limiter_new(10, 5);
+    address_new(1, &a);
+    address_new(2, &b);
+
+    for (n = 0; n < 5; n++)
+        assert(avahi_rate_limiter_check_address(l, &a));
+    assert(!avahi_rate_limiter_check_address(l, &a));
+    assert(avahi_rate_limiter_check_address(l, &b));
+    assert(avahi_rate_limiter_get_dropped(l) == 1);
+
+    /* A quarter second refills two and a half tokens */
+    usleep(250000);
+    assert(avahi_rate_limiter_check_address(l, &a));
+    assert(avahi_rate_limiter_check_address(l, &a));
+    assert(!avahi_rate_limiter_check_address(l, &a));
+    assert(avahi_rate_limiter_get_dropped(l) == 2);
+
+    avahi_rate_limiter_free(l);
+
+    /* Keys have their own buckets */
+    l = avahi_rate_limiter_new(1, 2);
+    k1 = avahi_key_new("a._limit._tcp.local", AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_SRV);
+    k2 = avahi_key_new("b._limit._tcp.local", AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_SRV);
+
+    assert(avahi_rate_limiter_check_key(l, i, k1));
+    assert(avahi_rate_limiter_check_key(l, i, k1));
+    assert(!avahi_rate_limiter_check_key(l, i, k1));
+    assert(avahi_rate_limiter_check_key(l, i, k2));
+    assert(avahi_rate_limiter_get_dropped(l) == 1);
+
+    avahi_key_unref(k1);
+    avahi_key_unref(k2);
+    avahi_rate_limiter_free(l);
+}
+
+static void check_bound(unsigned n) {
+    AvahiRateLimiter *l;
+    AvahiAddress a;
+    struct timeval start;
+    unsigned k;
+
+    assert(n > ENTRIES_MAX);
+
+    /* One per second, so that every bucket is empty after one check */
+    l = avahi_rate_limiter_new(1, 1);
+
+    gettimeofday(&start, NULL);
+    for (k = 0; k < n; k++) {
+        address_new(k, &a);
+        assert(avahi_rate_limiter_check_address(l, &a));
+    }
+    printf("%u checks from distinct addresses took %lld us\n", n, (long long) avahi_age(&start));
+
+    /* The least recently used buckets have been forgotten, so the
+     * first address has a full bucket again. The last one does not. */
+    address_new(0, &a);
+    assert(avahi_rate_limiter_check_address(l, &a));
+    address_new(n - 1, &a);
+    assert(!avahi_rate_limiter_check_address(l, &a));
+    address_new(n - ENTRIES_MAX + 1, &a);
+    assert(!avahi_rate_limiter_check_address(l, &a));
+
+    avahi_rate_limiter_free(l);
+}
+
+/* A socket sending multicast from the given address over the test
+ * interface, or -1 */
+static int open_sender(const char *address) {
+    struct sockaddr_in sa;
+    struct ip_mreqn mreq;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    inet_pton(AF_INET, address, &sa.sin_addr);
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_ifindex = TEST_IFINDEX;
+
+    if (bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0) {
+        perror("sender");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void send_queries(int fd, const char *name, unsigned n) {
+    struct sockaddr_in sa;
+    AvahiKey *key;
+    unsigned k;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(AVAHI_MDNS_PORT);
+    inet_pton(AF_INET, AVAHI_IPV4_MCAST_GROUP, &sa.sin_addr);
+
+    key = avahi_key_new(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_SRV);
+
+    for (k = 0; k < n; k++) {
+        AvahiDnsPacket *p = avahi_dns_packet_new_query(0);
+
+        avahi_dns_packet_append_key(p, key, 0);
+        avahi_dns_packet_set_field(p, AVAHI_DNS_FIELD_QDCOUNT, 1);
+
+        if (sendto(fd, AVAHI_DNS_PACKET_DATA(p), p->size, 0, (struct sockaddr*) &sa, sizeof(sa)) < 0)
+            perror("sendto");
+
+        avahi_dns_packet_free(p);
+    }
+
+    avahi_key_unref(key);
+}
+
+static int check_flood(AvahiServer *s) {
+    AvahiServerRateLimitStats st;
+    int fd1, fd2;
+
+    if ((fd1 = open_sender("127.0.0.1")) < 0 || (fd2 = open_sender("127.0.0.2")) < 0)
+        return -1;
+
+    /* Of one host's flood only the burst gets in, and only a few
+     * questions in there are answered */
+    send_queries(fd1, "a._limit._tcp.local", FLOOD);
+    test_run(200);
+    avahi_server_get_ratelimit_stats(s, &st);
+    printf("flood: dropped_source=%u dropped_key=%u\n", st.n_dropped_source, st.n_dropped_key);
+    assert(st.n_dropped_source == FLOOD - SOURCE_BURST);
+    assert(st.n_dropped_key == SOURCE_BURST - KEY_BURST);
+
+    /* Another host still gets its queries in, but that key is used up */
+    send_queries(fd2, "a._limit._tcp.local", KEY_BURST);
+    send_queries(fd2, "b._limit._tcp.local", KEY_BURST);
+    test_run(200);
+    avahi_server_get_ratelimit_stats(s, &st);
+    printf("second host: dropped_source=%u dropped_key=%u\n", st.n_dropped_source, st.n_dropped_key);
+    assert(st.n_dropped_source == FLOOD - SOURCE_BURST);
+    assert(st.n_dropped_key == SOURCE_BURST);
+
+    close(fd1);
+    close(fd2);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    AvahiServerConfig config;
+    AvahiServer *s;
+    unsigned n;
+    int r;
+
+    n = argc > 1 ? (unsigned) atoi(argv[1]) : 100000;
+
+    avahi_server_config_init(&config);
+    config.publish_workstation = 0;
+    config.use_ipv6 = 0;
+    config.query_ratelimit_source = 1;
+    config.query_ratelimit_source_burst = SOURCE_BURST;
+    config.query_ratelimit_key = 1;
+    config.query_ratelimit_key_burst = KEY_BURST;
+    config.host_name = avahi_strdup("ratelimit-test");
+
+    if (!(s = test_server_new(&config)))
+        return 1;
+
+    check_buckets(test_interface(s, AVAHI_PROTO_INET));
+    check_bound(n);
+    r = check_flood(s);
+
+    test_server_free(s);
+    avahi_server_config_free(&config);
+
+    return r < 0 ? TEST_SKIP : 0;
+}
@@ -0,0 +1,3 @@
+TARGET = ratelimit-test
+include($$PWD/tests.pri)
+SOURCES+= $$PWD/ratelimit-test.c
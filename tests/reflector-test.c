@@ -0,0 +1,217 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Feeds questions, responses and probes from the IPv4 side of the test
+ * interface into the reflector, which passes them to the IPv6 side,
+ * and checks its counters: repeats within a second are suppressed,
+ * except for goodbyes, probes, and answers to probes. Then reflects
+ * argv[1] (default 10000) distinct records and repeats them, and times
+ * that. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <avahi-common/malloc.h>
+#include <avahi-common/timeval.h>
+#include <avahi-common/gccmacro.h>
+#include <avahi-core/core.h>
+
+#include "avahi-core/internal.h"
+#include "avahi-core/reflector.h"
+
+#include "test-server.h"
+
+/* Until both sides are announcing */
+#define SETTLE_MSEC 300
+
+/* Past the suppression window */
+#define WINDOW_MSEC 1100
+
+/* AVAHI_REFLECTOR_HISTORY_MAX in reflector.c */
+#define HISTORY_MAX 1024
+
+static AvahiServer *server = NULL;
+static AvahiServerReflectorStats last;
+
+/* Checks the change of the counters since the last call */
+static void check_stats(const char *what, unsigned queries, unsigned responses, unsigned probes, unsigned forwarded, unsigned suppressed) {
+    AvahiServerReflectorStats st;
+
+    if (avahi_server_get_reflector_stats(server, &st) < 0)
+        assert(0);
+
+    printf("%s: queries=%u responses=%u probes=%u forwarded=%u suppressed=%u\n", what,
+           st.n_queries - last.n_queries,
+           st.n_responses - last.n_responses,
+           st.n_probes - last.n_probes,
+           st.n_forwarded - last.n_forwarded,
+           st.n_suppressed - last.n_suppressed);
+
+    assert(st.n_queries - last.n_queries == queries);
+    assert(st.n_responses - last.n_responses == responses);
+    assert(st.n_probes - last.n_probes == probes);
+    assert(st.n_forwarded - last.n_forwarded == forwarded);
+    assert(st.n_suppressed - last.n_suppressed == suppressed);
+
+    last = st;
+}
+
+static AvahiRecord *ptr_new(AvahiKey *k, const char *name, uint32_t ttl) {
+    AvahiRecord *r;
+
+    r = avahi_record_new(k, ttl);
+    r->data.ptr.name = avahi_strdup(name);
+
+    return r;
+}
+
+static void reflect_many(AvahiReflector *reflector, AvahiInterface *i, unsigned n) {
+    struct timeval start;
+    AvahiRecord **records;
+    AvahiUsec usec;
+    unsigned k, n_remembered;
+
+    records = avahi_new(AvahiRecord*, n);
+
+    for (k = 0; k < n; k++) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "device-%u.local", k);
+        records[k] = avahi_record_new_full(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_A, 120);
+        records[k]->data.a.address.address = 0x0a000000 | k;
+    }
+
+    gettimeofday(&start, NULL);
+    for (k = 0; k < n; k++)
+        avahi_reflector_response(reflector, i, records[k], 1);
+    usec = avahi_age(&start);
+    printf("%u records reflected in %lld us\n", n, (long long) usec);
+    check_stats("distinct", 0, n, 0, n, 0);
+
+    /* Only the most recent records are remembered. Repeated newest
+     * first, those are suppressed before the others push them out. */
+    n_remembered = n < HISTORY_MAX ? n : HISTORY_MAX;
+
+    gettimeofday(&start, NULL);
+    for (k = n; k > 0; k--)
+        avahi_reflector_response(reflector, i, records[k - 1], 1);
+    usec = avahi_age(&start);
+    printf("%u repeats handled in %lld us\n", n, (long long) usec);
+    check_stats("repeats", 0, n, 0, n - n_remembered, n_remembered);
+
+    for (k = 0; k < n; k++)
+        avahi_record_unref(records[k]);
+    avahi_free(records);
+}
+
+int main(int argc, char *argv[]) {
+    AvahiServerConfig config;
+    AvahiInterface *ipv4, *ipv6;
+    AvahiReflector *reflector;
+    AvahiKey *k, *srv_key;
+    AvahiRecord *r, *goodbye, *srv;
+    unsigned n;
+
+    n = argc > 1 ? (unsigned) atoi(argv[1]) : 10000;
+
+    avahi_server_config_init(&config);
+    config.publish_workstation = 0;
+    config.publish_addresses = 0;
+    config.enable_reflector = 1;
+    config.reflect_ipv = 1;
+    config.host_name = avahi_strdup("reflector-test");
+
+    if (!(server = test_server_new(&config)))
+        return 1;
+
+    test_run(SETTLE_MSEC);
+
+    reflector = server->reflector;
+    ipv4 = test_interface(server, AVAHI_PROTO_INET);
+    ipv6 = test_interface(server, AVAHI_PROTO_INET6);
+    assert(ipv4 && ipv4->announcing);
+    assert(ipv6 && ipv6->announcing);
+
+    k = avahi_key_new("_reflect._tcp.local", AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_PTR);
+    r = ptr_new(k, "a._reflect._tcp.local", 120);
+    goodbye = ptr_new(k, "a._reflect._tcp.local", 0);
+
+    srv_key = avahi_key_new("a._reflect._tcp.local", AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_SRV);
+    srv = avahi_record_new(srv_key, 120);
+    srv->data.srv.name = avahi_strdup("reflector-test.local");
+    srv->data.srv.port = 1234;
+
+    if (avahi_server_get_reflector_stats(server, &last) < 0)
+        assert(0);
+
+    /* The only way out of the IPv4 side is the IPv6 side */
+    avahi_reflector_query(reflector, ipv4, k);
+    assert(ipv4->n_reflect_targets == 1);
+    assert(ipv4->reflect_targets[0] == ipv6);
+    check_stats("query", 1, 0, 0, 1, 0);
+
+    avahi_reflector_query(reflector, ipv4, k);
+    check_stats("same query", 1, 0, 0, 0, 1);
+
+    avahi_reflector_response(reflector, ipv4, r, 0);
+    avahi_reflector_response(reflector, ipv4, r, 0);
+    check_stats("response twice", 0, 2, 0, 1, 1);
+
+    /* A goodbye always gets through, and so does the record when it
+     * is announced again right after */
+    avahi_reflector_response(reflector, ipv4, goodbye, 0);
+    avahi_reflector_response(reflector, ipv4, r, 0);
+    check_stats("goodbye and reannouncement", 0, 2, 0, 2, 0);
+
+    /* Probes are never suppressed, and clear the way for the answer
+     * that defends the name */
+    avahi_reflector_response(reflector, ipv4, srv, 1);
+    avahi_reflector_response(reflector, ipv4, srv, 1);
+    check_stats("unique record twice", 0, 2, 0, 1, 1);
+
+    avahi_reflector_probe(reflector, ipv4, srv);
+    avahi_reflector_probe(reflector, ipv4, srv);
+    check_stats("probe twice", 0, 0, 2, 2, 0);
+
+    avahi_reflector_response(reflector, ipv4, srv, 1);
+    check_stats("defense", 0, 1, 0, 1, 0);
+
+    avahi_reflector_response(reflector, ipv4, srv, 1);
+    check_stats("defense repeated", 0, 1, 0, 0, 1);
+
+    /* The window passes */
+    test_run(WINDOW_MSEC);
+    avahi_reflector_query(reflector, ipv4, k);
+    check_stats("query a second later", 1, 0, 0, 1, 0);
+
+    reflect_many(reflector, ipv4, n);
+
+    avahi_key_unref(k);
+    avahi_key_unref(srv_key);
+    avahi_record_unref(r);
+    avahi_record_unref(goodbye);
+    avahi_record_unref(srv);
+
+    test_server_free(server);
+    avahi_server_config_free(&config);
+
+    return 0;
+}
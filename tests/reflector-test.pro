@@ -0,0 +1,3 @@
+TARGET = reflector-test
+include($$PWD/tests.pri)
+SOURCES+= $$PWD/reflector-test.c
@@ -0,0 +1,133 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Allocates argv[1] (default 10000) legacy unicast reflect slots at
+ * once, more than the table can hold, and times that and looking them
+ * all up again. Checks that the IDs are unique, that the excess is
+ * counted as exhaustion, and that the slots expire on time. Includes
+ * server.c for its static slot functions. */
+
+#include "avahi-core/server.c"
+
+#include "test-server.h"
+
+/* Expiry is checked every AVAHI_LEGACY_UNICAST_REFLECT_TICK_MSEC */
+#define EXPIRY_MSEC_MIN AVAHI_LEGACY_UNICAST_REFLECT_TIMEOUT_MSEC
+#define EXPIRY_MSEC_MAX (AVAHI_LEGACY_UNICAST_REFLECT_TIMEOUT_MSEC + 3*AVAHI_LEGACY_UNICAST_REFLECT_TICK_MSEC)
+
+/* Runs the main loop until all slots are gone, returns how long that took */
+static unsigned expire(AvahiServer *s) {
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+
+    while (s->n_legacy_unicast_reflect_slots > 0 && avahi_age(&start) < (AvahiUsec) EXPIRY_MSEC_MAX * 2000)
+        test_run(10);
+
+    assert(s->n_legacy_unicast_reflect_slots == 0);
+
+    return (unsigned) (avahi_age(&start) / 1000);
+}
+
+static void check_stats(AvahiServer *s, unsigned slots, unsigned exhausted) {
+    AvahiServerReflectorStats st;
+
+    if (avahi_server_get_reflector_stats(s, &st) < 0)
+        assert(0);
+
+    printf("slots=%u exhausted=%u table size=%u\n", st.n_legacy_unicast_slots, st.n_legacy_unicast_exhausted, s->legacy_unicast_reflect_slots_size);
+
+    assert(st.n_legacy_unicast_slots == slots);
+    assert(st.n_legacy_unicast_exhausted == exhausted);
+}
+
+int main(int argc, char *argv[]) {
+    AvahiServerConfig config;
+    AvahiServer *s;
+    uint16_t *ids;
+    uint8_t *used;
+    unsigned n, n_slots, k, msec;
+    struct timeval start;
+
+    n = argc > 1 ? (unsigned) atoi(argv[1]) : 10000;
+
+    avahi_server_config_init(&config);
+    config.publish_workstation = 0;
+    config.publish_addresses = 0;
+    config.use_ipv6 = 0;
+    config.enable_reflector = 1;
+    config.host_name = avahi_strdup("slots-bench");
+
+    if (!(s = test_server_new(&config)))
+        return 1;
+
+    ids = avahi_new0(uint16_t, n);
+    used = avahi_new0(uint8_t, 0x10000);
+    n_slots = 0;
+
+    gettimeofday(&start, NULL);
+    for (k = 0; k < n; k++) {
+        AvahiLegacyUnicastReflectSlot *slot;
+
+        if (!(slot = allocate_slot(s)))
+            continue;
+
+        slot->interface = TEST_IFINDEX;
+        ids[n_slots++] = slot->id;
+    }
+    printf("%u slots allocated in %lld us\n", n, (long long) avahi_age(&start));
+
+    n_slots = n < AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX ? n : AVAHI_LEGACY_UNICAST_REFLECT_SLOTS_MAX;
+    check_stats(s, n_slots, n - n_slots);
+
+    gettimeofday(&start, NULL);
+    for (k = 0; k < n_slots; k++) {
+        AvahiLegacyUnicastReflectSlot *slot = find_slot(s, ids[k]);
+
+        assert(slot && slot->id == ids[k]);
+    }
+    printf("%u slots found in %lld us\n", n_slots, (long long) avahi_age(&start));
+
+    for (k = 0; k < n_slots; k++) {
+        assert(!used[ids[k]]);
+        used[ids[k]] = 1;
+    }
+
+    /* All of them go at once, and then the timer stops */
+    msec = expire(s);
+    printf("%u slots expired after %u ms\n", n_slots, msec);
+    assert(msec >= EXPIRY_MSEC_MIN && msec <= EXPIRY_MSEC_MAX);
+    assert(!s->legacy_unicast_reflect_time_event);
+    assert(!find_slot(s, ids[0]));
+
+    /* A slot allocated between two ticks lives just as long */
+    test_run(AVAHI_LEGACY_UNICAST_REFLECT_TICK_MSEC / 2);
+    assert(allocate_slot(s));
+    msec = expire(s);
+    printf("1 slot expired after %u ms\n", msec);
+    assert(msec >= EXPIRY_MSEC_MIN && msec <= EXPIRY_MSEC_MAX);
+
+    avahi_free(ids);
+    avahi_free(used);
+
+    test_server_free(s);
+    avahi_server_config_free(&config);
+
+    return 0;
+}
@@ -0,0 +1,5 @@
+TARGET = slots-bench
+include($$PWD/tests.pri)
+# Includes server.c
+SOURCES-= $$PWD/../avahi-core/server.c
+SOURCES+= $$PWD/slots-bench.c
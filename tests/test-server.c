@@ -0,0 +1,267 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include <avahi-common/simple-watch.h>
+#include <avahi-common/timeval.h>
+#include <avahi-common/error.h>
+#include <avahi-common/gccmacro.h>
+
+#include "avahi-core/internal.h"
+#include "avahi-core/netlink.h"
+
+#include "test-server.h"
+
+#define RUNNING_TIMEOUT_MSEC 5000
+
+AvahiNetlink *__wrap_avahi_netlink_new(const AvahiPoll *poll_api, uint32_t groups, AvahiNetlinkCallback callback, void* userdata);
+void __wrap_avahi_netlink_free(AvahiNetlink *n);
+int __wrap_avahi_netlink_send(AvahiNetlink *n, struct nlmsghdr *m, unsigned *ret_seq);
+int __wrap_avahi_netlink_work(AvahiNetlink *n, int block);
+
+static AvahiSimplePoll *simple_poll = NULL;
+static int server_running = 0;
+static unsigned iterations = 0;
+
+/* There is no real netlink socket, the callback stands in for it */
+static AvahiNetlinkCallback netlink_callback = NULL;
+static void *netlink_userdata = NULL;
+static uint16_t netlink_request = 0;
+static unsigned netlink_seq = 0;
+static uint8_t netlink_buffer[1024];
+
+#define NETLINK ((AvahiNetlink*) &netlink_callback)
+
+static struct nlmsghdr *netlink_message(uint16_t type, size_t size) {
+    struct nlmsghdr *n = (struct nlmsghdr*) netlink_buffer;
+
+    memset(netlink_buffer, 0, sizeof(netlink_buffer));
+    n->nlmsg_type = type;
+    n->nlmsg_len = NLMSG_LENGTH(size);
+    n->nlmsg_seq = netlink_seq;
+
+    return n;
+}
+
+static void netlink_attribute(struct nlmsghdr *n, unsigned short type, const void *data, size_t size) {
+    struct rtattr *a = (struct rtattr*) ((uint8_t*) n + NLMSG_ALIGN(n->nlmsg_len));
+
+    assert(NLMSG_ALIGN(n->nlmsg_len) + RTA_SPACE(size) <= sizeof(netlink_buffer));
+
+    a->rta_type = type;
+    a->rta_len = RTA_LENGTH(size);
+    memcpy(RTA_DATA(a), data, size);
+    n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(a->rta_len);
+}
+
+static void netlink_deliver(struct nlmsghdr *n) {
+    assert(netlink_callback);
+
+    netlink_callback(NETLINK, n, netlink_userdata);
+}
+
+static void netlink_link(void) {
+    struct nlmsghdr *n = netlink_message(RTM_NEWLINK, sizeof(struct ifinfomsg));
+    struct ifinfomsg *ifi = NLMSG_DATA(n);
+    uint32_t mtu = 1500;
+
+    /* Not flagged IFF_LOOPBACK, otherwise avahi would ignore it */
+    ifi->ifi_family = AF_UNSPEC;
+    ifi->ifi_index = TEST_IFINDEX;
+    ifi->ifi_flags = IFF_UP|IFF_RUNNING|IFF_MULTICAST;
+
+    netlink_attribute(n, IFLA_IFNAME, TEST_IFNAME, sizeof(TEST_IFNAME));
+    netlink_attribute(n, IFLA_MTU, &mtu, sizeof(mtu));
+    netlink_deliver(n);
+}
+
+static void netlink_done(void) {
+    netlink_deliver(netlink_message(NLMSG_DONE, 0));
+}
+
+void test_netlink_address(uint16_t type, const char *address, unsigned prefix, unsigned char scope, unsigned char flags) {
+    struct nlmsghdr *n;
+    struct ifaddrmsg *ifa;
+    uint8_t data[16];
+    int family;
+
+    assert(type == RTM_NEWADDR || type == RTM_DELADDR);
+    assert(address);
+
+    family = strchr(address, ':') ? AF_INET6 : AF_INET;
+    if (inet_pton(family, address, data) != 1)
+        assert(0);
+
+    n = netlink_message(type, sizeof(struct ifaddrmsg));
+    ifa = NLMSG_DATA(n);
+    ifa->ifa_family = family;
+    ifa->ifa_index = TEST_IFINDEX;
+    ifa->ifa_prefixlen = prefix;
+    ifa->ifa_scope = scope;
+    ifa->ifa_flags = flags;
+
+    netlink_attribute(n, IFA_ADDRESS, data, family == AF_INET ? 4 : 16);
+    netlink_deliver(n);
+}
+
+AvahiNetlink *__wrap_avahi_netlink_new(AVAHI_GCC_UNUSED const AvahiPoll *poll_api, AVAHI_GCC_UNUSED uint32_t groups, AvahiNetlinkCallback callback, void* userdata) {
+    assert(!netlink_callback);
+
+    netlink_callback = callback;
+    netlink_userdata = userdata;
+    netlink_request = 0;
+
+    return NETLINK;
+}
+
+void __wrap_avahi_netlink_free(AvahiNetlink *n) {
+    assert(n == NETLINK);
+
+    netlink_callback = NULL;
+    netlink_userdata = NULL;
+}
+
+int __wrap_avahi_netlink_send(AvahiNetlink *n, struct nlmsghdr *m, unsigned *ret_seq) {
+    assert(n == NETLINK);
+    assert(m->nlmsg_type == RTM_GETLINK || m->nlmsg_type == RTM_GETADDR);
+
+    /* Answered by the next avahi_netlink_work() */
+    netlink_request = m->nlmsg_type;
+    m->nlmsg_seq = ++netlink_seq;
+
+    if (ret_seq)
+        *ret_seq = netlink_seq;
+
+    return 0;
+}
+
+int __wrap_avahi_netlink_work(AvahiNetlink *n, AVAHI_GCC_UNUSED int block) {
+    assert(n == NETLINK);
+
+    /* The end of one dump requests the next one */
+    while (netlink_request) {
+        uint16_t request = netlink_request;
+        netlink_request = 0;
+
+        if (request == RTM_GETLINK)
+            netlink_link();
+        else {
+            test_netlink_address(RTM_NEWADDR, TEST_ADDRESS_IPV4, 24, RT_SCOPE_UNIVERSE, 0);
+            test_netlink_address(RTM_NEWADDR, TEST_ADDRESS_IPV6, 64, RT_SCOPE_UNIVERSE, 0);
+            test_netlink_address(RTM_NEWADDR, TEST_ADDRESS_LINK_LOCAL, 64, RT_SCOPE_LINK, 0);
+        }
+
+        netlink_done();
+    }
+
+    return 0;
+}
+
+static void server_callback(AVAHI_GCC_UNUSED AvahiServer *s, AvahiServerState state, AVAHI_GCC_UNUSED void *userdata) {
+    if (state == AVAHI_SERVER_RUNNING)
+        server_running = 1;
+}
+
+AvahiServer *test_server_new(const AvahiServerConfig *c) {
+    AvahiServer *s;
+    int error;
+
+    assert(c);
+    assert(!simple_poll);
+
+    simple_poll = avahi_simple_poll_new();
+    server_running = 0;
+
+    if (!(s = avahi_server_new(avahi_simple_poll_get(simple_poll), c, server_callback, NULL, &error))) {
+        fprintf(stderr, "Failed to create server: %s\n", avahi_strerror(error));
+        goto fail;
+    }
+
+    if (!test_run_until(&server_running, RUNNING_TIMEOUT_MSEC)) {
+        fprintf(stderr, "Server did not start running\n");
+        avahi_server_free(s);
+        goto fail;
+    }
+
+    return s;
+
+fail:
+    avahi_simple_poll_free(simple_poll);
+    simple_poll = NULL;
+    return NULL;
+}
+
+void test_server_free(AvahiServer *s) {
+    assert(s);
+    assert(simple_poll);
+
+    avahi_server_free(s);
+    avahi_simple_poll_free(simple_poll);
+    simple_poll = NULL;
+}
+
+const AvahiPoll *test_poll_api(void) {
+    assert(simple_poll);
+
+    return avahi_simple_poll_get(simple_poll);
+}
+
+int test_run_until(const int *done, unsigned msec) {
+    struct timeval end;
+
+    assert(simple_poll);
+
+    gettimeofday(&end, NULL);
+    avahi_timeval_add(&end, (AvahiUsec) msec * 1000);
+
+    while (!(done && *done)) {
+        AvahiUsec left = -avahi_age(&end);
+
+        if (left <= 0)
+            break;
+
+        /* Sleep until the next event, so that the iterations count
+         * only wakeups caused by the server */
+        iterations++;
+
+        if (avahi_simple_poll_iterate(simple_poll, (int) (left / 1000) + 1) < 0)
+            break;
+    }
+
+    return done && *done;
+}
+
+void test_run(unsigned msec) {
+    test_run_until(NULL, msec);
+}
+
+unsigned test_iterations(void) {
+    return iterations;
+}
+
+AvahiInterface *test_interface(AvahiServer *s, AvahiProtocol protocol) {
+    assert(s);
+
+    return avahi_interface_monitor_get_interface(s->monitor, TEST_IFINDEX, protocol);
+}
@@ -0,0 +1,62 @@
+#ifndef footestserverhfoo
+#define footestserverhfoo
+
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* An AvahiServer for the tests in this directory. The avahi_netlink_*()
+ * functions are replaced at link time (-Wl,--wrap), so instead of the
+ * host's interfaces the server sees only the loopback device, with the
+ * addresses below. Further address changes are fed in with
+ * test_netlink_address(). */
+
+#include <avahi-common/watch.h>
+#include <avahi-core/core.h>
+
+#include "avahi-core/iface.h"
+
+#define TEST_IFINDEX 1
+#define TEST_IFNAME "lo"
+#define TEST_ADDRESS_IPV4 "192.0.2.2"
+#define TEST_ADDRESS_IPV6 "fd00::2"
+#define TEST_ADDRESS_LINK_LOCAL "fe80::2"
+
+/* Exit code of a test that can't run here, as with automake */
+#define TEST_SKIP 77
+
+/* Creates the server and runs the main loop until it is running.
+ * Returns NULL if that doesn't happen within a few seconds. */
+AvahiServer *test_server_new(const AvahiServerConfig *c);
+void test_server_free(AvahiServer *s);
+
+const AvahiPoll *test_poll_api(void);
+
+/* Runs the main loop for the given time, or until *done is set */
+void test_run(unsigned msec);
+int test_run_until(const int *done, unsigned msec);
+
+/* Number of main loop iterations run so far */
+unsigned test_iterations(void);
+
+/* Delivers an RTM_NEWADDR or RTM_DELADDR message for TEST_IFINDEX */
+void test_netlink_address(uint16_t type, const char *address, unsigned prefix, unsigned char scope, unsigned char flags);
+
+AvahiInterface *test_interface(AvahiServer *s, AvahiProtocol protocol);
+
+#endif
@@ -0,0 +1,16 @@
+# One test program linked against the bundled avahi-core, with netlink
+# replaced by test-server.c
+TEMPLATE = app
+CONFIG += console testcase
+CONFIG -= qt app_bundle
+
+# Multicast groups are joined by interface index, see CMakeLists.txt
+DEFINES+= _GNU_SOURCE GETTEXT_PACKAGE HAVE_NETLINK HAVE_RECVMMSG HAVE_SENDMMSG HAVE_STRUCT_IP_MREQN
+INCLUDEPATH+= $$PWD/..
+
+HEADERS+= $$PWD/test-server.h
+SOURCES+= $$PWD/test-server.c
+SOURCES+= $$files($$PWD/../avahi-common/*.c)
+SOURCES+= $$files($$PWD/../avahi-core/*.c)
+
+QMAKE_LFLAGS+= -Wl,--wrap=avahi_netlink_new -Wl,--wrap=avahi_netlink_free -Wl,--wrap=avahi_netlink_send -Wl,--wrap=avahi_netlink_work
@@ -0,0 +1,16 @@
+# Tests and benchmarks for the bundled avahi-core, see CMakeLists.txt.
+# Run them with make check.
+TEMPLATE = subdirs
+
+linux {
+	SUBDIRS+= batch-bench.pro
+	SUBDIRS+= announce-bench.pro
+	SUBDIRS+= netlink-test.pro
+	SUBDIRS+= cname-test.pro
+	SUBDIRS+= cache-test.pro
+	SUBDIRS+= wide-area-test.pro
+	SUBDIRS+= wide-area-tcp-test.pro
+	SUBDIRS+= reflector-test.pro
+	SUBDIRS+= slots-bench.pro
+	SUBDIRS+= ratelimit-test.pro
+}
@@ -0,0 +1,253 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Runs wide area lookups against a DNS server stub that truncates
+ * large answers, and checks the fallback to TCP: pipelined queries on
+ * one connection, reuse of that connection, and failure when the
+ * server closes it. Also checks the fallback from EDNS0 queries to
+ * plain ones. Needs to bind port 53 on the loopback address. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include <avahi-common/error.h>
+#include <avahi-common/malloc.h>
+#include <avahi-common/timeval.h>
+#include <avahi-common/gccmacro.h>
+#include <avahi-core/core.h>
+
+#include "avahi-core/internal.h"
+#include "avahi-core/wide-area.h"
+
+#include "test-server.h"
+#include "dns-stub.h"
+
+/* Long enough for the retries before a lookup fails */
+#define LOOKUP_MSEC 20000
+
+/* Records in answers that don't fit into a UDP packet */
+#define BIG_ANSWER 100
+
+static AvahiServer *server = NULL;
+static DnsStub *stub = NULL;
+static unsigned n_edns0 = 0, n_formerr = 0;
+
+typedef struct Lookup {
+    unsigned n_new, n_all_for_now, n_failure;
+    int done;
+} Lookup;
+
+static void append_a(AvahiDnsPacket *reply, AvahiKey *key, uint32_t address) {
+    AvahiRecord *r;
+
+    r = avahi_record_new_full(key->name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_A, 300);
+    r->data.a.address.address = htonl(address);
+    dns_stub_append(reply, AVAHI_DNS_FIELD_ANCOUNT, r);
+    avahi_record_unref(r);
+}
+
+/* "big" names have answers too large for UDP, "noedns" names are on a
+ * server that refuses EDNS0, and for "drop" names the server closes
+ * the TCP connection */
+static int stub_callback(
+    AVAHI_GCC_UNUSED DnsStub *s,
+    AvahiDnsPacket *query,
+    AvahiKey *key,
+    AvahiDnsPacket *reply,
+    int tcp,
+    AVAHI_GCC_UNUSED void *userdata) {
+
+    int edns0, big, drop;
+    unsigned i;
+
+    edns0 = avahi_dns_packet_get_field(query, AVAHI_DNS_FIELD_ARCOUNT) > 0;
+    big = strncmp(key->name, "big", 3) == 0;
+    drop = strncmp(key->name, "drop", 4) == 0;
+
+    if (edns0)
+        n_edns0++;
+
+    if (edns0 && strncmp(key->name, "noedns", 6) == 0) {
+        n_formerr++;
+        avahi_dns_packet_set_field(reply, AVAHI_DNS_FIELD_FLAGS, AVAHI_DNS_FLAGS(1, 0, 1, 0, 1, 1, 0, 0, 0, 1));
+        return 1;
+    }
+
+    if (drop && tcp)
+        return 0;
+
+    if ((big || drop) && !tcp) {
+        avahi_dns_packet_set_field(reply, AVAHI_DNS_FIELD_FLAGS, AVAHI_DNS_FLAGS(1, 0, 1, 1, 1, 1, 0, 0, 0, 0));
+        return 1;
+    }
+
+    if (big) {
+        for (i = 0; i < BIG_ANSWER; i++)
+            append_a(reply, key, 0x0a000000 | i);
+
+        return 1;
+    }
+
+    append_a(reply, key, 0xc000024d);
+
+    if (!tcp) {
+        /* An OPT record, as EDNS0 servers add to their answers */
+        static const uint8_t opt[] = { 0, 0, AVAHI_DNS_TYPE_OPT, 0x10, 0, 0, 0, 0, 0, 0, 0 };
+
+        if (!avahi_dns_packet_append_bytes(reply, opt, sizeof(opt)))
+            assert(0);
+
+        avahi_dns_packet_inc_field(reply, AVAHI_DNS_FIELD_ARCOUNT);
+    }
+
+    return 1;
+}
+
+static void lookup_callback(
+    AVAHI_GCC_UNUSED AvahiWideAreaLookupEngine *e,
+    AvahiBrowserEvent event,
+    AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+    AvahiRecord *r,
+    void *userdata) {
+
+    Lookup *l = userdata;
+
+    switch (event) {
+        case AVAHI_BROWSER_NEW:
+            assert(r->key->type == AVAHI_DNS_TYPE_A);
+            l->n_new++;
+            break;
+
+        case AVAHI_BROWSER_ALL_FOR_NOW:
+            l->n_all_for_now++;
+            l->done = 1;
+            break;
+
+        case AVAHI_BROWSER_FAILURE:
+            l->n_failure++;
+            l->done = 1;
+            break;
+
+        default:
+            break;
+    }
+}
+
+static AvahiWideAreaLookup *lookup_new(const char *name, Lookup *l) {
+    AvahiWideAreaLookup *wl;
+    AvahiKey *k;
+
+    memset(l, 0, sizeof(*l));
+
+    k = avahi_key_new(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_A);
+    wl = avahi_wide_area_lookup_new(server->wide_area_lookup_engine, k, lookup_callback, l);
+    avahi_key_unref(k);
+    assert(wl);
+
+    return wl;
+}
+
+static void lookup(const char *name, Lookup *l) {
+    AvahiWideAreaLookup *wl;
+
+    wl = lookup_new(name, l);
+    test_run_until(&l->done, LOOKUP_MSEC);
+    assert(l->done);
+    avahi_wide_area_lookup_free(wl);
+}
+
+int main(AVAHI_GCC_UNUSED int argc, AVAHI_GCC_UNUSED char *argv[]) {
+    AvahiServerConfig config;
+    AvahiServerWideAreaStats st;
+    AvahiWideAreaLookup *wl1, *wl2;
+    Lookup l1, l2;
+    struct timeval start;
+
+    avahi_server_config_init(&config);
+    config.publish_workstation = 0;
+    config.publish_hinfo = 0;
+    config.publish_addresses = 0;
+    config.publish_domain = 0;
+    config.use_ipv6 = 0;
+    config.enable_wide_area = 1;
+    config.n_wide_area_servers = 1;
+    avahi_address_parse("127.0.0.1", AVAHI_PROTO_INET, &config.wide_area_servers[0]);
+    config.host_name = avahi_strdup("wide-area-tcp-test");
+
+    if (!(server = test_server_new(&config)))
+        return 1;
+
+    if (!(stub = dns_stub_new(test_poll_api(), stub_callback, NULL))) {
+        test_server_free(server);
+        avahi_server_config_free(&config);
+        return TEST_SKIP;
+    }
+
+    /* Queries carry an OPT record, the one in the answer is skipped */
+    lookup("a1.example", &l1);
+    assert(l1.n_new == 1 && l1.n_all_for_now == 1);
+    assert(n_edns0 == 1);
+
+    /* Two truncated answers, fetched again over a single connection */
+    wl1 = lookup_new("big1.example", &l1);
+    wl2 = lookup_new("big2.example", &l2);
+    test_run_until(&l1.done, LOOKUP_MSEC);
+    test_run_until(&l2.done, LOOKUP_MSEC);
+    assert(l1.n_new == BIG_ANSWER && l1.n_all_for_now == 1);
+    assert(l2.n_new == BIG_ANSWER && l2.n_all_for_now == 1);
+    assert(dns_stub_connections(stub) == 1);
+    assert(dns_stub_tcp_queries(stub) == 2);
+    avahi_wide_area_lookup_free(wl1);
+    avahi_wide_area_lookup_free(wl2);
+
+    /* The connection is still open for the next one */
+    lookup("big3.example", &l1);
+    assert(l1.n_new == BIG_ANSWER);
+    assert(dns_stub_connections(stub) == 1);
+
+    /* After one FORMERR the server only gets plain queries */
+    lookup("noedns1.example", &l1);
+    assert(l1.n_new == 1 && l1.n_all_for_now == 1);
+    assert(n_formerr == 1);
+    lookup("noedns2.example", &l1);
+    assert(l1.n_new == 1 && l1.n_all_for_now == 1);
+    assert(n_formerr == 1);
+
+    /* The server closes the connection on each try */
+    gettimeofday(&start, NULL);
+    lookup("drop1.example", &l1);
+    assert(l1.n_failure == 1);
+    printf("Lookup failed after %lld ms and %u connections\n", (long long) avahi_age(&start) / 1000, dns_stub_connections(stub));
+
+    /* A new connection for the next truncated answer */
+    lookup("big4.example", &l1);
+    assert(l1.n_new == BIG_ANSWER);
+
+    assert(avahi_server_get_wide_area_stats(server, &st, 1) == 1);
+    printf("queries=%u responses=%u timeouts=%u, %u queries over TCP\n", st.n_queries, st.n_responses, st.n_timeouts, dns_stub_tcp_queries(stub));
+
+    dns_stub_free(stub);
+    test_server_free(server);
+    avahi_server_config_free(&config);
+
+    return 0;
+}
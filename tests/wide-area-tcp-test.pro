@@ -0,0 +1,4 @@
+TARGET = wide-area-tcp-test
+include($$PWD/tests.pri)
+HEADERS+= $$PWD/dns-stub.h
+SOURCES+= $$PWD/dns-stub.c $$PWD/wide-area-tcp-test.c
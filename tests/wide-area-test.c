@@ -0,0 +1,232 @@
+/***
+  This file is part of avahi.
+
+  avahi is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  avahi is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+  Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with avahi; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Runs wide area lookups against a DNS server stub and checks which of
+ * them reach it: negative answers are cached, concurrent lookups for a
+ * key share one query, and the cache drops its least recently used
+ * entries. Needs to bind port 53 on the loopback address. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include <avahi-common/error.h>
+#include <avahi-common/malloc.h>
+#include <avahi-common/gccmacro.h>
+#include <avahi-core/core.h>
+
+#include "avahi-core/internal.h"
+#include "avahi-core/wide-area.h"
+
+#include "test-server.h"
+#include "dns-stub.h"
+
+#define CACHE_ENTRIES_MAX 3
+#define LOOKUP_MSEC 3000
+
+static AvahiServer *server = NULL;
+static DnsStub *stub = NULL;
+
+typedef struct Lookup {
+    unsigned n_new, n_all_for_now, n_failure;
+    int error;
+    int done;
+} Lookup;
+
+/* Names starting with "nx" don't exist, all others have an A record */
+static int stub_callback(
+    AVAHI_GCC_UNUSED DnsStub *s,
+    AVAHI_GCC_UNUSED AvahiDnsPacket *query,
+    AvahiKey *key,
+    AvahiDnsPacket *reply,
+    AVAHI_GCC_UNUSED int tcp,
+    AVAHI_GCC_UNUSED void *userdata) {
+
+    AvahiRecord *r;
+
+    if (strncmp(key->name, "nx", 2) == 0) {
+        /* serial, refresh, retry, expire and a minimum TTL of 60s */
+        static const uint8_t soa[] = {
+            0, 0,
+            0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 4, 0, 0, 0, 60
+        };
+
+        avahi_dns_packet_set_field(reply, AVAHI_DNS_FIELD_FLAGS, AVAHI_DNS_FLAGS(1, 0, 1, 0, 1, 1, 0, 0, 0, 3));
+
+        r = avahi_record_new_full("example", AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_SOA, 300);
+        r->data.generic.data = avahi_memdup(soa, sizeof(soa));
+        r->data.generic.size = sizeof(soa);
+        dns_stub_append(reply, AVAHI_DNS_FIELD_NSCOUNT, r);
+    } else {
+        r = avahi_record_new_full(key->name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_A, 300);
+        r->data.a.address.address = htonl(0xc000024d);
+        dns_stub_append(reply, AVAHI_DNS_FIELD_ANCOUNT, r);
+    }
+
+    avahi_record_unref(r);
+    return 1;
+}
+
+static void lookup_callback(
+    AVAHI_GCC_UNUSED AvahiWideAreaLookupEngine *e,
+    AvahiBrowserEvent event,
+    AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+    AVAHI_GCC_UNUSED AvahiRecord *r,
+    void *userdata) {
+
+    Lookup *l = userdata;
+
+    switch (event) {
+        case AVAHI_BROWSER_NEW:
+            l->n_new++;
+            break;
+
+        case AVAHI_BROWSER_ALL_FOR_NOW:
+            l->n_all_for_now++;
+            l->done = 1;
+            break;
+
+        case AVAHI_BROWSER_FAILURE:
+            l->n_failure++;
+            l->error = avahi_server_errno(server);
+            l->done = 1;
+            break;
+
+        default:
+            break;
+    }
+}
+
+static AvahiWideAreaLookup *lookup_new(const char *name, Lookup *l) {
+    AvahiWideAreaLookup *wl;
+    AvahiKey *k;
+
+    memset(l, 0, sizeof(*l));
+
+    k = avahi_key_new(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_A);
+    wl = avahi_wide_area_lookup_new(server->wide_area_lookup_engine, k, lookup_callback, l);
+    avahi_key_unref(k);
+    assert(wl);
+
+    return wl;
+}
+
+/* Runs a lookup to completion, returns the number of queries it took */
+static unsigned lookup(const char *name, Lookup *l) {
+    AvahiWideAreaLookup *wl;
+    unsigned n = dns_stub_queries(stub);
+
+    wl = lookup_new(name, l);
+    test_run_until(&l->done, LOOKUP_MSEC);
+    assert(l->done);
+    avahi_wide_area_lookup_free(wl);
+
+    return dns_stub_queries(stub) - n;
+}
+
+static unsigned cached(const char *name) {
+    AvahiKey *k;
+    Lookup l;
+    unsigned n;
+
+    memset(&l, 0, sizeof(l));
+
+    k = avahi_key_new(name, AVAHI_DNS_CLASS_IN, AVAHI_DNS_TYPE_A);
+    n = avahi_wide_area_scan_cache(server->wide_area_lookup_engine, k, lookup_callback, &l);
+    avahi_key_unref(k);
+
+    return n;
+}
+
+int main(AVAHI_GCC_UNUSED int argc, AVAHI_GCC_UNUSED char *argv[]) {
+    AvahiServerConfig config;
+    AvahiWideAreaLookup *wl1, *wl2;
+    Lookup l1, l2;
+    unsigned n;
+
+    avahi_server_config_init(&config);
+    config.publish_workstation = 0;
+    config.publish_hinfo = 0;
+    config.publish_addresses = 0;
+    config.publish_domain = 0;
+    config.use_ipv6 = 0;
+    config.enable_wide_area = 1;
+    config.n_wide_area_servers = 1;
+    avahi_address_parse("127.0.0.1", AVAHI_PROTO_INET, &config.wide_area_servers[0]);
+    config.n_wide_area_cache_entries_max = CACHE_ENTRIES_MAX;
+    config.host_name = avahi_strdup("wide-area-test");
+
+    if (!(server = test_server_new(&config)))
+        return 1;
+
+    if (!(stub = dns_stub_new(test_poll_api(), stub_callback, NULL))) {
+        test_server_free(server);
+        avahi_server_config_free(&config);
+        return TEST_SKIP;
+    }
+
+    /* A negative answer is cached for the SOA minimum TTL */
+    assert(lookup("nx1.example", &l1) == 1);
+    assert(l1.n_failure == 1 && l1.error == AVAHI_ERR_DNS_NXDOMAIN);
+    assert(lookup("nx1.example", &l1) == 0);
+    assert(l1.n_failure == 1 && l1.error == AVAHI_ERR_DNS_NXDOMAIN);
+
+    /* Two lookups for the same key share one query */
+    n = dns_stub_queries(stub);
+    wl1 = lookup_new("a1.example", &l1);
+    wl2 = lookup_new("a1.example", &l2);
+    test_run_until(&l1.done, LOOKUP_MSEC);
+    test_run_until(&l2.done, LOOKUP_MSEC);
+    assert(dns_stub_queries(stub) - n == 1);
+    assert(l1.n_new == 1 && l1.n_all_for_now == 1);
+    assert(l2.n_new == 1 && l2.n_all_for_now == 1);
+    avahi_wide_area_lookup_free(wl1);
+    avahi_wide_area_lookup_free(wl2);
+
+    /* The lookup that sent the query goes away, the other one takes
+     * over the answer */
+    n = dns_stub_queries(stub);
+    wl1 = lookup_new("a2.example", &l1);
+    wl2 = lookup_new("a2.example", &l2);
+    avahi_wide_area_lookup_free(wl1);
+    test_run_until(&l2.done, LOOKUP_MSEC);
+    assert(dns_stub_queries(stub) - n == 1);
+    assert(l2.n_new == 1 && l2.n_all_for_now == 1);
+    avahi_wide_area_lookup_free(wl2);
+
+    /* nx1, a1 and a2 fill the cache. Using a1 leaves nx1 the least
+     * recently used entry, so a3 evicts it. */
+    assert(cached("a1.example") == 1);
+    assert(lookup("a3.example", &l1) == 1);
+    assert(cached("a1.example") == 1);
+    assert(cached("a2.example") == 1);
+    assert(cached("a3.example") == 1);
+    assert(lookup("nx1.example", &l1) == 1);
+    assert(l1.error == AVAHI_ERR_DNS_NXDOMAIN);
+
+    printf("%u queries\n", dns_stub_queries(stub));
+
+    dns_stub_free(stub);
+    test_server_free(server);
+    avahi_server_config_free(&config);
+
+    return 0;
+}
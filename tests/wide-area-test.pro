@@ -0,0 +1,4 @@
+TARGET = wide-area-test
+include($$PWD/tests.pri)
+HEADERS+= $$PWD/dns-stub.h
+SOURCES+= $$PWD/dns-stub.c $$PWD/wide-area-test.c